@@ -2,6 +2,10 @@
 
 #include <openssl/rand.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 
 #include "judy64nb.h"
 
@@ -134,3 +138,1311 @@ BENCHMARK(remove, judy, 10, 10) {
 
     judy_close(j);
 }
+
+BENCHMARK(merge, judy, 10, 10) {
+    const uint inputs = 64, samples = 100000;
+    typedef struct {
+        uchar data[16] __attribute__((aligned(JUDY_key_size)));
+    } _key_t __attribute__((aligned(JUDY_key_size)));
+    Judy *j[inputs];
+    JudyMerge *m;
+    JudySlot *slot;
+    _key_t k;
+    uint idx;
+
+    for (idx=0; idx<inputs; ++idx) {
+        j[idx] = judy_open_bin(sizeof(_key_t));
+        assert(j[idx]);
+    }
+
+    for (idx=0; idx<samples; ++idx) {
+        RAND_bytes((unsigned char *)&k, sizeof(k));
+        slot = judy_cell_bin(j[idx % inputs], &k);
+        assert(slot);
+        *slot = idx + 1;
+    }
+
+    m = judy_merge_open(j, inputs, sizeof(_key_t));
+    assert(m);
+
+    idx = 0;
+    for (slot = judy_merge_strt(m, NULL, 0); slot; slot = judy_merge_nxt(m))
+        ++idx;
+    assert(idx == samples);
+
+    judy_merge_close(m);
+
+    for (idx=0; idx<inputs; ++idx)
+        judy_close(j[idx]);
+}
+
+// Sharded inserts then lookups from a growing number of threads
+
+typedef struct {
+    JudySharded *sharded;
+    uint first, last;
+} _sharded_arg_t;
+
+static void *sharded_worker(void *arg) {
+    _sharded_arg_t *a = (_sharded_arg_t *)arg;
+    judyvalue key[1];
+    uint idx;
+
+    for (idx = a->first; idx < a->last; ++idx) {
+        key[0] = (judyvalue)idx * 0x9e3779b97f4a7c15ULL;
+        judy_sharded_put(a->sharded, (uchar *)key, sizeof(key), idx + 1);
+    }
+
+    for (idx = a->first; idx < a->last; ++idx) {
+        key[0] = (judyvalue)idx * 0x9e3779b97f4a7c15ULL;
+        if (judy_sharded_get(a->sharded, (uchar *)key, sizeof(key)) != idx + 1)
+            abort();
+    }
+
+    return NULL;
+}
+
+static void sharded_run(uint threads) {
+    const uint samples = 1 << 20;
+    pthread_t tid[64];
+    _sharded_arg_t arg[64];
+    JudySharded *s;
+    uint idx;
+
+    s = judy_sharded_open(256, 0, 1);
+    assert(s);
+
+    for (idx=0; idx<threads; ++idx) {
+        arg[idx].sharded = s;
+        arg[idx].first = (uint)((uint64_t)idx * samples / threads);
+        arg[idx].last = (uint)((uint64_t)(idx + 1) * samples / threads);
+        pthread_create(&tid[idx], NULL, sharded_worker, &arg[idx]);
+    }
+
+    for (idx=0; idx<threads; ++idx)
+        pthread_join(tid[idx], NULL);
+
+    judy_sharded_close(s);
+}
+
+BENCHMARK(sharded, threads_1, 5, 1) { sharded_run(1); }
+BENCHMARK(sharded, threads_2, 5, 1) { sharded_run(2); }
+BENCHMARK(sharded, threads_4, 5, 1) { sharded_run(4); }
+BENCHMARK(sharded, threads_8, 5, 1) { sharded_run(8); }
+BENCHMARK(sharded, threads_16, 5, 1) { sharded_run(16); }
+BENCHMARK(sharded, threads_32, 5, 1) { sharded_run(32); }
+BENCHMARK(sharded, threads_64, 5, 1) { sharded_run(64); }
+
+// Concurrent array: 90% lookups, 10% inserts and deletes
+
+typedef struct {
+    Judy *judy;
+    uint id, ops;
+} _mt_arg_t;
+
+static void *mt_worker(void *arg) {
+    _mt_arg_t *a = (_mt_arg_t *)arg;
+    Judy *h = judy_attach(a->judy);
+    uint64_t rnd = a->id * 0x9e3779b97f4a7c15ULL + 1;
+    judyvalue key[1];
+    uint idx;
+
+    assert(h);
+
+    for (idx=0; idx<a->ops; ++idx) {
+        rnd ^= rnd << 13, rnd ^= rnd >> 7, rnd ^= rnd << 17;
+        key[0] = (rnd >> 8) % (1 << 20) * 0x9e3779b97f4a7c15ULL;
+
+        switch (rnd % 20) {
+            case 0:
+                judy_cell_mt(h, (uchar *)key, sizeof(key), idx + 1);
+                break;
+            case 1:
+                judy_del_mt(h, (uchar *)key, sizeof(key));
+                break;
+            default:
+                judy_slot_mt(h, (uchar *)key, sizeof(key));
+        }
+    }
+
+    judy_detach(h);
+    return NULL;
+}
+
+static void mt_run(uint threads) {
+    const uint samples = 1 << 20, ops = 1 << 21;
+    pthread_t tid[64];
+    _mt_arg_t arg[64];
+    judyvalue key[1];
+    Judy *j, *h;
+    uint idx;
+
+    j = judy_open_mt(0, 1);
+    assert(j);
+    h = judy_attach(j);
+    assert(h);
+
+    for (idx=0; idx<samples; idx += 2) {
+        key[0] = idx * 0x9e3779b97f4a7c15ULL;
+        judy_cell_mt(h, (uchar *)key, sizeof(key), idx + 1);
+    }
+
+    judy_detach(h);
+
+    for (idx=0; idx<threads; ++idx) {
+        arg[idx].judy = j;
+        arg[idx].id = idx;
+        arg[idx].ops = ops / threads;
+        pthread_create(&tid[idx], NULL, mt_worker, &arg[idx]);
+    }
+
+    for (idx=0; idx<threads; ++idx)
+        pthread_join(tid[idx], NULL);
+
+    judy_close(j);
+}
+
+BENCHMARK(concurrent, threads_1, 5, 1) { mt_run(1); }
+BENCHMARK(concurrent, threads_2, 5, 1) { mt_run(2); }
+BENCHMARK(concurrent, threads_4, 5, 1) { mt_run(4); }
+BENCHMARK(concurrent, threads_8, 5, 1) { mt_run(8); }
+BENCHMARK(concurrent, threads_16, 5, 1) { mt_run(16); }
+BENCHMARK(concurrent, threads_32, 5, 1) { mt_run(32); }
+BENCHMARK(concurrent, threads_64, 5, 1) { mt_run(64); }
+
+// Allocator churn: each thread fills and empties its own dense
+// key range, so every insert promotes or splits a node and every
+// delete retires one
+
+static void *churn_worker(void *arg) {
+    _mt_arg_t *a = (_mt_arg_t *)arg;
+    Judy *h = judy_attach(a->judy);
+    judyvalue key[1];
+    uint idx, round;
+
+    assert(h);
+
+    for (round=0; round<a->ops; ++round) {
+        for (idx=0; idx<4096; ++idx) {
+            key[0] = (judyvalue)a->id << 56 | idx;
+            judy_cell_mt(h, (uchar *)key, sizeof(key), idx + 1);
+        }
+
+        for (idx=0; idx<4096; ++idx) {
+            key[0] = (judyvalue)a->id << 56 | idx;
+            judy_del_mt(h, (uchar *)key, sizeof(key));
+        }
+    }
+
+    judy_detach(h);
+    return NULL;
+}
+
+static void churn_run(uint threads) {
+    const uint rounds = 256;
+    pthread_t tid[64];
+    _mt_arg_t arg[64];
+    Judy *j;
+    uint idx;
+
+    j = judy_open_mt(0, 1);
+    assert(j);
+
+    for (idx=0; idx<threads; ++idx) {
+        arg[idx].judy = j;
+        arg[idx].id = idx;
+        arg[idx].ops = rounds / threads;
+        pthread_create(&tid[idx], NULL, churn_worker, &arg[idx]);
+    }
+
+    for (idx=0; idx<threads; ++idx)
+        pthread_join(tid[idx], NULL);
+
+    judy_close(j);
+}
+
+BENCHMARK(churn, threads_1, 5, 1) { churn_run(1); }
+BENCHMARK(churn, threads_2, 5, 1) { churn_run(2); }
+BENCHMARK(churn, threads_4, 5, 1) { churn_run(4); }
+BENCHMARK(churn, threads_8, 5, 1) { churn_run(8); }
+BENCHMARK(churn, threads_16, 5, 1) { churn_run(16); }
+BENCHMARK(churn, threads_32, 5, 1) { churn_run(32); }
+BENCHMARK(churn, threads_64, 5, 1) { churn_run(64); }
+
+// Contended inserts: flat combining against a mutex around judy_cell
+
+typedef struct {
+    Judy *judy;
+    JudyFc *fc;
+    pthread_mutex_t *lock;
+    uint first, last;
+} _fc_arg_t;
+
+static void *fc_worker(void *arg) {
+    _fc_arg_t *a = (_fc_arg_t *)arg;
+    JudyFcSlot *req = NULL;
+    JudySlot *slot;
+    judyvalue key[1];
+    uint idx;
+
+    if (a->fc) {
+        req = judy_fc_attach(a->fc);
+        assert(req);
+    }
+
+    for (idx = a->first; idx < a->last; ++idx) {
+        key[0] = idx * 0x9e3779b97f4a7c15ULL;
+        if (req) {
+            judy_fc_insert(req, (uchar *)key, sizeof(key), idx + 1);
+            continue;
+        }
+        pthread_mutex_lock(a->lock);
+        slot = judy_cell(a->judy, (uchar *)key, sizeof(key));
+        *slot = idx + 1;
+        pthread_mutex_unlock(a->lock);
+    }
+
+    if (req)
+        judy_fc_detach(req);
+    return NULL;
+}
+
+static void fc_run(uint threads, bool combine) {
+    const uint samples = 1 << 20;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t tid[64];
+    _fc_arg_t arg[64];
+    JudyFc *fc = NULL;
+    Judy *j;
+    uint idx;
+
+    j = judy_open(0, 1);
+    assert(j);
+
+    if (combine) {
+        fc = judy_fc_open(j);
+        assert(fc);
+    }
+
+    for (idx=0; idx<threads; ++idx) {
+        arg[idx].judy = j;
+        arg[idx].fc = fc;
+        arg[idx].lock = &lock;
+        arg[idx].first = (uint)((uint64_t)idx * samples / threads);
+        arg[idx].last = (uint)((uint64_t)(idx + 1) * samples / threads);
+        pthread_create(&tid[idx], NULL, fc_worker, &arg[idx]);
+    }
+
+    for (idx=0; idx<threads; ++idx)
+        pthread_join(tid[idx], NULL);
+
+    if (fc)
+        judy_fc_close(fc);
+    judy_close(j);
+}
+
+BENCHMARK(combining, threads_1, 5, 1) { fc_run(1, true); }
+BENCHMARK(combining, threads_2, 5, 1) { fc_run(2, true); }
+BENCHMARK(combining, threads_4, 5, 1) { fc_run(4, true); }
+BENCHMARK(combining, threads_8, 5, 1) { fc_run(8, true); }
+BENCHMARK(combining, threads_16, 5, 1) { fc_run(16, true); }
+BENCHMARK(combining, threads_32, 5, 1) { fc_run(32, true); }
+BENCHMARK(combining, threads_64, 5, 1) { fc_run(64, true); }
+
+BENCHMARK(mutex, threads_1, 5, 1) { fc_run(1, false); }
+BENCHMARK(mutex, threads_2, 5, 1) { fc_run(2, false); }
+BENCHMARK(mutex, threads_4, 5, 1) { fc_run(4, false); }
+BENCHMARK(mutex, threads_8, 5, 1) { fc_run(8, false); }
+BENCHMARK(mutex, threads_16, 5, 1) { fc_run(16, false); }
+BENCHMARK(mutex, threads_32, 5, 1) { fc_run(32, false); }
+BENCHMARK(mutex, threads_64, 5, 1) { fc_run(64, false); }
+
+// Counting map: fetch_add on a concurrent array against a
+// mutex around *judy_cell += 1, over 2^18 distinct keys
+
+typedef struct {
+    Judy *judy;
+    pthread_mutex_t *lock;
+    uint id, ops;
+} _cnt_arg_t;
+
+static void *cnt_worker(void *arg) {
+    _cnt_arg_t *a = (_cnt_arg_t *)arg;
+    Judy *h = a->lock ? NULL : judy_attach(a->judy);
+    uint64_t rnd = a->id * 0x9e3779b97f4a7c15ULL + 1;
+    judyvalue key[1];
+    uint idx;
+
+    assert(a->lock || h);
+
+    for (idx=0; idx<a->ops; ++idx) {
+        rnd ^= rnd << 13, rnd ^= rnd >> 7, rnd ^= rnd << 17;
+        key[0] = (rnd >> 8) % (1 << 18) * 0x9e3779b97f4a7c15ULL;
+
+        if (h) {
+            judy_fetch_add(h, (uchar *)key, sizeof(key), 1);
+            continue;
+        }
+        pthread_mutex_lock(a->lock);
+        *judy_cell(a->judy, (uchar *)key, sizeof(key)) += 1;
+        pthread_mutex_unlock(a->lock);
+    }
+
+    if (h)
+        judy_detach(h);
+    return NULL;
+}
+
+static void cnt_run(uint threads, bool atomic) {
+    const uint ops = 1 << 21;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t tid[64];
+    _cnt_arg_t arg[64];
+    Judy *j;
+    uint idx;
+
+    j = atomic ? judy_open_mt(0, 1) : judy_open(0, 1);
+    assert(j);
+
+    for (idx=0; idx<threads; ++idx) {
+        arg[idx].judy = j;
+        arg[idx].lock = atomic ? NULL : &lock;
+        arg[idx].id = idx;
+        arg[idx].ops = ops / threads;
+        pthread_create(&tid[idx], NULL, cnt_worker, &arg[idx]);
+    }
+
+    for (idx=0; idx<threads; ++idx)
+        pthread_join(tid[idx], NULL);
+
+    judy_close(j);
+}
+
+BENCHMARK(fetch_add, threads_1, 5, 1) { cnt_run(1, true); }
+BENCHMARK(fetch_add, threads_2, 5, 1) { cnt_run(2, true); }
+BENCHMARK(fetch_add, threads_4, 5, 1) { cnt_run(4, true); }
+BENCHMARK(fetch_add, threads_8, 5, 1) { cnt_run(8, true); }
+BENCHMARK(fetch_add, threads_16, 5, 1) { cnt_run(16, true); }
+BENCHMARK(fetch_add, threads_32, 5, 1) { cnt_run(32, true); }
+BENCHMARK(fetch_add, threads_64, 5, 1) { cnt_run(64, true); }
+
+BENCHMARK(locked_add, threads_1, 5, 1) { cnt_run(1, false); }
+BENCHMARK(locked_add, threads_2, 5, 1) { cnt_run(2, false); }
+BENCHMARK(locked_add, threads_4, 5, 1) { cnt_run(4, false); }
+BENCHMARK(locked_add, threads_8, 5, 1) { cnt_run(8, false); }
+BENCHMARK(locked_add, threads_16, 5, 1) { cnt_run(16, false); }
+BENCHMARK(locked_add, threads_32, 5, 1) { cnt_run(32, false); }
+BENCHMARK(locked_add, threads_64, 5, 1) { cnt_run(64, false); }
+
+// Sorted bulk build of 2^22 integer keys by judy_build
+
+static judyvalue *build_keys;
+static uchar **build_ptrs;
+static JudySlot *build_values;
+
+static void build_run(uint threads) {
+    const uint samples = 1 << 22;
+    Judy *j;
+    uint idx;
+
+    if (!build_keys) {
+        build_keys = (judyvalue *)malloc(samples * sizeof(judyvalue));
+        build_ptrs = (uchar **)malloc(samples * sizeof(uchar *));
+        build_values = (JudySlot *)malloc(samples * sizeof(JudySlot));
+        assert(build_keys && build_ptrs && build_values);
+
+        for (idx=0; idx<samples; ++idx) {
+            build_keys[idx] = (judyvalue)idx << 42 | (judyvalue)idx * 2654435761U % (1ULL << 42);
+            build_ptrs[idx] = (uchar *)&build_keys[idx];
+            build_values[idx] = idx + 1;
+        }
+    }
+
+    j = judy_build(0, 1, build_ptrs, NULL, build_values, samples, threads);
+    assert(j);
+    judy_close(j);
+}
+
+BENCHMARK(build, threads_1, 5, 1) { build_run(1); }
+BENCHMARK(build, threads_2, 5, 1) { build_run(2); }
+BENCHMARK(build, threads_4, 5, 1) { build_run(4); }
+BENCHMARK(build, threads_8, 5, 1) { build_run(8); }
+BENCHMARK(build, threads_16, 5, 1) { build_run(16); }
+BENCHMARK(build, threads_32, 5, 1) { build_run(32); }
+BENCHMARK(build, threads_64, 5, 1) { build_run(64); }
+
+// Unsorted batch insert of 2^22 random integer keys by
+// judy_cell_batch, against a judy_cell loop over the same keys
+
+static judyvalue *batch_keys;
+static uchar **batch_ptrs;
+static JudySlot *batch_values;
+
+static void batch_run(uint threads) {
+    const uint samples = 1 << 22;
+    JudySlot *cell;
+    Judy *j;
+    uint idx;
+
+    if (!batch_keys) {
+        batch_keys = (judyvalue *)malloc(samples * sizeof(judyvalue));
+        batch_ptrs = (uchar **)malloc(samples * sizeof(uchar *));
+        batch_values = (JudySlot *)malloc(samples * sizeof(JudySlot));
+        assert(batch_keys && batch_ptrs && batch_values);
+
+        RAND_bytes((unsigned char *)batch_keys, samples * sizeof(judyvalue));
+
+        for (idx=0; idx<samples; ++idx) {
+            batch_ptrs[idx] = (uchar *)&batch_keys[idx];
+            batch_values[idx] = idx + 1;
+        }
+    }
+
+    j = judy_open(0, 1);
+    assert(j);
+
+    if (threads) {
+        bool ok = judy_cell_batch(j, batch_ptrs, NULL, batch_values, samples, threads);
+        assert(ok);
+        (void)ok;
+    } else {
+        for (idx=0; idx<samples; ++idx) {
+            cell = judy_cell(j, batch_ptrs[idx], 0);
+            assert(cell);
+            *cell = batch_values[idx];
+        }
+    }
+
+    judy_close(j);
+}
+
+BENCHMARK(cell_loop, threads_1, 5, 1) { batch_run(0); }
+
+BENCHMARK(batch, threads_1, 5, 1) { batch_run(1); }
+BENCHMARK(batch, threads_2, 5, 1) { batch_run(2); }
+BENCHMARK(batch, threads_4, 5, 1) { batch_run(4); }
+BENCHMARK(batch, threads_8, 5, 1) { batch_run(8); }
+BENCHMARK(batch, threads_16, 5, 1) { batch_run(16); }
+BENCHMARK(batch, threads_32, 5, 1) { batch_run(32); }
+BENCHMARK(batch, threads_64, 5, 1) { batch_run(64); }
+
+// Durable ingest of 2^16 integer keys through a write-ahead log,
+// each put returning once synced, against the same puts under
+// a mutex with no log; latency is the group commit window in us
+
+typedef struct {
+    Judy *judy;
+    JudyWal *wal;
+    pthread_mutex_t *lock;
+    uint first, last;
+} _wal_arg_t;
+
+static void *wal_worker(void *arg) {
+    _wal_arg_t *a = (_wal_arg_t *)arg;
+    JudySlot *slot;
+    judyvalue key[1];
+    uint idx;
+
+    for (idx = a->first; idx < a->last; ++idx) {
+        key[0] = idx * 0x9e3779b97f4a7c15ULL;
+        if (a->wal) {
+            judy_wal_put(a->wal, (uchar *)key, sizeof(key), idx + 1);
+            continue;
+        }
+        pthread_mutex_lock(a->lock);
+        slot = judy_cell(a->judy, (uchar *)key, sizeof(key));
+        *slot = idx + 1;
+        pthread_mutex_unlock(a->lock);
+    }
+
+    return NULL;
+}
+
+static void wal_run(uint threads, bool log, uint latency) {
+    const uint samples = 1 << 16;
+    const char *path = "bench_basic.wal";
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t tid[64];
+    _wal_arg_t arg[64];
+    JudyWal *wal = NULL;
+    Judy *j;
+    uint idx;
+
+    j = judy_open(0, 1);
+    assert(j);
+
+    if (log) {
+        unlink(path);
+        wal = judy_wal_open(j, path, latency);
+        assert(wal);
+    }
+
+    for (idx=0; idx<threads; ++idx) {
+        arg[idx].judy = j;
+        arg[idx].wal = wal;
+        arg[idx].lock = &lock;
+        arg[idx].first = (uint)((uint64_t)idx * samples / threads);
+        arg[idx].last = (uint)((uint64_t)(idx + 1) * samples / threads);
+        pthread_create(&tid[idx], NULL, wal_worker, &arg[idx]);
+    }
+
+    for (idx=0; idx<threads; ++idx)
+        pthread_join(tid[idx], NULL);
+
+    if (wal) {
+        judy_wal_close(wal);
+        unlink(path);
+    }
+    judy_close(j);
+}
+
+BENCHMARK(wal_off, threads_1, 5, 1) { wal_run(1, false, 0); }
+BENCHMARK(wal_off, threads_64, 5, 1) { wal_run(64, false, 0); }
+
+BENCHMARK(wal, threads_1, 5, 1) { wal_run(1, true, 0); }
+BENCHMARK(wal, threads_4, 5, 1) { wal_run(4, true, 0); }
+BENCHMARK(wal, threads_16, 5, 1) { wal_run(16, true, 0); }
+BENCHMARK(wal, threads_64, 5, 1) { wal_run(64, true, 0); }
+
+BENCHMARK(wal_500us, threads_4, 5, 1) { wal_run(4, true, 500); }
+BENCHMARK(wal_500us, threads_16, 5, 1) { wal_run(16, true, 500); }
+BENCHMARK(wal_500us, threads_64, 5, 1) { wal_run(64, true, 500); }
+
+// Full checkpoint of 2^22 integer keys written in the background
+// through io_uring or a thread pool, against a blocking
+// judy_checkpoint, to the working directory and to /dev/shm;
+// each includes the final fdatasync.  Then restores of it through
+// stdio and through judy_restore_fd.
+
+static Judy *ckpt_judy;
+
+enum { CKPT_blocking, CKPT_uring, CKPT_threads };
+
+static void ckpt_fill(void) {
+    const uint samples = 1 << 22;
+    judyvalue key[1];
+    uint idx;
+
+    if (ckpt_judy)
+        return;
+
+    ckpt_judy = judy_open(0, 1);
+    assert(ckpt_judy);
+
+    for (idx=0; idx<samples; ++idx) {
+        key[0] = idx * 0x9e3779b97f4a7c15ULL;
+        *judy_cell(ckpt_judy, (uchar *)key, 0) = idx + 1;
+    }
+}
+
+static void ckpt_run(int mode, const char *path) {
+    JudyAsync *async;
+    FILE *f;
+    int fd, err;
+
+    ckpt_fill();
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    if (mode == CKPT_blocking) {
+        f = fdopen(fd, "wb");
+        assert(f);
+        err = !judy_checkpoint(ckpt_judy, f, 1) || fflush(f) || fdatasync(fd);
+        fclose(f);
+    } else {
+        async = judy_snapshot_async(ckpt_judy, fd, 8 << 20, mode == CKPT_threads ? JUDY_async_threads : 0, NULL, NULL, NULL);
+        assert(async);
+        err = judy_async_wait(async);
+        close(fd);
+    }
+
+    assert(!err);
+    (void)err;
+}
+
+static void restore_run(bool batched, const char *path) {
+    Judy *j;
+    FILE *f;
+    int fd;
+
+    ckpt_run(CKPT_uring, path);
+
+    if (batched) {
+        fd = open(path, O_RDONLY);
+        assert(fd >= 0);
+        j = judy_restore_fd(fd);
+        close(fd);
+    } else {
+        f = fopen(path, "rb");
+        assert(f);
+        j = judy_restore(f);
+        fclose(f);
+    }
+
+    assert(j);
+    judy_close(j);
+}
+
+BENCHMARK(ckpt_blocking, disk, 5, 1) { ckpt_run(CKPT_blocking, "bench_basic.ckpt"); }
+BENCHMARK(ckpt_uring, disk, 5, 1) { ckpt_run(CKPT_uring, "bench_basic.ckpt"); }
+BENCHMARK(ckpt_threads, disk, 5, 1) { ckpt_run(CKPT_threads, "bench_basic.ckpt"); }
+
+BENCHMARK(ckpt_blocking, shm, 5, 1) { ckpt_run(CKPT_blocking, "/dev/shm/bench_basic.ckpt"); }
+BENCHMARK(ckpt_uring, shm, 5, 1) { ckpt_run(CKPT_uring, "/dev/shm/bench_basic.ckpt"); }
+BENCHMARK(ckpt_threads, shm, 5, 1) { ckpt_run(CKPT_threads, "/dev/shm/bench_basic.ckpt"); }
+
+BENCHMARK(ckpt_write_restore, stdio, 5, 1) { restore_run(false, "/dev/shm/bench_basic.ckpt"); unlink("/dev/shm/bench_basic.ckpt"); }
+BENCHMARK(ckpt_write_restore, batched, 5, 1) { restore_run(true, "/dev/shm/bench_basic.ckpt"); unlink("/dev/shm/bench_basic.ckpt"); }
+
+// 2^22 integer keys kept in a file by judy_open_heap: inserting
+// them, committing every 2^20 keys, then reopening the file,
+// against restoring the same array from a checkpoint
+
+static const char *heap_path = "bench_basic.heap";
+
+static void heap_insert(const char *path) {
+    const uint samples = 1 << 22;
+    judyvalue key[1];
+    Judy *j;
+    uint idx;
+
+    unlink(path);
+    j = judy_open_heap(path, 0, 1, (size_t)1 << 30);
+    assert(j);
+
+    for (idx=0; idx<samples; ++idx) {
+        key[0] = idx * 0x9e3779b97f4a7c15ULL;
+        *judy_cell(j, (uchar *)key, 0) = idx + 1;
+        if (!((idx + 1) & 0xfffff))
+            judy_heap_sync(j);
+    }
+
+    judy_close(j);
+}
+
+static void heap_reopen(void) {
+    judyvalue key[1];
+    Judy *j;
+
+    if (access(heap_path, F_OK))
+        heap_insert(heap_path);
+
+    j = judy_open_heap(heap_path, 0, 0, 0);
+    assert(j);
+    key[0] = 12345 * 0x9e3779b97f4a7c15ULL;
+    assert(*judy_slot(j, (uchar *)key, 0) == 12346);
+    judy_close(j);
+}
+
+static void heap_restore(void) {
+    const char *path = "bench_basic.ckpt";
+    Judy *j;
+    int fd;
+
+    ckpt_fill();
+
+    if (access(path, F_OK))
+        ckpt_run(CKPT_uring, path);
+
+    fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    j = judy_restore_fd(fd);
+    assert(j);
+    close(fd);
+    judy_close(j);
+}
+
+BENCHMARK(heap, insert_sync_1m, 3, 1) { heap_insert(heap_path); }
+BENCHMARK(heap, reopen, 5, 1) { heap_reopen(); }
+BENCHMARK(heap, restore_checkpoint, 5, 1) { heap_restore(); }
+
+// a key of the heap array drawn at random, so lookups spread
+// over the trie
+
+static judyvalue heap_key(void) {
+    return (judyvalue)(lrand48() & ((1 << 22) - 1)) * 0x9e3779b97f4a7c15ULL;
+}
+
+// first queries on the heap array mapped by a reader with its
+// pages dropped from the page cache, as after drop_caches: 1000
+// lookups cold, against after judy_warm of the top levels, the
+// time to warm included
+
+static void warm_run(uint levels) {
+    judyvalue key[1];
+    JudyShared *s;
+    uint idx;
+    Judy *j;
+    int fd;
+
+    if (access(heap_path, F_OK))
+        heap_insert(heap_path);
+
+    fd = open(heap_path, O_RDONLY);
+    assert(fd >= 0);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+
+    s = judy_shared_open(heap_path);
+    assert(s);
+    j = judy_shared_enter(s);
+
+    if (levels)
+        judy_warm(j, levels, 0);
+
+    for (idx=0; idx<1000; ++idx) {
+        key[0] = heap_key();
+        assert(*judy_slot(j, (uchar *)key, 0));
+    }
+
+    judy_shared_leave(s);
+    judy_shared_close(s);
+}
+
+BENCHMARK(heap_first_1k, cold, 5, 1) { warm_run(0); }
+BENCHMARK(heap_first_1k, warm_2, 5, 1) { warm_run(2); }
+BENCHMARK(heap_first_1k, warm_3, 5, 1) { warm_run(3); }
+
+// the heap array of 2^22 keys in shared memory, looked up from
+// several processes through judy_shared_open, against each
+// process restoring its own copy from a checkpoint
+
+static const char *shared_path = "/dev/shm/bench_basic.heap";
+
+static void shared_lookups(Judy *j) {
+    judyvalue key[1];
+    uint idx;
+
+    for (idx=0; idx<(1 << 20); ++idx) {
+        key[0] = (idx * 2654435761U & ((1 << 22) - 1)) * 0x9e3779b97f4a7c15ULL;
+        assert(*judy_slot(j, (uchar *)key, 0));
+    }
+}
+
+static void shared_run(uint procs, bool shared) {
+    const char *path = "bench_basic.ckpt";
+    JudyShared *s;
+    int status, fd;
+    uint idx;
+    Judy *j;
+
+    if (access(shared_path, F_OK))
+        heap_insert(shared_path);
+
+    if (!shared && access(path, F_OK)) {
+        ckpt_fill();
+        ckpt_run(CKPT_uring, path);
+    }
+
+    for (idx=0; idx<procs; ++idx)
+        if (!fork()) {
+            if (shared) {
+                s = judy_shared_open(shared_path);
+                assert(s);
+                shared_lookups(judy_shared_enter(s));
+                judy_shared_leave(s);
+                judy_shared_close(s);
+            } else {
+                fd = open(path, O_RDONLY);
+                j = judy_restore_fd(fd);
+                assert(j);
+                close(fd);
+                shared_lookups(j);
+                judy_close(j);
+            }
+            _exit(0);
+        }
+
+    for (idx=0; idx<procs; ++idx)
+        wait(&status);
+}
+
+BENCHMARK(shared_lookup, procs_1, 5, 1) { shared_run(1, true); }
+BENCHMARK(shared_lookup, procs_4, 5, 1) { shared_run(4, true); }
+BENCHMARK(private_lookup, procs_1, 5, 1) { shared_run(1, false); }
+BENCHMARK(private_lookup, procs_4, 5, 1) { shared_run(4, false); }
+
+// 2^20 integer keys in a tiered array, the newest 2^16 of them
+// still hot, against the same keys in one in-memory array: 2^20
+// random lookups, and a scan of every key
+
+static const char *tier_path = "bench_basic.tier";
+static JudyTier *tier_judy;
+static Judy *tier_flat;
+
+static judyvalue tier_key(uint idx) {
+    return (judyvalue)idx * 0x9e3779b97f4a7c15ULL;
+}
+
+static void tier_fill(void) {
+    const uint samples = 1 << 20;
+    judyvalue key[1];
+    uint idx;
+
+    if (tier_judy)
+        return;
+
+    unlink(tier_path);
+    tier_judy = judy_tier_open(tier_path, 0, 1, (size_t)1 << 30, 0);
+    tier_flat = judy_open(0, 1);
+    assert(tier_judy && tier_flat);
+
+    for (idx=0; idx<samples; ++idx) {
+        key[0] = tier_key(idx);
+        judy_tier_put(tier_judy, (uchar *)key, 0, idx + 1);
+        *judy_cell(tier_flat, (uchar *)key, 0) = idx + 1;
+        if (idx + 1 == samples - (1 << 16))
+            judy_tier_merge(tier_judy, 1);
+    }
+}
+
+static int tier_count(void *ctx, uchar *, uint, JudySlot) {
+    ++*(uint *)ctx;
+    return 0;
+}
+
+static void tier_lookup(bool tiered) {
+    judyvalue key[1];
+    uint idx;
+
+    tier_fill();
+
+    for (idx=0; idx<(1 << 20); ++idx) {
+        key[0] = tier_key(lrand48() & ((1 << 20) - 1));
+        if (tiered)
+            assert(judy_tier_get(tier_judy, (uchar *)key, 0));
+        else
+            assert(*judy_slot(tier_flat, (uchar *)key, 0));
+    }
+}
+
+static void tier_scan(bool tiered) {
+    JudySlot *cell;
+    uint cnt = 0;
+
+    tier_fill();
+
+    if (tiered)
+        judy_tier_scan(tier_judy, NULL, 0, tier_count, &cnt);
+    else
+        for (cell = judy_strt(tier_flat, NULL, 0); cell; cell = judy_nxt(tier_flat))
+            cnt++;
+
+    assert(cnt == 1 << 20);
+}
+
+BENCHMARK(tier, lookup_1m, 5, 1) { tier_lookup(true); }
+BENCHMARK(tier_flat, lookup_1m, 5, 1) { tier_lookup(false); }
+BENCHMARK(tier, scan_1m, 5, 1) { tier_scan(true); }
+BENCHMARK(tier_flat, scan_1m, 5, 1) { tier_scan(false); }
+
+// a synthetic full BGP table: 900k IPv4 prefixes with the length
+// mix of the global table, deaggregated under 16k allocations.
+// 2^20 lookups of addresses under random routes, by judy_lpm and
+// by probing one integer array per length from /32 down
+
+static const uint lpm_routes = 900000;
+static uint32_t lpm_route[lpm_routes];
+static Judy *lpm_judy, *lpm_flat;
+static uint32_t lpm_lengths;
+
+static uint lpm_length(void) {
+    static const uint mix[][2] = {
+        {24, 600}, {23, 100}, {22, 110}, {21, 45}, {20, 40}, {19, 30},
+        {18, 20}, {17, 12}, {16, 15}, {15, 3}, {14, 3}, {13, 2},
+        {12, 1}, {11, 1}, {10, 1}, {9, 1}, {8, 1}, {25, 5}, {28, 5}, {32, 4}
+    };
+    uint pick = lrand48() % 999, idx;
+
+    for (idx=0; pick >= mix[idx][1]; ++idx)
+        pick -= mix[idx][1];
+
+    return mix[idx][0];
+}
+
+static judyvalue lpm_key(uint32_t addr, uint len) {
+    return (judyvalue)len << 32 | (len ? addr & ~0U << (32 - len) : 0);
+}
+
+static void lpm_fill(void) {
+    uint32_t alloc[1 << 14], addr;
+    uchar bytes[4];
+    judyvalue key[1];
+    uint idx, len;
+
+    if (lpm_judy)
+        return;
+
+    lpm_judy = judy_open_lpm(32);
+    lpm_flat = judy_open(0, 1);
+    assert(lpm_judy && lpm_flat);
+
+    for (idx=0; idx<(1 << 14); ++idx)
+        alloc[idx] = (uint32_t)mrand48() & 0xfff00000U;
+
+    for (idx=0; idx<lpm_routes; ++idx) {
+        len = lpm_length();
+        addr = alloc[lrand48() & ((1 << 14) - 1)] | ((uint32_t)mrand48() & 0x000fffffU);
+        lpm_route[idx] = addr;
+        bytes[0] = addr >> 24, bytes[1] = addr >> 16, bytes[2] = addr >> 8, bytes[3] = addr;
+        *judy_lpm_cell(lpm_judy, bytes, len) = idx + 1;
+        key[0] = lpm_key(addr, len);
+        *judy_cell(lpm_flat, (uchar *)key, 0) = idx + 1;
+        lpm_lengths |= 1U << (len - 1);
+    }
+}
+
+static void lpm_lookup(bool lpm) {
+    JudySlot *cell;
+    judyvalue key[1];
+    uchar bytes[4];
+    uint32_t addr;
+    uint idx, len;
+
+    lpm_fill();
+
+    for (idx=0; idx<(1 << 20); ++idx) {
+        addr = lpm_route[lrand48() % lpm_routes];
+
+        if (lpm) {
+            bytes[0] = addr >> 24, bytes[1] = addr >> 16, bytes[2] = addr >> 8, bytes[3] = addr;
+            cell = judy_lpm(lpm_judy, bytes, 32, &len);
+        } else {
+            cell = NULL;
+            for (len=32; len && !cell; --len)
+                if (lpm_lengths & 1U << (len - 1)) {
+                    key[0] = lpm_key(addr, len);
+                    cell = judy_slot(lpm_flat, (uchar *)key, 0);
+                }
+        }
+
+        assert(cell);
+    }
+}
+
+BENCHMARK(lpm, lookup_1m, 5, 1) { lpm_lookup(true); }
+BENCHMARK(lpm_per_length, lookup_1m, 5, 1) { lpm_lookup(false); }
+
+// 2^20 disjoint ranges of random widths over 64-bit keys, as an
+// interval map and as the usual emulation: an array of pointers
+// to each range's end and value under its start, searched with
+// judy_strt and judy_prv.  2^20 lookups of random points, and
+// building the map from ranges inserted in random order
+
+static const uint interval_ranges = 1 << 20;
+static judyvalue interval_start[interval_ranges + 1];
+static JudySlot interval_record[interval_ranges][2];
+static JudyInterval *interval_map;
+static Judy *interval_flat;
+
+static void interval_fill(void) {
+    judyvalue key[1], hi[1];
+    uint idx;
+
+    if (interval_map)
+        return;
+
+    for (idx=0; idx<=interval_ranges; ++idx)
+        interval_start[idx] = (judyvalue)idx << 24 | (lrand48() & 0xffff);
+
+    interval_map = judy_interval_open(1);
+    interval_flat = judy_open(0, 1);
+    assert(interval_map && interval_flat);
+
+    for (idx=0; idx<interval_ranges; ++idx) {
+        key[0] = interval_start[idx];
+        hi[0] = key[0] + 1 + (lrand48() & 0xffffff);
+        if (hi[0] > interval_start[idx + 1])
+            hi[0] = interval_start[idx + 1];
+        judy_interval_insert(interval_map, key, hi, idx + 1);
+        interval_record[idx][0] = hi[0];
+        interval_record[idx][1] = idx + 1;
+        *judy_cell(interval_flat, (uchar *)key, 0) = (JudySlot)interval_record[idx];
+    }
+}
+
+static void interval_lookup(bool map) {
+    judyvalue key[1], point;
+    JudySlot *cell;
+    uint idx, hits = 0;
+
+    interval_fill();
+
+    for (idx=0; idx<(1 << 20); ++idx) {
+        point = (judyvalue)(lrand48() & (interval_ranges - 1)) << 24 | (lrand48() & 0xffffff);
+        key[0] = point;
+
+        if (map) {
+            hits += judy_interval_lookup(interval_map, key, NULL, NULL) != 0;
+            continue;
+        }
+
+        if (!(cell = judy_strt(interval_flat, (uchar *)key, sizeof(key))))
+            cell = judy_end(interval_flat);
+        else if (judy_key(interval_flat, (uchar *)key, sizeof(key)), key[0] != point)
+            cell = judy_prv(interval_flat);
+
+        if (cell && ((JudySlot *)*cell)[0] > point)
+            hits += ((JudySlot *)*cell)[1] != 0;
+    }
+
+    assert(hits);
+}
+
+BENCHMARK(interval, lookup_1m, 5, 1) { interval_lookup(true); }
+BENCHMARK(interval_strt_prv, lookup_1m, 5, 1) { interval_lookup(false); }
+
+BENCHMARK(interval, insert_1m, 5, 1) {
+    JudyInterval *map = judy_interval_open(1);
+    judyvalue lo[1], hi[1];
+    uint idx, pick;
+
+    interval_fill();
+
+    for (idx=0; idx<interval_ranges; ++idx) {
+        pick = (uint)(idx * 2654435761U) & (interval_ranges - 1);
+        lo[0] = interval_start[pick];
+        hi[0] = interval_start[pick + 1];
+        judy_interval_insert(map, lo, hi, pick % 7 + 1);
+    }
+
+    judy_interval_close(map);
+}
+
+// a type-ahead table: 2^20 queries of one to four words from a
+// 4096-word vocabulary, scored on a long-tailed scale.  The top
+// 10 under 1000 one- and two-letter prefixes, by judy_topk_prefix
+// over prefixes annotated to 6 bytes, and by scanning every query
+// under the prefix
+
+static JudyTopk *topk_table;
+static Judy *topk_plain;
+
+static void topk_word(char *word) {
+    uint len = 3 + lrand48() % 6, idx;
+
+    for (idx=0; idx<len; ++idx)
+        word[idx] = 'a' + lrand48() % 26;
+
+    word[len] = 0;
+}
+
+static void topk_fill(void) {
+    static char vocab[4096][10];
+    char query[64];
+    uint idx, words, len;
+    JudySlot score;
+
+    if (topk_table)
+        return;
+
+    topk_table = judy_topk_open(63, 6);
+    topk_plain = judy_open(63, 0);
+    assert(topk_table && topk_plain);
+
+    for (idx=0; idx<4096; ++idx)
+        topk_word(vocab[idx]);
+
+    for (idx=0; idx<(1 << 20); ++idx) {
+        len = 0;
+        for (words = 1 + lrand48() % 4; words--; )
+            len += sprintf(query + len, "%s%s", len ? " " : "", vocab[lrand48() % (1 + lrand48() % 4096)]);
+
+        score = 1000000000 / (1 + lrand48() % 1000000);
+        judy_topk_put(topk_table, (uchar *)query, len, score);
+        *judy_cell(topk_plain, (uchar *)query, len) = score;
+    }
+}
+
+static int topk_count(void *ctx, uchar *, uint, JudySlot) {
+    ++*(uint *)ctx;
+    return 0;
+}
+
+static void topk_prefix(bool pruned) {
+    JudySlot best[10], *cell;
+    uchar prefix[2], key[64];
+    Judy *judy = topk_plain;
+    uint idx, len, cnt, k;
+
+    topk_fill();
+
+    for (idx=0; idx<1000; ++idx) {
+        prefix[0] = 'a' + lrand48() % 26;
+        prefix[1] = 'a' + lrand48() % 26;
+        len = 1 + idx % 2;
+        cnt = 0;
+
+        if (pruned) {
+            judy_topk_prefix(topk_table, prefix, len, 10, topk_count, &cnt);
+            continue;
+        }
+
+        // keep the 10 best in a sorted array
+
+        for (cell = judy_strt(judy, prefix, len); cell; cell = judy_nxt(judy)) {
+            if (judy_key(judy, key, sizeof(key)) < len || memcmp(key, prefix, len))
+                break;
+
+            if (cnt == 10 && *cell <= best[9])
+                continue;
+
+            for (k = cnt < 10 ? cnt++ : 9; k && best[k - 1] < *cell; --k)
+                best[k] = best[k - 1];
+            best[k] = *cell;
+        }
+    }
+}
+
+BENCHMARK(topk_prefix, top10_1k, 5, 1) { topk_prefix(true); }
+BENCHMARK(topk_scan, top10_1k, 5, 1) { topk_prefix(false); }
+
+// byte counts under 2^20 timestamps about a thousand apart, and
+// the total over 1000 windows of up to a quarter of them, by
+// judy_sum and by walking the window in a plain array
+
+static JudySum *sum_table;
+static Judy *sum_plain;
+
+static void sum_fill(void) {
+    judyvalue key[1];
+    JudySlot bytes;
+    uint idx;
+
+    if (sum_table)
+        return;
+
+    sum_table = judy_sum_open(1);
+    sum_plain = judy_open(0, 1);
+    assert(sum_table && sum_plain);
+
+    for (idx=0; idx<(1 << 20); ++idx) {
+        key[0] = 1600000000000ULL + idx * 1000ULL + lrand48() % 1000;
+        bytes = 40 + lrand48() % 1460;
+        judy_sum_add(sum_table, key, bytes);
+        *judy_cell(sum_plain, (uchar *)key, sizeof(key)) = bytes;
+    }
+}
+
+static void sum_window(bool augmented) {
+    judyvalue lo[1], hi[1], key[1];
+    JudySlot total = 0, *cell;
+    uint idx;
+
+    sum_fill();
+
+    for (idx=0; idx<1000; ++idx) {
+        lo[0] = 1600000000000ULL + (lrand48() % (1 << 20)) * 1000ULL;
+        hi[0] = lo[0] + (lrand48() % (1 << 18)) * 1000ULL;
+
+        if (augmented) {
+            total += judy_sum(sum_table, lo, hi);
+            continue;
+        }
+
+        for (cell = judy_strt(sum_plain, (uchar *)lo, sizeof(lo)); cell; cell = judy_nxt(sum_plain)) {
+            judy_key(sum_plain, (uchar *)key, sizeof(key));
+            if (key[0] >= hi[0])
+                break;
+            total += *cell;
+        }
+    }
+
+    assert(total);
+}
+
+BENCHMARK(sum, window_1k, 5, 1) { sum_window(true); }
+BENCHMARK(sum_walk, window_1k, 5, 1) { sum_window(false); }
+
+BENCHMARK(sum, add_1m, 5, 1) {
+    JudySum *map = judy_sum_open(1);
+    judyvalue key[1];
+    uint idx;
+
+    for (idx=0; idx<(1 << 20); ++idx) {
+        key[0] = 1600000000000ULL + (lrand48() % (1 << 20)) * 1000ULL;
+        judy_sum_add(map, key, 1 + lrand48() % 1500);
+    }
+
+    judy_sum_close(map);
+}
+
+BENCHMARK(sum_plain, add_1m, 5, 1) {
+    Judy *judy = judy_open(0, 1);
+    judyvalue key[1];
+    uint idx;
+
+    for (idx=0; idx<(1 << 20); ++idx) {
+        key[0] = 1600000000000ULL + (lrand48() % (1 << 20)) * 1000ULL;
+        *judy_cell(judy, (uchar *)key, sizeof(key)) += 1 + lrand48() % 1500;
+    }
+
+    judy_close(judy);
+}
+
+// 1000 keys drawn uniformly from 2^20 integer keys: by
+// judy_sample from random keys, which it draws evenly, by
+// judy_sum_sample from unit counts under keys half in a dense
+// run and half scattered, and by reservoir sampling over a scan
+
+static Judy *sample_table;
+static JudySum *sample_counts;
+
+static void sample_fill(void) {
+    judyvalue key[1];
+    uint idx;
+
+    if (sample_table)
+        return;
+
+    sample_table = judy_open(0, 1);
+    sample_counts = judy_sum_open(1);
+    assert(sample_table && sample_counts);
+
+    for (idx=0; idx<(1 << 20); ++idx) {
+        key[0] = mrand48() * 0x9E3779B97F4A7C15ULL;
+        *judy_cell(sample_table, (uchar *)key, sizeof(key)) = idx + 1;
+
+        key[0] = idx % 2 ? idx : mrand48() * 0x9E3779B97F4A7C15ULL;
+        judy_sum_set(sample_counts, key, 1);
+    }
+}
+
+static int sample_keep(void *ctx, uchar *, uint, JudySlot value) {
+    *(JudySlot *)ctx += value;
+    return 0;
+}
+
+BENCHMARK(sample, draw_1k, 5, 1) {
+    static uint64_t seed = 1;
+    JudySlot sum = 0;
+
+    sample_fill();
+    judy_sample(sample_table, &seed, 1000, sample_keep, &sum);
+    assert(sum);
+}
+
+BENCHMARK(sample_sum, draw_1k, 5, 1) {
+    static uint64_t seed = 1;
+    JudySlot sum = 0;
+
+    sample_fill();
+    judy_sum_sample(sample_counts, &seed, 1000, sample_keep, &sum);
+    assert(sum == 1000);
+}
+
+BENCHMARK(sample_reservoir, draw_1k, 5, 1) {
+    static JudySlot kept[1000];
+    JudySlot *cell;
+    uint64_t seen = 0, pick;
+
+    sample_fill();
+
+    for (cell = judy_strt(sample_table, NULL, 0); cell; cell = judy_nxt(sample_table))
+        if (seen++ < 1000)
+            kept[seen - 1] = *cell;
+        else if ((pick = lrand48() % seen) < 1000)
+            kept[pick] = *cell;
+
+    assert(kept[999]);
+}
@@ -17,20 +17,79 @@
 //  functions:
 //  judy_open:  open a new judy array returning a judy object.
 //  judy_close: close an open judy array, freeing all memory.
+//  judy_close_ex: close an array, first passing every value to a destructor on several threads.
 //  judy_clone: clone an open judy array, duplicating the stack.
+//  judy_snapshot: take an immutable point-in-time version of the array.
+//  judy_copy:  duplicate an open judy array or snapshot.
+//  judy_checkpoint: write the segments changed since the last checkpoint.
+//  judy_restore: rebuild an array from a full checkpoint and the deltas after it.
+//  judy_restore_fd: judy_restore from a file descriptor, reading in large batches.
+//  judy_snapshot_async: write a full checkpoint of the array in the background.
+//  judy_async_wait: wait for a background checkpoint, returning its errno or zero.
+//  judy_open_heap: open or create an array kept in a file.
+//  judy_heap_sync: commit a file-backed array's contents to its file.
+//  judy_shared_open: map a file-backed array read-only in another process.
+//  judy_shared_close: unmap an array opened by judy_shared_open.
+//  judy_shared_enter: start a read section, returning a view of the newest commit.
+//  judy_shared_leave: end a read section.
+//  judy_warm: fault in the top levels of a mapped array ahead of its first queries.
+//  judy_union: return a new array with the keys of either array.
+//  judy_intersect: return a new array with the keys of both arrays.
+//  judy_difference: return a new array with the keys of one array but not the other.
+//  judy_build: build an array from sorted keys on several threads.
+//  judy_cell_batch: insert unsorted keys and their values on several threads.
 //  judy_data:  allocate data memory within judy array for external use.
 //  judy_cell:  insert a string into the judy array, return cell pointer.
+//  judy_cell_after: insert a key sharing a prefix with the previous insert, reusing its descent.
 //  judy_strt:  retrieve the cell pointer greater than or equal to given key
+//  judy_floor: retrieve the cell pointer less than or equal to given key
 //  judy_slot:  retrieve the cell pointer, or return NULL for a given key.
+//  judy_slot_write: retrieve the cell pointer for a given key to store through, copying shared nodes.
 //  judy_key:   retrieve the string value for the most recent judy query.
 //  judy_end:   retrieve the cell pointer for the last string in the array.
 //  judy_nxt:   retrieve the cell pointer for the next string in the array.
 //  judy_prv:   retrieve the cell pointer for the prev string in the array.
 //  judy_del:   delete the key and cell for the current stack entry.
-
+//  judy_sample: visit keys drawn at random, uniformly over the paths descents met.
+//  judy_open_mt: open a judy array for concurrent readers and writers.
+//  judy_attach: return a handle for the calling thread to use the array.
+//  judy_detach: release a handle returned by judy_attach.
+//  judy_slot_mt: retrieve the value stored under a key, or zero.
+//  judy_cell_mt: store a non-zero value under a key, returning the previous value; zero with errno ENOMEM if memory ran out.
+//  judy_del_mt: delete a key, returning the value it held.
+//  judy_fetch_add: add to the value under a key, returning the previous value.
+//  judy_cas_cell: replace the value under a key if it holds the expected value.
+//  judy_exchange_cell: replace the value under a key, returning the previous value.
+//  judy_open_lpm: open an array of bit-string prefixes for longest-prefix match.
+//  judy_lpm_cell: insert a prefix of an address, return cell pointer.
+//  judy_lpm:   retrieve the cell of the longest prefix of an address in the array.
+//  judy_lpm_del: delete a prefix, returning the value it held.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef __NR_io_uring_setup
+#define JUDY_uring
+#endif
+#endif
+#endif
 
 #include "judy64nb.h"
 
@@ -63,6 +122,16 @@
 #define JUDY_cache_line 8               // minimum size is 8 bytes
 #define JUDY_seg    65536
 
+//  segments are aligned on their size so that the
+//  segment holding any node can be found from its address
+
+#define JUDY_segment(addr) ((JudySeg *)((JudySlot)(addr) & ~(JudySlot)(JUDY_seg - 1)))
+
+//  retired blocks with this bit set in their type
+//  are whole reuse lists parked by judy_snapshot
+
+#define JUDY_chain  8
+
 enum JUDY_types {
     JUDY_radix      = 0,                // inner and outer radix fan-out
     JUDY_1          = 1,                // linear list nodes of designated count
@@ -94,6 +163,210 @@ judyvalue JudyMask[9] = {
 
 #define JUDY_max    JUDY_32
 
+//  copy-on-write snapshots:
+//  judy_snapshot seals every segment allocated so far with a new epoch.
+//  While a snapshot taken at or after that epoch is open, nodes in the
+//  sealed segments are shared and writers copy them before modifying.
+//  The originals are retired until the snapshots that can see them close.
+
+typedef struct {
+    void    *block;             // retired node or parked reuse list
+    uint    type;               // node type, or JUDY_chain | reuse index
+    uint    epoch;              // newest snapshot epoch able to see it
+} JudyRetire;
+
+struct JudySnap {
+    struct JudySnap *next;      // next older snapshot
+    JudySeg *seg;               // newest segment sealed for the snapshot
+    uint    epoch;              // epoch the snapshot was taken in
+    uint    live;               // cleared when the snapshot is closed
+};
+
+struct JudyCow {
+    struct JudySnap *snaps;     // snapshots, newest first
+    JudyRetire *retire;         // blocks waiting for snapshots to close
+    uint    count;              // number of retired blocks
+    uint    alloc;              // allocated size of retire vector
+    uint    epoch;              // epoch of the newest snapshot taken
+    uint    frozen;             // epoch of the newest open snapshot
+    uint    reap;               // set by judy_close on a snapshot
+};
+
+//  concurrent access through per-thread handles:
+//  nodes carry no spare bytes, so each node's version word
+//  lives in a cache padded stripe selected by its address.
+//  A version is odd while a writer holds the stripe locked.
+//  Readers descend without locks, checking each version is
+//  unchanged after following the node, and restart if not.
+//  Writers lock the node they change and its parent.
+//  Nodes unlinked by writers are reclaimed by epochs: a node
+//  retired in epoch e is reused once the epoch reaches e + 2,
+//  when every operation that could have reached it is over.
+//  Each handle carves its own segments and keeps its own free
+//  lists, so writers allocate without sharing a cache line.
+//  A handle keeps one magazine of free blocks per node size
+//  and passes the surplus to a shared depot, where handles
+//  that run short take whole magazines from.
+
+#define JUDY_mt_bits    10
+#define JUDY_mt_threads 128
+#define JUDY_mt_line    64
+#define JUDY_mt_reclaim 64      // retired nodes per reclamation attempt
+#define JUDY_mt_magazine 32     // free blocks a handle keeps per node size
+
+typedef struct {
+    uint64_t    ver;            // even when unlocked
+    uint        pins;           // atomic cell operations in progress
+} __attribute__((aligned(JUDY_mt_line))) JudyVersion;
+
+typedef struct {
+    uint64_t    *ver;           // version word of the node
+    uint64_t    seen;           // version read on the way down
+    JudySlot    *loc;           // where the node pointer lives
+} JudyPath;
+
+struct JudyThread {
+    struct JudyMt *mt;          // array the handle belongs to
+    uint        active;         // epoch of the current operation, or zero
+    uint        used;           // slot claimed by a handle
+    JudyRetire  *retire;        // unlinked nodes waiting for readers
+    uint        count;          // number of retired nodes
+    uint        stamp;          // retired nodes given an epoch
+    uint        held;           // retired nodes kept by the last reclamation
+    uint        alloc;          // allocated size of retire vector
+    JudyPath    *path;          // versions along the current descent
+    JudySeg     *seg;           // carving segment kept between owners
+} __attribute__((aligned(JUDY_mt_line)));
+
+struct JudyMt {
+    Judy        *judy;          // the shared array
+    uint        epoch;          // global reclamation epoch
+    uint        lock;           // segment and depot lock
+    void        * *depot[8];    // magazines of free blocks, linked by their second word
+    JudyVersion root;           // version of the root pointer
+    JudyVersion stripe[1 << JUDY_mt_bits];
+    struct JudyThread thread[JUDY_mt_threads];
+};
+
+//  persistent heap:
+//  judy_open_heap carves an array's segments from a shared file
+//  mapping, behind a header page with the file's geometry, two
+//  commit slots and the slots of readers in other processes.
+//  The file is mapped where it was before, so nodes keep plain
+//  pointers; when that address is taken the pointers are moved
+//  onto the new mapping in place, as judy_copy relocates its
+//  copies.  Segments are handed out in file order; judy_close
+//  returns those holding only free blocks, and judy_open_heap
+//  hands out again every segment the commit does not hold.
+
+#define JUDY_heap_magic 0x50484a4aU     // "JJHP"
+#define JUDY_heap_slot  (JUDY_seg / 4)  // bytes of a commit slot
+#define JUDY_heap_line  64
+#define JUDY_heap_readers   (JUDY_heap_slot / JUDY_heap_line)
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    size;           // bytes of the file
+    uint64_t    gen;            // commits made; slot gen & 1 holds the newest
+    uint64_t    reloc;          // base a relocation in progress moves to, or zero
+    uint64_t    judy;           // offset of the live array header
+} JudyHeapFile;
+
+typedef struct {
+    uint64_t    base;           // address the file was mapped at
+    uint64_t    used;           // bytes of segments handed out
+    uint64_t    epoch;          // newest snapshot epoch sealing the segments
+} JudyHeapCommit;               // followed by the committed array header
+
+typedef struct {
+    uint64_t    active;         // commit the reader is in, zero outside one
+    uint32_t    pid;            // process holding the slot
+    uint32_t    used;           // slot claimed
+} __attribute__((aligned(JUDY_heap_line))) JudyHeapReader;
+
+typedef struct {
+    Judy        *snap;          // snapshot keeping a commit's nodes
+    uint64_t    gen;            // the commit's generation
+} JudyHeapKept;
+
+struct JudyHeap {
+    JudyHeapFile *file;         // the mapping, starting with the header page
+    uint64_t    used;           // bytes of segments handed out
+    JudySeg     *spare;         // segments to hand out again first
+    size_t      size;           // bytes mapped
+    int         fd;
+    JudyHeapKept *kept;         // commits readers may still be in, newest last
+    uint        cnt, alloc;
+};
+
+int judy_heap_final(Judy *judy);
+
+//  allocate a new segment
+
+JudySeg *judy_segment(void) {
+    JudySeg *seg;
+
+    if ((seg = aligned_alloc(JUDY_seg, JUDY_seg))) {
+        seg->seg = NULL;
+        seg->next = JUDY_seg;
+        seg->epoch = 0;
+        seg->dirty = 1;
+    }
+    return seg;
+}
+
+//  allocate a segment from the array's file, or NULL once
+//  the file is full
+
+JudySeg *judy_heap_segment(struct JudyHeap *heap) {
+    JudySeg *seg;
+
+    if ((seg = heap->spare)) {
+        heap->spare = seg->seg;
+    } else if (heap->used + 2 * JUDY_seg > heap->size) {
+        return NULL;
+    } else {
+        seg = (JudySeg *)((uchar *)heap->file + JUDY_seg + heap->used);
+        heap->used += JUDY_seg;
+    }
+
+    seg->seg = NULL;
+    seg->next = JUDY_seg;
+    seg->epoch = 0;
+    seg->dirty = 1;
+    return seg;
+}
+
+//  allocate a new segment for the array to carve
+
+JudySeg *judy_grow(Judy *judy) {
+    return judy->heap ? judy_heap_segment(judy->heap) : judy_segment();
+}
+
+//  note a change to the segment holding addr for
+//  judy_checkpoint, once the array has been checkpointed
+
+void judy_dirty(Judy *judy, void *addr) {
+    JudySeg *seg = JUDY_segment(addr);
+
+    //  a segment frozen by a snapshot is copied from, not written
+
+    if (judy->track && !(judy->cow && seg->epoch && seg->epoch <= judy->cow->frozen))
+        __atomic_store_n(&seg->dirty, 1, __ATOMIC_RELAXED);
+}
+
+//  hand out a cell from judy_slot, which values may be
+//  stored through unless a snapshot shares its node: the
+//  lookup copies nothing, and judy_slot_write is for that.
+//  Cells from the cursor functions are not marked, so scans
+//  stay read-only.
+
+JudySlot *judy_touch(Judy *judy, JudySlot *cell) {
+    judy_dirty(judy, cell);
+    return cell;
+}
+
 //  open judy object
 //      call with max key size
 //      and Integer tree depth.
@@ -110,19 +383,14 @@ Judy *judy_open(uint max, uint depth) {
     else
         max++;                      // allow for zero terminator on keys
 
-    if ((seg = malloc(JUDY_seg))) {
-        seg->seg = NULL;
-        seg->next = JUDY_seg;
-    } else {
+    if (!(seg = judy_segment()))
         return NULL;
-    }
 
     amt = sizeof(Judy) + max * sizeof(JudyStack);
 
     if (amt & (JUDY_cache_line - 1))
         amt |= JUDY_cache_line - 1, amt++;
 
-    seg->next -= (JudySlot)seg & (JUDY_cache_line - 1);
     seg->next -= amt;
 
     judy = (Judy *)((uchar *)seg + seg->next);
@@ -135,11 +403,97 @@ Judy *judy_open(uint max, uint depth) {
 
 void judy_close(Judy *judy) {
     JudySeg *seg, *nxt = judy->seg;
+    struct JudyHeap *heap;
+    struct JudySnap *snap;
+    uint idx;
+
+    //  closing a snapshot lets the writer
+    //  release the nodes it was holding
+
+    if (judy->snap) {
+        __atomic_store_n(&judy->snap->live, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&judy->cow->reap, 1, __ATOMIC_RELEASE);
+        free(judy);
+        return;
+    }
+
+    //  commit a file-backed array, which lives in its mapping
+
+    if ((heap = judy->heap))
+        judy_heap_final(judy);
+
+    if (judy->mt) {
+        for (idx = 0; idx < JUDY_mt_threads; idx++)
+            free(judy->mt->thread[idx].retire);
+        free(judy->mt);
+    }
+
+    if (judy->cow) {
+        while ((snap = judy->cow->snaps))
+            judy->cow->snaps = snap->next, free(snap);
+        free(judy->cow->retire);
+        free(judy->cow);
+    }
+
+    if (heap) {
+        munmap(heap->file, heap->size);
+        close(heap->fd);
+        free(heap);
+        return;
+    }
 
     while ((seg = nxt))
         nxt = seg->seg, free(seg);
 }
 
+//  give a concurrent handle a fresh segment of its own to
+//  carve, linked behind the array's current one for judy_close
+
+JudySeg *judy_mt_segment(Judy *judy) {
+    struct JudyMt *mt = judy->thread->mt;
+    JudySeg *seg;
+
+    if (!(seg = judy_segment()))
+        return NULL;
+
+    while (__atomic_exchange_n(&mt->lock, 1, __ATOMIC_ACQUIRE))
+        ;
+    seg->seg = mt->judy->seg->seg;
+    mt->judy->seg->seg = seg;
+    __atomic_store_n(&mt->lock, 0, __ATOMIC_RELEASE);
+
+    return judy->seg = seg;
+}
+
+//  take a magazine of free blocks from the depot
+//  for a handle whose own list has run dry
+
+void judy_mt_refill(Judy *judy, uint type) {
+    struct JudyMt *mt = judy->thread->mt;
+    void * *block;
+
+    if (!__atomic_load_n(&mt->depot[type], __ATOMIC_RELAXED))
+        return;
+
+    while (__atomic_exchange_n(&mt->lock, 1, __ATOMIC_ACQUIRE))
+        ;
+    if ((block = mt->depot[type]))
+        mt->depot[type] = block[1];
+    __atomic_store_n(&mt->lock, 0, __ATOMIC_RELEASE);
+
+    judy->reuse[type] = block;
+}
+
+//  hand a list of free blocks to the depot
+
+void judy_mt_deposit(struct JudyMt *mt, void * *block, uint type) {
+    while (__atomic_exchange_n(&mt->lock, 1, __ATOMIC_ACQUIRE))
+        ;
+    block[1] = mt->depot[type];
+    __atomic_store_n(&mt->depot[type], block, __ATOMIC_RELAXED);
+    __atomic_store_n(&mt->lock, 0, __ATOMIC_RELEASE);
+}
+
 //  allocate judy node
 
 void *judy_alloc(Judy *judy, uint type) {
@@ -149,7 +503,8 @@ void *judy_alloc(Judy *judy, uint type) {
     void * *rtn;
 
     if (!judy->seg)
-        return NULL;
+        if (!judy->thread || !judy_mt_segment(judy))
+            return NULL;
 
     if (type == JUDY_radix)
         type = JUDY_radix_equiv;
@@ -159,6 +514,9 @@ void *judy_alloc(Judy *judy, uint type) {
 
     amt = JudySize[type];
 
+    if (judy->thread && !judy->reuse[type])
+        judy_mt_refill(judy, type);
+
     if (amt & 0x07)
         amt |= 0x07, amt += 1;
 
@@ -167,6 +525,7 @@ void *judy_alloc(Judy *judy, uint type) {
     if ((block = judy->reuse[type])) {
         judy->reuse[type] = *block;
         memset(block, 0, amt);
+        judy_dirty(judy, block);
         return (void *)block;
     }
 
@@ -182,17 +541,19 @@ void *judy_alloc(Judy *judy, uint type) {
                     block[JudySize[idx] / sizeof(void *)] = 0;
                 }
                 memset(block, 0, amt);
+                judy_dirty(judy, block);
                 return (void *)block;
             }
 
     min = amt < JUDY_cache_line ? JUDY_cache_line : amt;
 
     if (judy->seg->next < min + sizeof(*seg)) {
-        if ((seg = malloc(JUDY_seg))) {
-            seg->next = JUDY_seg;
+        if (judy->thread) {
+            if (!judy_mt_segment(judy))
+                return NULL;
+        } else if ((seg = judy_grow(judy))) {
             seg->seg = judy->seg;
             judy->seg = seg;
-            seg->next -= (JudySlot)seg & (JUDY_cache_line - 1);
         } else {
             return NULL;
         }
@@ -211,6 +572,7 @@ void *judy_alloc(Judy *judy, uint type) {
 
     judy->seg->next -= amt;
     memset(rtn, 0, JudySize[type]);
+    judy_dirty(judy, rtn);
     return (void *)rtn;
 }
 
@@ -225,11 +587,9 @@ void *judy_data(Judy *judy, uint amt) {
         amt |= (JUDY_cache_line - 1), amt += 1;
 
     if (judy->seg->next < amt + sizeof(*seg)) {
-        if ((seg = malloc(JUDY_seg))) {
-            seg->next = JUDY_seg;
+        if ((seg = judy_grow(judy))) {
             seg->seg = judy->seg;
             judy->seg = seg;
-            seg->next -= (JudySlot)seg & (JUDY_cache_line - 1);
         } else {
             return NULL;
         }
@@ -239,6 +599,7 @@ void *judy_data(Judy *judy, uint amt) {
 
     block = (void *)((uchar *)judy->seg + judy->seg->next);
     memset(block, 0, amt);
+    judy_dirty(judy, block);
     return block;
 }
 
@@ -253,7 +614,30 @@ void *judy_clone(Judy *judy) {
     return clone;
 }
 
-void judy_free(Judy *judy, void *block, int type) {
+//  hold a node unlinked through a concurrent handle;
+//  judy_mt_exit gives it the epoch it was retired in
+
+void judy_mt_retire(struct JudyThread *thread, void *block, uint type) {
+    JudyRetire *retire;
+
+    if (thread->count == thread->alloc) {
+        if ((retire = realloc(thread->retire, (thread->alloc * 2 + 64) * sizeof(JudyRetire)))) {
+            thread->alloc = thread->alloc * 2 + 64;
+            thread->retire = retire;
+        } else {
+            return;                 // leak the block rather than reuse it
+        }
+    }
+
+    retire = thread->retire + thread->count++;
+    retire->block = block;
+    retire->type = type;
+    retire->epoch = 0;
+}
+
+//  put a block on the free list for its size
+
+void judy_recycle(Judy *judy, void *block, int type) {
     if (type == JUDY_radix)
         type = JUDY_radix_equiv;
 
@@ -262,9 +646,267 @@ void judy_free(Judy *judy, void *block, int type) {
 
     *((void * *)(block)) = judy->reuse[type];
     judy->reuse[type] = (void * *)block;
+    judy_dirty(judy, block);
     return;
 }
 
+void judy_free(Judy *judy, void *block, int type) {
+    if (judy->thread)
+        judy_mt_retire(judy->thread, block, type);
+    else
+        judy_recycle(judy, block, type);
+}
+
+//  retire block until the snapshots
+//  that can still see it are closed
+
+void judy_retire(Judy *judy, void *block, uint type) {
+    struct JudyCow *cow = judy->cow;
+    JudyRetire *retire;
+
+    if (cow->count == cow->alloc) {
+        if ((retire = realloc(cow->retire, (cow->alloc * 2 + 64) * sizeof(JudyRetire)))) {
+            cow->alloc = cow->alloc * 2 + 64;
+            cow->retire = retire;
+        } else {
+            return;                 // leak the block rather than reuse it
+        }
+    }
+
+    retire = cow->retire + cow->count++;
+    retire->block = block;
+    retire->type = type;
+    retire->epoch = cow->epoch;
+}
+
+//  release blocks no open snapshot can see
+
+void judy_reap(Judy *judy) {
+    struct JudyCow *cow = judy->cow;
+    struct JudySnap *snap, * *prev;
+    uint lo = ~0U, hi = 0, idx, cnt;
+    JudyRetire *retire;
+    void * *block;
+
+    __atomic_store_n(&cow->reap, 0, __ATOMIC_RELAXED);
+
+    for (prev = &cow->snaps; (snap = *prev); )
+        if (__atomic_load_n(&snap->live, __ATOMIC_ACQUIRE)) {
+            if (snap->epoch < lo)
+                lo = snap->epoch;
+            if (snap->epoch > hi)
+                hi = snap->epoch;
+            prev = &snap->next;
+        } else {
+            *prev = snap->next;
+            free(snap);
+        }
+
+    cow->frozen = hi;
+
+    for (idx = cnt = 0; idx < cow->count; idx++) {
+        retire = cow->retire + idx;
+
+        if (retire->epoch >= lo) {
+            cow->retire[cnt++] = *retire;
+            continue;
+        }
+
+        if (!(retire->type & JUDY_chain)) {
+            judy_free(judy, retire->block, retire->type);
+            continue;
+        }
+
+        //  splice parked reuse list back
+
+        for (block = retire->block; *block; block = *block)
+            ;
+        *block = judy->reuse[retire->type & 0x07];
+        judy_dirty(judy, block);
+        judy->reuse[retire->type & 0x07] = retire->block;
+    }
+
+    cow->count = cnt;
+}
+
+//  is node in a segment shared with an open snapshot?
+
+int judy_frozen(Judy *judy, JudySlot next) {
+    uint epoch = JUDY_segment(next)->epoch;
+
+    return epoch && epoch <= judy->cow->frozen;
+}
+
+//  replace a shared node by a private copy, returning
+//  zero if memory ran out
+
+JudySlot judy_thaw(Judy *judy, JudySlot *next) {
+    uint type = *next & 0x07;
+    void *block;
+
+    if (!(block = judy_alloc(judy, type)))
+        return 0;
+
+    memcpy(block, (void *)(*next & JUDY_mask), JudySize[type]);
+    judy_retire(judy, (void *)(*next & JUDY_mask), type);
+    return *next = (JudySlot)block | type;
+}
+
+//  copy the shared nodes on the current stack
+//  so they can be modified in place, returning
+//  zero if memory ran out
+
+int judy_unshare(Judy *judy) {
+    JudySlot *next = judy->root;
+    JudySlot *table;
+    uint idx;
+    int slot;
+
+    for (idx = 1; idx <= judy->level; idx++) {
+        if (judy_frozen(judy, *next) && !judy_thaw(judy, next))
+            return 0;
+
+        judy->stack[idx].next = *next;
+        slot = judy->stack[idx].slot;
+
+        switch (*next & 0x07) {
+            case JUDY_radix:
+                table = (JudySlot *)(*next & JUDY_mask);
+                if (judy_frozen(judy, table[slot >> 4]) && !judy_thaw(judy, &table[slot >> 4]))
+                    return 0;
+                next = (JudySlot *)(table[slot >> 4] & JUDY_mask) + (slot & 0x0F);
+                continue;
+
+            case JUDY_span:
+                next = (JudySlot *)((*next & JUDY_mask) + JudySize[JUDY_span]) - 1;
+                continue;
+
+            default:
+                next = (JudySlot *)((*next & JUDY_mask) + JudySize[*next & 0x07]) - slot - 1;
+                continue;
+        }
+    }
+
+    return 1;
+}
+
+//  make the cell the last descent stopped on safe to store
+//  through: one in a node a snapshot shares is moved to a
+//  private copy of the path first.  Returns NULL for a
+//  snapshot, or if memory ran out.
+
+JudySlot *judy_writable(Judy *judy, JudySlot *cell) {
+    JudySlot next;
+    int slot;
+
+    if (judy->snap)
+        return NULL;
+
+    if (!judy->cow || !judy->cow->frozen || !judy_frozen(judy, (JudySlot)cell))
+        return cell;
+
+    if (!judy_unshare(judy))
+        return NULL;
+
+    next = judy->stack[judy->level].next;
+    slot = judy->stack[judy->level].slot;
+
+    switch (next & 0x07) {
+        case JUDY_radix:
+            cell = (JudySlot *)(((JudySlot *)(next & JUDY_mask))[slot >> 4] & JUDY_mask) + (slot & 0x0F);
+            break;
+
+        case JUDY_span:
+            cell = (JudySlot *)((next & JUDY_mask) + JudySize[JUDY_span]) - 1;
+            break;
+
+        default:
+            cell = (JudySlot *)((next & JUDY_mask) + JudySize[next & 0x07]) - slot - 1;
+            break;
+    }
+
+    judy_dirty(judy, cell);
+    return cell;
+}
+
+//  judy_snapshot: return a read-only copy of the array
+//  as of now, unaffected by later changes to the array.
+//  Call from the writer; the snapshot may then be read by
+//  another thread while writes continue, and is released
+//  with judy_close before the array itself is closed.
+
+Judy *judy_snapshot(Judy *judy) {
+    struct JudySnap *snap;
+    struct JudyCow *cow;
+    JudySeg *seg, *old;
+    Judy *clone;
+    uint amt, type;
+
+    if (!judy->seg || judy->mt)
+        return NULL;
+
+    if (!(cow = judy->cow))
+        if (!(cow = judy->cow = calloc(1, sizeof(struct JudyCow))))
+            return NULL;
+
+    amt = sizeof(Judy) + judy->max * sizeof(JudyStack);
+
+    if (!(clone = malloc(amt)))
+        return NULL;
+
+    if (!(snap = malloc(sizeof(struct JudySnap)))) {
+        free(clone);
+        return NULL;
+    }
+
+    //  start a fresh segment for the writer, unless
+    //  nothing was carved from its last one
+
+    seg = judy->seg;
+
+    if (seg->epoch || seg->next < JUDY_seg)
+        if (!(seg = judy_grow(judy))) {
+            free(snap);
+            free(clone);
+            return NULL;
+        }
+
+    judy_reap(judy);
+    cow->epoch++;
+
+    if (seg != judy->seg) {
+        seg->seg = judy->seg;
+        judy->seg = seg;
+    }
+
+    //  seal segments filled since the last snapshot
+    //  and park the free blocks they hold
+
+    for (old = seg->seg; old && !old->epoch; old = old->seg)
+        old->epoch = cow->epoch;
+
+    for (type = 0; type < 8; type++)
+        if (judy->reuse[type]) {
+            judy_retire(judy, judy->reuse[type], JUDY_chain | type);
+            judy->reuse[type] = NULL;
+        }
+
+    snap->seg = seg->seg;
+    snap->epoch = cow->epoch;
+    snap->live = 1;
+    snap->next = cow->snaps;
+    cow->snaps = snap;
+    cow->frozen = cow->epoch;
+
+    memcpy(clone, judy, amt);
+    memset(clone->reuse, 0, sizeof(clone->reuse));
+    clone->seg = NULL;      // stop allocations from snapshot
+    clone->snap = snap;
+    clone->level = 0;
+    clone->track = 0;
+    return clone;
+}
+
 //  assemble key from current path
 
 uint judy_key(Judy *judy, uchar *buff, uint max) {
@@ -423,7 +1065,7 @@ JudySlot *judy_slot(Judy *judy, uchar *buff, uint max) {
                     // is this a leaf?
 
                     if ((!judy->depth && !(value & 0xFF)) || (judy->depth && depth == judy->depth))
-                        return &node[-slot - 1];
+                        return judy_touch(judy, &node[-slot - 1]);
 
                     next = node[-slot - 1];
                     continue;
@@ -454,7 +1096,7 @@ JudySlot *judy_slot(Judy *judy, uchar *buff, uint max) {
 
                 if ((!judy->depth && !slot) || (judy->depth && depth == judy->depth)) {  // leaf?
                     if (table[slot & 0x0F])                                         // occupied?
-                        return &table[slot & 0x0F];
+                        return judy_touch(judy, &table[slot & 0x0F]);
                     else
                         return NULL;
                 }
@@ -470,7 +1112,7 @@ JudySlot *judy_slot(Judy *judy, uchar *buff, uint max) {
                     tst = max - off;
                 value = strncmp((const char *)base, (const char *)(buff + off), tst);
                 if (!value && tst < cnt && !base[tst])                              // leaf?
-                    return &node[-1];
+                    return judy_touch(judy, &node[-1]);
 
                 if (!value && tst == cnt) {
                     next = node[-1];
@@ -484,7 +1126,31 @@ JudySlot *judy_slot(Judy *judy, uchar *buff, uint max) {
     return NULL;
 }
 
-//  promote full nodes to next larger size
+//  judy_slot_write: find the cell for a key to store through,
+//  copying the nodes on its path that a snapshot shares.
+//  Returns NULL for a missing key, or with errno set to ENOMEM
+//  if memory ran out.
+
+JudySlot *judy_slot_write(Judy *judy, uchar *buff, uint max) {
+    JudySlot *cell;
+
+    if (judy->snap)
+        return NULL;
+
+    if (judy->cow && __atomic_load_n(&judy->cow->reap, __ATOMIC_ACQUIRE))
+        judy_reap(judy);
+
+    if (!(cell = judy_slot(judy, buff, max)))
+        return NULL;
+
+    if (!(cell = judy_writable(judy, cell)))
+        errno = ENOMEM;
+
+    return cell;
+}
+
+//  promote full nodes to next larger size,
+//  returning NULL if memory ran out
 
 JudySlot *judy_promote(Judy *judy, JudySlot *next, int idx, judyvalue value, int keysize) {
     uchar *base = (uchar *)(*next & JUDY_mask);
@@ -504,7 +1170,9 @@ JudySlot *judy_promote(Judy *judy, JudySlot *next, int idx, judyvalue value, int
 
     // promote node to next larger size
 
-    newbase = judy_alloc(judy, type);
+    if (!(newbase = judy_alloc(judy, type)))
+        return NULL;
+
     newnode = (JudySlot *)(newbase + JudySize[type]);
     *next = (JudySlot)newbase | type;
 
@@ -544,7 +1212,7 @@ JudySlot *judy_promote(Judy *judy, JudySlot *next, int idx, judyvalue value, int
 //  make node with slot - start entries
 //  moving key over one offset
 
-void judy_radix(Judy *judy, JudySlot *radix, uchar *old, int start, int slot, int keysize, uchar key, uint depth) {
+void judy_radix(Judy *judy, JudySlot *radix, uchar *old, int start, int slot, int keysize, uchar key) {
     int size, idx, cnt = slot - start, newcnt;
     JudySlot *node, *oldnode;
     uint type = JUDY_1 - 1;
@@ -560,9 +1228,10 @@ void judy_radix(Judy *judy, JudySlot *radix, uchar *old, int start, int slot, in
 
     oldnode = (JudySlot *)(old + JudySize[JUDY_max]);
 
-    // is this slot a leaf?
+    //  is this slot a leaf, or the end of an integer
+    //  key word whose cell points at the next word?
 
-    if ((!judy->depth && (!key || !keysize)) || (judy->depth && !keysize && depth == judy->depth)) {
+    if ((!judy->depth && (!key || !keysize)) || (judy->depth && !keysize)) {
         table[key & 0x0F] = oldnode[-start - 1];
         return;
     }
@@ -596,7 +1265,7 @@ void judy_radix(Judy *judy, JudySlot *radix, uchar *old, int start, int slot, in
 
 //  decompose full node to radix nodes
 
-void judy_splitnode(Judy *judy, JudySlot *next, uint size, uint keysize, uint depth) {
+void judy_splitnode(Judy *judy, JudySlot *next, uint size, uint keysize) {
     int cnt, slot, start = 0;
     uint key = 0x0100, nxt;
     JudySlot *newradix;
@@ -624,12 +1293,12 @@ void judy_splitnode(Judy *judy, JudySlot *next, uint size, uint keysize, uint de
 
         //  decompose portion of old node into radix nodes
 
-        judy_radix(judy, newradix, base, start, slot, keysize - 1, (uchar)key, depth);
+        judy_radix(judy, newradix, base, start, slot, keysize - 1, (uchar)key);
         start = slot;
         key = nxt;
     }
 
-    judy_radix(judy, newradix, base, start, slot, keysize - 1, (uchar)key, depth);
+    judy_radix(judy, newradix, base, start, slot, keysize - 1, (uchar)key);
     judy_free(judy, (void * *)base, JUDY_max);
 }
 
@@ -766,7 +1435,7 @@ JudySlot *judy_last(Judy *judy, JudySlot next, uint off, uint depth) {
                     if ((inner = (JudySlot *)(table[slot >> 4] & JUDY_mask))) {
                         if ((next = inner[slot & 0x0F])) {
                             if ((!judy->depth && !slot) || (judy->depth && depth == judy->depth))
-                                return &inner[0];
+                                return &inner[slot & 0x0F];
                             else
                                 break;
                         }
@@ -930,7 +1599,7 @@ JudySlot *judy_prv(Judy *judy) {
                     if ((inner = (JudySlot *)(table[slot >> 4] & JUDY_mask)))
                         if (inner[slot & 0x0F]) {
                             if ((!judy->depth && !slot) || (judy->depth && depth == judy->depth))
-                                return &inner[0];
+                                return &inner[slot & 0x0F];
                             else
                                 return judy_last(judy, inner[slot & 0x0F], off + 1, depth);
                         }
@@ -947,10 +1616,11 @@ JudySlot *judy_prv(Judy *judy) {
     return NULL;
 }
 
-//  judy_del: delete string from judy array
-//      returning previous entry.
+//  unlink the key at the top of the stack, freeing the nodes
+//  it leaves empty.  returns zero once the array is empty,
+//  otherwise the stack is left for judy_prv.
 
-JudySlot *judy_del(Judy *judy) {
+int judy_remove(Judy *judy) {
     int slot, off, size, type;
     JudySlot *table, *inner;
     JudySlot next, *node;
@@ -962,6 +1632,7 @@ JudySlot *judy_del(Judy *judy) {
         slot = judy->stack[judy->level].slot;
         off = judy->stack[judy->level].off;
         size = JudySize[next & 0x07];
+        judy_dirty(judy, (void *)next);
 
         switch (type = next & 0x07) {
             case JUDY_1:
@@ -990,7 +1661,7 @@ JudySlot *judy_del(Judy *judy) {
 
                 if (node[-cnt]) { // does node have any slots left?
                     judy->stack[judy->level].slot++;
-                    return judy_prv(judy);
+                    return 1;
                 }
 
                 judy_free(judy, base, type);
@@ -1001,17 +1672,18 @@ JudySlot *judy_del(Judy *judy) {
                 table = (JudySlot  *)(next & JUDY_mask);
                 inner = (JudySlot *)(table[slot >> 4] & JUDY_mask);
                 inner[slot & 0x0F] = 0;
+                judy_dirty(judy, inner);
 
                 for (cnt = 16; cnt--; )
                     if (inner[cnt])
-                        return judy_prv(judy);
+                        return 1;
 
                 judy_free(judy, inner, JUDY_radix);
                 table[slot >> 4] = 0;
 
                 for (cnt = 16; cnt--; )
                     if (table[cnt])
-                        return judy_prv(judy);
+                        return 1;
 
                 judy_free(judy, table, JUDY_radix);
                 judy->level--;
@@ -1025,16 +1697,40 @@ JudySlot *judy_del(Judy *judy) {
         }
     }
 
+    return 0;
+}
+
+//  judy_del: delete string from judy array
+//      returning previous entry.
+
+JudySlot *judy_del(Judy *judy) {
+    if (judy->snap)
+        return NULL;
+
+    if (judy->cow) {
+        if (__atomic_load_n(&judy->cow->reap, __ATOMIC_ACQUIRE))
+            judy_reap(judy);
+        if (judy->cow->frozen && !judy_unshare(judy))
+            return NULL;
+    }
+
+    if (judy_remove(judy))
+        return judy_prv(judy);
+
     //  tree is now empty
 
     *judy->root = 0;
+    judy_dirty(judy, judy->root);
     return NULL;
 }
 
 //  return cell for first key greater than or equal to given key
 
 JudySlot *judy_strt(Judy *judy, uchar *buff, uint max) {
-    JudySlot *cell;
+    JudySlot *cell, next;
+    uchar *base;
+    uint off;
+    int tst;
 
     judy->level = 0;
 
@@ -1044,19 +1740,92 @@ JudySlot *judy_strt(Judy *judy, uchar *buff, uint max) {
     if ((cell = judy_slot(judy, buff, max)))
         return cell;
 
+    //  a span the key left sorting after it starts with
+    //  the next key, where judy_nxt would step past it
+
+    next = judy->stack[judy->level].next;
+
+    if (judy->level && (next & 0x07) == JUDY_span) {
+        base = (uchar *)(next & JUDY_mask);
+        off = judy->stack[judy->level].off;
+        tst = JUDY_span_bytes;
+        if (tst > (int)(max - off))
+            tst = max - off;
+
+        if (strncmp((const char *)base, (const char *)(buff + off), tst) >= 0) {
+            judy->level--;
+            return judy_first(judy, next, off, 0);
+        }
+    }
+
     return judy_nxt(judy);
 }
 
-//  split open span node
+//  retrieve the cell pointer less than or equal to given key.
+//  A miss leaves the cursor on the node where the key left the
+//  array, from where the key before it is one step back.  A
+//  key ending in zeros can land on an empty linear slot, whose
+//  cell is zero; that is a miss like any other.
 
-void judy_splitspan(Judy *judy, JudySlot *next, uchar *base) {
-    JudySlot *node = (JudySlot *)(base + JudySize[JUDY_span]);
-    uint cnt = JUDY_span_bytes;
-    uchar *newbase;
-    uint off = 0;
-#if BYTE_ORDER != BIG_ENDIAN
-    int i;
-#endif
+JudySlot *judy_floor(Judy *judy, uchar *buff, uint max) {
+    int slot, tst;
+    JudySlot *cell;
+    JudySlot next;
+    uchar *base;
+    uint off;
+
+    if ((cell = judy_slot(judy, buff, max)) && *cell)
+        return cell;
+
+    if (!judy->level)
+        return NULL;
+
+    next = judy->stack[judy->level].next;
+    slot = judy->stack[judy->level].slot;
+    off = judy->stack[judy->level].off;
+
+    switch (next & 0x07) {
+        case JUDY_1:
+        case JUDY_2:
+        case JUDY_4:
+        case JUDY_8:
+        case JUDY_16:
+        case JUDY_32:
+            //  the slot left is the last one below the key,
+            //  or -1 when every slot is above it
+
+            judy->stack[judy->level].slot = slot + 1;
+            return judy_prv(judy);
+
+        case JUDY_radix:
+            return judy_prv(judy);
+
+        case JUDY_span:
+            base = (uchar *)(next & JUDY_mask);
+            tst = JUDY_span_bytes;
+            if (tst > (int)(max - off))
+                tst = max - off;
+
+            if (strncmp((const char *)base, (const char *)(buff + off), tst) >= 0)
+                return judy_prv(judy);
+
+            judy->level--;
+            return judy_last(judy, next, off, 0);
+    }
+
+    return NULL;
+}
+
+//  split open span node
+
+void judy_splitspan(Judy *judy, JudySlot *next, uchar *base) {
+    JudySlot *node = (JudySlot *)(base + JudySize[JUDY_span]);
+    uint cnt = JUDY_span_bytes;
+    uchar *newbase;
+    uint off = 0;
+#if BYTE_ORDER != BIG_ENDIAN
+    int i;
+#endif
 
     do {
         newbase = judy_alloc(judy, JUDY_1);
@@ -1080,26 +1849,30 @@ void judy_splitspan(Judy *judy, JudySlot *next, uchar *base) {
     judy_free(judy, base, JUDY_span);
 }
 
-//  judy_cell: add string to judy array
+//  add key to the subtree at next, whose nodes
+//  start at key offset off, Integer depth depth
 
-JudySlot *judy_cell(Judy *judy, uchar *buff, uint max) {
+JudySlot *judy_insert(Judy *judy, JudySlot *next, uint off, uint depth, uchar *buff, uint max) {
     judyvalue *src = (judyvalue *)buff;
     int size, idx, slot, cnt, tst;
-    JudySlot *next = judy->root;
     judyvalue test, value;
-    uint off = 0, start;
-    JudySlot *table;
+    JudySlot *table, *inner;
     JudySlot *node;
-    uint depth = 0;
     uint keysize;
+    uint start;
     uchar *base;
 
-    judy->level = 0;
-
     while (*next) {
         if (judy->level < judy->max)
             judy->level++;
 
+        //  copy nodes shared with a snapshot before changing them
+
+        if (judy->cow && judy_frozen(judy, *next) && !judy_thaw(judy, next))
+            return NULL;
+
+        judy_dirty(judy, next);
+        judy_dirty(judy, (void *)*next);
         judy->stack[judy->level].next = *next;
         judy->stack[judy->level].off = off;
         switch (*next & 0x07) {
@@ -1179,7 +1952,8 @@ JudySlot *judy_cell(Judy *judy, uchar *buff, uint max) {
                 }
 
                 if (size < JudySize[JUDY_max]) {
-                    next = judy_promote(judy, next, slot + 1, value, keysize);
+                    if (!(next = judy_promote(judy, next, slot + 1, value, keysize)))
+                        return NULL;
 
                     if ((!judy->depth && !(value & 0xFF)) || (judy->depth && depth == judy->depth)) {
                         return next;
@@ -1191,7 +1965,7 @@ JudySlot *judy_cell(Judy *judy, uchar *buff, uint max) {
                 //  split full maximal node into JUDY_radix nodes
                 //  loop to reprocess new insert
 
-                judy_splitnode(judy, next, size, keysize, depth);
+                judy_splitnode(judy, next, size, keysize);
                 judy->level--;
                 off = start;
                 if (judy->depth)
@@ -1214,12 +1988,17 @@ JudySlot *judy_cell(Judy *judy, uchar *buff, uint max) {
 
                 // allocate inner radix if empty
 
-                if (!table[slot >> 4])
-                    table[slot >> 4] = (JudySlot)judy_alloc(judy, JUDY_radix) | JUDY_radix;
+                if (!table[slot >> 4]) {
+                    if (!(inner = judy_alloc(judy, JUDY_radix)))
+                        return NULL;
+                    table[slot >> 4] = (JudySlot)inner | JUDY_radix;
+                } else if (judy->cow && judy_frozen(judy, table[slot >> 4]) && !judy_thaw(judy, &table[slot >> 4]))
+                    return NULL;
 
                 table = (JudySlot *)(table[slot >> 4] & JUDY_mask);
                 judy->stack[judy->level].slot = slot;
                 next = &table[slot & 0x0F];
+                judy_dirty(judy, table);
 
                 if ((!judy->depth && !slot) || (judy->depth && depth == judy->depth)) { // leaf?
                     return next;
@@ -1256,11 +2035,15 @@ JudySlot *judy_cell(Judy *judy, uchar *buff, uint max) {
         }
     }
 
+    judy_dirty(judy, next);
+
     // place JUDY_1 node under JUDY_radix node(s)
 
     if (off & JUDY_key_mask)
         if (judy->depth || off <= max) {
-            base = judy_alloc(judy, JUDY_1);
+            if (!(base = judy_alloc(judy, JUDY_1)))
+                return NULL;
+
             keysize = JUDY_key_size - (off & JUDY_key_mask);
             node = (JudySlot  *)(base + JudySize[JUDY_1]);
             *next = (JudySlot)base | JUDY_1;
@@ -1308,7 +2091,9 @@ JudySlot *judy_cell(Judy *judy, uchar *buff, uint max) {
 
     if (!judy->depth)
         while (off <= max) {
-            base = judy_alloc(judy, JUDY_span);
+            if (!(base = judy_alloc(judy, JUDY_span)))
+                return NULL;
+
             *next = (JudySlot)base | JUDY_span;
             node = (JudySlot  *)(base + JudySize[JUDY_span]);
             cnt = tst = JUDY_span_bytes;
@@ -1330,7 +2115,9 @@ JudySlot *judy_cell(Judy *judy, uchar *buff, uint max) {
         }
     else
         while (depth < judy->depth) {
-            base = judy_alloc(judy, JUDY_1);
+            if (!(base = judy_alloc(judy, JUDY_1)))
+                return NULL;
+
             node = (JudySlot  *)(base + JudySize[JUDY_1]);
             *next = (JudySlot)base | JUDY_1;
 
@@ -1352,32 +2139,4294 @@ JudySlot *judy_cell(Judy *judy, uchar *buff, uint max) {
     return next;
 }
 
-Judy *judy_open_bin(uint size) {
-    Judy *judy;
-    uint depth;
+//  judy_cell: add string to judy array
 
-    depth = size / JUDY_key_size;
-    if (0 == depth || size % JUDY_key_size)
+JudySlot *judy_cell(Judy *judy, uchar *buff, uint max) {
+    if (judy->snap)
         return NULL;
-    judy = judy_open(0, depth);
-    if (judy)
-        judy->ksize = size;
 
-    return judy;
+    if (judy->cow && __atomic_load_n(&judy->cow->reap, __ATOMIC_ACQUIRE))
+        judy_reap(judy);
+
+    judy->level = 0;
+    return judy_insert(judy, judy->root, 0, 0, buff, max);
 }
 
-JudySlot *judy_cell_bin(Judy *judy, void *key) {
-    return judy_cell(judy, key, judy->ksize);
+//  judy_cell_after: add a key whose first common bytes match
+//  the key of the previous judy_cell or judy_cell_after, such
+//  as the next key of a sorted batch.  The descent resumes at
+//  the deepest node on the stack that the shared prefix leads
+//  to, instead of starting again from the root.
+
+JudySlot *judy_cell_after(Judy *judy, uchar *buff, uint max, uint common) {
+    JudySlot *next = judy->root;
+    JudySlot *table, *node;
+    uint level, off;
+    int slot;
+
+    if (judy->snap)
+        return NULL;
+
+    if (judy->cow && __atomic_load_n(&judy->cow->reap, __ATOMIC_ACQUIRE))
+        judy_reap(judy);
+
+    for (level = judy->level; level && judy->stack[level].off > common; level--)
+        ;
+
+    if (!level) {
+        judy->level = 0;
+        return judy_insert(judy, judy->root, 0, 0, buff, max);
+    }
+
+    //  copy any path nodes a snapshot shares, then
+    //  find where the parent holds the node's pointer
+
+    judy->level = level - 1;
+
+    if (judy->cow && judy->cow->frozen && !judy_unshare(judy))
+        return NULL;
+
+    if (level > 1) {
+        slot = judy->stack[level - 1].slot;
+        next = (JudySlot *)judy->stack[level - 1].next;
+
+        switch ((JudySlot)next & 0x07) {
+            case JUDY_radix:
+                table = (JudySlot *)((JudySlot)next & JUDY_mask);
+                next = (JudySlot *)(table[slot >> 4] & JUDY_mask) + (slot & 0x0F);
+                break;
+
+            case JUDY_span:
+                next = (JudySlot *)(((JudySlot)next & JUDY_mask) + JudySize[JUDY_span]) - 1;
+                break;
+
+            default:
+                node = (JudySlot *)(((JudySlot)next & JUDY_mask) + JudySize[(JudySlot)next & 0x07]);
+                next = &node[-slot - 1];
+                break;
+        }
+    }
+
+    off = judy->stack[level].off;
+    return judy_insert(judy, next, off, judy->depth ? off / JUDY_key_size : 0, buff, max);
 }
 
-JudySlot *judy_strt_bin(Judy *judy, void *key) {
-    return judy_strt(judy, key, judy->ksize);
+//  visit every node pointer and leaf cell in the subtree at next.
+//  A visitor may clear a node pointer to leave its subtree out.
+
+typedef void (*JudyVisit)(Judy *judy, JudySlot *next, int leaf, void *ctx);
+
+void judy_walk(Judy *judy, JudySlot *next, uint off, uint depth, JudyVisit visit, void *ctx) {
+    JudySlot *table, *inner, *node;
+    int slot, size, keysize, cnt;
+    uchar *base;
+    int leaf;
+
+    visit(judy, next, 0, ctx);
+
+    if (!*next)
+        return;
+
+    switch (*next & 0x07) {
+        case JUDY_1:
+        case JUDY_2:
+        case JUDY_4:
+        case JUDY_8:
+        case JUDY_16:
+        case JUDY_32:
+            size = JudySize[*next & 0x07];
+            keysize = JUDY_key_size - (off & JUDY_key_mask);
+            cnt = size / (sizeof(JudySlot) + keysize);
+            node = (JudySlot *)((*next & JUDY_mask) + size);
+            base = (uchar *)(*next & JUDY_mask);
+
+            for (slot = 0; slot < cnt; slot++) {
+                if (!node[-slot - 1])
+                    continue;
+#if BYTE_ORDER != BIG_ENDIAN
+                leaf = (!judy->depth && !base[slot * keysize]) || (judy->depth && depth + 1 == judy->depth);
+#else
+                leaf = (!judy->depth && !base[slot * keysize + keysize - 1]) || (judy->depth && depth + 1 == judy->depth);
+#endif
+                if (leaf)
+                    visit(judy, &node[-slot - 1], 1, ctx);
+                else
+                    judy_walk(judy, &node[-slot - 1], (off | JUDY_key_mask) + 1, depth + 1, visit, ctx);
+            }
+            return;
+
+        case JUDY_radix:
+            table = (JudySlot *)(*next & JUDY_mask);
+            off++;
+
+            if (judy->depth)
+                if (!(off & JUDY_key_mask))
+                    depth++;
+
+            for (slot = 0; slot < 256; slot++) {
+                if (!table[slot >> 4]) {
+                    slot |= 0x0F;
+                    continue;
+                }
+
+                if (!(slot & 0x0F))
+                    visit(judy, &table[slot >> 4], 0, ctx);
+
+                if (!(inner = (JudySlot *)(table[slot >> 4] & JUDY_mask))) {
+                    slot |= 0x0F;
+                    continue;
+                }
+
+                if (!inner[slot & 0x0F])
+                    continue;
+
+                if ((!judy->depth && !slot) || (judy->depth && depth == judy->depth))
+                    visit(judy, &inner[slot & 0x0F], 1, ctx);
+                else
+                    judy_walk(judy, &inner[slot & 0x0F], off, depth, visit, ctx);
+            }
+            return;
+
+        case JUDY_span:
+            node = (JudySlot *)((*next & JUDY_mask) + JudySize[JUDY_span]);
+            base = (uchar *)(*next & JUDY_mask);
+
+            if (!base[JUDY_span_bytes - 1])
+                visit(judy, &node[-1], 1, ctx);
+            else
+                judy_walk(judy, &node[-1], off + JUDY_span_bytes, depth, visit, ctx);
+            return;
+    }
 }
 
-JudySlot *judy_slot_bin(Judy *judy, void *key) {
-    return judy_slot(judy, key, judy->ksize);
+//  Parallel teardown.  The radix nodes at the top of the tree are
+//  opened up until there are enough subtrees to go round, and
+//  workers then take subtrees in turn and walk them with
+//  judy_walk, passing each leaf value to the destructor.
+
+#define JUDY_close_split 8      // subtrees per worker to balance the load
+
+typedef struct {
+    JudySlot    *next;          // subtree pointer, or leaf cell
+    uint        off, depth;     // key position of the subtree
+    int         leaf;
+} JudyTree;
+
+typedef struct {
+    void        (*dtor)(JudySlot, void *);
+    void        *ctx;
+    JudyTree    *tree;          // subtrees to tear down
+    uint        cnt;
+    uint        taken;          // subtrees claimed by workers
+} JudyTeardown;
+
+void judy_close_visit(Judy *judy, JudySlot *next, int leaf, void *ctx) {
+    JudyTeardown *teardown = ctx;
+    (void)judy;
+
+    if (leaf && *next)
+        teardown->dtor(*next, teardown->ctx);
 }
 
-bool judy_key_bin(Judy *judy, void *key) {
-    return judy_key(judy, key, judy->ksize) == judy->ksize;
+void *judy_close_worker(void *arg) {
+    JudyTeardown *teardown = ((void **)arg)[0];
+    Judy *judy = ((void **)arg)[1];
+    JudyTree *tree;
+    uint idx;
+
+    while ((idx = __atomic_fetch_add(&teardown->taken, 1, __ATOMIC_RELAXED)) < teardown->cnt) {
+        tree = teardown->tree + idx;
+
+        if (tree->leaf)
+            judy_close_visit(judy, tree->next, 1, teardown);
+        else
+            judy_walk(judy, tree->next, tree->off, tree->depth, judy_close_visit, teardown);
+    }
+
+    return NULL;
+}
+
+//  judy_close_ex: pass every non-zero value in the array to dtor
+//  along with ctx, using up to threads workers, then close the
+//  array.  The destructor runs concurrently with itself.  The
+//  values of a snapshot belong to the array it was taken from
+//  and are not passed to dtor.
+
+void judy_close_ex(Judy *judy, void (*dtor)(JudySlot, void *), void *ctx, uint threads) {
+    JudySlot *table, *inner;
+    JudyTeardown teardown;
+    pthread_t *tid = NULL;
+    uint idx, cnt, slot, off, depth;
+    void *args[2];
+    JudyTree *tree;
+
+    if (!dtor || judy->snap || !judy->root[0]) {
+        judy_close(judy);
+        return;
+    }
+
+    memset(&teardown, 0, sizeof(teardown));
+    teardown.dtor = dtor;
+    teardown.ctx = ctx;
+
+    if (threads < 2 || !(teardown.tree = malloc(threads * JUDY_close_split * sizeof(JudyTree) + 256 * sizeof(JudyTree)))) {
+        judy_walk(judy, judy->root, 0, 0, judy_close_visit, &teardown);
+        judy_close(judy);
+        return;
+    }
+
+    tree = teardown.tree;
+    tree[0].next = judy->root;
+    tree[0].off = tree[0].depth = 0;
+    tree[0].leaf = 0;
+    teardown.cnt = 1;
+
+    //  replace radix subtrees by their children, from the
+    //  top down, until every worker has several to take
+
+    for (idx = 0; idx < teardown.cnt && teardown.cnt < threads * JUDY_close_split; ) {
+        if (tree[idx].leaf || (*tree[idx].next & 0x07) != JUDY_radix) {
+            idx++;
+            continue;
+        }
+
+        table = (JudySlot *)(*tree[idx].next & JUDY_mask);
+        off = tree[idx].off + 1;
+        depth = tree[idx].depth;
+
+        if (judy->depth)
+            if (!(off & JUDY_key_mask))
+                depth++;
+
+        tree[idx] = tree[--teardown.cnt];
+
+        for (slot = 0; slot < 256; slot++) {
+            if (!table[slot >> 4]) {
+                slot |= 0x0F;
+                continue;
+            }
+
+            inner = (JudySlot *)(table[slot >> 4] & JUDY_mask);
+
+            if (!inner[slot & 0x0F])
+                continue;
+
+            cnt = teardown.cnt++;
+            tree[cnt].next = &inner[slot & 0x0F];
+            tree[cnt].off = off;
+            tree[cnt].depth = depth;
+            tree[cnt].leaf = (!judy->depth && !slot) || (judy->depth && depth == judy->depth);
+        }
+    }
+
+    args[0] = &teardown;
+    args[1] = judy;
+
+    if (teardown.cnt > 1 && (tid = malloc(threads * sizeof(pthread_t))))
+        for (idx = 1; idx < threads; idx++)
+            if (pthread_create(&tid[idx], NULL, judy_close_worker, args))
+                break;
+
+    judy_close_worker(args);
+
+    while (tid && idx-- > 1)
+        pthread_join(tid[idx], NULL);
+
+    free(tid);
+    free(teardown.tree);
+    judy_close(judy);
+}
+
+//  map from original segments to their copies
+
+typedef struct {
+    JudySeg *old;               // original segment
+    JudySeg *seg;               // copied segment
+} JudyReloc;
+
+typedef struct {
+    JudyReloc *map;             // sorted by original segment
+    uint    cnt;                // number of segments
+} JudyRelocs;
+
+int judy_reloccmp(const void *a, const void *b) {
+    const JudyReloc *x = a, *y = b;
+
+    return (x->old > y->old) - (x->old < y->old);
+}
+
+//  translate pointer into original segments to the copy
+
+void *judy_reloc(JudyRelocs *relocs, void *addr) {
+    JudyReloc key[1], *found;
+
+    if (!addr)
+        return NULL;
+
+    key->old = JUDY_segment(addr);
+    found = bsearch(key, relocs->map, relocs->cnt, sizeof(JudyReloc), judy_reloccmp);
+
+    if (!found)
+        return addr;
+
+    return (uchar *)found->seg + ((uchar *)addr - (uchar *)found->old);
+}
+
+void judy_relocate(Judy *judy, JudySlot *next, int leaf, void *ctx) {
+    (void)judy;
+
+    if (!leaf)
+        *next = (JudySlot)judy_reloc(ctx, (void *)*next);
+}
+
+//  judy_copy: duplicate the array by copying its segments
+//  in bulk and relocating the node pointers within them.
+//  A snapshot is copied from the segments it sealed.  A
+//  concurrent array is copied, while no handle writes to it,
+//  into a plain array; its handles return NULL.
+
+Judy *judy_copy(Judy *judy) {
+    JudySeg *seg, *first = judy->seg, *head = NULL;
+    JudyRelocs relocs[1];
+    JudySlot *block;
+    uint amt, idx;
+    Judy *copy;
+
+    if (judy->snap)
+        first = judy->snap->seg;
+    else if (!first || judy->thread)
+        return NULL;                // clones and handles share their segments
+
+    relocs->cnt = 0;
+
+    for (seg = first; seg; seg = seg->seg)
+        relocs->cnt++;
+
+    if (!(relocs->map = malloc(relocs->cnt * sizeof(JudyReloc))))
+        return NULL;
+
+    amt = sizeof(Judy) + judy->max * sizeof(JudyStack);
+
+    if (amt & (JUDY_cache_line - 1))
+        amt |= JUDY_cache_line - 1, amt++;
+
+    //  a snapshot's header is not in its segments,
+    //  so give the copy a new segment to hold it
+
+    if (judy->snap) {
+        if (!(head = judy_segment())) {
+            free(relocs->map);
+            return NULL;
+        }
+        head->next -= amt;
+    }
+
+    //  copy the used part of each segment
+
+    for (idx = 0, seg = first; seg; seg = seg->seg, idx++) {
+        relocs->map[idx].old = seg;
+
+        if (!(relocs->map[idx].seg = judy_segment())) {
+            while (idx--)
+                free(relocs->map[idx].seg);
+            free(relocs->map);
+            free(head);
+            return NULL;
+        }
+
+        memcpy((uchar *)relocs->map[idx].seg + seg->next, (uchar *)seg + seg->next, JUDY_seg - seg->next);
+        relocs->map[idx].seg->next = seg->next;
+
+        if (idx)
+            relocs->map[idx - 1].seg->seg = relocs->map[idx].seg;
+    }
+
+    if (head) {
+        head->seg = relocs->map[0].seg;
+        copy = (Judy *)((uchar *)head + head->next);
+        memcpy(copy, judy, amt);
+        memset(copy->reuse, 0, sizeof(copy->reuse));
+        copy->seg = head;
+        copy->snap = NULL;
+    } else
+        seg = relocs->map[0].seg;
+
+    qsort(relocs->map, relocs->cnt, sizeof(JudyReloc), judy_reloccmp);
+
+    if (!head) {
+        copy = judy_reloc(relocs, judy);
+        copy->seg = seg;
+
+        for (idx = 0; idx < 8; idx++)
+            for (block = (JudySlot *)&copy->reuse[idx]; *block; block = (JudySlot *)*block)
+                *block = (JudySlot)judy_reloc(relocs, (void *)*block);
+    }
+
+    copy->cow = NULL;
+    copy->heap = NULL;
+    copy->mt = NULL;
+    copy->track = 0;
+
+    for (idx = 1; idx <= copy->level; idx++)
+        copy->stack[idx].next = (JudySlot)judy_reloc(relocs, (void *)copy->stack[idx].next);
+
+    if (*copy->root)
+        judy_walk(copy, copy->root, 0, 0, judy_relocate, relocs);
+
+    free(relocs->map);
+    return copy;
+}
+
+//  incremental checkpoints:
+//  once an array has been checkpointed, every node write, block
+//  allocation and free, and every cell judy_cell or judy_slot
+//  hands out marks the segment it lands in as dirty, and new
+//  segments start dirty.  A value changed through a cell from
+//  judy_strt, judy_nxt, judy_prv or judy_end is not seen until
+//  its key is looked up again with judy_slot.
+//  A checkpoint writes the used part of each dirty segment,
+//  always including the one holding the array header, under the
+//  address the segment had, then clears the marks.  Pointers are
+//  written as they are; judy_restore reads a full checkpoint and
+//  the deltas after it, keeping the newest image of every
+//  segment, then relocates the pointers onto the segments it
+//  allocated, as judy_copy does.
+
+#define JUDY_ckpt_magic 0x504b434aU     // "JCKP"
+#define JUDY_restore_batch (8 << 20)    // bytes judy_restore_fd reads at once
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    seq;            // zero for a full checkpoint, then one per delta
+    uint64_t    cnt;            // segment images that follow
+    uint64_t    judy;           // address of the array header
+} JudyCkpt;
+
+typedef struct {
+    uint64_t    addr;           // address of the segment when written
+    uint64_t    seg;            // its next segment then
+    uint32_t    next;           // start of its used part
+    uint32_t    fill;           // unused
+} JudyCkptSeg;
+
+//  judy_checkpoint: write to out the segments changed since
+//  the array's last checkpoint, or every segment if full is set
+//  or this is its first.  Values are written as they are, so
+//  they must mean the same thing when restored.  Returns zero
+//  on a write error, after which the next checkpoint is full.
+//  Not for snapshots or concurrent arrays.
+
+int judy_checkpoint(Judy *judy, FILE *out, int full) {
+    JudySeg *seg, *head = JUDY_segment(judy);
+    JudyCkptSeg image[1];
+    JudyCkpt ckpt[1];
+    int ok;
+
+    if (!judy->seg || judy->snap || judy->mt || judy->thread)
+        return 0;
+
+    if (!judy->track)
+        full = 1;
+
+    memset(ckpt, 0, sizeof(ckpt));
+    ckpt->magic = JUDY_ckpt_magic;
+    ckpt->seq = full ? 0 : judy->track;
+    ckpt->judy = (uint64_t)(JudySlot)judy;
+
+    for (seg = judy->seg; seg; seg = seg->seg)
+        if (full || seg->dirty || seg == head)
+            ckpt->cnt++;
+
+    ok = fwrite(ckpt, sizeof(ckpt), 1, out) == 1;
+
+    for (seg = judy->seg; ok && seg; seg = seg->seg) {
+        if (!full && !seg->dirty && seg != head)
+            continue;
+
+        memset(image, 0, sizeof(image));
+        image->addr = (uint64_t)(JudySlot)seg;
+        image->seg = (uint64_t)(JudySlot)seg->seg;
+        image->next = seg->next;
+
+        ok = fwrite(image, sizeof(image), 1, out) == 1;
+        ok = ok && fwrite((uchar *)seg + seg->next, 1, JUDY_seg - seg->next, out) == JUDY_seg - seg->next;
+    }
+
+    if (!ok) {
+        judy->track = 0;
+        return 0;
+    }
+
+    for (seg = judy->seg; seg; seg = seg->seg)
+        seg->dirty = 0;
+
+    judy->track = ckpt->seq + 1;
+    return 1;
+}
+
+//  checkpoint input: a stdio stream, or a file descriptor
+//  read in large batches
+
+typedef struct {
+    FILE    *in;            // stream, or NULL to read fd
+    int     fd;
+    uchar   *buff;          // batch read from fd
+    size_t  pos, fill;      // bytes of the batch used and read
+} JudyInput;
+
+int judy_input(JudyInput *input, void *dest, size_t len) {
+    ssize_t got;
+    size_t amt;
+
+    if (input->in)
+        return fread(dest, 1, len, input->in) == len;
+
+    while (len) {
+        if (input->pos == input->fill) {
+            while ((got = read(input->fd, input->buff, JUDY_restore_batch)) < 0 && errno == EINTR)
+                ;
+
+            if (got <= 0)
+                return 0;
+
+            input->pos = 0;
+            input->fill = got;
+        }
+
+        amt = input->fill - input->pos < len ? input->fill - input->pos : len;
+        memcpy(dest, input->buff + input->pos, amt);
+        dest = (uchar *)dest + amt;
+        input->pos += amt;
+        len -= amt;
+    }
+
+    return 1;
+}
+
+//  read one checkpoint's segment images into fresh segments,
+//  returning zero at end of input or if the checkpoint is cut
+//  short, freeing what it read
+
+int judy_ckpt_read(JudyInput *in, JudyCkpt *ckpt, JudyReloc **map) {
+    JudyCkptSeg image[1];
+    uint64_t idx;
+    JudySeg *seg;
+
+    *map = NULL;
+
+    if (!judy_input(in, ckpt, sizeof(JudyCkpt)) || ckpt->magic != JUDY_ckpt_magic)
+        return 0;
+
+    if (!ckpt->cnt || !(*map = calloc(ckpt->cnt, sizeof(JudyReloc))))
+        return 0;
+
+    for (idx = 0; idx < ckpt->cnt; idx++) {
+        if (!judy_input(in, image, sizeof(image)) || image->next < sizeof(JudySeg) || image->next > JUDY_seg)
+            break;
+
+        if (!(seg = judy_segment()))
+            break;
+
+        (*map)[idx].old = (JudySeg *)(JudySlot)image->addr;
+        (*map)[idx].seg = seg;
+        seg->seg = (JudySeg *)(JudySlot)image->seg;
+        seg->next = image->next;
+
+        if (!judy_input(in, (uchar *)seg + seg->next, JUDY_seg - seg->next))
+            break;
+    }
+
+    if (idx == ckpt->cnt)
+        return 1;
+
+    for (idx = 0; idx < ckpt->cnt; idx++)
+        free((*map)[idx].seg);
+
+    free(*map);
+    *map = NULL;
+    return 0;
+}
+
+//  rebuild an array from the checkpoints read from in
+
+Judy *judy_restore_input(JudyInput *in) {
+    JudyReloc *map, *found, *grow;
+    JudyRelocs relocs[1];
+    uint64_t addr = 0;
+    JudySlot *block;
+    JudyCkpt ckpt[1];
+    uint idx, cnt, seq = 0;
+    Judy *judy;
+    JudySeg *seg;
+
+    relocs->map = NULL;
+    relocs->cnt = 0;
+
+    while (judy_ckpt_read(in, ckpt, &map)) {
+
+        //  a full checkpoint starts over; a delta must follow on
+
+        if (!ckpt->seq) {
+            for (idx = 0; idx < relocs->cnt; idx++)
+                free(relocs->map[idx].seg);
+            relocs->cnt = 0;
+        } else if (!relocs->cnt || ckpt->seq != seq) {
+            for (idx = 0; idx < ckpt->cnt; idx++)
+                free(map[idx].seg);
+            free(map);
+            break;
+        }
+
+        if (!(grow = realloc(relocs->map, (relocs->cnt + ckpt->cnt) * sizeof(JudyReloc)))) {
+            for (idx = 0; idx < ckpt->cnt; idx++)
+                free(map[idx].seg);
+            free(map);
+            break;
+        }
+
+        relocs->map = grow;
+        cnt = relocs->cnt;
+
+        //  newer images replace older ones of the same segment
+
+        for (idx = 0; idx < ckpt->cnt; idx++)
+            if ((found = bsearch(map + idx, relocs->map, cnt, sizeof(JudyReloc), judy_reloccmp))) {
+                free(found->seg);
+                found->seg = map[idx].seg;
+            } else
+                relocs->map[relocs->cnt++] = map[idx];
+
+        qsort(relocs->map, relocs->cnt, sizeof(JudyReloc), judy_reloccmp);
+        free(map);
+        addr = ckpt->judy;
+        seq = ckpt->seq + 1;
+    }
+
+    if (!relocs->cnt) {
+        free(relocs->map);
+        return NULL;
+    }
+
+    //  point everything at the restored segments
+
+    for (idx = 0; idx < relocs->cnt; idx++) {
+        seg = relocs->map[idx].seg;
+        seg->seg = judy_reloc(relocs, seg->seg);
+        seg->epoch = 0;
+    }
+
+    judy = judy_reloc(relocs, (void *)(JudySlot)addr);
+    judy->seg = judy_reloc(relocs, judy->seg);
+
+    for (idx = 0; idx < 8; idx++)
+        for (block = (JudySlot *)&judy->reuse[idx]; *block; block = (JudySlot *)*block)
+            *block = (JudySlot)judy_reloc(relocs, (void *)*block);
+
+    judy->cow = NULL;
+    judy->snap = NULL;
+    judy->mt = NULL;
+    judy->thread = NULL;
+    judy->heap = NULL;
+    judy->level = 0;
+    judy->track = 0;
+
+    if (*judy->root)
+        judy_walk(judy, judy->root, 0, 0, judy_relocate, relocs);
+
+    //  free images of segments the array no longer chains,
+    //  such as ones released between checkpoints
+
+    for (idx = 0; idx < relocs->cnt; idx++)
+        relocs->map[idx].seg->dirty = 0;
+
+    for (seg = judy->seg; seg; seg = seg->seg)
+        seg->dirty = 1;
+
+    for (idx = 0; idx < relocs->cnt; idx++)
+        if (!relocs->map[idx].seg->dirty)
+            free(relocs->map[idx].seg);
+
+    free(relocs->map);
+    return judy;
+}
+
+//  judy_restore: rebuild an array from the checkpoints in
+//  in, starting with a full one.  A delta cut short at the end
+//  is ignored, restoring the checkpoint before it.  The array
+//  restored takes a full checkpoint first.  Returns NULL if in
+//  holds no complete full checkpoint or memory ran out.
+
+Judy *judy_restore(FILE *in) {
+    JudyInput input[1];
+
+    memset(input, 0, sizeof(input));
+    input->in = in;
+    return judy_restore_input(input);
+}
+
+//  judy_restore_fd: judy_restore from a file descriptor, read
+//  sequentially in batches of JUDY_restore_batch bytes
+
+Judy *judy_restore_fd(int fd) {
+    JudyInput input[1];
+    Judy *judy;
+
+    memset(input, 0, sizeof(input));
+    input->fd = fd;
+
+    if (!(input->buff = malloc(JUDY_restore_batch)))
+        return NULL;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    judy = judy_restore_input(input);
+    free(input->buff);
+    return judy;
+}
+
+//  background checkpoints:
+//  judy_snapshot_async takes a snapshot, so the writer carries
+//  on while the sealed segments are written, and gives the
+//  snapshot's header a segment of its own, as judy_copy does.
+//  Every segment image has a fixed offset in the file, laid out
+//  as judy_checkpoint writes a full checkpoint, so the writes
+//  may complete in any order.  Runs of segments go out straight
+//  from the segments with one vectored write each, through
+//  io_uring where the kernel has it and from a few threads
+//  otherwise.  inflight bounds the bytes of the writes queued
+//  at once; the segments stay pinned by the snapshot until the
+//  last write is done.  The writer's own header stays in one of
+//  the sealed segments and changes with every write, so that
+//  range goes out from a copy taken with the snapshot.
+
+#define JUDY_async_run  16      // most segments in one write
+#define JUDY_async_pool 8       // most threads writing without io_uring
+
+typedef struct {
+    struct iovec iov[2 * JUDY_async_run + 3];
+    uint    cnt;                // iovecs in use
+    off_t   off;                // file offset of the run
+    size_t  len;                // bytes in the run
+} JudyAsyncRun;
+
+struct JudyAsync {
+    Judy        *snap;          // snapshot being written
+    JudySeg     *head;          // segment holding the snapshot's header
+    uchar       *header;        // the writer's header as the snapshot found it
+    JudyCkpt    ckpt[1];
+    JudyCkptSeg *images;        // image headers, one per segment
+    JudyAsyncRun *runs;
+    uint        cnt;            // runs to write
+    uint        claim;          // next run for the pool
+    uint        depth;          // most runs in flight
+    int         fd;
+    uint        flags;
+    int         err;            // first errno, or zero
+    uint64_t    done, total;    // bytes written and to write
+    off_t       end;            // offset after the checkpoint
+    JudyProgress progress;
+    JudyFinish  finish;
+    void        *ctx;
+    pthread_mutex_t lock;       // serialises progress calls
+    pthread_t   thread;         // drives the writes
+};
+
+//  write a run from byte done on, returning zero or an errno
+
+int judy_async_rest(JudyAsync *async, JudyAsyncRun *run, size_t done) {
+    struct iovec iov[2 * JUDY_async_run + 3];
+    size_t skip;
+    uint idx, cnt;
+    ssize_t amt;
+
+    while (done < run->len) {
+        for (skip = done, idx = 0; skip >= run->iov[idx].iov_len; idx++)
+            skip -= run->iov[idx].iov_len;
+
+        for (cnt = 0; idx + cnt < run->cnt; cnt++)
+            iov[cnt] = run->iov[idx + cnt];
+
+        iov[0].iov_base = (uchar *)iov[0].iov_base + skip;
+        iov[0].iov_len -= skip;
+
+        if ((amt = pwritev(async->fd, iov, cnt, run->off + done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+
+        if (!amt)
+            return EIO;
+
+        done += amt;
+    }
+
+    return 0;
+}
+
+//  keep the first error
+
+void judy_async_error(JudyAsync *async, int err) {
+    pthread_mutex_lock(&async->lock);
+
+    if (!async->err)
+        async->err = err;
+
+    pthread_mutex_unlock(&async->lock);
+}
+
+//  account for a finished run
+
+void judy_async_done(JudyAsync *async, JudyAsyncRun *run, int err) {
+    pthread_mutex_lock(&async->lock);
+
+    if (err && !async->err)
+        async->err = err;
+
+    async->done += run->len;
+
+    if (async->progress && !err)
+        async->progress(async->ctx, async->done, async->total);
+
+    pthread_mutex_unlock(&async->lock);
+}
+
+void *judy_async_worker(void *arg) {
+    JudyAsync *async = arg;
+    uint idx;
+
+    while ((idx = __atomic_fetch_add(&async->claim, 1, __ATOMIC_RELAXED)) < async->cnt)
+        judy_async_done(async, async->runs + idx, judy_async_rest(async, async->runs + idx, 0));
+
+    return NULL;
+}
+
+//  write the runs from up to depth threads, this one included
+
+void judy_async_pool(JudyAsync *async) {
+    pthread_t threads[JUDY_async_pool];
+    uint idx, cnt = async->depth;
+
+    if (cnt > JUDY_async_pool)
+        cnt = JUDY_async_pool;
+
+    if (cnt > async->cnt)
+        cnt = async->cnt;
+
+    for (idx = 1; idx < cnt; idx++)
+        if (pthread_create(threads + idx, NULL, judy_async_worker, async))
+            break;
+
+    cnt = idx;
+    judy_async_worker(async);
+
+    for (idx = 1; idx < cnt; idx++)
+        pthread_join(threads[idx], NULL);
+}
+
+#ifdef JUDY_uring
+
+//  a submission and completion ring, driven with the raw
+//  system calls
+
+typedef struct {
+    int     fd;
+    uint    *sqtail, *sqmask, *sqarray;
+    uint    *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void    *sqmap, *cqmap;
+    size_t  sqsize, cqsize, sqesize;
+} JudyRing;
+
+int judy_ring_open(JudyRing *ring, uint entries) {
+    struct io_uring_params params[1];
+    uchar *sq, *cq;
+
+    memset(params, 0, sizeof(params));
+
+    if ((ring->fd = syscall(__NR_io_uring_setup, entries, params)) < 0)
+        return 0;
+
+    ring->sqsize = params->sq_off.array + params->sq_entries * sizeof(uint);
+    ring->cqsize = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesize = params->sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqsize > ring->sqsize)
+            ring->sqsize = ring->cqsize;
+        ring->cqsize = 0;
+    }
+
+    ring->cqmap = ring->sqes = MAP_FAILED;
+    ring->sqmap = mmap(NULL, ring->sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if (ring->sqmap != MAP_FAILED && ring->cqsize)
+        ring->cqmap = mmap(NULL, ring->cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+    if (ring->sqmap != MAP_FAILED)
+        ring->sqes = mmap(NULL, ring->sqesize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->sqmap == MAP_FAILED || (ring->cqsize && ring->cqmap == MAP_FAILED) || ring->sqes == MAP_FAILED) {
+        if (ring->sqmap != MAP_FAILED)
+            munmap(ring->sqmap, ring->sqsize);
+        if (ring->cqsize && ring->cqmap != MAP_FAILED)
+            munmap(ring->cqmap, ring->cqsize);
+        close(ring->fd);
+        return 0;
+    }
+
+    sq = ring->sqmap;
+    cq = ring->cqsize ? ring->cqmap : ring->sqmap;
+
+    ring->sqtail = (uint *)(sq + params->sq_off.tail);
+    ring->sqmask = (uint *)(sq + params->sq_off.ring_mask);
+    ring->sqarray = (uint *)(sq + params->sq_off.array);
+    ring->cqhead = (uint *)(cq + params->cq_off.head);
+    ring->cqtail = (uint *)(cq + params->cq_off.tail);
+    ring->cqmask = (uint *)(cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+    return 1;
+}
+
+void judy_ring_close(JudyRing *ring) {
+    munmap(ring->sqes, ring->sqesize);
+
+    if (ring->cqsize)
+        munmap(ring->cqmap, ring->cqsize);
+
+    munmap(ring->sqmap, ring->sqsize);
+    close(ring->fd);
+}
+
+//  keep up to depth runs queued on the ring until all are
+//  written.  A run the ring cuts short or fails with a retryable
+//  error is finished with pwritev; if the ring itself fails the
+//  checkpoint is abandoned.  Returns zero, writing nothing, if
+//  the ring cannot be set up.
+
+int judy_async_uring(JudyAsync *async) {
+    uint next = 0, queued = 0, inflight = 0, finished = 0;
+    uint tail, head, slot;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    JudyAsyncRun *run;
+    JudyRing ring[1];
+    int ret, err;
+
+    if (!judy_ring_open(ring, async->depth))
+        return 0;
+
+    while (finished < async->cnt) {
+        tail = *ring->sqtail;
+
+        while (next < async->cnt && inflight < async->depth) {
+            run = async->runs + next;
+            slot = tail & *ring->sqmask;
+            sqe = ring->sqes + slot;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = async->fd;
+            sqe->addr = (uint64_t)(JudySlot)run->iov;
+            sqe->len = run->cnt;
+            sqe->off = run->off;
+            sqe->user_data = next++;
+            ring->sqarray[slot] = slot;
+            tail++, queued++, inflight++;
+        }
+
+        __atomic_store_n(ring->sqtail, tail, __ATOMIC_RELEASE);
+
+        if ((ret = syscall(__NR_io_uring_enter, ring->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0)) < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+
+            judy_async_error(async, errno);
+            break;
+        }
+
+        queued -= ret;
+        head = *ring->cqhead;
+
+        while (head != __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE)) {
+            cqe = ring->cqes + (head++ & *ring->cqmask);
+            run = async->runs + cqe->user_data;
+            err = 0;
+
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+                err = judy_async_rest(async, run, 0);
+            else if (cqe->res < 0)
+                err = -cqe->res;
+            else if ((size_t)cqe->res < run->len)
+                err = judy_async_rest(async, run, cqe->res);
+
+            judy_async_done(async, run, err);
+            inflight--, finished++;
+        }
+
+        __atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+    }
+
+    judy_ring_close(ring);
+    return 1;
+}
+#endif
+
+//  write the checkpoint, then release the snapshot and report
+
+void *judy_async_main(void *arg) {
+    JudyAsync *async = arg;
+    int ring = 0;
+
+#ifdef JUDY_uring
+    if (!(async->flags & JUDY_async_threads))
+        ring = judy_async_uring(async);
+#endif
+
+    if (!ring)
+        judy_async_pool(async);
+
+    if (!async->err && fdatasync(async->fd))
+        async->err = errno;
+
+    judy_close(async->snap);
+    free(async->head);
+    free(async->header);
+    free(async->images);
+    free(async->runs);
+    async->snap = NULL;
+
+    if (async->finish)
+        async->finish(async->ctx, async->err);
+
+    return NULL;
+}
+
+//  judy_snapshot_async: write a full checkpoint of the array to
+//  fd, from its current offset, in the background while the
+//  writer carries on.  It is written as judy_checkpoint(judy, out,
+//  1) would and read back with judy_restore or judy_restore_fd,
+//  and later judy_checkpoint calls write deltas against it; if
+//  it fails, take a full checkpoint before trusting a delta.
+//  inflight bounds the bytes queued in writes at once, and the
+//  flag JUDY_async_threads writes from threads, not io_uring.
+//  progress is called as writes finish and finish once the data
+//  is synced, from a background thread.  fd is not to be used,
+//  nor the array closed, until judy_async_wait, which leaves fd
+//  at the end of the checkpoint.  Returns NULL if the snapshot
+//  cannot be taken or fd is not seekable.
+
+JudyAsync *judy_snapshot_async(Judy *judy, int fd, size_t inflight, uint flags, JudyProgress progress, JudyFinish finish, void *ctx) {
+    uint amt, cnt = 1, idx, len;
+    size_t hdr;
+    JudyAsyncRun *run;
+    JudyAsync *async;
+    JudySeg *seg;
+    off_t base;
+    Judy *copy;
+
+    if (!judy->seg || judy->snap || judy->mt || judy->thread)
+        return NULL;
+
+    if ((base = lseek(fd, 0, SEEK_CUR)) < 0)
+        return NULL;
+
+    if (!(async = calloc(1, sizeof(JudyAsync))))
+        return NULL;
+
+    if (!(async->snap = judy_snapshot(judy))) {
+        free(async);
+        return NULL;
+    }
+
+    for (seg = async->snap->snap->seg; seg; seg = seg->seg)
+        cnt++;
+
+    //  size the runs so a full queue holds about inflight bytes
+
+    len = inflight / JUDY_seg;
+
+    if (len > JUDY_async_run)
+        len = JUDY_async_run;
+    else if (!len)
+        len = 1;
+
+    async->depth = inflight / ((size_t)len * JUDY_seg);
+    async->cnt = (cnt + len - 1) / len;
+
+    if (!async->depth)
+        async->depth = 1;
+
+    if (async->depth > async->cnt)
+        async->depth = async->cnt;
+
+    amt = sizeof(Judy) + judy->max * sizeof(JudyStack);
+
+    if (amt & (JUDY_cache_line - 1))
+        amt |= JUDY_cache_line - 1, amt++;
+
+    async->images = calloc(cnt, sizeof(JudyCkptSeg));
+    async->runs = calloc(async->cnt, sizeof(JudyAsyncRun));
+    async->head = judy_segment();
+    async->header = malloc(amt);
+
+    if (!async->images || !async->runs || !async->head || !async->header) {
+        judy_close(async->snap);
+        free(async->header);
+        free(async->images);
+        free(async->runs);
+        free(async->head);
+        free(async);
+        return NULL;
+    }
+
+    //  a header segment for the snapshot, ahead of the sealed ones
+
+    async->head->next -= amt;
+    copy = (Judy *)((uchar *)async->head + async->head->next);
+    memcpy(copy, async->snap, amt);
+    copy->seg = async->head;
+    copy->snap = NULL;
+    async->head->seg = async->snap->snap->seg;
+    memcpy(async->header, judy, amt);
+
+    async->ckpt->magic = JUDY_ckpt_magic;
+    async->ckpt->cnt = cnt;
+    async->ckpt->judy = (uint64_t)(JudySlot)copy;
+
+    //  lay out the runs, the first led by the checkpoint header
+
+    run = async->runs;
+    run->off = base;
+    run->iov[0].iov_base = async->ckpt;
+    run->iov[0].iov_len = sizeof(JudyCkpt);
+    run->len = sizeof(JudyCkpt);
+    run->cnt = 1;
+
+    for (idx = 0, seg = async->head; seg; seg = seg->seg, idx++) {
+        run = async->runs + idx / len;
+
+        if (idx && !(idx % len))
+            run->off = run[-1].off + run[-1].len;
+
+        async->images[idx].addr = (uint64_t)(JudySlot)seg;
+        async->images[idx].seg = (uint64_t)(JudySlot)seg->seg;
+        async->images[idx].next = seg->next;
+
+        run->iov[run->cnt].iov_base = async->images + idx;
+        run->iov[run->cnt++].iov_len = sizeof(JudyCkptSeg);
+        run->iov[run->cnt].iov_base = (uchar *)seg + seg->next;
+        run->iov[run->cnt++].iov_len = JUDY_seg - seg->next;
+        run->len += sizeof(JudyCkptSeg) + JUDY_seg - seg->next;
+
+        //  write the writer's header from the copy
+
+        hdr = (uchar *)judy - ((uchar *)seg + seg->next);
+
+        if ((uchar *)judy >= (uchar *)seg + seg->next && hdr < JUDY_seg - seg->next) {
+            run->iov[run->cnt - 1].iov_len = hdr;
+            run->iov[run->cnt].iov_base = async->header;
+            run->iov[run->cnt++].iov_len = amt;
+            run->iov[run->cnt].iov_base = (uchar *)judy + amt;
+            run->iov[run->cnt++].iov_len = JUDY_seg - seg->next - hdr - amt;
+        }
+    }
+
+    run = async->runs + async->cnt - 1;
+    async->end = run->off + run->len;
+    async->total = async->end - base;
+    async->fd = fd;
+    async->flags = flags;
+    async->progress = progress;
+    async->finish = finish;
+    async->ctx = ctx;
+    pthread_mutex_init(&async->lock, NULL);
+
+    if (pthread_create(&async->thread, NULL, judy_async_main, async)) {
+        pthread_mutex_destroy(&async->lock);
+        judy_close(async->snap);
+        free(async->header);
+        free(async->images);
+        free(async->runs);
+        free(async->head);
+        free(async);
+        return NULL;
+    }
+
+    //  the sealed segments are now checkpointed
+
+    for (seg = judy->seg->seg; seg; seg = seg->seg)
+        seg->dirty = 0;
+
+    judy->track = 1;
+    return async;
+}
+
+//  judy_async_wait: wait for a background checkpoint to finish,
+//  free it and return its errno, or zero once it is durable.
+
+int judy_async_wait(JudyAsync *async) {
+    int err;
+
+    pthread_join(async->thread, NULL);
+
+    if (lseek(async->fd, async->end, SEEK_SET) < 0 && !async->err)
+        async->err = errno;
+
+    pthread_mutex_destroy(&async->lock);
+    err = async->err;
+    free(async);
+    return err;
+}
+
+//  persistent heap commits:
+//  nodes reach the file through the page cache in no particular
+//  order, so a commit does not order the writes of judy_cell but
+//  freezes them.  judy_heap_sync takes a snapshot, which seals
+//  every segment so later writes copy the nodes they change,
+//  syncs the sealed segments, then writes the snapshot's header
+//  into the idle commit slot and flips the generation.  The
+//  snapshot is held until the next commit, so the nodes of the
+//  newest commit are never written in place or reused: after a
+//  crash, judy_open_heap finds them as committed.  Free blocks
+//  are committed only by judy_close; a crash leaks the ones
+//  freed since.
+
+JudyHeapCommit *judy_heap_slot(JudyHeapFile *file, uint64_t gen) {
+    return (JudyHeapCommit *)((uchar *)file + JUDY_heap_slot * (1 + (gen & 1)));
+}
+
+uint judy_heap_size(uint max) {
+    uint amt = sizeof(Judy) + max * sizeof(JudyStack);
+
+    if (amt & (JUDY_cache_line - 1))
+        amt |= JUDY_cache_line - 1, amt++;
+
+    return amt;
+}
+
+//  write state, with its segments starting at seg, as the next
+//  commit once the segments are synced
+
+int judy_heap_commit(struct JudyHeap *heap, Judy *state, JudySeg *seg, uint64_t used) {
+    JudyHeapFile *file = heap->file;
+    JudyHeapCommit *commit = judy_heap_slot(file, file->gen + 1);
+    Judy *header = (Judy *)(commit + 1);
+
+    if (msync(file, JUDY_seg + used, MS_SYNC))
+        return 0;
+
+    commit->base = (uint64_t)(JudySlot)file;
+    commit->used = used;
+    commit->epoch = state->cow ? state->cow->epoch : 0;
+    memcpy(header, state, judy_heap_size(state->max));
+    memset(header->stack, 0, state->max * sizeof(JudyStack));
+    header->seg = seg;
+    header->level = 0;
+
+    if (msync(file, JUDY_seg, MS_SYNC))
+        return 0;
+
+    //  readers entering from now on find the new commit
+
+    file->reloc = 0;
+    __atomic_store_n(&file->gen, file->gen + 1, __ATOMIC_SEQ_CST);
+    return !msync(file, JUDY_seg, MS_SYNC);
+}
+
+//  is a reader in another process inside commit gen?  Slots
+//  left by readers that died are released.
+
+int judy_heap_reading(JudyHeapFile *file, uint64_t gen) {
+    JudyHeapReader *reader = (JudyHeapReader *)((uchar *)file + 3 * JUDY_heap_slot);
+    uint idx;
+
+    for (idx = 0; idx < JUDY_heap_readers; idx++, reader++) {
+        if (!__atomic_load_n(&reader->used, __ATOMIC_SEQ_CST) || __atomic_load_n(&reader->active, __ATOMIC_SEQ_CST) != gen)
+            continue;
+
+        if (!kill((pid_t)reader->pid, 0) || errno != ESRCH)
+            return 1;
+
+        __atomic_store_n(&reader->active, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&reader->used, 0, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+//  close the snapshots of commits before the newest that no
+//  reader is in.  Returns the number still kept for readers.
+
+uint judy_heap_release(struct JudyHeap *heap) {
+    uint idx, cnt = 0;
+
+    for (idx = 0; idx + 1 < heap->cnt; idx++)
+        if (judy_heap_reading(heap->file, heap->kept[idx].gen))
+            heap->kept[cnt++] = heap->kept[idx];
+        else
+            judy_close(heap->kept[idx].snap);
+
+    if (heap->cnt)
+        heap->kept[cnt] = heap->kept[heap->cnt - 1];
+
+    heap->cnt = heap->cnt ? cnt + 1 : 0;
+    return cnt;
+}
+
+//  judy_heap_sync: make the array's contents as of now durable
+//  in its file, and the newest version judy_shared_enter finds.
+//  Returns zero if the array is not file-backed or the sync
+//  failed, leaving the last commit in place.
+
+int judy_heap_sync(Judy *judy) {
+    struct JudyHeap *heap = judy->heap;
+    JudyHeapKept *kept;
+    uint64_t used;
+    Judy *snap;
+
+    if (!heap || judy->snap)
+        return 0;
+
+    if (heap->cnt == heap->alloc) {
+        if (!(kept = realloc(heap->kept, (heap->alloc + 4) * sizeof(JudyHeapKept))))
+            return 0;
+
+        heap->kept = kept;
+        heap->alloc += 4;
+    }
+
+    used = heap->used;
+
+    if (!(snap = judy_snapshot(judy)))
+        return 0;
+
+    if (!judy_heap_commit(heap, snap, snap->snap->seg, used)) {
+        judy_close(snap);
+        return 0;
+    }
+
+    heap->kept[heap->cnt].snap = snap;
+    heap->kept[heap->cnt++].gen = heap->file->gen;
+    judy_heap_release(heap);
+    return 1;
+}
+
+//  number of the file segment holding addr
+
+uint judy_heap_index(struct JudyHeap *heap, void *addr) {
+    return (uint)(((uchar *)JUDY_segment(addr) - (uchar *)heap->file) / JUDY_seg);
+}
+
+//  return the segments holding only free blocks to the file:
+//  their blocks leave the free lists and the segments leave
+//  the array, so the final commit no longer holds them.  The
+//  commit before it holds none of their nodes either.
+
+void judy_heap_trim(Judy *judy) {
+    struct JudyHeap *heap = judy->heap;
+    uint cnt = heap->used / JUDY_seg + 1;
+    JudySeg *seg, * *prev;
+    JudySlot *block;
+    uint64_t *spare;
+    uint idx, amt;
+
+    if (!(spare = calloc(cnt, sizeof(uint64_t))))
+        return;
+
+    for (idx = 0; idx < 8; idx++) {
+        amt = JudySize[idx];
+
+        if (amt & 0x07)
+            amt |= 0x07, amt += 1;
+
+        for (block = (JudySlot *)judy->reuse[idx]; block; block = (JudySlot *)*block)
+            spare[judy_heap_index(heap, block)] += amt;
+    }
+
+    //  free blocks lie in the carved part of their segment, so
+    //  a count of JUDY_seg marks a segment being returned
+
+    for (prev = &judy->seg; (seg = *prev); )
+        if (spare[idx = judy_heap_index(heap, seg)] == JUDY_seg - seg->next) {
+            spare[idx] = JUDY_seg;
+            *prev = seg->seg;
+        } else {
+            prev = &seg->seg;
+        }
+
+    for (idx = 0; idx < 8; idx++)
+        for (block = (JudySlot *)&judy->reuse[idx]; *block; )
+            if (spare[judy_heap_index(heap, (void *)*block)] == JUDY_seg)
+                *block = *(JudySlot *)*block;
+            else
+                block = (JudySlot *)*block;
+
+    free(spare);
+}
+
+//  commit the array for judy_close, then once nothing need be
+//  kept for the commit, again with its free blocks and without
+//  the segments they fill.  Blocks freed while a reader is in
+//  an older commit are left out, as a crash would leave them.
+
+int judy_heap_final(Judy *judy) {
+    struct JudyHeap *heap = judy->heap;
+    int ok = judy_heap_sync(judy);
+    uint idx, held;
+
+    held = judy_heap_release(heap);
+
+    for (idx = 0; idx < heap->cnt; idx++)
+        judy_close(heap->kept[idx].snap);
+
+    free(heap->kept);
+    heap->kept = NULL;
+    heap->cnt = heap->alloc = 0;
+
+    if (!ok || held)
+        return ok;
+
+    judy_reap(judy);
+    judy_heap_trim(judy);
+    return judy_heap_commit(heap, judy, judy->seg, heap->used);
+}
+
+//  hand out again the segments below used that the committed
+//  array does not hold: those judy_close returned, and those
+//  taken since a commit a crash ended the session after.  The
+//  lowest are handed out first.
+
+int judy_heap_spare(struct JudyHeap *heap, Judy *judy) {
+    uint idx, cnt = heap->used / JUDY_seg + 1;
+    uchar *held;
+    JudySeg *seg;
+
+    if (!(held = calloc(cnt, 1)))
+        return 0;
+
+    for (seg = judy->seg; seg; seg = seg->seg)
+        held[judy_heap_index(heap, seg)] = 1;
+
+    for (idx = cnt; --idx; )
+        if (!held[idx]) {
+            seg = (JudySeg *)((uchar *)heap->file + (uint64_t)idx * JUDY_seg);
+            seg->seg = heap->spare;
+            heap->spare = seg;
+        }
+
+    free(held);
+    return 1;
+}
+
+//  map size bytes of fd at want, or anywhere segment aligned
+//  when want is NULL or taken.  Returns MAP_FAILED on failure.
+
+void *judy_heap_map(int fd, size_t size, void *want) {
+    uchar *map, *base;
+
+    if (want) {
+#ifdef MAP_FIXED_NOREPLACE
+        map = mmap(want, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+#else
+        map = mmap(want, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#endif
+        if (map == want)
+            return map;
+
+        if (map != MAP_FAILED)
+            munmap(map, size);
+    }
+
+    //  reserve enough to align the mapping, then trim
+
+    if ((map = mmap(NULL, size + JUDY_seg, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+        return MAP_FAILED;
+
+    base = (uchar *)(((JudySlot)map + JUDY_seg - 1) & ~(JudySlot)(JUDY_seg - 1));
+
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(map, size + JUDY_seg);
+        return MAP_FAILED;
+    }
+
+    if (base > map)
+        munmap(map, base - map);
+
+    if (map + JUDY_seg > base)
+        munmap(base + size, map + JUDY_seg - base);
+
+    return base;
+}
+
+//  does the mapping at base overlap size bytes at addr?
+
+int judy_heap_overlap(uchar *base, size_t size, uint64_t addr) {
+    return addr && (uint64_t)(JudySlot)base < addr + size && addr < (uint64_t)(JudySlot)base + size;
+}
+
+//  move the committed array from the addresses it was mapped
+//  at onto the mapping.  Pointers already moved are left alone,
+//  so a relocation cut short by a crash is finished next time.
+
+int judy_heap_relocate(JudyHeapFile *file, JudyHeapCommit *commit) {
+    uint64_t from[2] = { commit->base, file->reloc };
+    Judy *header = (Judy *)(commit + 1);
+    uint cnt = file->size / JUDY_seg;
+    JudyRelocs relocs[1];
+    JudySlot *block;
+    uint idx, src;
+    JudySeg *seg;
+
+    relocs->cnt = 0;
+
+    if (!(relocs->map = malloc(2 * cnt * sizeof(JudyReloc))))
+        return 0;
+
+    for (src = 0; src < 2; src++)
+        if (from[src] && from[src] != (uint64_t)(JudySlot)file)
+            for (idx = 0; idx < cnt; idx++) {
+                relocs->map[relocs->cnt].old = (JudySeg *)(JudySlot)(from[src] + (uint64_t)idx * JUDY_seg);
+                relocs->map[relocs->cnt++].seg = (JudySeg *)((uchar *)file + (uint64_t)idx * JUDY_seg);
+            }
+
+    qsort(relocs->map, relocs->cnt, sizeof(JudyReloc), judy_reloccmp);
+
+    //  note where the pointers are going before moving any
+
+    file->reloc = (uint64_t)(JudySlot)file;
+
+    if (msync(file, JUDY_seg, MS_SYNC)) {
+        free(relocs->map);
+        return 0;
+    }
+
+    header->seg = judy_reloc(relocs, header->seg);
+
+    for (seg = header->seg; seg; seg = seg->seg)
+        seg->seg = judy_reloc(relocs, seg->seg);
+
+    for (idx = 0; idx < 8; idx++)
+        for (block = (JudySlot *)&header->reuse[idx]; *block; block = (JudySlot *)*block)
+            *block = (JudySlot)judy_reloc(relocs, (void *)*block);
+
+    if (*header->root)
+        judy_walk(header, header->root, 0, 0, judy_relocate, relocs);
+
+    free(relocs->map);
+    return 1;
+}
+
+//  judy_open_heap: open the array kept in the file at path, or
+//  create one of max and depth as for judy_open, in a file of
+//  size bytes.  The array holds what it held at its last commit,
+//  by judy_heap_sync or judy_close.  Values are kept as they
+//  are, so pointers stored as values, even to judy_data blocks,
+//  do not survive a move of the mapping.  Returns NULL if the
+//  file cannot be opened, mapped or created, or is not an
+//  array's.  An array open in one process is not to be opened
+//  again before it is closed.
+
+Judy *judy_open_heap(const char *path, uint max, uint depth, size_t size) {
+    JudyHeapCommit commit[1], *last;
+    struct JudyHeap *heap;
+    uchar *map = NULL, *held;
+    JudyHeapFile file[1];
+    struct stat st;
+    uint64_t want;
+    uint amt, tries;
+    JudySeg *seg;
+    Judy *judy;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return NULL;
+
+    if (fstat(fd, &st) || !(heap = calloc(1, sizeof(struct JudyHeap)))) {
+        close(fd);
+        return NULL;
+    }
+
+    heap->fd = fd;
+
+    //  a new file: the array header goes in the first segment
+
+    if (!st.st_size) {
+        if (depth)
+            max = JUDY_key_size * depth;
+        else
+            max++;
+
+        size = (size + JUDY_seg - 1) & ~(size_t)(JUDY_seg - 1);
+        amt = judy_heap_size(max);
+
+        if (size < 2 * JUDY_seg || amt + sizeof(JudyHeapCommit) > JUDY_heap_slot || ftruncate(fd, size))
+            goto fail;
+
+        if ((map = judy_heap_map(fd, size, NULL)) == MAP_FAILED)
+            goto fail;
+
+        heap->file = (JudyHeapFile *)map;
+        heap->size = size;
+        heap->file->magic = JUDY_heap_magic;
+        heap->file->version = 1;
+        heap->file->size = size;
+
+        seg = judy_heap_segment(heap);
+        seg->next -= amt;
+        judy = (Judy *)((uchar *)seg + seg->next);
+        memset(judy, 0, amt);
+        judy->depth = depth;
+        judy->seg = seg;
+        judy->max = max;
+        judy->heap = heap;
+        heap->file->judy = (uchar *)judy - map;
+
+        if (!judy_heap_sync(judy))
+            goto fail;
+
+        return judy;
+    }
+
+    if (pread(fd, file, sizeof(file), 0) != sizeof(file) || file->magic != JUDY_heap_magic || file->version != 1)
+        goto fail;
+
+    if (file->size != (uint64_t)st.st_size || !file->gen || pread(fd, commit, sizeof(commit), JUDY_heap_slot * (1 + (file->gen & 1))) != sizeof(commit))
+        goto fail;
+
+    //  map where the array was, or where it was being moved to,
+    //  or else clear of both
+
+    heap->size = size = file->size;
+    want = file->reloc ? file->reloc : commit->base;
+    map = judy_heap_map(fd, size, (void *)(JudySlot)want);
+
+    for (tries = 0; map != MAP_FAILED && (uint64_t)(JudySlot)map != want; tries++) {
+        if (!judy_heap_overlap(map, size, commit->base) && !judy_heap_overlap(map, size, file->reloc))
+            break;
+
+        if (tries == 4) {
+            munmap(map, size);
+            map = MAP_FAILED;
+            break;
+        }
+
+        //  hold the overlapping mapping while making the next
+
+        held = map;
+        map = judy_heap_map(fd, size, NULL);
+        munmap(held, size);
+    }
+
+    if (map == MAP_FAILED)
+        goto fail;
+
+    heap->file = (JudyHeapFile *)map;
+    last = judy_heap_slot(heap->file, heap->file->gen);
+
+    if ((uint64_t)(JudySlot)map != last->base || heap->file->reloc)
+        if (!judy_heap_relocate(heap->file, last))
+            goto fail;
+
+    //  the live header takes the committed one, segments handed
+    //  out after the commit are handed out again, and snapshots
+    //  seal segments after the epochs already sealing them
+
+    judy = (Judy *)(map + heap->file->judy);
+    memcpy(judy, last + 1, judy_heap_size(((Judy *)(last + 1))->max));
+    heap->used = last->used;
+
+    if (!judy_heap_spare(heap, judy) || !(judy->cow = calloc(1, sizeof(struct JudyCow))))
+        goto fail;
+
+    judy->cow->epoch = last->epoch;
+    judy->snap = NULL;
+    judy->mt = NULL;
+    judy->thread = NULL;
+    judy->track = 0;
+    judy->heap = heap;
+
+    //  commit again to hold the committed nodes, recording
+    //  where the file is now mapped
+
+    if (!judy_heap_sync(judy)) {
+        free(judy->cow);
+        goto fail;
+    }
+
+    return judy;
+
+fail:
+    if (map && map != MAP_FAILED)
+        munmap(map, size);
+
+    close(fd);
+    free(heap);
+    return NULL;
+}
+
+//  shared arrays:
+//  other processes map an array's file read-only where its
+//  writer has it mapped, so the nodes' pointers hold for them,
+//  and read the commits judy_heap_sync publishes.  A reader
+//  announces the generation it reads in its slot of the header
+//  page, the one page it maps writable, and the writer keeps a
+//  commit's snapshot, and so its nodes, until no reader is in
+//  it.  Commit headers are copied as a seqlock: the copy counts
+//  only if the generation has not moved meanwhile.
+
+struct JudyShared {
+    JudyHeapFile *file;         // the mapping, read-only past the header page
+    size_t      size;           // bytes mapped
+    int         fd;
+    JudyHeapReader *reader;     // slot in the header page
+    uint64_t    built;          // generation the view was copied from
+    Judy        *view;          // reader's cursor over the commit
+    uint        amt;            // bytes of the view
+};
+
+//  judy_shared_open: map the array in the file at path for
+//  reading alongside a writer in another process that has it
+//  open with judy_open_heap.  A POSIX shared memory object is
+//  named by its path under /dev/shm, a memfd by /proc/pid/fd/n.
+//  Returns NULL if the file is not an array's, every reader
+//  slot is taken, or the writer's address for it is taken in
+//  this process; pointers cannot be moved in a read-only map.
+
+JudyShared *judy_shared_open(const char *path) {
+    JudyHeapCommit commit[1];
+    JudyHeapReader *reader;
+    JudyHeapFile file[1];
+    JudyShared *shared;
+    Judy header[1];
+    struct stat st;
+    uchar *map;
+    uint idx;
+    int fd;
+
+    if ((fd = open(path, O_RDWR)) < 0)
+        return NULL;
+
+    if (fstat(fd, &st) || pread(fd, file, sizeof(file), 0) != sizeof(file) || file->magic != JUDY_heap_magic || file->version != 1)
+        goto fail;
+
+    if (file->size != (uint64_t)st.st_size || !file->gen || pread(fd, commit, sizeof(commit), JUDY_heap_slot * (1 + (file->gen & 1))) != sizeof(commit))
+        goto fail;
+
+    if (pread(fd, header, sizeof(header), JUDY_heap_slot * (1 + (file->gen & 1)) + sizeof(commit)) != sizeof(header))
+        goto fail;
+
+#ifdef MAP_FIXED_NOREPLACE
+    map = mmap((void *)(JudySlot)commit->base, file->size, PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+#else
+    map = mmap((void *)(JudySlot)commit->base, file->size, PROT_READ, MAP_SHARED, fd, 0);
+#endif
+    if (map == MAP_FAILED)
+        goto fail;
+
+    if ((uint64_t)(JudySlot)map != commit->base || mprotect(map, JUDY_seg, PROT_READ | PROT_WRITE))
+        goto unmap;
+
+    if (!(shared = calloc(1, sizeof(JudyShared))))
+        goto unmap;
+
+    shared->amt = judy_heap_size(header->max);
+
+    if (!(shared->view = malloc(shared->amt))) {
+        free(shared);
+        goto unmap;
+    }
+
+    reader = (JudyHeapReader *)(map + 3 * JUDY_heap_slot);
+
+    for (idx = 0; idx < JUDY_heap_readers; idx++, reader++)
+        if (!__atomic_exchange_n(&reader->used, 1, __ATOMIC_ACQUIRE))
+            break;
+
+    if (idx == JUDY_heap_readers) {
+        free(shared->view);
+        free(shared);
+        goto unmap;
+    }
+
+    reader->pid = (uint32_t)getpid();
+    __atomic_store_n(&reader->active, 0, __ATOMIC_RELEASE);
+
+    shared->file = (JudyHeapFile *)map;
+    shared->size = file->size;
+    shared->fd = fd;
+    shared->reader = reader;
+    return shared;
+
+unmap:
+    munmap(map, file->size);
+fail:
+    close(fd);
+    return NULL;
+}
+
+void judy_shared_close(JudyShared *shared) {
+    __atomic_store_n(&shared->reader->active, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&shared->reader->used, 0, __ATOMIC_RELEASE);
+    munmap(shared->file, shared->size);
+    close(shared->fd);
+    free(shared->view);
+    free(shared);
+}
+
+//  announce the newest commit, then return the reader's view
+//  of it, which stays valid until judy_shared_leave.  Values
+//  are read through the view's cells, never stored.  Returns
+//  NULL if the writer has since mapped the file elsewhere, when
+//  the array must be opened again.
+
+Judy *judy_shared_enter(JudyShared *shared) {
+    JudyHeapFile *file = shared->file;
+    JudyHeapCommit *commit;
+    Judy *view = shared->view;
+    uint64_t gen;
+
+    while (1) {
+        gen = __atomic_load_n(&file->gen, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&shared->reader->active, gen, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&file->gen, __ATOMIC_SEQ_CST) != gen)
+            continue;
+
+        if (shared->built == gen)
+            return view;
+
+        //  the commit slot is rewritten two commits on
+
+        commit = judy_heap_slot(file, gen);
+
+        if (commit->base != (uint64_t)(JudySlot)file) {
+            __atomic_store_n(&shared->reader->active, 0, __ATOMIC_RELEASE);
+            return NULL;
+        }
+
+        memcpy(view, commit + 1, shared->amt);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&file->gen, __ATOMIC_SEQ_CST) == gen)
+            break;
+    }
+
+    view->seg = NULL;
+    view->level = 0;
+    view->track = 0;
+    view->cow = NULL;
+    view->snap = NULL;
+    view->mt = NULL;
+    view->thread = NULL;
+    view->heap = NULL;
+    shared->built = gen;
+    return view;
+}
+
+void judy_shared_leave(JudyShared *shared) {
+    __atomic_store_n(&shared->reader->active, 0, __ATOMIC_RELEASE);
+}
+
+//  warming:
+//  the top of a trie is walked a level at a time.  Every block
+//  of a level is advised before any is read, so the kernel has
+//  the level's page reads in flight together, rather than the
+//  walk taking one major fault per node.  A radix node's inner
+//  tables are a step of their own, within the node's level.
+
+typedef struct {
+    JudySlot    next;           // node, or a radix node's inner table
+    uint        off;            // key offset, as for judy_walk
+    uint        depth;
+    uint        level;          // trie level of the node
+    int         hi;             // inner table's high nibble, or -1 for a node
+} JudyWarmItem;
+
+typedef struct {
+    JudyWarmItem *item;
+    size_t      cnt, max;
+} JudyWarmStep;
+
+int judy_warm_push(JudyWarmStep *step, JudySlot next, uint off, uint depth, uint level, int hi) {
+    JudyWarmItem *item;
+
+    if (step->cnt == step->max) {
+        if (!(item = realloc(step->item, (step->max * 2 + 64) * sizeof(JudyWarmItem))))
+            return 0;
+
+        step->item = item;
+        step->max = step->max * 2 + 64;
+    }
+
+    item = step->item + step->cnt++;
+    item->next = next;
+    item->off = off;
+    item->depth = depth;
+    item->level = level;
+    item->hi = hi;
+    return 1;
+}
+
+int judy_warm_pagecmp(const void *a, const void *b) {
+    JudySlot x = *(const JudySlot *)a, y = *(const JudySlot *)b;
+
+    return (x > y) - (x < y);
+}
+
+//  advise, and lock if asked, the pages of a step's blocks,
+//  as runs of adjacent pages.  A failed lock clears lock.
+
+int judy_warm_advise(JudyWarmStep *step, JudySlot **pages, size_t *max, int *lock) {
+    JudySlot pg = (JudySlot)sysconf(_SC_PAGESIZE), addr, *list;
+    size_t idx, cnt = 0, run;
+    JudyWarmItem *item;
+    uint size;
+
+    if (*max < 2 * step->cnt) {
+        if (!(list = realloc(*pages, 2 * step->cnt * sizeof(JudySlot))))
+            return 0;
+
+        *pages = list;
+        *max = 2 * step->cnt;
+    }
+
+    list = *pages;
+
+    for (idx = 0; idx < step->cnt; idx++) {
+        item = step->item + idx;
+        addr = item->next & JUDY_mask;
+        size = item->hi < 0 ? (uint)JudySize[item->next & 0x07] : 16 * sizeof(JudySlot);
+        list[cnt++] = addr & ~(pg - 1);
+
+        if (((addr + size - 1) & ~(pg - 1)) != (addr & ~(pg - 1)))
+            list[cnt++] = (addr + size - 1) & ~(pg - 1);
+    }
+
+    qsort(list, cnt, sizeof(JudySlot), judy_warm_pagecmp);
+
+    for (idx = 0; idx < cnt; idx = run) {
+        for (run = idx + 1; run < cnt && list[run] <= list[run - 1] + pg; run++)
+            ;
+
+        madvise((void *)list[idx], list[run - 1] + pg - list[idx], MADV_WILLNEED);
+
+        if (*lock && mlock((void *)list[idx], list[run - 1] + pg - list[idx]))
+            *lock = 0;
+    }
+
+    return 1;
+}
+
+//  queue the blocks below a step's block within levels
+
+int judy_warm_children(Judy *judy, JudyWarmItem *item, JudyWarmStep *step, uint levels) {
+    JudySlot *table, *node;
+    int slot, size, keysize, cnt;
+    uint off, depth;
+    uchar *base;
+    int leaf;
+
+    if (item->hi >= 0) {
+        table = (JudySlot *)(item->next & JUDY_mask);
+
+        for (slot = 0; slot < 16; slot++) {
+            if (!table[slot] || item->level + 1 >= levels)
+                continue;
+
+            if ((!judy->depth && !(item->hi << 4 | slot)) || (judy->depth && item->depth == judy->depth))
+                continue;
+
+            if (!judy_warm_push(step, table[slot], item->off, item->depth, item->level + 1, -1))
+                return 0;
+        }
+
+        return 1;
+    }
+
+    switch (item->next & 0x07) {
+        case JUDY_1:
+        case JUDY_2:
+        case JUDY_4:
+        case JUDY_8:
+        case JUDY_16:
+        case JUDY_32:
+            if (item->level + 1 >= levels)
+                return 1;
+
+            size = JudySize[item->next & 0x07];
+            keysize = JUDY_key_size - (item->off & JUDY_key_mask);
+            cnt = size / (sizeof(JudySlot) + keysize);
+            node = (JudySlot *)((item->next & JUDY_mask) + size);
+            base = (uchar *)(item->next & JUDY_mask);
+
+            for (slot = 0; slot < cnt; slot++) {
+                if (!node[-slot - 1])
+                    continue;
+#if BYTE_ORDER != BIG_ENDIAN
+                leaf = (!judy->depth && !base[slot * keysize]) || (judy->depth && item->depth + 1 == judy->depth);
+#else
+                leaf = (!judy->depth && !base[slot * keysize + keysize - 1]) || (judy->depth && item->depth + 1 == judy->depth);
+#endif
+                if (!leaf && !judy_warm_push(step, node[-slot - 1], (item->off | JUDY_key_mask) + 1, item->depth + 1, item->level + 1, -1))
+                    return 0;
+            }
+
+            return 1;
+
+        case JUDY_radix:
+            table = (JudySlot *)(item->next & JUDY_mask);
+            off = item->off + 1;
+            depth = item->depth;
+
+            if (judy->depth)
+                if (!(off & JUDY_key_mask))
+                    depth++;
+
+            for (slot = 0; slot < 16; slot++)
+                if (table[slot] && !judy_warm_push(step, table[slot], off, depth, item->level, slot))
+                    return 0;
+
+            return 1;
+
+        case JUDY_span:
+            node = (JudySlot *)((item->next & JUDY_mask) + JudySize[JUDY_span]);
+            base = (uchar *)(item->next & JUDY_mask);
+
+            if (base[JUDY_span_bytes - 1] && item->level + 1 < levels)
+                return judy_warm_push(step, node[-1], item->off + JUDY_span_bytes, item->depth, item->level + 1, -1);
+
+            return 1;
+    }
+
+    return 1;
+}
+
+//  judy_warm: fault in the top levels of the array ahead of its
+//  first queries, as after opening a file-backed array, with
+//  madvise(MADV_WILLNEED) a level at a time, and with lock set
+//  mlock them too.  Locked pages stay locked while mapped.
+//  Returns zero if memory ran out or locking failed, as under a
+//  low RLIMIT_MEMLOCK; the pages advised stay advised.
+
+int judy_warm(Judy *judy, uint levels, int lock) {
+    JudyWarmStep step[1] = { { NULL, 0, 0 } }, next[1] = { { NULL, 0, 0 } }, swap;
+    JudySlot *pages = NULL;
+    size_t idx, max = 0;
+    int ok = 1, asked = lock;
+
+    if (*judy->root && levels)
+        ok = judy_warm_push(step, *judy->root, 0, 0, 0, -1);
+
+    while (ok && step->cnt) {
+        if (!judy_warm_advise(step, &pages, &max, &lock)) {
+            ok = 0;
+            break;
+        }
+
+        for (idx = 0; idx < step->cnt; idx++)
+            if (!judy_warm_children(judy, step->item + idx, next, levels)) {
+                ok = 0;
+                break;
+            }
+
+        swap = *step, *step = *next, *next = swap;
+        next->cnt = 0;
+    }
+
+    free(step->item);
+    free(next->item);
+    free(pages);
+    return ok && lock == asked;
+}
+
+//  set operations:
+//  both tries are traversed in lockstep while they have radix nodes
+//  at the same key offset.  Subtrees present on one side only are
+//  copied whole or skipped; anywhere else the keys below the common
+//  prefix are merged, seeking over runs that are on one side only.
+
+enum JUDY_setops {
+    JUDY_union,
+    JUDY_intersect,
+    JUDY_difference
+};
+
+typedef struct {
+    Judy    *a, *b, *out;       // operands and result
+    int     op;                 // JUDY_setops
+    uint    len;                // size of key buffers
+    uchar   *prefix;            // key bytes leading to current subtree
+    uchar   *akey, *bkey;       // current keys of a and b
+    int     failed;             // memory ran out
+} JudySetOp;
+
+//  return byte idx of a key in judy_key format
+
+uint judy_byte(Judy *judy, uchar *key, uint idx) {
+    if (judy->depth)
+        return (((judyvalue *)key)[idx / JUDY_key_size] >> (8 * (JUDY_key_size - 1 - idx % JUDY_key_size))) & 0xff;
+
+    return key[idx];
+}
+
+//  compare two keys in judy_key format
+
+int judy_keycmp(Judy *judy, uchar *x, uchar *y) {
+    judyvalue *p = (judyvalue *)x, *q = (judyvalue *)y;
+    uint idx;
+
+    if (!judy->depth)
+        return strcmp((const char *)x, (const char *)y);
+
+    for (idx = 0; idx < judy->depth; idx++)
+        if (p[idx] != q[idx])
+            return p[idx] < q[idx] ? -1 : 1;
+
+    return 0;
+}
+
+//  length of a key in judy_key format
+
+uint judy_keylen(Judy *judy, uchar *key) {
+    if (judy->depth)
+        return judy->depth * JUDY_key_size;
+
+    return strlen((const char *)key);
+}
+
+//  load the key for cell, or return NULL
+//  if it has left the subtree being merged
+
+JudySlot *judy_setkey(JudySetOp *setop, Judy *judy, JudySlot *cell, uchar *key, uint off) {
+    uint idx;
+
+    if (!cell)
+        return NULL;
+
+    judy_key(judy, key, judy->max);
+
+    for (idx = 0; idx < off; idx++)
+        if (judy_byte(judy, key, idx) != setop->prefix[idx])
+            return NULL;
+
+    return cell;
+}
+
+//  position judy at the first key >= key,
+//  passing over an empty cell judy_slot may land on
+
+JudySlot *judy_setseek(JudySetOp *setop, Judy *judy, uchar *key, uint off, uchar *dest) {
+    JudySlot *cell = judy_strt(judy, key, judy_keylen(judy, key));
+
+    if (cell && !*cell)
+        cell = judy_nxt(judy);
+
+    return judy_setkey(setop, judy, cell, dest, off);
+}
+
+//  add a key and its cell to the result subtree at next
+
+int judy_setcell(JudySetOp *setop, JudySlot *next, uint off, uchar *key, JudySlot value) {
+    JudySlot *cell;
+
+    setop->out->level = 0;
+
+    if (!(cell = judy_insert(setop->out, next, off, off / JUDY_key_size, key, judy_keylen(setop->a, key)))) {
+        setop->failed = 1;
+        return 0;
+    }
+
+    *cell = value;
+    return 1;
+}
+
+//  merge the keys of a and b below the prefix,
+//  adding the result to the subtree at next
+
+void judy_setkeys(JudySetOp *setop, JudySlot *next, uint off) {
+    uint idx;
+    JudySlot *cella, *cellb;
+    uchar *seek;
+    int cmp;
+
+    //  start both cursors at the smallest key with the prefix
+
+    seek = setop->akey;
+    memset(seek, 0, setop->len);
+
+    for (idx = 0; idx < off; idx++)
+        if (setop->a->depth)
+            ((judyvalue *)seek)[idx / JUDY_key_size] |= (judyvalue)setop->prefix[idx] << (8 * (JUDY_key_size - 1 - idx % JUDY_key_size));
+        else
+            seek[idx] = setop->prefix[idx];
+
+    memcpy(setop->bkey, seek, setop->len);
+    cellb = judy_setseek(setop, setop->b, setop->bkey, off, setop->bkey);
+    cella = judy_setseek(setop, setop->a, seek, off, setop->akey);
+
+    while (cella || cellb) {
+        if (cella && cellb)
+            cmp = judy_keycmp(setop->a, setop->akey, setop->bkey);
+        else
+            cmp = cella ? -1 : 1;
+
+        if (!cmp) {
+            if (setop->op != JUDY_difference && !judy_setcell(setop, next, off, setop->akey, *cella))
+                return;
+            cella = judy_setkey(setop, setop->a, judy_nxt(setop->a), setop->akey, off);
+            cellb = judy_setkey(setop, setop->b, judy_nxt(setop->b), setop->bkey, off);
+            continue;
+        }
+
+        if (cmp < 0) {
+            if (setop->op != JUDY_intersect) {
+                if (!judy_setcell(setop, next, off, setop->akey, *cella))
+                    return;
+                cella = judy_setkey(setop, setop->a, judy_nxt(setop->a), setop->akey, off);
+            } else if (cellb)
+                cella = judy_setseek(setop, setop->a, setop->bkey, off, setop->akey);
+            else
+                break;
+            continue;
+        }
+
+        if (setop->op == JUDY_union) {
+            if (!judy_setcell(setop, next, off, setop->bkey, *cellb))
+                return;
+            cellb = judy_setkey(setop, setop->b, judy_nxt(setop->b), setop->bkey, off);
+        } else if (cella)
+            cellb = judy_setseek(setop, setop->b, setop->akey, off, setop->bkey);
+        else
+            break;
+    }
+}
+
+//  copy the node at next into the result, or once memory
+//  has run out leave it out
+
+void judy_dupnode(Judy *judy, JudySlot *next, int leaf, void *ctx) {
+    JudySetOp *setop = ctx;
+    uint type = *next & 0x07;
+    void *block;
+
+    (void)judy;
+
+    if (leaf)
+        return;
+
+    if (setop->failed || !(block = judy_alloc(setop->out, type))) {
+        setop->failed = 1;
+        *next = 0;
+        return;
+    }
+
+    memcpy(block, (void *)(*next & JUDY_mask), JudySize[type]);
+    *next = (JudySlot)block | type;
+}
+
+//  copy subtree of judy at next into the result
+
+JudySlot judy_dup(JudySetOp *setop, Judy *judy, JudySlot next, uint off, uint depth) {
+    judy_walk(judy, &next, off, depth, judy_dupnode, setop);
+    return next;
+}
+
+//  merge subtrees a and b at key offset off into next
+
+void judy_setnode(JudySetOp *setop, JudySlot a, JudySlot b, JudySlot *next, uint off, uint depth) {
+    JudySlot *tablea, *tableb, *table, *inner;
+    JudySlot *innera, *innerb;
+    JudySlot childa, childb;
+    int slot, idx;
+
+    if (!b) {
+        if (a && setop->op != JUDY_intersect)
+            *next = judy_dup(setop, setop->a, a, off, depth);
+        return;
+    }
+
+    if (!a) {
+        if (setop->op == JUDY_union)
+            *next = judy_dup(setop, setop->b, b, off, depth);
+        return;
+    }
+
+    if ((a & 0x07) != JUDY_radix || (b & 0x07) != JUDY_radix) {
+        judy_setkeys(setop, next, off);
+        return;
+    }
+
+    tablea = (JudySlot *)(a & JUDY_mask);
+    tableb = (JudySlot *)(b & JUDY_mask);
+
+    if (!(table = judy_alloc(setop->out, JUDY_radix))) {
+        setop->failed = 1;
+        return;
+    }
+
+    *next = (JudySlot)table | JUDY_radix;
+    off++;
+
+    if (setop->a->depth)
+        if (!(off & JUDY_key_mask))
+            depth++;
+
+    for (slot = 0; slot < 256 && !setop->failed; slot++) {
+        innera = (JudySlot *)(tablea[slot >> 4] & JUDY_mask);
+        innerb = (JudySlot *)(tableb[slot >> 4] & JUDY_mask);
+
+        if (!innera && !innerb) {
+            slot |= 0x0F;
+            continue;
+        }
+
+        childa = innera ? innera[slot & 0x0F] : 0;
+        childb = innerb ? innerb[slot & 0x0F] : 0;
+
+        if (!childa && !childb)
+            continue;
+
+        if (!table[slot >> 4]) {
+            if (!(inner = judy_alloc(setop->out, JUDY_radix))) {
+                setop->failed = 1;
+                break;
+            }
+            table[slot >> 4] = (JudySlot)inner | JUDY_radix;
+        }
+
+        inner = (JudySlot *)(table[slot >> 4] & JUDY_mask);
+        setop->prefix[off - 1] = slot;
+
+        if ((!setop->a->depth && !slot) || (setop->a->depth && depth == setop->a->depth)) {
+            if (setop->op == JUDY_union)
+                inner[slot & 0x0F] = childa ? childa : childb;
+            else if (setop->op == JUDY_intersect)
+                inner[slot & 0x0F] = childb ? childa : 0;
+            else
+                inner[slot & 0x0F] = childb ? 0 : childa;
+        } else
+            judy_setnode(setop, childa, childb, &inner[slot & 0x0F], off, depth);
+    }
+
+    //  drop radix nodes left empty
+
+    for (slot = 256; slot--; ) {
+        if (!(inner = (JudySlot *)(table[slot >> 4] & JUDY_mask))) {
+            slot &= 0xF0;
+            continue;
+        }
+        if (inner[slot & 0x0F]) {
+            slot &= 0xF0;
+            continue;
+        }
+        if (!(slot & 0x0F)) {
+            judy_free(setop->out, inner, JUDY_radix);
+            table[slot >> 4] = 0;
+        }
+    }
+
+    for (idx = 16; idx--; )
+        if (table[idx])
+            return;
+
+    judy_free(setop->out, table, JUDY_radix);
+    *next = 0;
+}
+
+Judy *judy_setop(Judy *a, Judy *b, int op) {
+    JudySetOp setop[1];
+    uint max;
+
+    if (a->depth != b->depth)
+        return NULL;
+
+    max = a->max > b->max ? a->max : b->max;
+
+    if (!(setop->out = judy_open(a->depth ? 0 : max - 1, a->depth)))
+        return NULL;
+
+    setop->out->ksize = a->ksize;
+    setop->len = max + JUDY_key_size;
+    setop->a = a;
+    setop->b = b;
+    setop->op = op;
+    setop->failed = 0;
+
+    if (!(setop->prefix = malloc(3 * setop->len))) {
+        judy_close(setop->out);
+        return NULL;
+    }
+
+    setop->akey = setop->prefix + setop->len;
+    setop->bkey = setop->akey + setop->len;
+
+    judy_setnode(setop, *a->root, *b->root, setop->out->root, 0, 0);
+    free(setop->prefix);
+
+    if (setop->failed) {
+        judy_close(setop->out);
+        return NULL;
+    }
+
+    return setop->out;
+}
+
+//  judy_union: return a new array with the keys of a and b,
+//  taking cells from a where both have the key.
+
+Judy *judy_union(Judy *a, Judy *b) {
+    return judy_setop(a, b, JUDY_union);
+}
+
+//  judy_intersect: return a new array with the keys
+//  of a that are also in b, with the cells from a.
+
+Judy *judy_intersect(Judy *a, Judy *b) {
+    return judy_setop(a, b, JUDY_intersect);
+}
+
+//  judy_difference: return a new array with
+//  the keys and cells of a that are not in b.
+
+Judy *judy_difference(Judy *a, Judy *b) {
+    return judy_setop(a, b, JUDY_difference);
+}
+
+//  Parallel bulk build.  Keys whose first bytes differ live in
+//  disjoint subtrees under a radix root, so sorted input is cut
+//  at first byte boundaries into one run per worker.  Each
+//  worker inserts its run into an array of its own, rooted at a
+//  radix node and with its own segments, resuming every insert
+//  from the previous key's descent.  The subtrees are then
+//  hung under the first worker's root and the other workers'
+//  segments and free blocks handed to its array.
+
+#define JUDY_build_max 256      // one worker per first byte at most
+
+typedef struct {
+    Judy        *judy;          // worker's array
+    uchar       **keys;         // the whole input
+    uint        *lens;
+    JudySlot    *values;
+    size_t      first, last;    // this worker's run
+    uint        lo, hi;         // first bytes of the run, hi exclusive
+    int         thread;         // run on a thread of its own
+    int         failed;
+} JudyBuild;
+
+//  length of input key idx
+
+uint judy_build_len(Judy *judy, uchar **keys, uint *lens, size_t idx) {
+    if (judy->depth)
+        return judy->depth * JUDY_key_size;
+
+    return lens ? lens[idx] : (uint)strlen((char *)keys[idx]);
+}
+
+//  first byte of a key, zero for an empty string
+
+uint judy_build_byte(Judy *judy, uchar *key, uint len) {
+    if (judy->depth)
+        return (uint)(*(judyvalue *)key >> (8 * (JUDY_key_size - 1))) & 0xff;
+
+    return len ? key[0] : 0;
+}
+
+//  number of leading bytes two keys share
+
+uint judy_build_common(Judy *judy, uchar *x, uint xlen, uchar *y, uint ylen) {
+    judyvalue *p = (judyvalue *)x, *q = (judyvalue *)y;
+    uint idx, len;
+
+    if (judy->depth) {
+        for (idx = 0; idx < judy->depth && p[idx] == q[idx]; idx++)
+            ;
+
+        if (idx == judy->depth)
+            return idx * JUDY_key_size;
+
+        for (len = 0; len < JUDY_key_size - 1; len++)
+            if ((p[idx] ^ q[idx]) >> (8 * (JUDY_key_size - 1 - len)))
+                break;
+
+        return idx * JUDY_key_size + len;
+    }
+
+    len = xlen < ylen ? xlen : ylen;
+
+    for (idx = 0; idx < len && x[idx] == y[idx]; idx++)
+        ;
+
+    return idx;
+}
+
+void *judy_build_worker(void *arg) {
+    JudyBuild *build = arg;
+    Judy *judy = build->judy;
+    uint len, prev = 0, common = 0;
+    JudySlot *cell;
+    size_t idx;
+
+    for (idx = build->first; idx < build->last; idx++) {
+        len = judy_build_len(judy, build->keys, build->lens, idx);
+
+        if (idx > build->first)
+            common = judy_build_common(judy, build->keys[idx - 1], prev, build->keys[idx], len);
+
+        if (!(cell = judy_cell_after(judy, build->keys[idx], len, common))) {
+            build->failed = 1;
+            break;
+        }
+
+        *cell = build->values[idx];
+        prev = len;
+    }
+
+    return NULL;
+}
+
+//  judy_build: build an array of judy_open's max and depth from
+//  cnt keys sorted in ascending order, storing values[idx] under
+//  keys[idx], using up to threads workers.  lens gives the length
+//  of each string key, or is NULL for zero terminated strings; it
+//  is ignored for integer keys.  A repeated key keeps its last
+//  value.
+
+Judy *judy_build(uint max, uint depth, uchar **keys, uint *lens, JudySlot *values, size_t cnt, uint threads) {
+    size_t start[JUDY_build_max + 1], lo, hi, mid, target;
+    JudyBuild build[JUDY_build_max];
+    pthread_t tid[JUDY_build_max];
+    JudySlot *outer, *inner, *src;
+    uint idx, byte, type, workers;
+    void * *block;
+    JudySeg *seg;
+    Judy *judy;
+    int failed = 0;
+
+    if (!(judy = judy_open(max, depth)) || !cnt)
+        return judy;
+
+    if (threads > JUDY_build_max)
+        threads = JUDY_build_max;
+
+    if (!threads)
+        threads = 1;
+
+    //  start[byte]: first key whose first byte is >= byte
+
+    for (byte = 0; byte <= JUDY_build_max; byte++) {
+        for (lo = 0, hi = cnt; lo < hi; ) {
+            mid = lo + (hi - lo) / 2;
+
+            if (judy_build_byte(judy, keys[mid], judy_build_len(judy, keys, lens, mid)) < byte)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        start[byte] = lo;
+    }
+
+    //  cut the input into runs of whole first bytes,
+    //  each ending at the first boundary past its share
+
+    memset(build, 0, sizeof(build));
+
+    for (workers = byte = 0; workers < threads && byte < JUDY_build_max; workers++) {
+        target = (workers + 1) * cnt / threads;
+        build[workers].lo = byte;
+
+        if (workers + 1 == threads)
+            byte = JUDY_build_max;
+        else
+            while (++byte < JUDY_build_max && start[byte] < target)
+                ;
+
+        build[workers].hi = byte;
+        build[workers].first = start[build[workers].lo];
+        build[workers].last = start[byte];
+        build[workers].keys = keys;
+        build[workers].lens = lens;
+        build[workers].values = values;
+    }
+
+    //  the first worker builds straight into the result
+
+    for (idx = 0; idx < workers; idx++) {
+        if (!idx)
+            build[idx].judy = judy;
+        else if (!(build[idx].judy = judy_open(max, depth)))
+            break;
+
+        if (!(outer = judy_alloc(build[idx].judy, JUDY_radix))) {
+            if (idx)
+                judy_close(build[idx].judy);
+            break;
+        }
+
+        build[idx].judy->root[0] = (JudySlot)outer | JUDY_radix;
+    }
+
+    if (idx < workers) {
+        while (idx-- > 1)
+            judy_close(build[idx].judy);
+        judy_close(judy);
+        return NULL;
+    }
+
+    //  a run no thread can be had for is built here
+
+    for (idx = 1; idx < workers; idx++)
+        if (build[idx].first < build[idx].last)
+            if (!(build[idx].thread = !pthread_create(&tid[idx], NULL, judy_build_worker, &build[idx])))
+                judy_build_worker(&build[idx]);
+
+    judy_build_worker(&build[0]);
+
+    for (idx = 1; idx < workers; idx++)
+        if (build[idx].thread)
+            pthread_join(tid[idx], NULL);
+
+    //  hang each worker's subtrees under the result's root
+    //  and chain its segments behind the result's own
+
+    outer = (JudySlot *)(judy->root[0] & JUDY_mask);
+
+    for (idx = 0; idx < workers; idx++) {
+        failed |= build[idx].failed;
+
+        if (!idx)
+            continue;
+
+        src = (JudySlot *)(build[idx].judy->root[0] & JUDY_mask);
+
+        for (byte = build[idx].lo; !failed && byte < build[idx].hi; byte++) {
+            if (!src[byte >> 4] || !((JudySlot *)(src[byte >> 4] & JUDY_mask))[byte & 0x0F])
+                continue;
+
+            if (!outer[byte >> 4]) {
+                if (!(inner = judy_alloc(judy, JUDY_radix))) {
+                    failed = 1;
+                    break;
+                }
+
+                outer[byte >> 4] = (JudySlot)inner | JUDY_radix;
+            }
+
+            inner = (JudySlot *)(outer[byte >> 4] & JUDY_mask);
+            inner[byte & 0x0F] = ((JudySlot *)(src[byte >> 4] & JUDY_mask))[byte & 0x0F];
+        }
+
+        //  the worker's free blocks and its root radix
+        //  nodes, now empty, go on the result's free lists
+
+        for (type = 0; type < 8; type++)
+            if ((block = build[idx].judy->reuse[type])) {
+                while (*block)
+                    block = *block;
+
+                *block = judy->reuse[type];
+                judy->reuse[type] = build[idx].judy->reuse[type];
+                judy_dirty(judy, block);
+            }
+
+        for (byte = 0; byte < 16; byte++)
+            if (src[byte])
+                judy_free(judy, (void *)(src[byte] & JUDY_mask), JUDY_radix);
+
+        judy_free(judy, src, JUDY_radix);
+
+        for (seg = build[idx].judy->seg; seg->seg; seg = seg->seg)
+            ;
+
+        seg->seg = judy->seg->seg;
+        judy->seg->seg = build[idx].judy->seg;
+    }
+
+    if (failed) {
+        judy_close(judy);
+        return NULL;
+    }
+
+    return judy;
+}
+
+//  Parallel batch insert.  An unsorted batch is partitioned by
+//  first key byte in two parallel passes, one counting and one
+//  scattering key numbers, which keeps each byte's keys in input
+//  order.  The root is made a radix node and the inner tables
+//  the batch needs are made up front.  Each worker then inserts
+//  a run of first bytes below inner slots no other worker
+//  touches, allocating from segments of its own that are handed
+//  to the array afterwards along with its free blocks.
+
+enum JUDY_batchpass {
+    JUDY_batch_count,
+    JUDY_batch_scatter,
+    JUDY_batch_insert
+};
+
+typedef struct {
+    Judy        *judy;          // the array
+    Judy        *alloc;         // worker's allocator and stack
+    uchar       **keys;
+    uint        *lens;
+    JudySlot    *values;
+    size_t      *perm;          // key numbers grouped by first byte
+    size_t      *start;         // first perm entry of each first byte
+    size_t      first, last;    // worker's slice of the input
+    size_t      count[JUDY_build_max];  // slice's keys per first byte, then scatter positions
+    uint        lo, hi;         // worker's first bytes, hi exclusive
+    uint        pass;
+    int         thread;         // pass runs on a thread of its own
+    int         failed;
+} JudyBatch;
+
+void *judy_batch_worker(void *arg) {
+    JudyBatch *batch = arg;
+    Judy *judy = batch->judy;
+    JudySlot *outer, *inner, *cell;
+    uint byte, len;
+    size_t idx, key;
+
+    switch (batch->pass) {
+        case JUDY_batch_count:
+            for (idx = batch->first; idx < batch->last; idx++) {
+                len = judy_build_len(judy, batch->keys, batch->lens, idx);
+                batch->count[judy_build_byte(judy, batch->keys[idx], len)]++;
+            }
+
+            break;
+
+        case JUDY_batch_scatter:
+            for (idx = batch->first; idx < batch->last; idx++) {
+                len = judy_build_len(judy, batch->keys, batch->lens, idx);
+                batch->perm[batch->count[judy_build_byte(judy, batch->keys[idx], len)]++] = idx;
+            }
+
+            break;
+
+        case JUDY_batch_insert:
+            outer = (JudySlot *)(judy->root[0] & JUDY_mask);
+
+            for (byte = batch->lo; !batch->failed && byte < batch->hi; byte++) {
+                inner = (JudySlot *)(outer[byte >> 4] & JUDY_mask);
+
+                for (idx = batch->start[byte]; idx < batch->start[byte + 1]; idx++) {
+                    key = batch->perm[idx];
+
+                    //  a zero first byte ends a string key in the radix root
+
+                    if (!judy->depth && !byte)
+                        cell = &inner[0];
+                    else {
+                        batch->alloc->level = 0;
+                        len = judy_build_len(judy, batch->keys, batch->lens, key);
+                        cell = judy_insert(batch->alloc, &inner[byte & 0x0F], 1, 0, batch->keys[key], len);
+                    }
+
+                    if (!cell) {
+                        batch->failed = 1;
+                        break;
+                    }
+
+                    *cell = batch->values[key];
+                }
+            }
+
+            break;
+    }
+
+    return NULL;
+}
+
+//  run one pass on every worker, the first on this thread
+
+void judy_batch_pass(JudyBatch *batch, pthread_t *tid, uint workers, uint pass) {
+    uint idx;
+
+    for (idx = 0; idx < workers; idx++)
+        batch[idx].pass = pass;
+
+    for (idx = 1; idx < workers; idx++)
+        if (!(batch[idx].thread = !pthread_create(&tid[idx], NULL, judy_batch_worker, &batch[idx])))
+            judy_batch_worker(&batch[idx]);
+
+    judy_batch_worker(&batch[0]);
+
+    for (idx = 1; idx < workers; idx++)
+        if (batch[idx].thread)
+            pthread_join(tid[idx], NULL);
+}
+
+//  judy_cell_batch: store values[idx] under keys[idx] for cnt
+//  keys in any order, using up to threads workers; lens is as
+//  for judy_build, and a repeated key keeps its last value.
+//  An array whose root is not a radix node while holding keys,
+//  and arrays with snapshots or concurrent handles, are filled
+//  by the calling thread alone.  Returns zero if memory ran out.
+
+int judy_cell_batch(Judy *judy, uchar **keys, uint *lens, JudySlot *values, size_t cnt, uint threads) {
+    size_t start[JUDY_build_max + 1], pos, next, target;
+    JudyBatch *batch = NULL;
+    pthread_t *tid = NULL;
+    JudySlot *outer, *cell;
+    uint idx, byte, workers;
+    size_t *perm = NULL;
+    void * *block;
+    JudySeg *seg;
+    int failed = 0;
+
+    if (threads > JUDY_build_max)
+        threads = JUDY_build_max;
+
+    if (threads > 1 && cnt >= threads && !judy->cow && !judy->snap && !judy->mt && !judy->thread && !judy->heap)
+        if (!judy->root[0] || (judy->root[0] & 0x07) == JUDY_radix) {
+            batch = calloc(threads, sizeof(JudyBatch));
+            perm = malloc(cnt * sizeof(size_t));
+            tid = malloc(threads * sizeof(pthread_t));
+        }
+
+    if (!batch || !perm || !tid) {
+        free(batch);
+        free(perm);
+        free(tid);
+
+        for (pos = 0; pos < cnt; pos++) {
+            if (!(cell = judy_cell(judy, keys[pos], judy_build_len(judy, keys, lens, pos))))
+                return 0;
+            *cell = values[pos];
+        }
+
+        return 1;
+    }
+
+    for (idx = 0; idx < threads; idx++) {
+        batch[idx].judy = judy;
+        batch[idx].keys = keys;
+        batch[idx].lens = lens;
+        batch[idx].values = values;
+        batch[idx].perm = perm;
+        batch[idx].start = start;
+        batch[idx].first = idx * cnt / threads;
+        batch[idx].last = (idx + 1) * cnt / threads;
+    }
+
+    //  count each slice's first bytes, then turn the counts into
+    //  the positions each slice scatters its keys to
+
+    judy_batch_pass(batch, tid, threads, JUDY_batch_count);
+
+    for (pos = byte = 0; byte < JUDY_build_max; byte++) {
+        start[byte] = pos;
+
+        for (idx = 0; idx < threads; idx++) {
+            next = pos + batch[idx].count[byte];
+            batch[idx].count[byte] = pos;
+            pos = next;
+        }
+    }
+
+    start[JUDY_build_max] = cnt;
+    judy_batch_pass(batch, tid, threads, JUDY_batch_scatter);
+
+    //  root and inner radix tables for every first byte present
+
+    if (!judy->root[0]) {
+        if ((outer = judy_alloc(judy, JUDY_radix)))
+            judy->root[0] = (JudySlot)outer | JUDY_radix;
+        else
+            failed = 1;
+    }
+
+    outer = (JudySlot *)(judy->root[0] & JUDY_mask);
+
+    for (byte = 0; !failed && byte < JUDY_build_max; byte++)
+        if (start[byte] < start[byte + 1] && !outer[byte >> 4]) {
+            if ((cell = judy_alloc(judy, JUDY_radix)))
+                outer[byte >> 4] = (JudySlot)cell | JUDY_radix;
+            else
+                failed = 1;
+        }
+
+    //  hand out runs of whole first bytes, as judy_build does
+
+    for (workers = byte = 0; !failed && workers < threads && byte < JUDY_build_max; workers++) {
+        target = (workers + 1) * cnt / threads;
+        batch[workers].lo = byte;
+
+        if (workers + 1 == threads)
+            byte = JUDY_build_max;
+        else
+            while (++byte < JUDY_build_max && start[byte] < target)
+                ;
+
+        batch[workers].hi = byte;
+
+        if (!(batch[workers].alloc = judy_open(judy->depth ? 0 : judy->max - 1, judy->depth)))
+            failed = 1;
+        else
+            batch[workers].alloc->track = judy->track;
+    }
+
+    if (!failed)
+        judy_batch_pass(batch, tid, workers, JUDY_batch_insert);
+
+    //  give the workers' segments and free blocks to the array
+
+    for (idx = 0; idx < workers; idx++) {
+        if (!batch[idx].alloc)
+            continue;
+
+        failed |= batch[idx].failed;
+
+        for (byte = 0; byte < 8; byte++)
+            if ((block = batch[idx].alloc->reuse[byte])) {
+                while (*block)
+                    block = *block;
+
+                *block = judy->reuse[byte];
+                judy->reuse[byte] = batch[idx].alloc->reuse[byte];
+                judy_dirty(judy, block);
+            }
+
+        for (seg = batch[idx].alloc->seg; seg->seg; seg = seg->seg)
+            ;
+
+        seg->seg = judy->seg->seg;
+        judy->seg->seg = batch[idx].alloc->seg;
+    }
+
+    free(batch);
+    free(perm);
+    free(tid);
+    return !failed;
+}
+
+//  judy_open_mt: open a judy array for concurrent use.
+//  Each thread works through its own handle from judy_attach.
+//  The plain functions may be used on the array itself only
+//  while no handle is in use.  Snapshots are not supported.
+
+Judy *judy_open_mt(uint max, uint depth) {
+    struct JudyMt *mt;
+    Judy *judy;
+
+    if (!(judy = judy_open(max, depth)))
+        return NULL;
+
+    if (!(mt = aligned_alloc(JUDY_mt_line, sizeof(struct JudyMt)))) {
+        judy_close(judy);
+        return NULL;
+    }
+
+    memset(mt, 0, sizeof(struct JudyMt));
+    mt->judy = judy;
+    mt->epoch = 1;
+    judy->mt = mt;
+    return judy;
+}
+
+//  judy_attach: claim a thread slot and return a handle
+//  holding the calling thread's stack and descent path
+
+Judy *judy_attach(Judy *judy) {
+    struct JudyMt *mt = judy->mt;
+    struct JudyThread *thread;
+    Judy *handle;
+    uint amt, idx;
+
+    if (!mt)
+        return NULL;
+
+    for (idx = 0; idx < JUDY_mt_threads; idx++)
+        if (!__atomic_exchange_n(&mt->thread[idx].used, 1, __ATOMIC_ACQUIRE))
+            break;
+
+    if (idx == JUDY_mt_threads)
+        return NULL;
+
+    thread = mt->thread + idx;
+    thread->mt = mt;
+
+    amt = sizeof(Judy) + judy->max * sizeof(JudyStack);
+    handle = malloc(amt);
+    thread->path = malloc((judy->max + 1) * sizeof(JudyPath));
+
+    if (!handle || !thread->path) {
+        free(thread->path);
+        free(handle);
+        thread->path = NULL;
+        __atomic_store_n(&thread->used, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    memset(handle, 0, amt);
+    handle->depth = judy->depth;
+    handle->max = judy->max;
+    handle->ksize = judy->ksize;
+    handle->seg = thread->seg;
+    handle->thread = thread;
+    return handle;
+}
+
+//  announce the epoch an operation runs in
+
+void judy_mt_enter(struct JudyThread *thread) {
+    uint epoch;
+
+    do {
+        epoch = __atomic_load_n(&thread->mt->epoch, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&thread->active, epoch, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&thread->mt->epoch, __ATOMIC_SEQ_CST) != epoch);
+}
+
+//  keep one magazine on each of a handle's free lists,
+//  passing the rest to the depot once there are two
+
+void judy_mt_spill(Judy *judy) {
+    void * *block, * *keep;
+    uint type, cnt;
+
+    for (type = 0; type < 8; type++) {
+        keep = NULL;
+
+        for (block = judy->reuse[type], cnt = 1; block && cnt < 2 * JUDY_mt_magazine; cnt++) {
+            if (cnt == JUDY_mt_magazine)
+                keep = block;
+            block = *block;
+        }
+
+        if (block) {
+            judy_mt_deposit(judy->thread->mt, *keep, type);
+            *keep = NULL;
+        }
+    }
+}
+
+//  advance the epoch if every operation in progress
+//  started in the current one, then reuse the nodes
+//  retired two or more epochs ago
+
+void judy_mt_reclaim(Judy *judy) {
+    struct JudyThread *thread = judy->thread;
+    struct JudyMt *mt = thread->mt;
+    JudyRetire *retire;
+    uint epoch, active;
+    uint idx, cnt;
+
+    epoch = __atomic_load_n(&mt->epoch, __ATOMIC_SEQ_CST);
+
+    for (idx = 0; idx < JUDY_mt_threads; idx++)
+        if ((active = __atomic_load_n(&mt->thread[idx].active, __ATOMIC_SEQ_CST)) && active != epoch)
+            break;
+
+    if (idx == JUDY_mt_threads)
+        if (__atomic_compare_exchange_n(&mt->epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            epoch++;
+
+    for (idx = cnt = 0; idx < thread->count; idx++) {
+        retire = thread->retire + idx;
+
+        if (epoch - retire->epoch < 2)
+            thread->retire[cnt++] = *retire;
+        else
+            judy_recycle(judy, retire->block, retire->type);
+    }
+
+    thread->count = thread->stamp = thread->held = cnt;
+    judy_mt_spill(judy);
+}
+
+//  leave the operation's epoch, stamping the nodes it
+//  retired with an epoch read after they were unlinked
+
+void judy_mt_exit(Judy *judy) {
+    struct JudyThread *thread = judy->thread;
+    uint epoch;
+
+    __atomic_store_n(&thread->active, 0, __ATOMIC_RELEASE);
+
+    if (thread->stamp < thread->count) {
+        epoch = __atomic_load_n(&thread->mt->epoch, __ATOMIC_SEQ_CST);
+
+        while (thread->stamp < thread->count)
+            thread->retire[thread->stamp++].epoch = epoch;
+    }
+
+    if (thread->count >= thread->held + JUDY_mt_reclaim)
+        judy_mt_reclaim(judy);
+}
+
+//  judy_detach: release the handle's thread slot.  Nodes it
+//  retired that are still visible to readers stay with the
+//  slot and are reused by its next owner or judy_close, as
+//  does the rest of its segment; its free blocks go to the
+//  depot.
+
+void judy_detach(Judy *handle) {
+    struct JudyThread *thread = handle->thread;
+    uint type;
+
+    judy_mt_reclaim(handle);
+
+    for (type = 0; type < 8; type++)
+        if (handle->reuse[type])
+            judy_mt_deposit(thread->mt, handle->reuse[type], type);
+
+    thread->seg = handle->seg;
+    free(thread->path);
+    thread->path = NULL;
+    free(handle);
+    __atomic_store_n(&thread->used, 0, __ATOMIC_RELEASE);
+}
+
+//  version word of the stripe holding a node
+
+uint64_t *judy_mt_version(struct JudyMt *mt, JudySlot next) {
+    uint64_t hash = (uint64_t)(next & JUDY_mask) * 0x9E3779B97F4A7C15ULL;
+
+    return &mt->stripe[hash >> (64 - JUDY_mt_bits)].ver;
+}
+
+//  pin count of the stripe holding a version word
+
+uint *judy_mt_pins(uint64_t *ver) {
+    return &((JudyVersion *)ver)->pins;
+}
+
+//  is the node at this path entry unchanged since it was read?
+
+int judy_mt_valid(JudyPath *path) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(path->ver, __ATOMIC_RELAXED) == path->seen;
+}
+
+//  judy_mt_find: descend to the key without locking, filling
+//  the handle's stack and path, and checking each node is
+//  unchanged after reading the pointer out of it.  Returns
+//  zero if a writer got in the way, yielding the processor
+//  first if the writer still holds a node, as it may have
+//  been preempted holding it.  Otherwise sets *cell to
+//  the key's cell, or to NULL with the stack ending at the
+//  node where the key is missing (level zero: empty array).
+
+//  Node contents are read while writers may be changing them;
+//  whatever is read is discarded unless the version check
+//  after it passes, and epochs keep the memory from reuse.
+
+int judy_mt_find(Judy *judy, uchar *buff, uint max, JudySlot **cell) {
+    struct JudyMt *mt = judy->thread->mt;
+    JudyPath *path = judy->thread->path;
+    judyvalue *src = (judyvalue *)buff;
+    int slot, size, keysize, tst, cnt;
+    JudySlot *next = mt->judy->root;
+    judyvalue value, test = 0;
+    JudySlot *table, *node;
+    JudySlot child;
+    uint depth = 0;
+    uint off = 0;
+    uchar *base;
+
+    judy->level = 0;
+    *cell = NULL;
+
+    path->ver = &mt->root.ver;
+    path->loc = NULL;
+
+    if ((path->seen = __atomic_load_n(path->ver, __ATOMIC_ACQUIRE)) & 1)
+        return sched_yield(), 0;
+
+    child = __atomic_load_n(next, __ATOMIC_ACQUIRE);
+
+    while (child) {
+        if (!judy_mt_valid(path + judy->level))
+            return 0;
+
+        if (judy->level < judy->max)
+            judy->level++;
+
+        path[judy->level].ver = judy_mt_version(mt, child);
+        path[judy->level].loc = next;
+
+        if ((path[judy->level].seen = __atomic_load_n(path[judy->level].ver, __ATOMIC_ACQUIRE)) & 1)
+            return sched_yield(), 0;
+
+        judy->stack[judy->level].next = child;
+        judy->stack[judy->level].off = off;
+        size = JudySize[child & 0x07];
+
+        switch (child & 0x07) {
+            case JUDY_1:
+            case JUDY_2:
+            case JUDY_4:
+            case JUDY_8:
+            case JUDY_16:
+            case JUDY_32:
+                base = (uchar *)(child & JUDY_mask);
+                node = (JudySlot *)((child & JUDY_mask) + size);
+                keysize = JUDY_key_size - (off & JUDY_key_mask);
+                cnt = size / (sizeof(JudySlot) + keysize);
+                slot = cnt;
+                value = 0;
+
+                if (judy->depth) {
+                    value = src[depth++];
+                    off |= JUDY_key_mask;
+                    off++;
+                    value &= JudyMask[keysize];
+                } else
+                    do {
+                        value <<= 8;
+                        if (off < max)
+                            value |= buff[off];
+                    } while (++off & JUDY_key_mask);
+
+                //  find slot > key
+
+                while (slot--) {
+                    test = *(judyvalue *)(base + slot * keysize);
+#if BYTE_ORDER == BIG_ENDIAN
+                    test >>= 8 * (JUDY_key_size - keysize);
+#else
+                    test &= JudyMask[keysize];
+#endif
+                    if (test <= value)
+                        break;
+                }
+                judy->stack[judy->level].slot = slot;
+
+                if (test != value)
+                    return judy_mt_valid(path + judy->level);
+
+                next = &node[-slot - 1];
+
+                if ((!judy->depth && !(value & 0xFF)) || (judy->depth && depth == judy->depth)) {
+                    *cell = next;
+                    return 1;
+                }
+
+                break;
+
+            case JUDY_radix:
+                table = (JudySlot  *)(child & JUDY_mask);                           // outer radix
+
+                if (judy->depth)
+                    slot = (src[depth] >> ((JUDY_key_size - (++off & JUDY_key_mask)) * 8)) & 0xff;
+                else if (off < max)
+                    slot = buff[off++];
+                else
+                    slot = 0;
+
+                judy->stack[judy->level].slot = slot;
+
+                if (!(child = __atomic_load_n(&table[slot >> 4], __ATOMIC_ACQUIRE)))
+                    return judy_mt_valid(path + judy->level);
+
+                table = (JudySlot  *)(child & JUDY_mask);                           // inner radix
+
+                if (judy->depth)
+                    if (!(off & JUDY_key_mask))
+                        depth++;
+
+                next = &table[slot & 0x0F];
+
+                if ((!judy->depth && !slot) || (judy->depth && depth == judy->depth)) {  // leaf?
+                    *cell = next;
+                    return 1;
+                }
+
+                break;
+
+            case JUDY_span:
+                node = (JudySlot *)((child & JUDY_mask) + JudySize[JUDY_span]);
+                base = (uchar *)(child & JUDY_mask);
+                cnt = tst = JUDY_span_bytes;
+                if (tst > (int)(max - off))
+                    tst = max - off;
+                value = strncmp((const char *)base, (const char *)(buff + off), tst);
+
+                if (!value && tst < cnt && !base[tst]) {                            // leaf?
+                    *cell = &node[-1];
+                    return 1;
+                }
+
+                if (!value && tst == cnt) {
+                    next = &node[-1];
+                    off += cnt;
+                    break;
+                }
+
+                return judy_mt_valid(path + judy->level);
+        }
+
+        child = __atomic_load_n(next, __ATOMIC_ACQUIRE);
+    }
+
+    return judy_mt_valid(path + judy->level);
+}
+
+//  release the stripes of path levels first up to end
+
+void judy_mt_unlock(Judy *judy, uint first, uint end) {
+    JudyPath *path = judy->thread->path;
+    uint idx, prev;
+
+    for (idx = first; idx < end; idx++) {
+        for (prev = first; prev < idx; prev++)
+            if (path[prev].ver == path[idx].ver)
+                break;
+
+        if (prev == idx)
+            __atomic_store_n(path[idx].ver, path[idx].seen + 2, __ATOMIC_RELEASE);
+    }
+}
+
+//  lock the stripes of path levels first up to end,
+//  failing if any node changed since it was read
+
+int judy_mt_lock(Judy *judy, uint first, uint end) {
+    JudyPath *path = judy->thread->path;
+    uint idx, prev;
+    uint64_t seen;
+
+    for (idx = first; idx < end; idx++) {
+        for (prev = first; prev < idx; prev++)
+            if (path[prev].ver == path[idx].ver)
+                break;
+
+        //  nodes sharing a stripe that is already held
+
+        if (prev < idx) {
+            if (path[prev].seen == path[idx].seen)
+                continue;
+        } else {
+            seen = path[idx].seen;
+
+            //  then wait out atomic cell operations already
+            //  under way in the stripe's nodes, whose
+            //  threads may have been preempted
+
+            if (__atomic_compare_exchange_n(path[idx].ver, &seen, seen + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                while (__atomic_load_n(judy_mt_pins(path[idx].ver), __ATOMIC_SEQ_CST))
+                    sched_yield();
+                continue;
+            }
+        }
+
+        judy_mt_unlock(judy, first, idx);
+        return 0;
+    }
+
+    return 1;
+}
+
+//  judy_slot_mt: return the value stored under the key, or zero
+
+JudySlot judy_slot_mt(Judy *judy, uchar *buff, uint max) {
+    JudySlot *cell, value;
+
+    judy_mt_enter(judy->thread);
+
+    for (;;) {
+        if (!judy_mt_find(judy, buff, max, &cell))
+            continue;
+
+        value = cell ? __atomic_load_n(cell, __ATOMIC_RELAXED) : 0;
+
+        if (!cell || judy_mt_valid(judy->thread->path + judy->level))
+            break;
+    }
+
+    judy_mt_exit(judy);
+    return value;
+}
+
+//  store value under the key through the locking write
+//  path.  A present key's cell is only replaced when replace
+//  is set.  Returns 1 if the value was stored, with the value
+//  it replaced in *prev, zero if it was not, or -1 with errno
+//  set to ENOMEM if memory ran out inserting the key.
+
+int judy_mt_store(Judy *judy, uchar *buff, uint max, JudySlot value, int replace, JudySlot *prev) {
+    struct JudyMt *mt = judy->thread->mt;
+    uint level, first, off;
+    JudySlot *cell;
+
+    for (;;) {
+        if (!judy_mt_find(judy, buff, max, &cell))
+            continue;
+
+        level = judy->level;
+
+        //  the key is present: lock its node to set the cell
+
+        if (cell) {
+            if (!replace) {
+                *prev = __atomic_load_n(cell, __ATOMIC_RELAXED);
+
+                if (!judy_mt_valid(judy->thread->path + level))
+                    continue;
+
+                return 0;
+            }
+
+            if (!judy_mt_lock(judy, level, level + 1))
+                continue;
+
+            *prev = *cell;
+            __atomic_store_n(cell, value, __ATOMIC_RELAXED);
+            judy_mt_unlock(judy, level, level + 1);
+            return 1;
+        }
+
+        //  otherwise lock the node where it is missing, and the
+        //  parent holding its pointer, which a promotion or split
+        //  replaces.  Nodes built below them stay private until
+        //  published through them, so nothing else is locked.
+
+        first = level ? level - 1 : 0;
+
+        if (!judy_mt_lock(judy, first, level + 1))
+            continue;
+
+        off = level ? judy->stack[level].off : 0;
+        judy->level = first;
+
+        cell = judy_insert(judy, level ? judy->thread->path[level].loc : mt->judy->root, off, judy->depth ? off / JUDY_key_size : 0, buff, max);
+
+        if (cell)
+            *prev = *cell, *cell = value;
+
+        judy_mt_unlock(judy, first, level + 1);
+
+        if (!cell) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        return 1;
+    }
+}
+
+//  judy_cell_mt: store a non-zero value under the key,
+//  returning the value it replaced, or zero if it is new.
+//  Returns zero with errno set to ENOMEM if memory ran out.
+
+JudySlot judy_cell_mt(Judy *judy, uchar *buff, uint max, JudySlot value) {
+    JudySlot prev = 0;
+
+    if (!value)
+        return 0;
+
+    judy_mt_enter(judy->thread);
+    judy_mt_store(judy, buff, max, value, 1, &prev);
+    judy_mt_exit(judy);
+    return prev;
+}
+
+//  will the node at this stack level keep other keys
+//  after judy_remove takes its slot out?
+
+int judy_mt_keeps(Judy *judy, uint level) {
+    JudySlot next = judy->stack[level].next;
+    int slot = judy->stack[level].slot;
+    int size = JudySize[next & 0x07];
+    JudySlot *table, *inner, *node;
+    int keysize, cnt;
+
+    switch (next & 0x07) {
+        case JUDY_radix:
+            table = (JudySlot *)(next & JUDY_mask);
+            inner = (JudySlot *)(table[slot >> 4] & JUDY_mask);
+
+            for (cnt = 16; cnt--; )
+                if ((cnt != (slot & 0x0F) && inner[cnt]) || (cnt != slot >> 4 && table[cnt]))
+                    return 1;
+
+            return 0;
+
+        case JUDY_span:
+            return 0;
+
+        default:
+            keysize = JUDY_key_size - (judy->stack[level].off & JUDY_key_mask);
+            cnt = size / (sizeof(JudySlot) + keysize);
+            node = (JudySlot *)((next & JUDY_mask) + size);
+
+            //  keys fill the top slots, so the node
+            //  empties only when its top key goes last
+
+            return slot + 1 < cnt || (cnt > 1 && node[1 - cnt]);
+    }
+}
+
+//  judy_del_mt: delete the key, returning the value it held
+
+JudySlot judy_del_mt(Judy *judy, uchar *buff, uint max) {
+    struct JudyMt *mt = judy->thread->mt;
+    JudySlot *cell, value;
+    uint level, top;
+
+    judy_mt_enter(judy->thread);
+
+    for (;;) {
+        if (!judy_mt_find(judy, buff, max, &cell))
+            continue;
+
+        value = cell ? __atomic_load_n(cell, __ATOMIC_RELAXED) : 0;
+        level = judy->level;
+
+        if (!value) {
+            if (!cell || judy_mt_valid(judy->thread->path + level))
+                break;
+
+            continue;
+        }
+
+        //  lock from the lowest node that keeps other keys down
+        //  to the key's node; the nodes below that one are freed
+
+        for (top = level; top && !judy_mt_keeps(judy, top); top--)
+            ;
+
+        if (!judy_mt_lock(judy, top, level + 1))
+            continue;
+
+        value = *cell;
+
+        if (!judy_remove(judy))
+            __atomic_store_n(mt->judy->root, 0, __ATOMIC_RELEASE);
+
+        judy_mt_unlock(judy, top, level + 1);
+        break;
+    }
+
+    judy_mt_exit(judy);
+    return value;
+}
+
+//  Atomic cell operations.  On a concurrent handle a key that
+//  is present is updated in place with one atomic instruction
+//  and no lock.  Its node's stripe is pinned for the duration,
+//  which makes writers that lock the stripe wait before moving
+//  the node's cells.  Missing keys are inserted through the
+//  locking write path.  A value brought to zero reads as absent
+//  but keeps its key.  On a plain array they are ordinary
+//  read-modify-writes of the key's cell.
+
+//  find the key's cell and pin its node, or return NULL
+//  with the key missing
+
+JudySlot *judy_mt_pin(Judy *judy, uchar *buff, uint max) {
+    JudyPath *path;
+    JudySlot *cell;
+
+    for (;;) {
+        if (!judy_mt_find(judy, buff, max, &cell))
+            continue;
+
+        if (!cell)
+            return NULL;
+
+        path = judy->thread->path + judy->level;
+        __atomic_fetch_add(judy_mt_pins(path->ver), 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(path->ver, __ATOMIC_SEQ_CST) == path->seen)
+            return cell;
+
+        __atomic_fetch_sub(judy_mt_pins(path->ver), 1, __ATOMIC_RELEASE);
+    }
+}
+
+void judy_mt_unpin(Judy *judy) {
+    __atomic_fetch_sub(judy_mt_pins(judy->thread->path[judy->level].ver), 1, __ATOMIC_RELEASE);
+}
+
+//  judy_fetch_add: add delta to the value under the key,
+//  inserting the key if missing, and return the old value
+
+JudySlot judy_fetch_add(Judy *judy, uchar *buff, uint max, JudySlot delta) {
+    JudySlot *cell, prev = 0;
+
+    if (!judy->thread) {
+        if ((cell = judy_cell(judy, buff, max)))
+            prev = *cell, *cell += delta;
+
+        return prev;
+    }
+
+    judy_mt_enter(judy->thread);
+
+    for (;;) {
+        if ((cell = judy_mt_pin(judy, buff, max))) {
+            prev = __atomic_fetch_add(cell, delta, __ATOMIC_SEQ_CST);
+            judy_mt_unpin(judy);
+            break;
+        }
+
+        //  retry in place if another writer inserted it first
+
+        if (!delta || judy_mt_store(judy, buff, max, delta, 0, &prev)) {
+            prev = 0;
+            break;
+        }
+    }
+
+    judy_mt_exit(judy);
+    return prev;
+}
+
+//  judy_cas_cell: store desired under the key if its value is
+//  *expected, a missing key counting as zero.  Returns non-zero
+//  on success; otherwise sets *expected to the value found.
+//  Also returns zero if memory ran out inserting the key.
+
+int judy_cas_cell(Judy *judy, uchar *buff, uint max, JudySlot *expected, JudySlot desired) {
+    JudySlot *cell, prev;
+    int done;
+
+    if (!judy->thread) {
+        cell = judy_slot(judy, buff, max);
+        prev = cell ? *cell : 0;
+
+        if (prev != *expected) {
+            *expected = prev;
+            return 0;
+        }
+
+        if (cell && !(cell = judy_writable(judy, cell)))
+            return 0;
+
+        if (!cell && desired && !(cell = judy_cell(judy, buff, max)))
+            return 0;
+
+        if (cell)
+            *cell = desired;
+
+        return 1;
+    }
+
+    judy_mt_enter(judy->thread);
+
+    for (;;) {
+        if ((cell = judy_mt_pin(judy, buff, max))) {
+            done = __atomic_compare_exchange_n(cell, expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            judy_mt_unpin(judy);
+            break;
+        }
+
+        //  a missing key holds zero
+
+        if (*expected) {
+            *expected = 0;
+            done = 0;
+            break;
+        }
+
+        //  retry if another writer inserted it first, and
+        //  fail if memory ran out
+
+        if (!desired)
+            done = 1;
+        else if (!(done = judy_mt_store(judy, buff, max, desired, 0, &prev)))
+            continue;
+
+        done = done > 0;
+        break;
+    }
+
+    judy_mt_exit(judy);
+    return done;
+}
+
+//  judy_exchange_cell: store value under the key, inserting
+//  the key if missing, and return the old value
+
+JudySlot judy_exchange_cell(Judy *judy, uchar *buff, uint max, JudySlot value) {
+    JudySlot *cell, prev = 0;
+
+    if (!judy->thread) {
+        if ((cell = judy_cell(judy, buff, max)))
+            prev = *cell, *cell = value;
+
+        return prev;
+    }
+
+    judy_mt_enter(judy->thread);
+
+    for (;;) {
+        if ((cell = judy_mt_pin(judy, buff, max))) {
+            prev = __atomic_exchange_n(cell, value, __ATOMIC_SEQ_CST);
+            judy_mt_unpin(judy);
+            break;
+        }
+
+        if (!value || judy_mt_store(judy, buff, max, value, 0, &prev)) {
+            prev = 0;
+            break;
+        }
+    }
+
+    judy_mt_exit(judy);
+    return prev;
+}
+
+Judy *judy_open_bin(uint size) {
+    Judy *judy;
+    uint depth;
+
+    depth = size / JUDY_key_size;
+    if (0 == depth || size % JUDY_key_size)
+        return NULL;
+    judy = judy_open(0, depth);
+    if (judy)
+        judy->ksize = size;
+
+    return judy;
+}
+
+JudySlot *judy_cell_bin(Judy *judy, void *key) {
+    return judy_cell(judy, key, judy->ksize);
+}
+
+JudySlot *judy_strt_bin(Judy *judy, void *key) {
+    return judy_strt(judy, key, judy->ksize);
+}
+
+JudySlot *judy_slot_bin(Judy *judy, void *key) {
+    return judy_slot(judy, key, judy->ksize);
+}
+
+bool judy_key_bin(Judy *judy, void *key) {
+    return judy_key(judy, key, judy->ksize) == judy->ksize;
+}
+
+//  longest-prefix match:
+//  an lpm array keeps bit-string prefixes, such as routes, as
+//  string keys.  Key byte j carries prefix bits 7j to 7j+6 under
+//  a set top bit; a prefix of length 7q+r ends after q of these
+//  in a terminal byte (1 << r) | v, v being its last r bits.
+//  No key byte is zero, and every prefix of an address is a
+//  terminal entry hanging off the path its chunk bytes trace,
+//  so judy_lpm finds the longest in one descent along it.
+
+#define JUDY_lpm_chunks 64
+
+//  the 7 bits of an address from pos on, zero past its length
+
+static uint judy_lpm_chunk(uchar *addr, uint bits, uint pos) {
+    uint word;
+
+    if (pos >= bits)
+        return 0;
+
+    word = addr[pos >> 3] << 8;
+
+    if ((pos >> 3) + 1 < (bits + 7) >> 3)
+        word |= addr[(pos >> 3) + 1];
+
+    word = (word >> (9 - (pos & 7))) & 0x7f;
+
+    if (bits - pos < 7)
+        word &= (0x7f << (7 - (bits - pos))) & 0x7f;
+
+    return word;
+}
+
+//  length of the prefix a terminal byte at key offset off
+//  stands for, or -1 if it is not a prefix of the address
+
+static int judy_lpm_match(uchar *chunk, uint bits, uint off, uint code) {
+    uint rem;
+
+    if (!code || code & 0x80)
+        return -1;
+
+    rem = 31 - __builtin_clz(code);
+
+    if (off * 7 + rem > bits || (uint)chunk[off] >> (7 - rem) != (code & ((1 << rem) - 1)))
+        return -1;
+
+    return off * 7 + rem;
+}
+
+//  the cell of the key ending where node next, at key offset
+//  off, begins
+
+static JudySlot *judy_lpm_end(JudySlot next, uint off) {
+    int slot, size, keysize;
+    JudySlot *table, *node;
+    judyvalue test;
+    uchar *base;
+
+    switch (next & 0x07) {
+        case JUDY_1:
+        case JUDY_2:
+        case JUDY_4:
+        case JUDY_8:
+        case JUDY_16:
+        case JUDY_32:
+            size = JudySize[next & 0x07];
+            base = (uchar *)(next & JUDY_mask);
+            node = (JudySlot *)((next & JUDY_mask) + size);
+            keysize = JUDY_key_size - (off & JUDY_key_mask);
+            slot = size / (sizeof(JudySlot) + keysize);
+
+            while (slot--) {
+                test = *(judyvalue *)(base + slot * keysize);
+#if BYTE_ORDER == BIG_ENDIAN
+                test >>= 8 * (JUDY_key_size - keysize);
+#else
+                test &= JudyMask[keysize];
+#endif
+                if (!test)
+                    return &node[-slot - 1];
+            }
+            return NULL;
+
+        case JUDY_radix:
+            table = (JudySlot *)(next & JUDY_mask);
+            if (!table[0])
+                return NULL;
+            return (JudySlot *)(table[0] & JUDY_mask);
+
+        case JUDY_span:
+            base = (uchar *)(next & JUDY_mask);
+            if (base[0])
+                return NULL;
+            return (JudySlot *)((next & JUDY_mask) + JudySize[JUDY_span]) - 1;
+    }
+
+    return NULL;
+}
+
+Judy *judy_open_lpm(uint bits) {
+    if (bits / 7 >= JUDY_lpm_chunks)
+        return NULL;
+
+    return judy_open(bits / 7 + 1, 0);
+}
+
+//  the key of the prefix of length bits
+
+static uint judy_lpm_key(uchar *key, uchar *addr, uint bits) {
+    uint idx, len = bits / 7, rem = bits % 7;
+
+    for (idx = 0; idx < len; idx++)
+        key[idx] = 0x80 | judy_lpm_chunk(addr, bits, idx * 7);
+
+    key[len] = (1 << rem) | judy_lpm_chunk(addr, bits, len * 7) >> (7 - rem);
+    return len + 1;
+}
+
+JudySlot *judy_lpm_cell(Judy *judy, uchar *addr, uint bits) {
+    uchar key[JUDY_lpm_chunks + 1];
+    uint len;
+
+    if (judy->depth || bits / 7 + 2 > judy->max)
+        return NULL;
+
+    len = judy_lpm_key(key, addr, bits);
+    return judy_cell(judy, key, len);
+}
+
+JudySlot judy_lpm_del(Judy *judy, uchar *addr, uint bits) {
+    uchar key[JUDY_lpm_chunks + 1];
+    JudySlot *cell, value;
+    uint len;
+
+    if (judy->depth || bits / 7 + 2 > judy->max)
+        return 0;
+
+    len = judy_lpm_key(key, addr, bits);
+
+    if (!(cell = judy_slot(judy, key, len)))
+        return 0;
+
+    value = *cell;
+    judy_del(judy);
+    return value;
+}
+
+//  return the cell of the longest prefix of the bits-long
+//  address holding a value, setting *len to its length, or
+//  NULL if no prefix of it is in the array.  The cell is for
+//  reading: store through the one judy_lpm_cell returns.
+
+JudySlot *judy_lpm(Judy *judy, uchar *addr, uint bits, uint *len) {
+    uchar chunk[JUDY_lpm_chunks + 1], path[JUDY_lpm_chunks + JUDY_key_size];
+    JudySlot *radix[JUDY_lpm_chunks + 1], *best = NULL, *cell, *table, *node;
+    uint idx, off = 0, full, level = 0, at[JUDY_lpm_chunks + 1];
+    int slot, size, keysize, cnt, found, most = -1;
+    JudySlot next = *judy->root;
+    judyvalue value, test, diff;
+    uchar *base;
+
+    if (judy->depth || bits / 7 >= JUDY_lpm_chunks)
+        return NULL;
+
+    //  the address as chunks, and as the bytes of the path
+    //  its chunk keys share; the path ends in zeros
+
+    full = bits / 7;
+    memset(path, 0, sizeof(path));
+
+    for (idx = 0; idx <= full; idx++)
+        chunk[idx] = judy_lpm_chunk(addr, bits, idx * 7);
+
+    for (idx = 0; idx < full; idx++)
+        path[idx] = 0x80 | chunk[idx];
+
+    while (next && off <= full) {
+        size = JudySize[next & 0x07];
+
+        switch (next & 0x07) {
+            case JUDY_1:
+            case JUDY_2:
+            case JUDY_4:
+            case JUDY_8:
+            case JUDY_16:
+            case JUDY_32:
+                base = (uchar *)(next & JUDY_mask);
+                node = (JudySlot *)((next & JUDY_mask) + size);
+                keysize = JUDY_key_size - (off & JUDY_key_mask);
+                cnt = size / (sizeof(JudySlot) + keysize);
+                value = 0;
+
+                for (idx = 0; idx < (uint)keysize; idx++)
+                    value = value << 8 | path[off + idx];
+
+                //  the slot matching the path is where it goes on;
+                //  a slot leaving it at a terminal byte is a prefix
+
+                next = 0;
+
+                for (slot = 0; slot < cnt; slot++) {
+                    test = *(judyvalue *)(base + slot * keysize);
+#if BYTE_ORDER == BIG_ENDIAN
+                    test >>= 8 * (JUDY_key_size - keysize);
+#else
+                    test &= JudyMask[keysize];
+#endif
+                    if (!(diff = test ^ value)) {
+                        if (test & 0xFF)
+                            next = node[-slot - 1];
+                        continue;
+                    }
+
+                    idx = (__builtin_clzll(diff) - 8 * (JUDY_key_size - keysize)) / 8;
+                    found = judy_lpm_match(chunk, bits, off + idx, (test >> 8 * (keysize - idx - 1)) & 0xFF);
+
+                    if (found <= most)
+                        continue;
+
+                    if (!(test & 0xFF))
+                        cell = &node[-slot - 1];
+                    else if (idx + 1 == (uint)keysize)
+                        cell = judy_lpm_end(node[-slot - 1], off + keysize);
+                    else
+                        continue;
+
+                    if (cell && *cell)
+                        best = cell, most = found;
+                }
+
+                off += keysize;
+                continue;
+
+            case JUDY_radix:
+                table = (JudySlot *)(next & JUDY_mask);
+
+                //  the terminal bytes of the prefixes ending here
+                //  are looked up after the descent, deepest first
+
+                radix[level] = table;
+                at[level++] = off;
+
+                slot = path[off++];
+
+                if (!slot || !(next = table[slot >> 4]))
+                    break;
+
+                next = ((JudySlot *)(next & JUDY_mask))[slot & 0x0F];
+                continue;
+
+            case JUDY_span:
+                node = (JudySlot *)((next & JUDY_mask) + JudySize[JUDY_span]);
+                base = (uchar *)(next & JUDY_mask);
+                cnt = JUDY_span_bytes;
+
+                for (idx = 0; idx < (uint)cnt; idx++)
+                    if (off + idx >= full || base[idx] != path[off + idx])
+                        break;
+
+                next = 0;
+
+                if (idx == (uint)cnt) {
+                    next = node[-1];
+                    off += cnt;
+                    continue;
+                }
+
+                if ((found = judy_lpm_match(chunk, bits, off + idx, base[idx])) < 0)
+                    break;
+
+                if (idx + 1 < (uint)cnt && !base[idx + 1])
+                    cell = &node[-1];
+                else if (idx + 1 == (uint)cnt)
+                    cell = judy_lpm_end(node[-1], off + cnt);
+                else
+                    cell = NULL;
+
+                if (cell && *cell)
+                    best = cell, most = found;
+                break;
+        }
+
+        break;
+    }
+
+    //  a radix node holds no longer prefixes than the ones
+    //  deeper down, so the first found is the longest
+
+    while (level--) {
+        table = radix[level];
+        off = at[level];
+
+        for (idx = 7; idx--; ) {
+            if ((int)(off * 7 + idx) <= most || off * 7 + idx > bits)
+                continue;
+
+            slot = (1 << idx) | chunk[off] >> (7 - idx);
+
+            if (!(next = table[slot >> 4]))
+                continue;
+
+            next = ((JudySlot *)(next & JUDY_mask))[slot & 0x0F];
+
+            if (next && (cell = judy_lpm_end(next, off + 1)) && *cell) {
+                best = cell, most = off * 7 + idx;
+                break;
+            }
+        }
+
+        if (idx < 7 || (int)(off * 7) <= most)
+            break;
+    }
+
+    if (best && len)
+        *len = most;
+
+    return best;
+}
+
+//  random sampling:
+//  a random descent taking one of a node's children uniformly
+//  reaches a key with the chance 1 / W, W being the product of
+//  the child counts along its path.  Keeping the key with the
+//  chance W / bound leaves every key whose W is within the bound
+//  equally likely.  The nodes keep no subtree counts, so the
+//  bound starts as the largest W of JUDY_sample_pilot descents.
+//  The draws are then made once without visiting; a descent on
+//  a heavier path raises the bound and starts them over from
+//  the same generator state, and the draws are replayed to the
+//  visitor once a whole set is made under one bound.  Every
+//  path met is within the bound, so keys on them are drawn
+//  exactly uniformly.  A key on a heavier path no descent took
+//  is drawn bound / W times its share: after m descents without
+//  meeting one, all such keys together catch a descent with a
+//  chance below 3 / m at 95% confidence.  That bounds how rarely
+//  descents reach them, not how many keys they are, so the
+//  error is bounded only where no small set of heavy paths holds
+//  many keys.  A draw takes about bound / N descents over N keys,
+//  twice over for the replay: evenly spread keys draw cheaply,
+//  while a few keys under wide nodes beside many under narrow
+//  ones can make draws a hundred times dearer.  A JudySum
+//  holding unit values keeps the counts, and judy_sum_sample
+//  draws from it exactly, at any shape.
+
+#define JUDY_sample_pilot 256
+
+//  splitmix64
+
+static uint64_t judy_sample_rand(uint64_t *seed) {
+    uint64_t z = (*seed += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+//  descend to a random leaf, setting up the cursor as
+//  judy_first does, and return its cell and its path weight
+
+static JudySlot *judy_sample_walk(Judy *judy, uint64_t *seed, double *weight) {
+    JudySlot next = *judy->root;
+    JudySlot *table, *inner;
+    uint keysize, size;
+    uint off = 0, depth = 0;
+    JudySlot *node;
+    int slot, cnt;
+    uchar *base;
+
+    judy->level = 0;
+    *weight = 1;
+
+    while (next) {
+        if (judy->level < judy->max)
+            judy->level++;
+
+        judy->stack[judy->level].off = off;
+        judy->stack[judy->level].next = next;
+        size = JudySize[next & 0x07];
+
+        switch (next & 0x07) {
+            case JUDY_1:
+            case JUDY_2:
+            case JUDY_4:
+            case JUDY_8:
+            case JUDY_16:
+            case JUDY_32:
+                keysize = JUDY_key_size - (off & JUDY_key_mask);
+                node = (JudySlot *)((next & JUDY_mask) + size);
+                base = (uchar *)(next & JUDY_mask);
+                cnt = size / (sizeof(JudySlot) + keysize);
+
+                //  the empty slots come first
+
+                for (slot = 0; slot < cnt; slot++)
+                    if (node[-slot - 1])
+                        break;
+
+                if (slot == cnt)
+                    return NULL;
+
+                *weight *= cnt - slot;
+                slot += judy_sample_rand(seed) % (cnt - slot);
+                judy->stack[judy->level].slot = slot;
+#if BYTE_ORDER != BIG_ENDIAN
+                if ((!judy->depth && !base[slot * keysize]) || (judy->depth && ++depth == judy->depth))
+                    return &node[-slot - 1];
+#else
+                if ((!judy->depth && !base[slot * keysize + keysize - 1]) || (judy->depth && ++depth == judy->depth))
+                    return &node[-slot - 1];
+#endif
+                next = node[-slot - 1];
+                off = (off | JUDY_key_mask) + 1;
+                continue;
+
+            case JUDY_radix:
+                off++;
+
+                if (judy->depth)
+                    if (!(off & JUDY_key_mask))
+                        depth++;
+
+                table = (JudySlot *)(next & JUDY_mask);
+                cnt = 0;
+
+                for (slot = 0; slot < 256; slot++)
+                    if ((inner = (JudySlot *)(table[slot >> 4] & JUDY_mask)))
+                        cnt += !!inner[slot & 0x0F];
+                    else
+                        slot |= 0x0F;
+
+                if (!cnt)
+                    return NULL;
+
+                *weight *= cnt;
+                cnt = judy_sample_rand(seed) % cnt;
+
+                for (slot = 0; slot < 256; slot++)
+                    if ((inner = (JudySlot *)(table[slot >> 4] & JUDY_mask))) {
+                        if ((next = inner[slot & 0x0F]) && !cnt--)
+                            break;
+                    } else
+                        slot |= 0x0F;
+
+                judy->stack[judy->level].slot = slot;
+
+                if ((!judy->depth && !slot) || (judy->depth && depth == judy->depth))
+                    return &inner[slot & 0x0F];
+
+                continue;
+
+            case JUDY_span:
+                node = (JudySlot *)((next & JUDY_mask) + JudySize[JUDY_span]);
+                base = (uchar *)(next & JUDY_mask);
+                cnt = JUDY_span_bytes;
+                if (!base[cnt - 1])                                     // leaf node?
+                    return &node[-1];
+                next = node[-1];
+                off += cnt;
+                continue;
+        }
+    }
+    return NULL;
+}
+
+//  visit n keys drawn at random with replacement, from a
+//  generator state in seed, until the visitor returns non-zero.
+//  The visitor is not to change the array.  Returns the number
+//  of keys visited, or -1 if memory ran out.
+
+int judy_sample(Judy *judy, uint64_t *seed, uint n, JudyScan visit, void *ctx) {
+    double weight, bound = 0;
+    uint64_t start;
+    JudySlot *cell;
+    uint idx, len;
+    uchar *buff;
+
+    if (!n || !*judy->root)
+        return 0;
+
+    for (idx = 0; idx < JUDY_sample_pilot; idx++)
+        if (judy_sample_walk(judy, seed, &weight) && bound < weight)
+            bound = weight;
+
+    if (!(buff = malloc(judy->max + 1)))
+        return -1;
+
+    //  make the draws once without visiting, raising the bound
+    //  and starting over from the same state on a heavier path,
+    //  then replay them under the final bound
+
+    start = *seed;
+
+    for (idx = 0; idx < n; ) {
+        if (!judy_sample_walk(judy, seed, &weight))
+            continue;
+
+        if (weight > bound) {
+            bound = weight;
+            *seed = start;
+            idx = 0;
+            continue;
+        }
+
+        if (weight < bound && (judy_sample_rand(seed) >> 11) * 0x1p-53 * bound >= weight)
+            continue;
+
+        idx++;
+    }
+
+    *seed = start;
+
+    for (idx = 0; idx < n; ) {
+        if (!(cell = judy_sample_walk(judy, seed, &weight)))
+            continue;
+
+        if (weight < bound && (judy_sample_rand(seed) >> 11) * 0x1p-53 * bound >= weight)
+            continue;
+
+        len = judy_key(judy, buff, judy->max + 1);
+        idx++;
+
+        if (visit(ctx, buff, len, *cell))
+            break;
+    }
+
+    free(buff);
+    return idx;
 }
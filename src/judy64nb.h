@@ -1,7 +1,9 @@
 #ifndef JUDY64NB_H
 #define JUDY64NB_H
 
+#include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef unsigned char uchar;
@@ -49,6 +51,8 @@ typedef uint32_t JudySlot;
 typedef struct {
     void    *seg;               // next used allocator
     uint    next;               // next available offset
+    uint    epoch;              // snapshot epoch sealing this segment, or zero
+    uint    dirty;              // changed since the last checkpoint
 } JudySeg;
 
 typedef struct {
@@ -57,6 +61,12 @@ typedef struct {
     int         slot;           // slot within object
 } JudyStack;
 
+struct JudyCow;                 // copy-on-write state shared with snapshots
+struct JudySnap;                // snapshot record
+struct JudyMt;                  // shared state of a concurrent array
+struct JudyThread;              // per-thread state of a concurrent handle
+struct JudyHeap;                // file mapping of a persistent array
+
 typedef struct {
     JudySlot    root[1];        // root of judy array
     void        * *reuse[8];    // reuse judy blocks
@@ -65,9 +75,44 @@ typedef struct {
     uint        max;            // max height of stack
     uint        depth;          // number of Integers in a key, or zero for string keys
     uint        ksize;          // size of a binary key
+    uint        track;          // checkpoints since the last full one, plus one, or zero
+    struct JudyCow  *cow;       // snapshot bookkeeping, or NULL
+    struct JudySnap *snap;      // set when this is a snapshot
+    struct JudyMt   *mt;        // set when opened by judy_open_mt
+    struct JudyThread *thread;  // set when this is a judy_attach handle
+    struct JudyHeap *heap;      // set when the segments live in a file
     JudyStack   stack[1];       // current cursor
 } Judy;
 
+typedef struct JudyMerge JudyMerge;     // ordered cursor over several arrays
+typedef struct JudySharded JudySharded; // concurrent array split by key prefix
+typedef struct JudyFc JudyFc;           // flat combining front end
+typedef struct JudyFcSlot JudyFcSlot;   // per-thread request slot
+typedef struct JudyHandle JudyHandle;   // array published to readers
+typedef struct JudyReader JudyReader;   // per-thread reader slot
+typedef struct JudyWal JudyWal;         // write-ahead log in front of an array
+typedef struct JudyAsync JudyAsync;     // checkpoint written in the background
+typedef struct JudyShared JudyShared;   // file-backed array read from another process
+typedef struct JudyTier JudyTier;       // hot array over a mapped cold file
+typedef struct JudyInterval JudyInterval; // disjoint key ranges mapped to values
+typedef struct JudyTopk JudyTopk;       // scored keys with bounds under their prefixes
+typedef struct JudySum JudySum;         // integer keys with sums under their prefixes
+
+//  scan visitor: return non-zero to stop the scan
+
+typedef int (*JudyScan)(void *ctx, uchar *key, uint len, JudySlot value);
+
+//  interval visitor: return non-zero to stop the scan
+
+typedef int (*JudyIntervalScan)(void *ctx, judyvalue *lo, judyvalue *hi, JudySlot value);
+
+//  background checkpoint callbacks, made from the writing threads
+
+typedef void (*JudyProgress)(void *ctx, uint64_t done, uint64_t total);
+typedef void (*JudyFinish)(void *ctx, int err);
+
+#define JUDY_async_threads  1           // write from a thread pool, not io_uring
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -77,16 +122,62 @@ extern "C" {
 Judy *judy_open(uint max, uint depth);
 //  judy_close: close an open judy array, freeing all memory.
 void judy_close(Judy *judy);
+//  judy_close_ex: close an array, first passing every value to a destructor on several threads.
+void judy_close_ex(Judy *judy, void (*dtor)(JudySlot, void *), void *ctx, uint threads);
 //  judy_clone: clone an open judy array, duplicating the stack.
 void *judy_clone(Judy *judy);
+//  judy_snapshot: take an immutable point-in-time version of the array.
+Judy *judy_snapshot(Judy *judy);
+//  judy_copy:  duplicate an open judy array or snapshot.
+Judy *judy_copy(Judy *judy);
+//  judy_checkpoint: write the segments changed since the last checkpoint.
+int judy_checkpoint(Judy *judy, FILE *out, int full);
+//  judy_restore: rebuild an array from a full checkpoint and the deltas after it.
+Judy *judy_restore(FILE *in);
+//  judy_restore_fd: judy_restore from a file descriptor, reading in large batches.
+Judy *judy_restore_fd(int fd);
+//  judy_snapshot_async: write a full checkpoint of the array in the background.
+JudyAsync *judy_snapshot_async(Judy *judy, int fd, size_t inflight, uint flags, JudyProgress progress, JudyFinish finish, void *ctx);
+//  judy_async_wait: wait for a background checkpoint, returning its errno or zero.
+int judy_async_wait(JudyAsync *async);
+//  judy_open_heap: open or create an array kept in a file.
+Judy *judy_open_heap(const char *path, uint max, uint depth, size_t size);
+//  judy_heap_sync: commit a file-backed array's contents to its file.
+int judy_heap_sync(Judy *judy);
+//  judy_shared_open: map a file-backed array read-only in another process.
+JudyShared *judy_shared_open(const char *path);
+//  judy_shared_close: unmap an array opened by judy_shared_open.
+void judy_shared_close(JudyShared *shared);
+//  judy_shared_enter: start a read section, returning a view of the newest commit.
+Judy *judy_shared_enter(JudyShared *shared);
+//  judy_shared_leave: end a read section.
+void judy_shared_leave(JudyShared *shared);
+//  judy_warm: fault in the top levels of a mapped array ahead of its first queries.
+int judy_warm(Judy *judy, uint levels, int lock);
+//  judy_union: return a new array with the keys of either array.
+Judy *judy_union(Judy *a, Judy *b);
+//  judy_intersect: return a new array with the keys of both arrays.
+Judy *judy_intersect(Judy *a, Judy *b);
+//  judy_difference: return a new array with the keys of one array but not the other.
+Judy *judy_difference(Judy *a, Judy *b);
+//  judy_build: build an array from sorted keys on several threads.
+Judy *judy_build(uint max, uint depth, uchar **keys, uint *lens, JudySlot *values, size_t cnt, uint threads);
+//  judy_cell_batch: insert unsorted keys and their values on several threads.
+int judy_cell_batch(Judy *judy, uchar **keys, uint *lens, JudySlot *values, size_t cnt, uint threads);
 //  judy_data:  allocate data memory within judy array for external use.
 void *judy_data(Judy *judy, uint amt);
 //  judy_cell:  insert a string into the judy array, return cell pointer.
 JudySlot *judy_cell(Judy *judy, uchar *buff, uint max);
+//  judy_cell_after: insert a key sharing a prefix with the previous insert, reusing its descent.
+JudySlot *judy_cell_after(Judy *judy, uchar *buff, uint max, uint common);
 //  judy_strt:  retrieve the cell pointer greater than or equal to given key
 JudySlot *judy_strt(Judy *judy, uchar *buff, uint max);
+//  judy_floor: retrieve the cell pointer less than or equal to given key
+JudySlot *judy_floor(Judy *judy, uchar *buff, uint max);
 //  judy_slot:  retrieve the cell pointer, or return NULL for a given key.
 JudySlot *judy_slot(Judy *judy, uchar *buff, uint max);
+//  judy_slot_write: retrieve the cell pointer for a given key to store through, copying shared nodes.
+JudySlot *judy_slot_write(Judy *judy, uchar *buff, uint max);
 //  judy_key:   retrieve the string value for the most recent judy query.
 uint judy_key(Judy *judy, uchar *buff, uint max);
 //  judy_end:   retrieve the cell pointer for the last string in the array.
@@ -97,6 +188,8 @@ JudySlot *judy_nxt(Judy *judy);
 JudySlot *judy_prv(Judy *judy);
 //  judy_del:   delete the key and cell for the current stack entry.
 JudySlot *judy_del(Judy *judy);
+//  judy_sample: visit keys drawn at random, uniformly over the paths descents met.
+int judy_sample(Judy *judy, uint64_t *seed, uint n, JudyScan visit, void *ctx);
 
 // Helpers for binary keys
 
@@ -111,6 +204,184 @@ JudySlot *judy_slot_bin(Judy *judy, void *key);
 //  judy_key:   retrieve the string value for the most recent judy query.
 bool judy_key_bin(Judy *judy, void *key);
 
+// Longest-prefix match over bit-string prefixes, such as routes
+
+//  judy_open_lpm: open an array of prefixes of addresses up to bits long.
+Judy *judy_open_lpm(uint bits);
+//  judy_lpm_cell: insert the prefix of length bits of an address, return cell pointer.
+JudySlot *judy_lpm_cell(Judy *judy, uchar *addr, uint bits);
+//  judy_lpm:      retrieve the cell of the longest prefix of the address holding a value, or NULL.
+JudySlot *judy_lpm(Judy *judy, uchar *addr, uint bits, uint *len);
+//  judy_lpm_del:  delete the prefix of length bits of an address, returning the value it held.
+JudySlot judy_lpm_del(Judy *judy, uchar *addr, uint bits);
+
+// Concurrent arrays, used through one handle per thread
+
+//  judy_open_mt: open a judy array for concurrent readers and writers.
+Judy *judy_open_mt(uint max, uint depth);
+//  judy_attach: return a handle for the calling thread to use the array.
+Judy *judy_attach(Judy *judy);
+//  judy_detach: release a handle returned by judy_attach.
+void judy_detach(Judy *handle);
+//  judy_slot_mt: retrieve the value stored under a key, or zero.
+JudySlot judy_slot_mt(Judy *handle, uchar *buff, uint max);
+//  judy_cell_mt: store a non-zero value under a key, returning the previous value; zero with errno ENOMEM if memory ran out.
+JudySlot judy_cell_mt(Judy *handle, uchar *buff, uint max, JudySlot value);
+//  judy_del_mt: delete a key, returning the value it held.
+JudySlot judy_del_mt(Judy *handle, uchar *buff, uint max);
+
+// Atomic cell operations, lock-free on a handle when the key is present
+
+//  judy_fetch_add: add to the value under a key, returning the previous value.
+JudySlot judy_fetch_add(Judy *judy, uchar *buff, uint max, JudySlot delta);
+//  judy_cas_cell: replace the value under a key if it holds the expected value.
+int judy_cas_cell(Judy *judy, uchar *buff, uint max, JudySlot *expected, JudySlot desired);
+//  judy_exchange_cell: replace the value under a key, returning the previous value.
+JudySlot judy_exchange_cell(Judy *judy, uchar *buff, uint max, JudySlot value);
+
+// Flat combining front end for contended writers
+
+//  judy_fc_open:   open a combining front end for a judy array.
+JudyFc *judy_fc_open(Judy *judy);
+//  judy_fc_close:  free the front end, leaving the array open.
+void judy_fc_close(JudyFc *fc);
+//  judy_fc_attach: return a request slot for the calling thread.
+JudyFcSlot *judy_fc_attach(JudyFc *fc);
+//  judy_fc_detach: release a request slot.
+void judy_fc_detach(JudyFcSlot *req);
+//  judy_fc_insert: store a value under a key unless present, returning the present value; zero with errno ENOMEM if memory ran out.
+JudySlot judy_fc_insert(JudyFcSlot *req, uchar *buff, uint max, JudySlot value);
+//  judy_fc_update: replace the value under a key if present, returning the old value.
+JudySlot judy_fc_update(JudyFcSlot *req, uchar *buff, uint max, JudySlot value);
+//  judy_fc_del:    delete a key, returning the value it held.
+JudySlot judy_fc_del(JudyFcSlot *req, uchar *buff, uint max);
+
+// Merge cursor over several arrays
+
+//  judy_merge_open:  open a merge cursor over an array of judy objects.
+JudyMerge *judy_merge_open(Judy **judy, uint cnt, uint max);
+//  judy_merge_close: free a merge cursor, leaving the inputs open.
+void judy_merge_close(JudyMerge *merge);
+//  judy_merge_strt:  position every input at its first key >= given key.
+JudySlot *judy_merge_strt(JudyMerge *merge, uchar *buff, uint max);
+//  judy_merge_nxt:   advance to the next key in merged order.
+JudySlot *judy_merge_nxt(JudyMerge *merge);
+//  judy_merge_key:   retrieve the key of the current merged entry.
+uint judy_merge_key(JudyMerge *merge, uchar *buff, uint max);
+//  judy_merge_src:   retrieve the input index of the current merged entry.
+uint judy_merge_src(JudyMerge *merge);
+
+// Sharded arrays for concurrent writers
+
+//  judy_sharded_open:  open a sharded array with the given number of shards.
+JudySharded *judy_sharded_open(uint cnt, uint max, uint depth);
+//  judy_sharded_close: close a sharded array, freeing all memory.
+void judy_sharded_close(JudySharded *sharded);
+//  judy_sharded_put:   store a non-zero value under a key, returning the previous value.
+JudySlot judy_sharded_put(JudySharded *sharded, uchar *buff, uint max, JudySlot value);
+//  judy_sharded_get:   retrieve the value stored under a key, or zero.
+JudySlot judy_sharded_get(JudySharded *sharded, uchar *buff, uint max);
+//  judy_sharded_del:   delete a key, returning the value it held.
+JudySlot judy_sharded_del(JudySharded *sharded, uchar *buff, uint max);
+//  judy_sharded_scan:  visit the keys >= a given key in order.
+int judy_sharded_scan(JudySharded *sharded, uchar *buff, uint max, JudyScan visit, void *ctx);
+
+// Published arrays, swapped under readers with epoch reclamation
+
+//  judy_handle_open:    publish an array to readers through a new handle.
+JudyHandle *judy_handle_open(Judy *judy);
+//  judy_handle_close:   close the handle and its current array.
+void judy_handle_close(JudyHandle *handle);
+//  judy_handle_attach:  return a reader slot for the calling thread.
+JudyReader *judy_handle_attach(JudyHandle *handle);
+//  judy_handle_detach:  release a reader slot.
+void judy_handle_detach(JudyReader *reader);
+//  judy_handle_enter:   start a read section, returning a view of the current array.
+Judy *judy_handle_enter(JudyReader *reader);
+//  judy_handle_leave:   end a read section.
+void judy_handle_leave(JudyReader *reader);
+//  judy_handle_publish: swap in a new array, closing the old one after the grace period.
+int judy_handle_publish(JudyHandle *handle, Judy *judy);
+
+// Write-ahead log with group commit
+
+//  judy_wal_open:       open or create a log, replaying it into an array.
+JudyWal *judy_wal_open(Judy *judy, const char *path, uint latency);
+//  judy_wal_close:      sync and close the log, leaving the array open.
+void judy_wal_close(JudyWal *wal);
+//  judy_wal_put:        store a non-zero value under a key durably, returning the previous value, or zero with errno set if the log failed.
+JudySlot judy_wal_put(JudyWal *wal, uchar *buff, uint max, JudySlot value);
+//  judy_wal_get:        retrieve the value stored under a key, or zero.
+JudySlot judy_wal_get(JudyWal *wal, uchar *buff, uint max);
+//  judy_wal_del:        delete a key durably, returning the value it held, or zero with errno set if the log failed.
+JudySlot judy_wal_del(JudyWal *wal, uchar *buff, uint max);
+//  judy_wal_checkpoint: rewrite the log as the array's live keys.
+int judy_wal_checkpoint(JudyWal *wal);
+//  judy_wal_error:      return the errno of the first failed log write, or zero.
+int judy_wal_error(JudyWal *wal);
+
+// Tiered arrays: recent writes in memory over a mapped cold file
+
+//  judy_tier_open:  open a tiered array over the cold file at path, creating it if absent.
+JudyTier *judy_tier_open(const char *path, uint max, uint depth, size_t size, uint64_t limit);
+//  judy_tier_close: fold the hot tier into the cold file and close.
+int judy_tier_close(JudyTier *tier);
+//  judy_tier_put:   store a value under a key, returning the previous value.
+JudySlot judy_tier_put(JudyTier *tier, uchar *buff, uint max, JudySlot value);
+//  judy_tier_get:   retrieve the value stored under a key, or zero.
+JudySlot judy_tier_get(JudyTier *tier, uchar *buff, uint max);
+//  judy_tier_del:   delete a key, returning the value it held.
+JudySlot judy_tier_del(JudyTier *tier, uchar *buff, uint max);
+//  judy_tier_scan:  visit the keys >= a given key in order.
+int judy_tier_scan(JudyTier *tier, uchar *buff, uint max, JudyScan visit, void *ctx);
+//  judy_tier_merge: fold the hot tier into a new cold file in the background.
+int judy_tier_merge(JudyTier *tier, int wait);
+
+// Interval maps: disjoint [start, end) ranges of integer keys to values
+
+//  judy_interval_open:   open an empty interval map over keys of depth words.
+JudyInterval *judy_interval_open(uint depth);
+//  judy_interval_close:  close the map, freeing its records.
+void judy_interval_close(JudyInterval *map);
+//  judy_interval_insert: map every key in [lo, hi) to a value, or clear them for zero.
+int judy_interval_insert(JudyInterval *map, judyvalue *lo, judyvalue *hi, JudySlot value);
+//  judy_interval_lookup: retrieve the value of the range holding a key, or zero.
+JudySlot judy_interval_lookup(JudyInterval *map, judyvalue *key, judyvalue *lo, judyvalue *hi);
+//  judy_interval_scan:   visit the ranges meeting [lo, hi) in order.
+int judy_interval_scan(JudyInterval *map, judyvalue *lo, judyvalue *hi, JudyIntervalScan visit, void *ctx);
+
+// Top-k by value under a key prefix, for string keys
+
+//  judy_topk_open:   open an empty array annotating prefixes up to levels bytes.
+JudyTopk *judy_topk_open(uint max, uint levels);
+//  judy_topk_close:  close the array and its annotations.
+void judy_topk_close(JudyTopk *topk);
+//  judy_topk_put:    store a non-zero score under a key, returning the previous score.
+JudySlot judy_topk_put(JudyTopk *topk, uchar *buff, uint max, JudySlot value);
+//  judy_topk_get:    retrieve the score stored under a key, or zero.
+JudySlot judy_topk_get(JudyTopk *topk, uchar *buff, uint max);
+//  judy_topk_del:    delete a key, returning the score it held.
+JudySlot judy_topk_del(JudyTopk *topk, uchar *buff, uint max);
+//  judy_topk_prefix: visit the k keys with the highest scores under a prefix, best first.
+int judy_topk_prefix(JudyTopk *topk, uchar *prefix, uint len, uint k, JudyScan visit, void *ctx);
+
+// Range sums over integer keys
+
+//  judy_sum_open:  open an empty array over keys of depth words.
+JudySum *judy_sum_open(uint depth);
+//  judy_sum_close: close the array and its sums.
+void judy_sum_close(JudySum *map);
+//  judy_sum_add:   add to the value of a key.
+int judy_sum_add(JudySum *map, judyvalue *key, JudySlot delta);
+//  judy_sum_set:   store a value under a key, or delete the key for zero.
+int judy_sum_set(JudySum *map, judyvalue *key, JudySlot value);
+//  judy_sum_get:   retrieve the value of a key, or zero.
+JudySlot judy_sum_get(JudySum *map, judyvalue *key);
+//  judy_sum:       sum the values of the keys in [lo, hi).
+JudySlot judy_sum(JudySum *map, judyvalue *lo, judyvalue *hi);
+//  judy_sum_sample: visit keys drawn at random in proportion to their values.
+int judy_sum_sample(JudySum *map, uint64_t *seed, uint n, JudyScan visit, void *ctx);
+
 #ifdef __cplusplus
 }
 #endif
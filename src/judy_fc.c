@@ -0,0 +1,237 @@
+//  Flat combining front end for a judy array
+
+//  Threads publish their requests in per-thread slots instead
+//  of queueing on a lock.  Whichever thread takes the combiner
+//  role collects every pending request, sorts the batch by key
+//  and applies it in one pass, resuming each insert from the
+//  previous key's descent with judy_cell_after, while the other
+//  threads wait on their own slot for the answer.
+
+//  functions:
+//  judy_fc_open:   open a combining front end for a judy array.
+//  judy_fc_close:  free the front end, leaving the array open.
+//  judy_fc_attach: return a request slot for the calling thread.
+//  judy_fc_detach: release a request slot.
+//  judy_fc_insert: store a value under a key unless present, returning the present value; zero with errno ENOMEM if memory ran out.
+//  judy_fc_update: replace the value under a key if present, returning the old value.
+//  judy_fc_del:    delete a key, returning the value it held.
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <errno.h>
+
+#include "judy64nb.h"
+
+#define JUDY_fc_slots   128
+#define JUDY_fc_line    64
+#define JUDY_fc_spin    64      // polls of the slot before yielding
+
+enum JUDY_fcops {
+    JUDY_fc_idle,               // no request, or request answered
+    JUDY_fc_insert,
+    JUDY_fc_update,
+    JUDY_fc_del
+};
+
+struct JudyFcSlot {
+    JudyFc      *fc;            // front end the slot belongs to
+    uchar       *key;           // caller's key, valid until answered
+    uint        max;            // key length
+    uint        op;             // pending request
+    uint        used;           // slot claimed by a thread
+    int         err;            // errno for the caller, or zero
+    JudySlot    value;          // argument, then result
+} __attribute__((aligned(JUDY_fc_line)));
+
+struct JudyFc {
+    Judy        *judy;          // the combined array
+    uint        lock;           // held by the combiner
+    uint        high;           // slots ever claimed
+    JudyFcSlot  *batch[JUDY_fc_slots];  // combiner's sorted requests
+    JudyFcSlot  slot[JUDY_fc_slots];
+};
+
+//  byte idx of a request key, zero past its end
+
+static uint judy_fc_byte(JudyFc *fc, JudyFcSlot *req, uint idx) {
+    if (fc->judy->depth)
+        return (uint)(((judyvalue *)req->key)[idx / JUDY_key_size] >> (8 * (JUDY_key_size - 1 - idx % JUDY_key_size))) & 0xff;
+
+    return idx < req->max ? req->key[idx] : 0;
+}
+
+//  number of leading key bytes two requests share
+
+static uint judy_fc_common(JudyFc *fc, JudyFcSlot *x, JudyFcSlot *y) {
+    uint len = fc->judy->depth ? fc->judy->depth * JUDY_key_size : (x->max > y->max ? x->max : y->max);
+    uint idx, byte;
+
+    for (idx = 0; idx < len; idx++)
+        if ((byte = judy_fc_byte(fc, x, idx)) != judy_fc_byte(fc, y, idx) || (!byte && !fc->judy->depth))
+            break;
+
+    return idx;
+}
+
+static int judy_fc_cmp(JudyFc *fc, JudyFcSlot *x, JudyFcSlot *y) {
+    uint idx = judy_fc_common(fc, x, y);
+    uint len = fc->judy->depth ? fc->judy->depth * JUDY_key_size : (x->max > y->max ? x->max : y->max);
+
+    if (idx == len)
+        return 0;
+
+    return (int)judy_fc_byte(fc, x, idx) - (int)judy_fc_byte(fc, y, idx);
+}
+
+//  apply every pending request in key order
+
+static void judy_fc_combine(JudyFc *fc) {
+    uint high = __atomic_load_n(&fc->high, __ATOMIC_ACQUIRE);
+    Judy *judy = fc->judy;
+    uint cnt = 0, idx, pos;
+    JudyFcSlot *req, *prev = NULL;
+    JudySlot *cell, old;
+
+    for (idx = 0; idx < high; idx++)
+        if (__atomic_load_n(&fc->slot[idx].op, __ATOMIC_ACQUIRE) != JUDY_fc_idle)
+            fc->batch[cnt++] = fc->slot + idx;
+
+    //  a batch is at most one request per thread, so
+    //  a stable insertion sort keeps duplicates in order
+
+    for (idx = 1; idx < cnt; idx++) {
+        req = fc->batch[idx];
+
+        for (pos = idx; pos && judy_fc_cmp(fc, fc->batch[pos - 1], req) > 0; pos--)
+            fc->batch[pos] = fc->batch[pos - 1];
+
+        fc->batch[pos] = req;
+    }
+
+    for (idx = 0; idx < cnt; idx++) {
+        req = fc->batch[idx];
+
+        switch (req->op) {
+            case JUDY_fc_insert:
+                cell = judy_cell_after(judy, req->key, req->max, prev ? judy_fc_common(fc, prev, req) : 0);
+                prev = req;
+
+                if (!cell)
+                    req->value = 0, req->err = ENOMEM;
+                else if (*cell)
+                    req->value = *cell;
+                else
+                    *cell = req->value, req->value = 0;
+
+                break;
+
+            case JUDY_fc_update:
+                if ((cell = judy_slot_write(judy, req->key, req->max)) && (old = *cell)) {
+                    *cell = req->value;
+                    req->value = old;
+                } else
+                    req->value = 0;
+
+                prev = NULL;
+                break;
+
+            case JUDY_fc_del:
+                if ((cell = judy_slot(judy, req->key, req->max)) && (req->value = *cell))
+                    judy_del(judy);
+
+                prev = NULL;
+                break;
+        }
+    }
+
+    //  answer the batch only once it is applied, since a waiter
+    //  may reuse its key as soon as its slot goes idle, while the
+    //  next insert still compares it against the previous key
+
+    for (idx = 0; idx < cnt; idx++)
+        __atomic_store_n(&fc->batch[idx]->op, JUDY_fc_idle, __ATOMIC_RELEASE);
+}
+
+//  publish a request and wait for it to be answered,
+//  combining the pending batch when the role is free
+
+static JudySlot judy_fc_request(JudyFcSlot *req, uint op, uchar *buff, uint max, JudySlot value) {
+    JudyFc *fc = req->fc;
+    uint spin = 0;
+
+    req->key = buff;
+    req->max = max;
+    req->err = 0;
+    req->value = value;
+    __atomic_store_n(&req->op, op, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&req->op, __ATOMIC_ACQUIRE) != JUDY_fc_idle) {
+        if (!__atomic_load_n(&fc->lock, __ATOMIC_RELAXED) && !__atomic_exchange_n(&fc->lock, 1, __ATOMIC_ACQUIRE)) {
+            judy_fc_combine(fc);
+            __atomic_store_n(&fc->lock, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        if (++spin % JUDY_fc_spin == 0)
+            sched_yield();
+    }
+
+    if (req->err)
+        errno = req->err;
+
+    return req->value;
+}
+
+JudyFc *judy_fc_open(Judy *judy) {
+    JudyFc *fc;
+
+    if (!(fc = aligned_alloc(JUDY_fc_line, sizeof(JudyFc))))
+        return NULL;
+
+    memset(fc, 0, sizeof(JudyFc));
+    fc->judy = judy;
+    return fc;
+}
+
+void judy_fc_close(JudyFc *fc) {
+    free(fc);
+}
+
+JudyFcSlot *judy_fc_attach(JudyFc *fc) {
+    uint idx, high;
+
+    for (idx = 0; idx < JUDY_fc_slots; idx++)
+        if (!__atomic_exchange_n(&fc->slot[idx].used, 1, __ATOMIC_ACQUIRE))
+            break;
+
+    if (idx == JUDY_fc_slots)
+        return NULL;
+
+    fc->slot[idx].fc = fc;
+
+    //  let the combiner scan up to the new slot
+
+    high = __atomic_load_n(&fc->high, __ATOMIC_RELAXED);
+
+    while (high <= idx && !__atomic_compare_exchange_n(&fc->high, &high, idx + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    return fc->slot + idx;
+}
+
+void judy_fc_detach(JudyFcSlot *req) {
+    __atomic_store_n(&req->used, 0, __ATOMIC_RELEASE);
+}
+
+JudySlot judy_fc_insert(JudyFcSlot *req, uchar *buff, uint max, JudySlot value) {
+    return value ? judy_fc_request(req, JUDY_fc_insert, buff, max, value) : 0;
+}
+
+JudySlot judy_fc_update(JudyFcSlot *req, uchar *buff, uint max, JudySlot value) {
+    return value ? judy_fc_request(req, JUDY_fc_update, buff, max, value) : 0;
+}
+
+JudySlot judy_fc_del(JudyFcSlot *req, uchar *buff, uint max) {
+    return judy_fc_request(req, JUDY_fc_del, buff, max, 0);
+}
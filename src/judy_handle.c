@@ -0,0 +1,189 @@
+//  Published judy arrays with epoch reclamation
+
+//  A JudyHandle holds the array readers currently use.  A
+//  writer builds a replacement off to the side and publishes
+//  it; readers that entered before the swap keep using the old
+//  array until they leave, and the publisher closes the old
+//  array once every one of them has.
+
+//  Readers bracket their lookups with judy_handle_enter and
+//  judy_handle_leave, which announce the epoch the reader runs
+//  in: entering costs two loads of the epoch, a store to the
+//  reader's own slot and a load of the current array.  Judy
+//  cursors live in the array header, so each reader is handed
+//  its own read-only view of the array, rebuilt only when the
+//  epoch has moved since its last section.
+
+//  A published array must not be changed while readers can
+//  reach it, and the arrays published through one handle must
+//  share the depth and max of the first.
+
+//  functions:
+//  judy_handle_open:    publish an array to readers through a new handle.
+//  judy_handle_close:   close the handle and its current array.
+//  judy_handle_attach:  return a reader slot for the calling thread.
+//  judy_handle_detach:  release a reader slot.
+//  judy_handle_enter:   start a read section, returning a view of the current array.
+//  judy_handle_leave:   end a read section.
+//  judy_handle_publish: swap in a new array, closing the old one after the grace period.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+
+#include "judy64nb.h"
+
+#define JUDY_handle_readers 128
+#define JUDY_handle_line    64
+
+struct JudyReader {
+    JudyHandle  *handle;        // handle the slot belongs to
+    uint64_t    active;         // epoch of the read section, zero outside one
+    uint64_t    built;          // epoch the view was built in
+    Judy        *view;          // reader's cursor over the array
+    uint        used;           // slot claimed by a thread
+} __attribute__((aligned(JUDY_handle_line)));
+
+struct JudyHandle {
+    Judy        *current;       // array readers enter
+    uint64_t    epoch;          // advanced by each publish
+    uint        lock;           // serialises publishers
+    uint        max;            // stack height of the arrays
+    uint        depth;          // as for judy_open
+    uint        high;           // slots ever claimed
+    JudyReader  reader[JUDY_handle_readers];
+};
+
+//  size of a view header with the arrays' stack
+
+static size_t judy_handle_viewsize(JudyHandle *handle) {
+    return sizeof(Judy) + handle->max * sizeof(JudyStack);
+}
+
+JudyHandle *judy_handle_open(Judy *judy) {
+    JudyHandle *handle;
+
+    if (!(handle = aligned_alloc(JUDY_handle_line, sizeof(JudyHandle))))
+        return NULL;
+
+    memset(handle, 0, sizeof(JudyHandle));
+    handle->current = judy;
+    handle->epoch = 1;
+    handle->max = judy->max;
+    handle->depth = judy->depth;
+    return handle;
+}
+
+//  close the handle once every reader has detached
+
+void judy_handle_close(JudyHandle *handle) {
+    uint idx;
+
+    for (idx = 0; idx < handle->high; idx++)
+        free(handle->reader[idx].view);
+
+    judy_close(handle->current);
+    free(handle);
+}
+
+JudyReader *judy_handle_attach(JudyHandle *handle) {
+    JudyReader *reader;
+    uint idx, high;
+
+    for (idx = 0; idx < JUDY_handle_readers; idx++)
+        if (!__atomic_exchange_n(&handle->reader[idx].used, 1, __ATOMIC_ACQUIRE))
+            break;
+
+    if (idx == JUDY_handle_readers)
+        return NULL;
+
+    reader = handle->reader + idx;
+
+    if (!reader->view && !(reader->view = malloc(judy_handle_viewsize(handle)))) {
+        __atomic_store_n(&reader->used, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    reader->handle = handle;
+    reader->built = 0;
+
+    //  let publishers scan up to the new slot
+
+    high = __atomic_load_n(&handle->high, __ATOMIC_RELAXED);
+
+    while (high <= idx && !__atomic_compare_exchange_n(&handle->high, &high, idx + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        ;
+
+    return reader;
+}
+
+void judy_handle_detach(JudyReader *reader) {
+    __atomic_store_n(&reader->used, 0, __ATOMIC_RELEASE);
+}
+
+//  announce the current epoch, then return the reader's view of
+//  the array it covers.  The view and the array stay valid until
+//  judy_handle_leave.
+
+Judy *judy_handle_enter(JudyReader *reader) {
+    JudyHandle *handle = reader->handle;
+    uint64_t epoch;
+    Judy *judy;
+
+    do {
+        epoch = __atomic_load_n(&handle->epoch, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&reader->active, epoch, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&handle->epoch, __ATOMIC_SEQ_CST) != epoch);
+
+    if (reader->built == epoch)
+        return reader->view;
+
+    //  the epoch moved: copy the header of the array now
+    //  current, without its allocator
+
+    judy = __atomic_load_n(&handle->current, __ATOMIC_ACQUIRE);
+    memcpy(reader->view, judy, sizeof(Judy));
+    reader->view->seg = NULL;
+    reader->view->level = 0;
+    reader->view->track = 0;
+    reader->built = epoch;
+    return reader->view;
+}
+
+void judy_handle_leave(JudyReader *reader) {
+    __atomic_store_n(&reader->active, 0, __ATOMIC_RELEASE);
+}
+
+//  make judy the array readers enter, then wait until every
+//  reader that may still use the old array has left and close
+//  it.  Returns zero, publishing nothing, if judy's depth or
+//  max differs from the handle's arrays.
+
+int judy_handle_publish(JudyHandle *handle, Judy *judy) {
+    uint64_t epoch, active;
+    uint idx, high;
+    Judy *old;
+
+    if (judy->depth != handle->depth || judy->max != handle->max)
+        return 0;
+
+    while (__atomic_exchange_n(&handle->lock, 1, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    old = __atomic_exchange_n(&handle->current, judy, __ATOMIC_SEQ_CST);
+    epoch = __atomic_add_fetch(&handle->epoch, 1, __ATOMIC_SEQ_CST);
+
+    //  readers that entered in the new epoch see the new array
+
+    high = __atomic_load_n(&handle->high, __ATOMIC_SEQ_CST);
+
+    for (idx = 0; idx < high; idx++)
+        while ((active = __atomic_load_n(&handle->reader[idx].active, __ATOMIC_SEQ_CST)) && active != epoch)
+            sched_yield();
+
+    __atomic_store_n(&handle->lock, 0, __ATOMIC_RELEASE);
+
+    judy_close(old);
+    return 1;
+}
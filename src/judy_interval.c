@@ -0,0 +1,268 @@
+//  Interval map: disjoint [start, end) key ranges to values
+
+//  A JudyInterval keeps each range under its start in an integer
+//  judy array of the given depth.  The cell points at a record of
+//  the range's value and end key, carved from the array's own
+//  segments with judy_data and recycled through a free list, so a
+//  range costs one leaf cell and one record.  Ranges never
+//  overlap: judy_floor on a point finds the only range that can
+//  hold it in one descent, and an ordered walk from there visits
+//  the ranges meeting a span.
+
+//  Inserting a range overwrites what it covers, cutting the
+//  ranges it overlaps at its ends, and joins it with neighbours
+//  it touches that hold the same value.  A zero value clears the
+//  range instead.
+
+//  functions:
+//  judy_interval_open:   open an empty interval map over keys of depth words.
+//  judy_interval_close:  close the map, freeing its records.
+//  judy_interval_insert: map every key in [lo, hi) to a value, or clear them for zero.
+//  judy_interval_lookup: retrieve the value of the range holding a key, or zero.
+//  judy_interval_scan:   visit the ranges meeting [lo, hi) in order.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "judy64nb.h"
+
+typedef struct JudyRange {
+    JudySlot    value;          // mapped value, or next free record
+    judyvalue   end[];          // first key past the range
+} JudyRange;
+
+struct JudyInterval {
+    Judy        *judy;          // records under their start keys
+    JudyRange   *spare;         // free records
+    judyvalue   *start;         // start key of the current range
+    uint        depth;          // words in a key
+    uint        size;           // bytes in a key
+};
+
+static int judy_interval_cmp(JudyInterval *map, judyvalue *x, judyvalue *y) {
+    uint idx;
+
+    for (idx = 0; idx < map->depth; idx++)
+        if (x[idx] != y[idx])
+            return x[idx] < y[idx] ? -1 : 1;
+
+    return 0;
+}
+
+static JudyRange *judy_interval_record(JudyInterval *map, judyvalue *end, JudySlot value) {
+    JudyRange *range;
+
+    if ((range = map->spare))
+        map->spare = (JudyRange *)range->value;
+    else if (!(range = judy_data(map->judy, sizeof(JudyRange) + map->size)))
+        return NULL;
+
+    memcpy(range->end, end, map->size);
+    range->value = value;
+    return range;
+}
+
+static void judy_interval_free(JudyInterval *map, JudyRange *range) {
+    range->value = (JudySlot)map->spare;
+    map->spare = range;
+}
+
+//  file a record under a start key
+
+static int judy_interval_file(JudyInterval *map, judyvalue *start, JudyRange *range) {
+    JudySlot *cell;
+
+    if (!(cell = judy_cell(map->judy, (uchar *)start, map->size)))
+        return 0;
+
+    *cell = (JudySlot)range;
+    return 1;
+}
+
+//  the first range starting at or after key.  A key ending in
+//  zeros can land on an empty linear slot, whose cell is zero.
+
+static JudySlot *judy_interval_strt(JudyInterval *map, judyvalue *key) {
+    JudySlot *cell = judy_strt(map->judy, (uchar *)key, map->size);
+
+    while (cell && !*cell)
+        cell = judy_nxt(map->judy);
+
+    return cell;
+}
+
+JudyInterval *judy_interval_open(uint depth) {
+    JudyInterval *map;
+
+    if (!depth || !(map = malloc(sizeof(JudyInterval) + depth * sizeof(judyvalue))))
+        return NULL;
+
+    if (!(map->judy = judy_open(0, depth))) {
+        free(map);
+        return NULL;
+    }
+
+    map->start = (judyvalue *)(map + 1);
+    map->spare = NULL;
+    map->depth = depth;
+    map->size = depth * JUDY_key_size;
+    return map;
+}
+
+void judy_interval_close(JudyInterval *map) {
+    judy_close(map->judy);
+    free(map);
+}
+
+//  returns zero if lo is not below hi or memory ran out, which
+//  can leave the keys of [lo, hi) partly cleared
+
+int judy_interval_insert(JudyInterval *map, judyvalue *lo, judyvalue *hi, JudySlot value) {
+    JudyRange *range, *tail, *left = NULL, *right = NULL;
+    judyvalue *start = map->start;
+    int seek = 0, moved = 0;
+    JudySlot *cell;
+
+    if (judy_interval_cmp(map, lo, hi) >= 0)
+        return 0;
+
+    //  cut the range running into lo, keeping what lies past
+    //  hi as a range of its own.  A range before lo is the left
+    //  neighbour; one starting at lo is dropped below, and the
+    //  neighbour then has to be looked up again.
+
+    if ((cell = judy_floor(map->judy, (uchar *)lo, map->size))) {
+        range = (JudyRange *)*cell;
+        judy_key(map->judy, (uchar *)start, map->size);
+
+        if (judy_interval_cmp(map, start, lo) < 0) {
+            if (judy_interval_cmp(map, range->end, lo) > 0) {
+                if (judy_interval_cmp(map, range->end, hi) > 0) {
+                    if (!(tail = judy_interval_record(map, range->end, range->value)))
+                        return 0;
+                    if (!judy_interval_file(map, hi, tail))
+                        return 0;
+                }
+
+                memcpy(range->end, lo, map->size);
+            }
+
+            left = range;
+        } else
+            seek = 1;
+    }
+
+    //  drop the ranges starting in [lo, hi), moving the start
+    //  of one running past hi up to it.  The loop ends on the
+    //  range starting at hi, if any, the right neighbour.
+
+    while ((cell = judy_interval_strt(map, lo))) {
+        range = (JudyRange *)*cell;
+        judy_key(map->judy, (uchar *)start, map->size);
+
+        if (judy_interval_cmp(map, start, hi) >= 0) {
+            if (!judy_interval_cmp(map, start, hi))
+                right = range;
+            break;
+        }
+
+        judy_del(map->judy);
+
+        if (judy_interval_cmp(map, range->end, hi) > 0) {
+            if (!judy_interval_file(map, hi, range))
+                return 0;
+            right = range;
+            moved = 1;
+            break;
+        }
+
+        judy_interval_free(map, range);
+    }
+
+    if (!value)
+        return 1;
+
+    //  join neighbours that touch the range and hold its value
+
+    if (right && right->value == value) {
+        if (moved)
+            judy_slot(map->judy, (uchar *)hi, map->size);
+        judy_del(map->judy);
+    } else
+        right = NULL;
+
+    if (seek && (cell = judy_floor(map->judy, (uchar *)lo, map->size)))
+        left = (JudyRange *)*cell;
+
+    if (left && (left->value != value || judy_interval_cmp(map, left->end, lo)))
+        left = NULL;
+
+    if (left) {
+        memcpy(left->end, right ? right->end : hi, map->size);
+        if (right)
+            judy_interval_free(map, right);
+        return 1;
+    }
+
+    if (right)
+        return judy_interval_file(map, lo, right);
+
+    if (!(range = judy_interval_record(map, hi, value)))
+        return 0;
+
+    return judy_interval_file(map, lo, range);
+}
+
+//  the range holding key, its bounds copied to lo and hi
+//  unless NULL
+
+JudySlot judy_interval_lookup(JudyInterval *map, judyvalue *key, judyvalue *lo, judyvalue *hi) {
+    JudyRange *range;
+    JudySlot *cell;
+
+    if (!(cell = judy_floor(map->judy, (uchar *)key, map->size)))
+        return 0;
+
+    range = (JudyRange *)*cell;
+
+    if (judy_interval_cmp(map, range->end, key) <= 0)
+        return 0;
+
+    if (lo)
+        judy_key(map->judy, (uchar *)lo, map->size);
+    if (hi)
+        memcpy(hi, range->end, map->size);
+
+    return range->value;
+}
+
+//  visit the ranges meeting [lo, hi), lowest first, until the
+//  visitor returns non-zero, which is returned.  The visitor
+//  must not change the map.
+
+int judy_interval_scan(JudyInterval *map, judyvalue *lo, judyvalue *hi, JudyIntervalScan visit, void *ctx) {
+    judyvalue *start = map->start;
+    JudyRange *range;
+    JudySlot *cell;
+    int stop;
+
+    //  the range running into lo, if any, comes first
+
+    cell = judy_floor(map->judy, (uchar *)lo, map->size);
+
+    if (!cell || judy_interval_cmp(map, ((JudyRange *)*cell)->end, lo) <= 0)
+        cell = judy_interval_strt(map, lo);
+
+    for (; cell; cell = judy_nxt(map->judy)) {
+        range = (JudyRange *)*cell;
+        judy_key(map->judy, (uchar *)start, map->size);
+
+        if (judy_interval_cmp(map, start, hi) >= 0)
+            break;
+
+        if ((stop = visit(ctx, start, range->end, range->value)))
+            return stop;
+    }
+
+    return 0;
+}
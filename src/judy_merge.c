@@ -0,0 +1,234 @@
+//  Merge cursor over several judy arrays
+
+//  Presents the keys of N arrays of the same kind as one
+//  ordered sequence.  Each input keeps its own stack cursor
+//  and is advanced with judy_nxt; a loser tree over the
+//  inputs' current keys picks the smallest one, so each step
+//  costs one judy_nxt, one judy_key and log2(N) compares.
+//  All buffers are sized at open time; stepping and seeking
+//  never allocate.
+
+//  Equal keys present in several inputs are all returned,
+//  in the order of the inputs given to judy_merge_open.
+
+//  functions:
+//  judy_merge_open:  open a merge cursor over an array of judy objects.
+//  judy_merge_close: free a merge cursor, leaving the inputs open.
+//  judy_merge_strt:  position every input at its first key >= given key.
+//  judy_merge_nxt:   advance to the next key in merged order.
+//  judy_merge_key:   retrieve the key of the current merged entry.
+//  judy_merge_src:   retrieve the input index of the current merged entry.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "judy64nb.h"
+
+struct JudyMerge {
+    Judy        **judy;         // input arrays
+    JudySlot    **cell;         // current cell of each input, NULL when exhausted
+    uint        *len;           // length of each input's current key
+    uint        *tree;          // loser tree, tree[0] holds the winner
+    uchar       *keys;          // current key of each input, max bytes apiece
+    uint        cnt;            // number of inputs
+    uint        max;            // key buffer size
+};
+
+//  current key buffer of input idx
+
+static uchar *judy_mergebuf(JudyMerge *merge, uint idx) {
+    return merge->keys + (size_t)idx * merge->max;
+}
+
+//  does input x order before input y?
+//  exhausted inputs order after everything
+
+static int judy_mergeless(JudyMerge *merge, uint x, uint y) {
+    uint lx = merge->len[x], ly = merge->len[y];
+    judyvalue *p, *q;
+    uint idx;
+    int cmp;
+
+    if (!merge->cell[x])
+        return 0;
+
+    if (!merge->cell[y])
+        return 1;
+
+    if (merge->judy[x]->depth) {
+        p = (judyvalue *)judy_mergebuf(merge, x);
+        q = (judyvalue *)judy_mergebuf(merge, y);
+
+        for (idx = 0; idx < merge->judy[x]->depth; idx++)
+            if (p[idx] != q[idx])
+                return p[idx] < q[idx];
+
+        return x < y;
+    }
+
+    cmp = memcmp(judy_mergebuf(merge, x), judy_mergebuf(merge, y), lx < ly ? lx : ly);
+
+    if (cmp)
+        return cmp < 0;
+
+    if (lx != ly)
+        return lx < ly;
+
+    return x < y;
+}
+
+//  capture the key under input idx's new cell
+
+static void judy_mergeload(JudyMerge *merge, uint idx, JudySlot *cell) {
+    merge->cell[idx] = cell;
+
+    if (cell)
+        merge->len[idx] = judy_key(merge->judy[idx], judy_mergebuf(merge, idx), merge->max);
+}
+
+//  play the subtree rooted at node, leaving its loser
+//  in the node and returning its winner
+
+static uint judy_mergebuild(JudyMerge *merge, uint node) {
+    uint x, y;
+
+    if (node >= merge->cnt)
+        return node - merge->cnt;
+
+    x = judy_mergebuild(merge, 2 * node);
+    y = judy_mergebuild(merge, 2 * node + 1);
+
+    if (judy_mergeless(merge, y, x)) {
+        merge->tree[node] = x;
+        return y;
+    }
+
+    merge->tree[node] = y;
+    return x;
+}
+
+//  replay the matches on the path from input idx's leaf
+
+static void judy_mergereplay(JudyMerge *merge, uint idx) {
+    uint node = (idx + merge->cnt) / 2, swap;
+
+    while (node) {
+        if (judy_mergeless(merge, merge->tree[node], idx)) {
+            swap = merge->tree[node];
+            merge->tree[node] = idx;
+            idx = swap;
+        }
+
+        node /= 2;
+    }
+
+    merge->tree[0] = idx;
+}
+
+//  open a merge cursor over cnt arrays of the same depth,
+//  with key buffers of max bytes
+
+JudyMerge *judy_merge_open(Judy **judy, uint cnt, uint max) {
+    JudyMerge *merge;
+    uint idx;
+
+    if (!cnt)
+        return NULL;
+
+    for (idx = 1; idx < cnt; idx++)
+        if (judy[idx]->depth != judy[0]->depth)
+            return NULL;
+
+    if (judy[0]->depth)
+        max = judy[0]->depth * JUDY_key_size;
+
+    if (!(merge = calloc(1, sizeof(JudyMerge))))
+        return NULL;
+
+    merge->cnt = cnt;
+    merge->max = max;
+    merge->judy = malloc(cnt * sizeof(Judy *));
+    merge->cell = calloc(cnt, sizeof(JudySlot *));
+    merge->len = calloc(cnt, sizeof(uint));
+    merge->tree = calloc(cnt, sizeof(uint));
+    merge->keys = calloc(cnt, max);
+
+    if (!merge->judy || !merge->cell || !merge->len || !merge->tree || !merge->keys) {
+        judy_merge_close(merge);
+        return NULL;
+    }
+
+    memcpy(merge->judy, judy, cnt * sizeof(Judy *));
+    return merge;
+}
+
+void judy_merge_close(JudyMerge *merge) {
+    free(merge->judy);
+    free(merge->cell);
+    free(merge->len);
+    free(merge->tree);
+    free(merge->keys);
+    free(merge);
+}
+
+//  position every input at its first key greater than
+//  or equal to the given key, and return the smallest.
+//  as with judy_strt, a zero max starts from the beginning
+
+JudySlot *judy_merge_strt(JudyMerge *merge, uchar *buff, uint max) {
+    JudySlot *cell;
+    uint idx;
+
+    for (idx = 0; idx < merge->cnt; idx++) {
+        cell = judy_strt(merge->judy[idx], buff, max);
+
+        //  judy_slot reports an empty cell for a string
+        //  ending exactly on a node boundary; pass over it
+
+        if (cell && !*cell)
+            cell = judy_nxt(merge->judy[idx]);
+
+        judy_mergeload(merge, idx, cell);
+    }
+
+    merge->tree[0] = judy_mergebuild(merge, 1);
+    return merge->cell[merge->tree[0]];
+}
+
+//  advance the current input and return the new smallest
+
+JudySlot *judy_merge_nxt(JudyMerge *merge) {
+    uint idx = merge->tree[0];
+
+    if (!merge->cell[idx])
+        return NULL;
+
+    judy_mergeload(merge, idx, judy_nxt(merge->judy[idx]));
+    judy_mergereplay(merge, idx);
+    return merge->cell[merge->tree[0]];
+}
+
+//  copy the current key into buff, returning its length
+
+uint judy_merge_key(JudyMerge *merge, uchar *buff, uint max) {
+    uint idx = merge->tree[0], len;
+
+    if (!merge->cell[idx])
+        return 0;
+
+    len = merge->len[idx];
+
+    if (len > max)
+        len = max;
+
+    memcpy(buff, judy_mergebuf(merge, idx), len);
+
+    if (!merge->judy[idx]->depth && len < max)
+        buff[len] = 0;
+
+    return len;
+}
+
+uint judy_merge_src(JudyMerge *merge) {
+    return merge->tree[0];
+}
@@ -0,0 +1,185 @@
+//  Sharded judy arrays for concurrent writers
+
+//  A JudySharded splits the key space into a fixed number of
+//  judy arrays, each guarded by its own mutex.  Keys are routed
+//  by their first byte, scaled onto the shard count, so every
+//  shard holds one contiguous key range and walking the shards
+//  in turn visits keys in global order.
+
+//  Cells move when judy nodes are promoted or split, so the
+//  operations here copy values in and out under the shard lock
+//  rather than handing back cell pointers.
+
+//  functions:
+//  judy_sharded_open:  open a sharded array with the given number of shards.
+//  judy_sharded_close: close a sharded array, freeing all memory.
+//  judy_sharded_put:   store a non-zero value under a key, returning the previous value.
+//  judy_sharded_get:   retrieve the value stored under a key, or zero.
+//  judy_sharded_del:   delete a key, returning the value it held.
+//  judy_sharded_scan:  visit the keys >= a given key in order.
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "judy64nb.h"
+
+//  shards are padded to a cache line so that
+//  neighbouring locks are not falsely shared
+
+#define JUDY_shard_align 64
+#define JUDY_shard_max 256
+
+typedef struct {
+    pthread_mutex_t lock;       // guards judy
+    Judy        *judy;          // keys routed to this shard
+} __attribute__((aligned(JUDY_shard_align))) JudyShard;
+
+struct JudySharded {
+    JudyShard   *shard;         // cache aligned shard array
+    uint        cnt;            // number of shards
+    uint        max;            // max string key length
+    uint        depth;          // as for judy_open
+};
+
+//  route a key to its shard by its first byte
+
+static JudyShard *judy_shardof(JudySharded *sharded, uchar *buff, uint max) {
+    uint byte;
+
+    if (sharded->depth)
+        byte = (uint)(*(judyvalue *)buff >> (8 * (JUDY_key_size - 1))) & 0xff;
+    else
+        byte = max ? buff[0] : 0;
+
+    return sharded->shard + byte * sharded->cnt / JUDY_shard_max;
+}
+
+//  open a sharded array of cnt shards, up to 256,
+//  with judy_open's max and depth for every shard
+
+JudySharded *judy_sharded_open(uint cnt, uint max, uint depth) {
+    JudySharded *sharded;
+    uint idx;
+
+    if (!cnt || cnt > JUDY_shard_max)
+        return NULL;
+
+    if (!(sharded = calloc(1, sizeof(JudySharded))))
+        return NULL;
+
+    sharded->shard = aligned_alloc(JUDY_shard_align, cnt * sizeof(JudyShard));
+
+    if (!sharded->shard) {
+        free(sharded);
+        return NULL;
+    }
+
+    sharded->cnt = cnt;
+    sharded->max = max;
+    sharded->depth = depth;
+
+    for (idx = 0; idx < cnt; idx++) {
+        pthread_mutex_init(&sharded->shard[idx].lock, NULL);
+
+        if (!(sharded->shard[idx].judy = judy_open(max, depth))) {
+            sharded->cnt = idx + 1;
+            judy_sharded_close(sharded);
+            return NULL;
+        }
+    }
+
+    return sharded;
+}
+
+void judy_sharded_close(JudySharded *sharded) {
+    uint idx;
+
+    for (idx = 0; idx < sharded->cnt; idx++) {
+        if (sharded->shard[idx].judy)
+            judy_close(sharded->shard[idx].judy);
+
+        pthread_mutex_destroy(&sharded->shard[idx].lock);
+    }
+
+    free(sharded->shard);
+    free(sharded);
+}
+
+//  store value under the key, returning the value it replaced
+
+JudySlot judy_sharded_put(JudySharded *sharded, uchar *buff, uint max, JudySlot value) {
+    JudyShard *shard = judy_shardof(sharded, buff, max);
+    JudySlot *cell, prev = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    if ((cell = judy_cell(shard->judy, buff, max))) {
+        prev = *cell;
+        *cell = value;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return prev;
+}
+
+JudySlot judy_sharded_get(JudySharded *sharded, uchar *buff, uint max) {
+    JudyShard *shard = judy_shardof(sharded, buff, max);
+    JudySlot *cell, value = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    if ((cell = judy_slot(shard->judy, buff, max)))
+        value = *cell;
+
+    pthread_mutex_unlock(&shard->lock);
+    return value;
+}
+
+JudySlot judy_sharded_del(JudySharded *sharded, uchar *buff, uint max) {
+    JudyShard *shard = judy_shardof(sharded, buff, max);
+    JudySlot *cell, value = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    if ((cell = judy_slot(shard->judy, buff, max)) && (value = *cell))
+        judy_del(shard->judy);
+
+    pthread_mutex_unlock(&shard->lock);
+    return value;
+}
+
+//  call visit for each key >= the given key in order, until it
+//  returns non-zero.  each shard is locked while it is visited,
+//  so the scan is consistent per shard but not across shards.
+//  a zero max starts from the beginning.  visit must not call
+//  back into the sharded array.  returns visit's stopping value.
+
+int judy_sharded_scan(JudySharded *sharded, uchar *buff, uint max, JudyScan visit, void *ctx) {
+    uint size = sharded->depth ? sharded->depth * JUDY_key_size : sharded->max + 1;
+    JudyShard *shard = max ? judy_shardof(sharded, buff, max) : sharded->shard;
+    JudySlot *cell;
+    uchar *key;
+    uint len;
+    int ret = 0;
+
+    if (!(key = malloc(size)))
+        return -1;
+
+    for (; !ret && shard < sharded->shard + sharded->cnt; shard++, max = 0) {
+        pthread_mutex_lock(&shard->lock);
+
+        for (cell = judy_strt(shard->judy, buff, max); !ret && cell; cell = judy_nxt(shard->judy)) {
+            if (!*cell)
+                continue;
+
+            len = judy_key(shard->judy, key, size);
+            ret = visit(ctx, key, len, *cell);
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    free(key);
+    return ret;
+}
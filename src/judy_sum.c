@@ -0,0 +1,295 @@
+//  Range sums over integer keys
+
+//  A JudySum keeps integer keys and their values in an ordinary
+//  array, and beside it one array per prefix length short of a
+//  whole key, mapping each n-byte prefix of a stored key, padded
+//  with zero bytes, to the sum of the values under it.  Every
+//  update adds its change in value to the key's prefixes, so the
+//  sum of the keys below any key is the sum, at each byte, of
+//  the siblings before it: at most half a node's children, as
+//  the later ones are taken off the parent's sum instead.  A
+//  range sum is the difference of two of those.
+
+//  Sums wrap modulo the width of a JudySlot, so the values can
+//  be treated as signed.  A linear node takes a zero cell for an
+//  empty slot, so a key or prefix whose sum reaches zero is
+//  deleted, and a missing prefix sums to zero.  That also drops
+//  the prefixes left without keys under them.
+
+//  With positive values the sums also weigh the children of
+//  every prefix, so a draw descends once, taking each child in
+//  proportion to its sum.  Unit values make the array a count of
+//  its keys, and the draws uniform over them.
+
+//  functions:
+//  judy_sum_open:  open an empty array over keys of depth words.
+//  judy_sum_close: close the array and its sums.
+//  judy_sum_add:   add to the value of a key.
+//  judy_sum_set:   store a value under a key, or delete the key for zero.
+//  judy_sum_get:   retrieve the value of a key, or zero.
+//  judy_sum:       sum the values of the keys in [lo, hi).
+//  judy_sum_sample: visit keys drawn at random in proportion to their values.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "judy64nb.h"
+
+struct JudySum {
+    Judy        *judy;          // keys and their values
+    Judy        **level;        // level[n - 1]: sum under each prefix of n bytes
+    JudySlot    total;          // sum of every value
+    judyvalue   *prefix;        // prefix being looked up
+    judyvalue   *key;           // key found
+    uint        depth;          // words in a key
+    uint        size;           // bytes in a key
+};
+
+//  word idx of key cut to its first len bytes
+
+static judyvalue judy_sum_word(judyvalue *key, uint idx, uint len) {
+    if ((idx + 1) * JUDY_key_size <= len)
+        return key[idx];
+
+    if (idx * JUDY_key_size >= len)
+        return 0;
+
+    return key[idx] & ~(~(judyvalue)0 >> 8 * (len - idx * JUDY_key_size));
+}
+
+static void judy_sum_mask(JudySum *map, judyvalue *key, uint len, judyvalue *prefix) {
+    uint idx;
+
+    for (idx = 0; idx < map->depth; idx++)
+        prefix[idx] = judy_sum_word(key, idx, len);
+}
+
+static int judy_sum_same(JudySum *map, judyvalue *x, judyvalue *y, uint len) {
+    uint idx;
+
+    for (idx = 0; idx < map->depth; idx++)
+        if (judy_sum_word(x, idx, len) != judy_sum_word(y, idx, len))
+            return 0;
+
+    return 1;
+}
+
+static uint judy_sum_shift(uint off) {
+    return 8 * (JUDY_key_size - 1 - off % JUDY_key_size);
+}
+
+static uint judy_sum_byte(judyvalue *key, uint off) {
+    return (key[off / JUDY_key_size] >> judy_sum_shift(off)) & 0xFF;
+}
+
+//  the sums under prefixes of len bytes
+
+static Judy *judy_sum_level(JudySum *map, uint len) {
+    return len < map->size ? map->level[len - 1] : map->judy;
+}
+
+JudySum *judy_sum_open(uint depth) {
+    JudySum *map;
+    uint idx;
+
+    if (!depth || !(map = calloc(1, sizeof(JudySum) + 2 * depth * sizeof(judyvalue))))
+        return NULL;
+
+    map->prefix = (judyvalue *)(map + 1);
+    map->key = map->prefix + depth;
+    map->depth = depth;
+    map->size = depth * JUDY_key_size;
+
+    if (!(map->level = calloc(map->size - 1, sizeof(Judy *))) || !(map->judy = judy_open(0, depth))) {
+        judy_sum_close(map);
+        return NULL;
+    }
+
+    for (idx = 0; idx < map->size - 1; idx++)
+        if (!(map->level[idx] = judy_open(0, depth))) {
+            judy_sum_close(map);
+            return NULL;
+        }
+
+    return map;
+}
+
+void judy_sum_close(JudySum *map) {
+    uint idx;
+
+    if (map->level)
+        for (idx = 0; idx < map->size - 1; idx++)
+            if (map->level[idx])
+                judy_close(map->level[idx]);
+
+    if (map->judy)
+        judy_close(map->judy);
+
+    free(map->level);
+    free(map);
+}
+
+JudySlot judy_sum_get(JudySum *map, judyvalue *key) {
+    JudySlot *cell;
+
+    if ((cell = judy_slot(map->judy, (uchar *)key, map->size)))
+        return *cell;
+
+    return 0;
+}
+
+//  returns zero if memory ran out, which can leave the key and
+//  its prefixes only partly updated
+
+int judy_sum_add(JudySum *map, judyvalue *key, JudySlot delta) {
+    judyvalue *prefix = map->prefix;
+    JudySlot *cell;
+    Judy *judy;
+    uint len;
+
+    if (!delta)
+        return 1;
+
+    for (len = 1; len <= map->size; len++) {
+        judy = judy_sum_level(map, len);
+        judy_sum_mask(map, key, len, prefix);
+
+        if (!(cell = judy_cell(judy, (uchar *)prefix, map->size)))
+            return 0;
+
+        if (!(*cell += delta)) {
+            judy_slot(judy, (uchar *)prefix, map->size);
+            judy_del(judy);
+        }
+    }
+
+    map->total += delta;
+    return 1;
+}
+
+int judy_sum_set(JudySum *map, judyvalue *key, JudySlot value) {
+    return judy_sum_add(map, key, value - judy_sum_get(map, key));
+}
+
+//  sum the children of key's first len bytes whose next byte is
+//  below key's, or for upper at or above it, setting child to
+//  the sum of the child holding key, or NULL if it sums to zero
+
+static JudySlot judy_sum_side(JudySum *map, judyvalue *key, uint len, int upper, JudySlot **child) {
+    Judy *judy = judy_sum_level(map, len + 1);
+    uint byte, next = judy_sum_byte(key, len);
+    JudySlot *cell, sum = 0;
+
+    judy_sum_mask(map, key, len, map->prefix);
+
+    if (upper)
+        map->prefix[len / JUDY_key_size] |= (judyvalue)next << judy_sum_shift(len);
+
+    *child = NULL;
+
+    for (cell = judy_strt(judy, (uchar *)map->prefix, map->size); cell; cell = judy_nxt(judy)) {
+        judy_key(judy, (uchar *)map->key, map->size);
+
+        if (!judy_sum_same(map, map->key, key, len))
+            break;
+
+        //  judy_strt can land on an empty slot in place of a
+        //  missing child, whose zero cell adds nothing
+
+        if ((byte = judy_sum_byte(map->key, len)) == next)
+            *child = cell;
+        else if (!upper && byte > next)
+            break;
+
+        if (upper || byte < next)
+            sum += *cell;
+    }
+
+    return sum;
+}
+
+//  the sum of the keys below key
+
+static JudySlot judy_sum_below(JudySum *map, judyvalue *key) {
+    JudySlot total = map->total, sum = 0, *child;
+    uint len;
+
+    for (len = 0; len < map->size; len++) {
+        if (judy_sum_byte(key, len) < 128)
+            sum += judy_sum_side(map, key, len, 0, &child);
+        else
+            sum += total - judy_sum_side(map, key, len, 1, &child);
+
+        total = child ? *child : 0;
+    }
+
+    return sum;
+}
+
+JudySlot judy_sum(JudySum *map, judyvalue *lo, judyvalue *hi) {
+    uint idx;
+
+    for (idx = 0; idx < map->depth; idx++)
+        if (lo[idx] != hi[idx])
+            break;
+
+    if (idx == map->depth || lo[idx] > hi[idx])
+        return 0;
+
+    return judy_sum_below(map, hi) - judy_sum_below(map, lo);
+}
+
+//  the generator judy_sample uses: splitmix64
+
+static uint64_t judy_sum_rand(uint64_t *seed) {
+    uint64_t z = (*seed += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+//  visit n keys drawn with replacement, each with the chance of
+//  its share of the total, until the visitor returns non-zero.
+//  The values must all be positive.  Returns the number of keys
+//  visited.
+
+int judy_sum_sample(JudySum *map, uint64_t *seed, uint n, JudyScan visit, void *ctx) {
+    judyvalue *prefix = map->prefix;
+    JudySlot *cell = NULL, pick;
+    uint idx, len;
+    Judy *judy;
+
+    for (idx = 0; idx < n && map->total; idx++) {
+        pick = judy_sum_rand(seed) % map->total;
+        memset(prefix, 0, map->size);
+
+        //  take the child whose sum holds pick, less the sums
+        //  of the children before it
+
+        for (len = 0; len < map->size; len++) {
+            judy = judy_sum_level(map, len + 1);
+
+            for (cell = judy_strt(judy, (uchar *)prefix, map->size); cell; cell = judy_nxt(judy))
+                if (pick < *cell)
+                    break;
+                else
+                    pick -= *cell;
+
+            if (!cell)
+                return idx;
+
+            judy_key(judy, (uchar *)map->key, map->size);
+
+            if (!judy_sum_same(map, map->key, prefix, len))
+                return idx;
+
+            judy_sum_mask(map, map->key, len + 1, prefix);
+        }
+
+        if (visit(ctx, (uchar *)prefix, map->size, *cell))
+            return idx + 1;
+    }
+
+    return idx;
+}
@@ -0,0 +1,537 @@
+//  Tiered judy array: an in-memory hot tier over a mapped cold file
+
+//  A JudyTier keeps recent writes in an ordinary array, the hot
+//  tier, over the bulk of the keys in a file-backed array that is
+//  never changed once written, the cold tier, which readers map
+//  read-only with judy_shared_open so that only the pages queries
+//  touch take memory.  Lookups try the hot tier first; deletes of
+//  keys the lower tiers hold are recorded in the hot tier as
+//  tombstones.  Ordered scans merge the tiers with a judy_merge
+//  cursor, the newest tier's entry for a key hiding the others.
+
+//  Once the hot tier holds limit keys it is frozen and a new one
+//  started, and a thread folds the frozen tier into a new cold
+//  file, written beside the old one and renamed over it.  Until
+//  the fold is swapped in, lookups go hot, frozen, then cold.
+//  The fold reads the frozen and cold arrays through cursors of
+//  its own, since nothing writes to either, and takes the lock
+//  only to swap.  The hot tier is memory only: keys written since
+//  the last fold are lost in a crash, so put a judy_wal in front
+//  where that matters.
+
+//  functions:
+//  judy_tier_open:  open a tiered array over the cold file at path, creating it if absent.
+//  judy_tier_close: fold the hot tier into the cold file and close.
+//  judy_tier_put:   store a value under a key, returning the previous value.
+//  judy_tier_get:   retrieve the value stored under a key, or zero.
+//  judy_tier_del:   delete a key, returning the value it held.
+//  judy_tier_scan:  visit the keys >= a given key in order.
+//  judy_tier_merge: fold the hot tier into a new cold file in the background.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "judy64nb.h"
+
+#define JUDY_tier_tomb  (~(JudySlot)0)  // hot value of a deleted key
+
+struct JudyTier {
+    pthread_mutex_t lock;       // guards everything below
+    pthread_cond_t folded;      // a fold finished
+    pthread_t   thread;         // the running fold
+    Judy        *hot;           // recent writes and tombstones
+    Judy        *frozen;        // hot tier being folded, or NULL
+    JudyShared  *shared;        // the cold file's mapping
+    Judy        *cold;          // view of the cold array
+    Judy        *cursor[2];     // the fold's cursors over frozen and cold
+    char        *path;          // cold file
+    size_t      size;           // bytes of a new cold file
+    uint64_t    count;          // keys in the hot tier
+    uint64_t    limit;          // hot keys that start a fold
+    uint        max;            // as for judy_open
+    uint        depth;
+    uint        folding;        // a fold is running
+    uint        joinable;       // thread is yet to be joined
+    int         error;          // errno of the last failed fold
+};
+
+//  a private cursor over an array nothing writes to
+
+static Judy *judy_tier_cursor(Judy *judy) {
+    size_t amt = sizeof(Judy) + judy->max * sizeof(JudyStack);
+    Judy *cursor;
+
+    if ((cursor = malloc(amt))) {
+        memcpy(cursor, judy, amt);
+        cursor->seg = NULL;
+        cursor->level = 0;
+        cursor->track = 0;
+    }
+
+    return cursor;
+}
+
+//  map the cold file read-only.  Its address may be taken, as by
+//  the allocations of other threads: reopening it with
+//  judy_open_heap moves it, after which the map is tried again.
+
+static int judy_tier_map(JudyTier *tier) {
+    uint tries;
+    Judy *judy;
+
+    for (tries = 0; !(tier->shared = judy_shared_open(tier->path)); tries++) {
+        if (tries == 4 || !(judy = judy_open_heap(tier->path, 0, 0, 0)))
+            return 0;
+
+        judy_close(judy);
+    }
+
+    tier->cold = judy_shared_enter(tier->shared);
+    return 1;
+}
+
+//  value the lower tiers give a key, zero if none
+
+static JudySlot judy_tier_lower(JudyTier *tier, uchar *buff, uint max) {
+    JudySlot *cell;
+
+    if (tier->frozen && (cell = judy_slot(tier->frozen, buff, max)) && *cell)
+        return *cell == JUDY_tier_tomb ? 0 : *cell;
+
+    if ((cell = judy_slot(tier->cold, buff, max)))
+        return *cell;
+
+    return 0;
+}
+
+//  write the frozen tier and the cold array, newest first, as
+//  the array of a new file at tmp
+
+static int judy_tier_write(JudyTier *tier, Judy *frozen, Judy *cold, char *tmp) {
+    uint size = tier->depth ? tier->depth * JUDY_key_size : tier->max + 1;
+    uint len, prev = 0, have = 0;
+    Judy *inputs[2], *judy;
+    uchar *key, *last;
+    JudySlot *cell, value;
+    JudyMerge *merge;
+    int err = 0;
+
+    unlink(tmp);
+
+    if (!(judy = judy_open_heap(tmp, tier->max, tier->depth, tier->size)))
+        return errno ? errno : EIO;
+
+    inputs[0] = frozen;
+    inputs[1] = cold;
+
+    if (!(key = malloc(2 * size)) || !(merge = judy_merge_open(inputs, 2, size))) {
+        free(key);
+        judy_close(judy);
+        return ENOMEM;
+    }
+
+    last = key + size;
+
+    for (cell = judy_merge_strt(merge, NULL, 0); cell; cell = judy_merge_nxt(merge)) {
+        if (!*cell)
+            continue;
+
+        len = judy_merge_key(merge, key, size);
+
+        //  the frozen tier's entry for a key comes first
+
+        if (have && len == prev && !memcmp(key, last, len))
+            continue;
+
+        memcpy(last, key, len);
+        prev = len, have = 1;
+
+        if ((value = *cell) == JUDY_tier_tomb)
+            continue;
+
+        if (!(cell = judy_cell(judy, key, len))) {
+            err = ENOSPC;
+            break;
+        }
+
+        *cell = value;
+    }
+
+    judy_merge_close(merge);
+    free(key);
+    judy_close(judy);
+    return err;
+}
+
+//  move the frozen tier's keys the hot tier lacks back into it,
+//  after a failed fold.  Returns non-zero, keeping the frozen
+//  tier, if memory runs out.
+
+static int judy_tier_unfreeze(JudyTier *tier) {
+    uint size = tier->depth ? tier->depth * JUDY_key_size : tier->max + 1;
+    JudySlot *cell, *hot;
+    uchar *key;
+    uint len;
+
+    if (!(key = malloc(size)))
+        return 1;
+
+    for (cell = judy_strt(tier->frozen, NULL, 0); cell; cell = judy_nxt(tier->frozen)) {
+        if (!*cell)
+            continue;
+
+        len = judy_key(tier->frozen, key, size);
+
+        if (!(hot = judy_cell(tier->hot, key, len))) {
+            free(key);
+            return 1;
+        }
+
+        if (!*hot)
+            *hot = *cell, tier->count++;
+    }
+
+    free(key);
+    judy_close(tier->frozen);
+    tier->frozen = NULL;
+    return 0;
+}
+
+//  fold thread: write the new cold file, rename it over the old
+//  one and swap it in
+
+static void *judy_tier_fold(void *arg) {
+    JudyTier *tier = arg;
+    Judy *frozen = tier->cursor[0], *cold = tier->cursor[1];
+    JudyShared *shared;
+    char *tmp;
+    int err;
+
+    if (!(tmp = malloc(strlen(tier->path) + 5)))
+        err = ENOMEM;
+    else {
+        strcpy(tmp, tier->path);
+        strcat(tmp, ".new");
+
+        if (!(err = judy_tier_write(tier, frozen, cold, tmp)) && rename(tmp, tier->path))
+            err = errno;
+
+        if (err)
+            unlink(tmp);
+    }
+
+    free(frozen);
+    free(cold);
+    free(tmp);
+
+    pthread_mutex_lock(&tier->lock);
+    shared = tier->shared;
+
+    //  on failure the frozen tier goes back under the hot one,
+    //  whose entries are newer, to be folded again
+
+    if (!err && !judy_tier_map(tier)) {
+        err = errno ? errno : EIO;
+        tier->shared = shared;
+        tier->cold = judy_shared_enter(shared);
+    } else if (!err) {
+        judy_shared_close(shared);
+        judy_close(tier->frozen);
+        tier->frozen = NULL;
+    }
+
+    if (err && judy_tier_unfreeze(tier))
+        err = ENOMEM;
+
+    tier->error = err;
+    tier->folding = 0;
+    pthread_cond_broadcast(&tier->folded);
+    pthread_mutex_unlock(&tier->lock);
+    return NULL;
+}
+
+//  freeze the hot tier and start folding it, with the lock held,
+//  which the fold's cursors are copied under.  Returns an errno,
+//  EBUSY while a fold is running.
+
+static int judy_tier_start(JudyTier *tier) {
+    Judy *hot;
+    int err;
+
+    if (tier->folding)
+        return EBUSY;
+
+    if (tier->joinable)
+        pthread_join(tier->thread, NULL), tier->joinable = 0;
+
+    if (tier->frozen && judy_tier_unfreeze(tier))
+        return ENOMEM;
+
+    if (!(tier->cursor[0] = judy_tier_cursor(tier->hot)) || !(tier->cursor[1] = judy_tier_cursor(tier->cold))) {
+        free(tier->cursor[0]);
+        return ENOMEM;
+    }
+
+    if (!(hot = judy_open(tier->max, tier->depth))) {
+        free(tier->cursor[0]);
+        free(tier->cursor[1]);
+        return ENOMEM;
+    }
+
+    tier->frozen = tier->hot;
+    tier->hot = hot;
+    tier->count = 0;
+    tier->folding = 1;
+
+    if ((err = pthread_create(&tier->thread, NULL, judy_tier_fold, tier))) {
+        free(tier->cursor[0]);
+        free(tier->cursor[1]);
+        tier->folding = 0;
+        judy_tier_unfreeze(tier);
+        return err;
+    }
+
+    tier->joinable = 1;
+    return 0;
+}
+
+//  open a tiered array over the cold file at path, creating an
+//  empty one if absent, with judy_open's max and depth.  New cold
+//  files are made size bytes long, which must hold every key, and
+//  a fold starts whenever the hot tier reaches limit keys, never
+//  if zero.  Returns NULL with errno set on failure, EINVAL if the
+//  file holds an array of another max or depth.
+
+JudyTier *judy_tier_open(const char *path, uint max, uint depth, size_t size, uint64_t limit) {
+    JudyTier *tier;
+    Judy *judy;
+    int err;
+
+    if (!(tier = calloc(1, sizeof(JudyTier))))
+        return NULL;
+
+    pthread_mutex_init(&tier->lock, NULL);
+    pthread_cond_init(&tier->folded, NULL);
+    tier->max = max;
+    tier->depth = depth;
+    tier->size = size;
+    tier->limit = limit;
+
+    if (!(tier->path = strdup(path)))
+        goto fail;
+
+    if (access(path, F_OK)) {
+        if (!(judy = judy_open_heap(path, max, depth, size)))
+            goto fail;
+
+        judy_close(judy);
+    }
+
+    if (!judy_tier_map(tier))
+        goto fail;
+
+    if (tier->cold->depth != depth || tier->cold->max != (depth ? JUDY_key_size * depth : max + 1)) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    if ((tier->hot = judy_open(max, depth)))
+        return tier;
+
+fail:
+    err = errno ? errno : EIO;
+
+    if (tier->shared)
+        judy_shared_close(tier->shared);
+
+    pthread_mutex_destroy(&tier->lock);
+    pthread_cond_destroy(&tier->folded);
+    free(tier->path);
+    free(tier);
+    errno = err;
+    return NULL;
+}
+
+//  fold the hot tier into the cold file, waiting for it, and
+//  close.  Returns zero with errno set if the fold failed, when
+//  the keys written since the last fold are lost.
+
+int judy_tier_close(JudyTier *tier) {
+    int ok = judy_tier_merge(tier, 1), err = errno;
+
+    if (tier->joinable)
+        pthread_join(tier->thread, NULL);
+
+    if (tier->frozen)
+        judy_close(tier->frozen);
+
+    judy_close(tier->hot);
+    judy_shared_close(tier->shared);
+    pthread_mutex_destroy(&tier->lock);
+    pthread_cond_destroy(&tier->folded);
+    free(tier->path);
+    free(tier);
+    errno = err;
+    return ok;
+}
+
+//  store value under the key, returning the value the tiers held.
+//  Values must be non-zero and not all ones, which marks a delete.
+
+JudySlot judy_tier_put(JudyTier *tier, uchar *buff, uint max, JudySlot value) {
+    JudySlot *cell, prev = 0;
+
+    if (!value || value == JUDY_tier_tomb)
+        return 0;
+
+    pthread_mutex_lock(&tier->lock);
+
+    if ((cell = judy_cell(tier->hot, buff, max))) {
+        if (!(prev = *cell))
+            tier->count++, prev = judy_tier_lower(tier, buff, max);
+        else if (prev == JUDY_tier_tomb)
+            prev = 0;
+
+        *cell = value;
+
+        if (tier->limit && tier->count >= tier->limit && !tier->folding)
+            judy_tier_start(tier);
+    }
+
+    pthread_mutex_unlock(&tier->lock);
+    return prev;
+}
+
+JudySlot judy_tier_get(JudyTier *tier, uchar *buff, uint max) {
+    JudySlot *cell, value;
+
+    pthread_mutex_lock(&tier->lock);
+
+    if ((cell = judy_slot(tier->hot, buff, max)) && *cell)
+        value = *cell == JUDY_tier_tomb ? 0 : *cell;
+    else
+        value = judy_tier_lower(tier, buff, max);
+
+    pthread_mutex_unlock(&tier->lock);
+    return value;
+}
+
+//  delete the key, returning the value it held.  A tombstone is
+//  left only when a lower tier holds the key.
+
+JudySlot judy_tier_del(JudyTier *tier, uchar *buff, uint max) {
+    JudySlot *cell, value = 0, lower;
+
+    pthread_mutex_lock(&tier->lock);
+    lower = judy_tier_lower(tier, buff, max);
+
+    if ((cell = judy_slot(tier->hot, buff, max)) && *cell) {
+        value = *cell == JUDY_tier_tomb ? 0 : *cell;
+
+        if (lower)
+            *cell = JUDY_tier_tomb;
+        else
+            judy_del(tier->hot), tier->count--;
+    } else if ((value = lower) && (cell = judy_cell(tier->hot, buff, max))) {
+        *cell = JUDY_tier_tomb;
+        tier->count++;
+    } else
+        value = 0;
+
+    pthread_mutex_unlock(&tier->lock);
+    return value;
+}
+
+//  call visit for each key >= the given key in order, with the
+//  value of the newest tier holding it, until visit returns
+//  non-zero.  The tiers are locked for the scan, so visit must
+//  not call back into the array.  A zero max starts from the
+//  beginning.  Returns visit's stopping value, or -1 if memory
+//  runs out.
+
+int judy_tier_scan(JudyTier *tier, uchar *buff, uint max, JudyScan visit, void *ctx) {
+    uint size = tier->depth ? tier->depth * JUDY_key_size : tier->max + 1;
+    uint len, prev = 0, have = 0, cnt = 0;
+    Judy *inputs[3];
+    JudyMerge *merge;
+    uchar *key, *last;
+    JudySlot *cell;
+    int ret = 0;
+
+    if (!(key = malloc(2 * size)))
+        return -1;
+
+    last = key + size;
+    pthread_mutex_lock(&tier->lock);
+    inputs[cnt++] = tier->hot;
+
+    if (tier->frozen)
+        inputs[cnt++] = tier->frozen;
+
+    inputs[cnt++] = tier->cold;
+
+    if (!(merge = judy_merge_open(inputs, cnt, size))) {
+        pthread_mutex_unlock(&tier->lock);
+        free(key);
+        return -1;
+    }
+
+    for (cell = judy_merge_strt(merge, buff, max); !ret && cell; cell = judy_merge_nxt(merge)) {
+        if (!*cell)
+            continue;
+
+        len = judy_merge_key(merge, key, size);
+
+        //  the newest tier's entry for a key comes first
+
+        if (have && len == prev && !memcmp(key, last, len))
+            continue;
+
+        memcpy(last, key, len);
+        prev = len, have = 1;
+
+        if (*cell != JUDY_tier_tomb)
+            ret = visit(ctx, key, len, *cell);
+    }
+
+    judy_merge_close(merge);
+    pthread_mutex_unlock(&tier->lock);
+    free(key);
+    return ret;
+}
+
+//  start folding the hot tier into a new cold file, and with wait
+//  set wait for the fold, and any already running, to finish.
+//  Returns zero with errno set if the fold could not be started,
+//  or with wait set failed; EBUSY without wait if one is running.
+
+int judy_tier_merge(JudyTier *tier, int wait) {
+    int err = 0;
+
+    pthread_mutex_lock(&tier->lock);
+
+    if (wait)
+        while (tier->folding)
+            pthread_cond_wait(&tier->folded, &tier->lock);
+
+    if (tier->count || tier->frozen)
+        err = judy_tier_start(tier);
+
+    if (wait && !err) {
+        while (tier->folding)
+            pthread_cond_wait(&tier->folded, &tier->lock);
+
+        err = tier->error;
+    }
+
+    pthread_mutex_unlock(&tier->lock);
+    errno = err;
+    return !err;
+}
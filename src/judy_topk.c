@@ -0,0 +1,423 @@
+//  Top-k by value under a key prefix
+
+//  A JudyTopk keeps string keys and their scores in an ordinary
+//  array, and beside it one array per prefix length up to levels
+//  bytes, mapping each prefix of a stored key to a bound on the
+//  scores of the keys under it.  judy_topk_prefix searches best
+//  first: it expands the prefix with the highest bound into its
+//  own key and its children one byte longer, scans the keys
+//  under prefixes of levels bytes outright, and stops once no
+//  bound left can enter the k best scores found.
+
+//  The bounds are raised as scores are stored but not lowered
+//  when keys are deleted or their scores drop: a stale bound
+//  only costs the search an expansion, and each expansion sets
+//  the bound of the prefix it expands to the highest of its
+//  children's, so bounds tighten as prefixes are searched.
+
+//  functions:
+//  judy_topk_open:   open an empty array annotating prefixes up to levels bytes.
+//  judy_topk_close:  close the array and its annotations.
+//  judy_topk_put:    store a non-zero score under a key, returning the previous score.
+//  judy_topk_get:    retrieve the score stored under a key, or zero.
+//  judy_topk_del:    delete a key, returning the score it held.
+//  judy_topk_prefix: visit the k keys with the highest scores under a prefix, best first.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "judy64nb.h"
+
+struct JudyTopk {
+    Judy        *judy;          // keys and their scores
+    Judy        **level;        // level[n - 1]: bound under each prefix of n bytes
+    JudySlot    top;            // bound on every score
+    uint        levels;         // longest prefix annotated
+    uint        max;            // longest key
+};
+
+//  a prefix waiting to be expanded, its bytes at key in the
+//  search's prefix pool
+
+typedef struct {
+    JudySlot    bound;
+    uint        len;
+    uint        key;
+} JudyTopkItem;
+
+//  a key found, its bytes at key in the result pool
+
+typedef struct {
+    JudySlot    value;
+    uint        len;
+    uint        key;
+} JudyTopkHit;
+
+typedef struct {
+    JudyTopk    *topk;
+    JudyTopkItem *item;         // max-heap of prefixes on bound
+    uchar       *pool;          // bytes of the prefixes pushed
+    uint        cnt, alloc, used;  // prefixes queued, room for, ever pushed
+    JudyTopkHit *hit;           // min-heap of the best keys on value
+    uchar       *keys;          // bytes of the keys in hit
+    uchar       *buff;          // key buffer
+    uchar       *path;          // prefix being expanded, out of the pool
+    uint        found, k;
+    int         error;
+} JudyTopkSearch;
+
+JudyTopk *judy_topk_open(uint max, uint levels) {
+    JudyTopk *topk;
+    uint idx;
+
+    if (!levels || levels > max || !(topk = calloc(1, sizeof(JudyTopk))))
+        return NULL;
+
+    topk->levels = levels;
+    topk->max = max;
+
+    if (!(topk->level = calloc(levels, sizeof(Judy *))) || !(topk->judy = judy_open(max, 0))) {
+        judy_topk_close(topk);
+        return NULL;
+    }
+
+    for (idx = 0; idx < levels; idx++)
+        if (!(topk->level[idx] = judy_open(idx + 1, 0))) {
+            judy_topk_close(topk);
+            return NULL;
+        }
+
+    return topk;
+}
+
+void judy_topk_close(JudyTopk *topk) {
+    uint idx;
+
+    if (topk->level)
+        for (idx = 0; idx < topk->levels; idx++)
+            if (topk->level[idx])
+                judy_close(topk->level[idx]);
+
+    if (topk->judy)
+        judy_close(topk->judy);
+
+    free(topk->level);
+    free(topk);
+}
+
+//  a value of zero deletes the key
+
+JudySlot judy_topk_put(JudyTopk *topk, uchar *buff, uint max, JudySlot value) {
+    JudySlot *cell, prev;
+    uint idx;
+
+    if (!value)
+        return judy_topk_del(topk, buff, max);
+
+    if (!max || max > topk->max || !(cell = judy_cell(topk->judy, buff, max)))
+        return 0;
+
+    prev = *cell;
+    *cell = value;
+
+    //  raise the bounds of the key's prefixes
+
+    if (topk->top < value)
+        topk->top = value;
+
+    for (idx = 0; idx < topk->levels && idx < max; idx++)
+        if ((cell = judy_cell(topk->level[idx], buff, idx + 1)) && *cell < value)
+            *cell = value;
+
+    return prev;
+}
+
+JudySlot judy_topk_get(JudyTopk *topk, uchar *buff, uint max) {
+    JudySlot *cell;
+
+    if ((cell = judy_slot(topk->judy, buff, max)))
+        return *cell;
+
+    return 0;
+}
+
+JudySlot judy_topk_del(JudyTopk *topk, uchar *buff, uint max) {
+    JudySlot *cell, prev;
+
+    if (!(cell = judy_slot(topk->judy, buff, max)))
+        return 0;
+
+    prev = *cell;
+    judy_del(topk->judy);
+    return prev;
+}
+
+//  the lowest score that can still enter the results
+
+static JudySlot judy_topk_floor(JudyTopkSearch *search) {
+    return search->found < search->k ? 0 : search->hit[0].value;
+}
+
+static void judy_topk_sift(JudyTopkSearch *search, uint idx) {
+    JudyTopkHit *hit = search->hit, swap;
+    uint child;
+
+    while ((child = 2 * idx + 1) < search->found) {
+        if (child + 1 < search->found && hit[child + 1].value < hit[child].value)
+            child++;
+        if (hit[idx].value <= hit[child].value)
+            break;
+        swap = hit[idx], hit[idx] = hit[child], hit[child] = swap;
+        idx = child;
+    }
+}
+
+//  offer a key to the results
+
+static void judy_topk_offer(JudyTopkSearch *search, uchar *key, uint len, JudySlot value) {
+    JudyTopkHit *hit = search->hit, swap;
+    uint idx, up;
+
+    if (!value || value <= judy_topk_floor(search))
+        return;
+
+    if (search->found < search->k) {
+        idx = search->found++;
+        hit[idx].key = idx * search->topk->max;
+    } else
+        idx = 0;
+
+    hit[idx].value = value;
+    hit[idx].len = len;
+    memcpy(search->keys + hit[idx].key, key, len);
+
+    if (!idx && search->found == search->k) {
+        judy_topk_sift(search, 0);
+        return;
+    }
+
+    while (idx && hit[up = (idx - 1) / 2].value > hit[idx].value) {
+        swap = hit[idx], hit[idx] = hit[up], hit[up] = swap;
+        idx = up;
+    }
+}
+
+//  queue a prefix to expand
+
+static void judy_topk_push(JudyTopkSearch *search, uchar *key, uint len, JudySlot bound) {
+    JudyTopkItem *item, swap;
+    uint idx, up;
+    void *grow;
+
+    //  pool bytes are not reused, so used bounds cnt
+
+    if (search->used == search->alloc) {
+        if (!(grow = realloc(search->item, 2 * search->alloc * sizeof(JudyTopkItem)))) {
+            search->error = 1;
+            return;
+        }
+        search->item = grow;
+
+        if (!(grow = realloc(search->pool, 2 * search->alloc * (size_t)search->topk->levels))) {
+            search->error = 1;
+            return;
+        }
+        search->pool = grow;
+        search->alloc *= 2;
+    }
+
+    item = search->item;
+    idx = search->cnt++;
+    item[idx].bound = bound;
+    item[idx].len = len;
+    item[idx].key = search->used++ * search->topk->levels;
+    memcpy(search->pool + item[idx].key, key, len);
+
+    while (idx && item[up = (idx - 1) / 2].bound < item[idx].bound) {
+        swap = item[idx], item[idx] = item[up], item[up] = swap;
+        idx = up;
+    }
+}
+
+static JudyTopkItem judy_topk_pop(JudyTopkSearch *search) {
+    JudyTopkItem *item = search->item, top = item[0], swap;
+    uint idx = 0, child;
+
+    item[0] = item[--search->cnt];
+
+    while ((child = 2 * idx + 1) < search->cnt) {
+        if (child + 1 < search->cnt && item[child + 1].bound > item[child].bound)
+            child++;
+        if (item[idx].bound >= item[child].bound)
+            break;
+        swap = item[idx], item[idx] = item[child], item[child] = swap;
+        idx = child;
+    }
+
+    return top;
+}
+
+//  offer every key under a prefix, returning their highest score
+
+static JudySlot judy_topk_scan(JudyTopkSearch *search, uchar *prefix, uint len) {
+    Judy *judy = search->topk->judy;
+    JudySlot *cell, most = 0;
+    uint size;
+
+    for (cell = judy_strt(judy, prefix, len); cell; cell = judy_nxt(judy)) {
+        size = judy_key(judy, search->buff, search->topk->max + 1);
+
+        if (size < len || memcmp(search->buff, prefix, len))
+            break;
+
+        if (most < *cell)
+            most = *cell;
+
+        judy_topk_offer(search, search->buff, size, *cell);
+    }
+
+    return most;
+}
+
+//  offer the key equal to a prefix and queue its children,
+//  returning the highest score or bound among them
+
+static JudySlot judy_topk_expand(JudyTopkSearch *search, uchar *prefix, uint len) {
+    Judy *level = search->topk->level[len];
+    JudySlot *cell, most = 0;
+    uint size;
+
+    if (len && (cell = judy_slot(search->topk->judy, prefix, len)) && *cell) {
+        judy_topk_offer(search, prefix, len, *cell);
+        most = *cell;
+    }
+
+    for (cell = judy_strt(level, prefix, len); cell; cell = judy_nxt(level)) {
+        size = judy_key(level, search->buff, len + 2);
+
+        if (size != len + 1 || memcmp(search->buff, prefix, len))
+            break;
+
+        if (!*cell)
+            continue;
+
+        if (most < *cell)
+            most = *cell;
+
+        if (*cell > judy_topk_floor(search))
+            judy_topk_push(search, search->buff, size, *cell);
+    }
+
+    return most;
+}
+
+//  lower the bound of a prefix to what its expansion found
+
+static void judy_topk_tighten(JudyTopk *topk, uchar *prefix, uint len, JudySlot bound, JudySlot most) {
+    JudySlot *cell;
+
+    if (most >= bound)
+        return;
+
+    if (!len) {
+        topk->top = most;
+        return;
+    }
+
+    if ((cell = judy_slot(topk->level[len - 1], prefix, len))) {
+        if (most)
+            *cell = most;
+        else
+            judy_del(topk->level[len - 1]);
+    }
+}
+
+//  visit the k keys under the prefix with the highest scores,
+//  highest first, until the visitor returns non-zero.  Returns
+//  the number of keys found, or -1 if memory ran out.
+
+int judy_topk_prefix(JudyTopk *topk, uchar *prefix, uint len, uint k, JudyScan visit, void *ctx) {
+    JudyTopkSearch search[1];
+    JudySlot bound, *cell, most;
+    JudyTopkItem item;
+    JudyTopkHit hit;
+    uchar *key;
+    int found;
+    uint idx;
+
+    memset(search, 0, sizeof(search));
+    search->topk = topk;
+    search->k = k;
+    search->alloc = 64;
+
+    if (!k || len > topk->max)
+        return 0;
+
+    search->item = malloc(search->alloc * sizeof(JudyTopkItem));
+    search->pool = malloc(search->alloc * (size_t)topk->levels);
+    search->hit = malloc(k * sizeof(JudyTopkHit));
+    search->keys = malloc((size_t)k * topk->max);
+    search->buff = malloc(topk->max + 1);
+    search->path = malloc(topk->levels);
+
+    if (!search->item || !search->pool || !search->hit || !search->keys || !search->buff || !search->path)
+        search->error = 1;
+
+    //  prefixes longer than the annotations are scanned outright
+
+    if (search->error)
+        ;
+    else if (len >= topk->levels)
+        judy_topk_scan(search, prefix, len);
+    else {
+        bound = topk->top;
+
+        if (len)
+            bound = (cell = judy_slot(topk->level[len - 1], prefix, len)) ? *cell : 0;
+
+        if (bound)
+            judy_topk_push(search, prefix, len, bound);
+
+        while (search->cnt && !search->error) {
+            item = judy_topk_pop(search);
+
+            if (item.bound <= judy_topk_floor(search))
+                break;
+
+            //  pushes may move the pool
+
+            key = memcpy(search->path, search->pool + item.key, item.len);
+
+            if (item.len < topk->levels)
+                most = judy_topk_expand(search, key, item.len);
+            else
+                most = judy_topk_scan(search, key, item.len);
+
+            judy_topk_tighten(topk, key, item.len, item.bound, most);
+        }
+    }
+
+    //  hand out the results best first
+
+    found = search->error ? -1 : (int)search->found;
+
+    for (idx = search->found; !search->error && idx--; ) {
+        hit = search->hit[0];
+        search->hit[0] = search->hit[idx];
+        search->found = idx;
+        judy_topk_sift(search, 0);
+        search->hit[idx] = hit;
+    }
+
+    for (idx = 0; found > 0 && idx < (uint)found; idx++)
+        if (visit(ctx, search->keys + search->hit[idx].key, search->hit[idx].len, search->hit[idx].value))
+            break;
+
+    free(search->item);
+    free(search->pool);
+    free(search->hit);
+    free(search->keys);
+    free(search->buff);
+    free(search->path);
+    return found;
+}
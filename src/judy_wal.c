@@ -0,0 +1,648 @@
+//  Write-ahead log for a judy array
+
+//  A JudyWal puts a log file in front of an in-memory array.
+//  Every put and delete is applied to the array and appended to
+//  the log as a compact binary record, and the call returns once
+//  the record is on disk.  Opening the log replays it into the
+//  array, so an index can be restarted from its log instead of
+//  being rebuilt from the store it indexes.
+
+//  Commits are grouped: the first caller to find no flush under
+//  way becomes the flusher.  It waits up to the log's latency
+//  bound for other callers to append their records, stopping
+//  early once every caller inside the log is waiting on the
+//  batch.  It then writes and syncs the whole batch while the
+//  next batch collects, and wakes every caller the sync
+//  covered.  A latency of zero syncs at once, still grouping
+//  whatever arrived during the previous sync.
+
+//  judy_wal_checkpoint rewrites the log as one put per live key
+//  and swaps it in by rename, which bounds both the log and the
+//  replay time.  Values are logged as they are, so they must
+//  mean the same thing after a restart: counters and offsets,
+//  not pointers.
+
+//  The log file starts with a header naming the array's depth
+//  and max.  A record is a 32 bit check of the rest, the
+//  operation, the key length and key, and for a put the value,
+//  the length and value written as base 128 varints.  Replay
+//  stops at the first record that is cut short or fails its
+//  check, and cuts the log there.
+
+//  functions:
+//  judy_wal_open:       open or create a log, replaying it into an array.
+//  judy_wal_close:      sync and close the log, leaving the array open.
+//  judy_wal_put:        store a non-zero value under a key durably, returning the previous value, or zero with errno set if the log failed.
+//  judy_wal_get:        retrieve the value stored under a key, or zero.
+//  judy_wal_del:        delete a key durably, returning the value it held, or zero with errno set if the log failed.
+//  judy_wal_checkpoint: rewrite the log as the array's live keys.
+//  judy_wal_error:      return the errno of the first failed log write, or zero.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "judy64nb.h"
+
+#define JUDY_wal_magic  0x4c41574aU     // "JWAL"
+#define JUDY_wal_batch  (1 << 20)       // bytes that end a flusher's wait early
+#define JUDY_wal_record 32              // record bytes besides the key
+
+enum JUDY_walops {
+    JUDY_wal_put = 1,
+    JUDY_wal_del
+};
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    depth;          // as for judy_open
+    uint32_t    max;            // array's max, the string key length bound
+} JudyWalHeader;
+
+struct JudyWal {
+    Judy        *judy;          // the logged array
+    char        *path;          // log file
+    int         fd;
+    int         error;          // errno of the first failed write
+    uint        latency;        // microseconds a flusher waits for company
+    uint        flushing;       // a caller is writing a batch
+    uint        callers;        // callers inside put and del
+    pthread_mutex_t lock;       // guards the array and everything below
+    pthread_cond_t synced;      // a batch reached the disk
+    pthread_cond_t full;        // the open batch is worth flushing
+    uchar       *buff;          // records not yet written
+    size_t      fill, size;
+    uchar       *spare;         // buffer being written by the flusher
+    size_t      sparesize;
+    uint64_t    appended;       // records appended
+    uint64_t    durable;        // records synced
+    uint64_t    lost;           // first record whose write failed, or zero
+};
+
+//  FNV-1a over a record
+
+static uint32_t judy_wal_check(uchar *buff, size_t len) {
+    uint32_t hash = 2166136261U;
+
+    while (len--)
+        hash = (hash ^ *buff++) * 16777619U;
+
+    return hash;
+}
+
+static uchar *judy_wal_varint(uchar *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (uchar)(value | 0x80);
+        value >>= 7;
+    }
+
+    *out++ = (uchar)value;
+    return out;
+}
+
+//  decode a varint from buff, returning the bytes used or
+//  zero when it runs past end
+
+static size_t judy_wal_unvarint(uchar *buff, uchar *end, uint64_t *value) {
+    uint shift = 0;
+    size_t len = 0;
+
+    for (*value = 0; buff + len < end && shift < 64; shift += 7) {
+        *value |= (uint64_t)(buff[len] & 0x7f) << shift;
+
+        if (!(buff[len++] & 0x80))
+            return len;
+    }
+
+    return 0;
+}
+
+//  key length as the array stores it
+
+static uint judy_wal_keylen(Judy *judy, uint max) {
+    return judy->depth ? judy->depth * JUDY_key_size : max;
+}
+
+static int judy_wal_write(int fd, uchar *buff, size_t len) {
+    ssize_t done;
+
+    while (len) {
+        if ((done = write(fd, buff, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+
+        buff += done;
+        len -= done;
+    }
+
+    return 0;
+}
+
+//  sync the directory holding path, making a create or rename durable
+
+static int judy_wal_syncdir(char *path) {
+    char *dir = strdup(path), *slash;
+    int fd, err = 0;
+
+    if (!dir)
+        return ENOMEM;
+
+    if ((slash = strrchr(dir, '/')))
+        slash[slash == dir] = 0;
+    else
+        strcpy(dir, ".");
+
+    if ((fd = open(dir, O_RDONLY)) < 0 || fsync(fd))
+        err = errno;
+
+    if (fd >= 0)
+        close(fd);
+
+    free(dir);
+    return err;
+}
+
+//  true when a waiting flusher should stop waiting: the batch
+//  is large, or holds a record from every caller in the log
+
+static int judy_wal_ready(JudyWal *wal) {
+    return wal->fill >= JUDY_wal_batch || wal->appended - wal->durable >= wal->callers;
+}
+
+//  append a record to the open batch, returning its sequence
+//  number or zero if memory ran out
+
+static uint64_t judy_wal_append(JudyWal *wal, uint op, uchar *key, uint len, JudySlot value) {
+    size_t need = wal->fill + len + JUDY_wal_record, size;
+    uint32_t check;
+    uchar *rec, *out;
+
+    if (need > wal->size) {
+        for (size = wal->size ? wal->size : 4096; size < need; size *= 2)
+            ;
+
+        if (!(out = realloc(wal->buff, size)))
+            return 0;
+
+        wal->buff = out;
+        wal->size = size;
+    }
+
+    rec = wal->buff + wal->fill;
+    out = rec + 4;
+    *out++ = (uchar)op;
+    out = judy_wal_varint(out, len);
+    memcpy(out, key, len);
+    out += len;
+
+    if (op == JUDY_wal_put)
+        out = judy_wal_varint(out, value);
+
+    check = judy_wal_check(rec + 4, out - rec - 4);
+    memcpy(rec, &check, 4);
+    wal->fill = out - wal->buff;
+
+    wal->appended++;
+
+    if (judy_wal_ready(wal))
+        pthread_cond_signal(&wal->full);
+
+    return wal->appended;
+}
+
+//  with the lock held, return once record seq is synced,
+//  flushing batches while no other caller is.  After a failed
+//  write, batches are dropped and the error kept for
+//  judy_wal_error.  Returns zero if seq did not reach the disk.
+
+static int judy_wal_commit(JudyWal *wal, uint64_t seq) {
+    struct timespec deadline;
+    size_t fill, size;
+    uint64_t upto;
+    uchar *buff;
+    int err = 0;
+
+    while (wal->durable < seq) {
+        if (wal->flushing) {
+            pthread_cond_wait(&wal->synced, &wal->lock);
+            continue;
+        }
+
+        wal->flushing = 1;
+
+        if (wal->latency && !judy_wal_ready(wal)) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)(wal->latency % 1000000) * 1000;
+            deadline.tv_sec += wal->latency / 1000000 + deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+
+            while (!judy_wal_ready(wal))
+                if (pthread_cond_timedwait(&wal->full, &wal->lock, &deadline))
+                    break;
+        }
+
+        //  take the batch, leaving the spare buffer to collect the next
+
+        buff = wal->buff;
+        fill = wal->fill;
+        size = wal->size;
+        upto = wal->appended;
+        wal->buff = wal->spare;
+        wal->size = wal->sparesize;
+        wal->fill = 0;
+
+        if (!wal->error) {
+            pthread_mutex_unlock(&wal->lock);
+
+            if (!(err = judy_wal_write(wal->fd, buff, fill)) && fdatasync(wal->fd))
+                err = errno;
+
+            pthread_mutex_lock(&wal->lock);
+        }
+
+        wal->spare = buff;
+        wal->sparesize = size;
+
+        if (err && !wal->error) {
+            wal->error = err;
+            wal->lost = wal->durable + 1;
+        }
+
+        wal->durable = upto;
+        wal->flushing = 0;
+        pthread_cond_broadcast(&wal->synced);
+    }
+
+    return !wal->lost || seq < wal->lost;
+}
+
+//  with the lock held, sync every record appended so far and
+//  wait out any flusher, leaving the batch empty
+
+static void judy_wal_drain(JudyWal *wal) {
+    while (wal->flushing || wal->durable < wal->appended)
+        if (wal->flushing)
+            pthread_cond_wait(&wal->synced, &wal->lock);
+        else
+            judy_wal_commit(wal, wal->appended);
+}
+
+//  apply the records in buff to the array, returning the
+//  length of the valid prefix
+
+static size_t judy_wal_replay(JudyWal *wal, uchar *buff, size_t len) {
+    uchar *rec = buff, *pos, *key, *end = buff + len;
+    uint64_t keylen, value;
+    JudySlot *cell;
+    uint32_t check;
+    size_t used;
+    uint op;
+
+    while (end - rec > 5) {
+        pos = rec + 4;
+        op = *pos++;
+
+        if (op != JUDY_wal_put && op != JUDY_wal_del)
+            break;
+
+        if (!(used = judy_wal_unvarint(pos, end, &keylen)) || keylen > (uint64_t)(end - pos - used))
+            break;
+
+        key = pos + used;
+        pos = key + keylen;
+        value = 0;
+
+        if (op == JUDY_wal_put) {
+            if (!(used = judy_wal_unvarint(pos, end, &value)))
+                break;
+            pos += used;
+        }
+
+        memcpy(&check, rec, 4);
+
+        if (check != judy_wal_check(rec + 4, pos - rec - 4) || keylen != judy_wal_keylen(wal->judy, (uint)keylen))
+            break;
+
+        if (op == JUDY_wal_put) {
+            if (!(cell = judy_cell(wal->judy, key, (uint)keylen)))
+                break;
+            *cell = (JudySlot)value;
+        } else if ((cell = judy_slot(wal->judy, key, (uint)keylen)) && *cell)
+            judy_del(wal->judy);
+
+        rec = pos;
+    }
+
+    return rec - buff;
+}
+
+static void judy_wal_free(JudyWal *wal) {
+    if (wal->fd >= 0)
+        close(wal->fd);
+
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->synced);
+    pthread_cond_destroy(&wal->full);
+    free(wal->buff);
+    free(wal->spare);
+    free(wal->path);
+    free(wal);
+}
+
+static void judy_wal_header(Judy *judy, JudyWalHeader *header) {
+    memset(header, 0, sizeof(JudyWalHeader));
+    header->magic = JUDY_wal_magic;
+    header->version = 1;
+    header->depth = judy->depth;
+    header->max = judy->max;
+}
+
+//  open the log at path, creating it if absent, and replay it
+//  into judy, which should be empty.  latency is the longest a
+//  flusher waits for other callers, in microseconds.  Returns
+//  NULL with errno set on failure, EINVAL if the log belongs to
+//  an array of another depth or max.
+
+JudyWal *judy_wal_open(Judy *judy, const char *path, uint latency) {
+    JudyWalHeader header, want;
+    uchar *buff = NULL;
+    struct stat st;
+    ssize_t got;
+    JudyWal *wal;
+    size_t valid;
+    int err = 0;
+
+    if (!(wal = calloc(1, sizeof(JudyWal))))
+        return NULL;
+
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->synced, NULL);
+    pthread_cond_init(&wal->full, NULL);
+    wal->judy = judy;
+    wal->latency = latency;
+    wal->fd = -1;
+    judy_wal_header(judy, &want);
+
+    if (!(wal->path = strdup(path)) || (wal->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(wal->fd, &st)) {
+        err = errno;
+        goto fail;
+    }
+
+    //  a new log gets its header
+
+    if (st.st_size < (off_t)sizeof(header)) {
+        if (ftruncate(wal->fd, 0) || fsync(wal->fd)) {
+            err = errno;
+            goto fail;
+        }
+
+        if ((err = judy_wal_write(wal->fd, (uchar *)&want, sizeof(want))))
+            goto fail;
+
+        if (fsync(wal->fd)) {
+            err = errno;
+            goto fail;
+        }
+
+        if ((err = judy_wal_syncdir(wal->path)))
+            goto fail;
+
+        return wal;
+    }
+
+    if (!(buff = malloc(st.st_size))) {
+        err = ENOMEM;
+        goto fail;
+    }
+
+    for (valid = 0; valid < (size_t)st.st_size; valid += got)
+        if ((got = read(wal->fd, buff + valid, st.st_size - valid)) <= 0) {
+            if (got < 0 && errno == EINTR)
+                got = 0;
+            else {
+                err = got ? errno : EIO;
+                goto fail;
+            }
+        }
+
+    memcpy(&header, buff, sizeof(header));
+
+    if (memcmp(&header, &want, sizeof(header))) {
+        err = EINVAL;
+        goto fail;
+    }
+
+    valid = sizeof(header) + judy_wal_replay(wal, buff + sizeof(header), st.st_size - sizeof(header));
+
+    //  cut a torn tail so later records follow the last good one
+
+    if (valid < (size_t)st.st_size && (ftruncate(wal->fd, valid) || fsync(wal->fd))) {
+        err = errno;
+        goto fail;
+    }
+
+    if (lseek(wal->fd, valid, SEEK_SET) < 0) {
+        err = errno;
+        goto fail;
+    }
+
+    free(buff);
+    return wal;
+
+fail:
+    free(buff);
+    judy_wal_free(wal);
+    errno = err;
+    return NULL;
+}
+
+//  sync any records still buffered and close the log
+
+void judy_wal_close(JudyWal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    judy_wal_drain(wal);
+    pthread_mutex_unlock(&wal->lock);
+    judy_wal_free(wal);
+}
+
+//  store value under the key, returning the value it replaced
+//  once the change is on disk.  Other callers may see the new
+//  value while it is being synced.  Returns zero with errno set
+//  if the change did not reach the log, so a caller telling that
+//  from a new key clears errno first.  A change whose write
+//  failed stays in the array.
+
+JudySlot judy_wal_put(JudyWal *wal, uchar *buff, uint max, JudySlot value) {
+    uint len = judy_wal_keylen(wal->judy, max);
+    JudySlot *cell, prev = 0;
+    uint64_t seq = 0;
+    int err = 0;
+
+    pthread_mutex_lock(&wal->lock);
+    wal->callers++;
+
+    if ((cell = judy_cell(wal->judy, buff, max)) && (seq = judy_wal_append(wal, JUDY_wal_put, buff, len, value))) {
+        prev = *cell;
+        *cell = value;
+    } else
+        err = ENOMEM;
+
+    if (!judy_wal_commit(wal, seq))
+        err = wal->error, prev = 0;
+
+    wal->callers--;
+    pthread_mutex_unlock(&wal->lock);
+
+    if (err)
+        errno = err;
+
+    return prev;
+}
+
+JudySlot judy_wal_get(JudyWal *wal, uchar *buff, uint max) {
+    JudySlot *cell, value = 0;
+
+    pthread_mutex_lock(&wal->lock);
+
+    if ((cell = judy_slot(wal->judy, buff, max)))
+        value = *cell;
+
+    pthread_mutex_unlock(&wal->lock);
+    return value;
+}
+
+JudySlot judy_wal_del(JudyWal *wal, uchar *buff, uint max) {
+    uint len = judy_wal_keylen(wal->judy, max);
+    JudySlot *cell, value = 0;
+    uint64_t seq = 0;
+    int err = 0;
+
+    pthread_mutex_lock(&wal->lock);
+    wal->callers++;
+
+    if ((cell = judy_slot(wal->judy, buff, max)) && (value = *cell)) {
+        if ((seq = judy_wal_append(wal, JUDY_wal_del, buff, len, 0)))
+            judy_del(wal->judy);
+        else
+            err = ENOMEM, value = 0;
+    }
+
+    if (!judy_wal_commit(wal, seq))
+        err = wal->error, value = 0;
+
+    wal->callers--;
+    pthread_mutex_unlock(&wal->lock);
+
+    if (err)
+        errno = err;
+
+    return value;
+}
+
+//  write the array's live keys to a new log beside the old one,
+//  then rename it over the old.  Callers wait while it runs.
+//  Returns zero with errno set on failure, leaving the old log
+//  in use.
+
+int judy_wal_checkpoint(JudyWal *wal) {
+    Judy *judy = wal->judy;
+    uint size = judy->max, len;
+    JudyWalHeader header;
+    char *tmp = NULL;
+    uchar *key = NULL;
+    JudySlot *cell;
+    int fd = -1, err = 0;
+
+    pthread_mutex_lock(&wal->lock);
+    judy_wal_drain(wal);
+
+    if (!(tmp = malloc(strlen(wal->path) + 5)) || !(key = malloc(size))) {
+        err = ENOMEM;
+        goto done;
+    }
+
+    strcpy(tmp, wal->path);
+    strcat(tmp, ".new");
+    judy_wal_header(judy, &header);
+
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        err = errno;
+        goto done;
+    }
+
+    if ((err = judy_wal_write(fd, (uchar *)&header, sizeof(header))))
+        goto done;
+
+    //  the batch buffer is empty and nobody can append, so the
+    //  checkpoint records are collected there
+
+    for (cell = judy_strt(judy, NULL, 0); !err && cell; cell = judy_nxt(judy)) {
+        if (!*cell)
+            continue;
+
+        len = judy_key(judy, key, size);
+
+        if (!judy_wal_append(wal, JUDY_wal_put, key, judy_wal_keylen(judy, len), *cell))
+            err = ENOMEM;
+        else if (wal->fill >= JUDY_wal_batch) {
+            err = judy_wal_write(fd, wal->buff, wal->fill);
+            wal->fill = 0;
+        }
+    }
+
+    if (!err)
+        err = judy_wal_write(fd, wal->buff, wal->fill);
+
+    wal->fill = 0;
+    wal->durable = wal->appended;
+
+    if (!err && fsync(fd))
+        err = errno;
+
+    if (!err && rename(tmp, wal->path))
+        err = errno;
+
+    if (err)
+        goto done;
+
+    //  the new log is in place whether or not the directory
+    //  sync below succeeds, so it is used from here on
+
+    close(wal->fd);
+    wal->fd = fd;
+    fd = -1;
+    err = judy_wal_syncdir(wal->path);
+
+done:
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmp);
+    }
+
+    pthread_mutex_unlock(&wal->lock);
+    free(tmp);
+    free(key);
+    errno = err;
+    return !err;
+}
+
+int judy_wal_error(JudyWal *wal) {
+    int err;
+
+    pthread_mutex_lock(&wal->lock);
+    err = wal->error;
+    pthread_mutex_unlock(&wal->lock);
+    return err;
+}
@@ -1,8 +1,20 @@
+#define _DEFAULT_SOURCE
+
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <openssl/sha.h>
 #include <openssl/rand.h>
 
@@ -131,29 +143,3035 @@ void test_fill_binkeys(void) {
     judy_close(j);
 }
 
-int init_suite(void) {
-    srand((unsigned)time(NULL));
+//  two word keys that differ only in the last byte of the first
+//  word, enough to split that byte's node into a radix node whose
+//  cells point straight at the second word's nodes
 
-    return 0;
+void test_split(void) {
+    judyvalue key[2];
+    JudySlot *slot;
+    uint idx, cnt;
+    Judy *judy;
+
+    judy = judy_open(0, 2);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+
+    for (idx = 0; idx < 256 * 3; idx++) {
+        key[0] = 0x0102030405060700ULL | idx % 256;
+        key[1] = idx / 256;
+        *judy_cell(judy, (uchar *)key, 0) = idx + 1;
+    }
+
+    for (idx = 0; idx < 256 * 3; idx++) {
+        key[0] = 0x0102030405060700ULL | idx % 256;
+        key[1] = idx / 256;
+        slot = judy_slot(judy, (uchar *)key, 0);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(slot);
+        CU_ASSERT_EQUAL(*slot, idx + 1);
+    }
+
+    for (cnt = 0, slot = judy_strt(judy, NULL, 0); slot; slot = judy_nxt(judy))
+        cnt++;
+    CU_ASSERT_EQUAL(cnt, 256 * 3);
+
+    judy_close(judy);
 }
 
-int clean_suite(void) {
+//  one-word keys sharing their first seven bytes, enough to split
+//  the last byte's node into a radix node with leaf cells; a
+//  reverse scan must hand back each key's own cell
+
+void test_reverse(void) {
+    judyvalue key[1];
+    JudySlot *slot;
+    uint idx;
+    Judy *judy;
+
+    judy = judy_open(0, 1);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+
+    for (idx = 0; idx < 256; idx += 3) {
+        key[0] = 0x0102030405060700ULL | idx;
+        *judy_cell(judy, (uchar *)key, 0) = idx + 1;
+    }
+
+    for (idx = 255 / 3 * 3 + 3, slot = judy_end(judy); slot; slot = judy_prv(judy)) {
+        idx -= 3;
+        judy_key(judy, (uchar *)key, sizeof(key));
+        CU_ASSERT_EQUAL(key[0], 0x0102030405060700ULL | idx);
+        CU_ASSERT_EQUAL(*slot, idx + 1);
+    }
+    CU_ASSERT_EQUAL(idx, 0);
+
+    judy_close(judy);
+}
+
+//  a search key that leaves the array sorting before a span
+//  node's bytes must start at the first key under that span
+
+void test_strt_span(void) {
+    uchar buff[64];
+    JudySlot *slot;
+    Judy *judy;
+
+    judy = judy_open(64, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+
+    *judy_cell(judy, (uchar *)"a", 1) = 1;
+    *judy_cell(judy, (uchar *)"abcdefghijklmnopqrstuvwxyz", 26) = 2;
+    *judy_cell(judy, (uchar *)"b", 1) = 3;
+
+    slot = judy_strt(judy, (uchar *)"abcdefghijA", 11);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(slot);
+    CU_ASSERT_EQUAL(*slot, 2);
+    judy_key(judy, buff, sizeof(buff));
+    CU_ASSERT(!strcmp((char *)buff, "abcdefghijklmnopqrstuvwxyz"));
+
+    slot = judy_strt(judy, (uchar *)"abcdefghijz", 11);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(slot);
+    CU_ASSERT_EQUAL(*slot, 3);
+
+    judy_close(judy);
+}
+
+static uint snapshot_count(Judy *j, JudySlot *expect, uint samples) {
+    uchar key[32];
+    JudySlot *slot;
+    uint idx, cnt = 0;
+
+    for (slot = judy_strt(j, NULL, 0); slot; slot = judy_nxt(j)) {
+        judy_key(j, key, sizeof(key));
+        idx = strtoul((char *)key + 3, NULL, 10);
+        CU_ASSERT_FATAL(idx < samples);
+        CU_ASSERT_EQUAL(*slot, expect[idx]);
+        ++cnt;
+    }
+    return cnt;
+}
+
+void test_snapshot(void) {
+    const uint samples = 20000;
+    JudySlot *before, *after;
+    Judy *j, *s1, *s2;
+    JudySlot *slot;
+    uchar key[32];
+    uint idx, cnt;
+
+    j = judy_open(32, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(j);
+    before = calloc(2 * samples, sizeof(JudySlot));
+    after = calloc(2 * samples, sizeof(JudySlot));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(before);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(after);
+
+    for (idx = 0; idx < samples; ++idx) {
+        snprintf((char *)key, sizeof(key), "key%u", idx * 7919 % samples);
+        slot = judy_cell(j, key, strlen((char *)key));
+        CU_ASSERT_PTR_NOT_NULL_FATAL(slot);
+        *slot = before[idx * 7919 % samples] = idx + 1;
+    }
+
+    s1 = judy_snapshot(j);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(s1);
+    memcpy(after, before, 2 * samples * sizeof(JudySlot));
+
+    //  a lookup behind the snapshot copies nothing, handing
+    //  out the cell the snapshot shares
+
+    snprintf((char *)key, sizeof(key), "key%u", 1);
+    slot = judy_slot(j, key, strlen((char *)key));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(slot);
+    CU_ASSERT_EQUAL(slot, judy_slot(s1, key, strlen((char *)key)));
+    CU_ASSERT_PTR_NULL(judy_slot_write(s1, key, strlen((char *)key)));
+
+    //  update, delete and add behind the snapshot
+
+    for (idx = 0; idx < 2 * samples; ++idx) {
+        snprintf((char *)key, sizeof(key), "key%u", idx);
+        if (idx % 3 == 0 && idx < samples) {
+            CU_ASSERT_PTR_NOT_NULL_FATAL(judy_slot(j, key, strlen((char *)key)));
+            judy_del(j);
+            after[idx] = 0;
+        } else if (idx % 3 == 1 && idx < samples) {
+            *judy_slot_write(j, key, strlen((char *)key)) = after[idx] = idx + 100000;
+        } else {
+            *judy_cell(j, key, strlen((char *)key)) = after[idx] = idx + 100000;
+        }
+    }
+
+    s2 = judy_snapshot(j);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(s2);
+
+    CU_ASSERT_EQUAL(snapshot_count(s1, before, 2 * samples), samples);
+    CU_ASSERT_PTR_NULL(judy_cell(s1, key, strlen((char *)key)));
+    judy_close(s1);
+
+    for (idx = 0; idx < samples; ++idx) {
+        snprintf((char *)key, sizeof(key), "key%u", idx);
+        if ((slot = judy_slot(j, key, strlen((char *)key))))
+            judy_del(j);
+    }
+
+    for (idx = cnt = 0; idx < 2 * samples; ++idx)
+        cnt += after[idx] != 0;
+
+    CU_ASSERT_EQUAL(snapshot_count(s2, after, 2 * samples), cnt);
+    judy_close(s2);
+
+    memset(after, 0, samples * sizeof(JudySlot));
+    CU_ASSERT_EQUAL(snapshot_count(j, after, 2 * samples), samples);
+
+    free(before);
+    free(after);
+    judy_close(j);
+}
+
+void test_copy(void) {
+    const uint samples = 20000;
+    Judy *j, *c, *s, *sc, *h;
+    JudySlot *slot, *expect;
+    judyvalue key[2];
+    uint idx;
+
+    j = judy_open(0, 2);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(j);
+    expect = calloc(samples, sizeof(JudySlot));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(expect);
+
+    for (idx = 0; idx < samples; ++idx) {
+        key[0] = (judyvalue)idx * 0x9E3779B97F4A7C15ULL;
+        key[1] = idx;
+        *judy_cell(j, (uchar *)key, 0) = expect[idx] = idx + 1;
+        if (idx % 5 == 0)
+            judy_del(j), expect[idx] = 0;
+    }
+
+    s = judy_snapshot(j);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(s);
+    c = judy_copy(j);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(c);
+
+    //  the copy is independent of the original
+
+    for (idx = 0; idx < samples; ++idx) {
+        key[0] = (judyvalue)idx * 0x9E3779B97F4A7C15ULL;
+        key[1] = idx;
+        *judy_cell(j, (uchar *)key, 0) = samples + idx;
+    }
+
+    sc = judy_copy(s);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(sc);
+    judy_close(s);
+    judy_close(j);
+
+    for (idx = 0; idx < samples; ++idx) {
+        key[0] = (judyvalue)idx * 0x9E3779B97F4A7C15ULL;
+        key[1] = idx;
+        slot = judy_slot(c, (uchar *)key, 0);
+        CU_ASSERT_EQUAL_FATAL(slot ? *slot : 0, expect[idx]);
+        slot = judy_slot(sc, (uchar *)key, 0);
+        CU_ASSERT_EQUAL_FATAL(slot ? *slot : 0, expect[idx]);
+        if (slot)
+            judy_del(sc);
+        *judy_cell(c, (uchar *)key, 0) = idx + 1;
+    }
+
+    CU_ASSERT_PTR_NULL(judy_strt(sc, NULL, 0));
+
+    idx = 0;
+    for (slot = judy_strt(c, NULL, 0); slot; slot = judy_nxt(c))
+        ++idx;
+    CU_ASSERT_EQUAL(idx, samples);
+
+    free(expect);
+    judy_close(sc);
+    judy_close(c);
+
+    //  a concurrent array copies to a plain array, while its
+    //  handles share its segments and are not copied
+
+    j = judy_open_mt(0, 2);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(j);
+    h = judy_attach(j);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+
+    for (idx = 0; idx < samples; ++idx) {
+        key[0] = (judyvalue)idx * 0x9E3779B97F4A7C15ULL;
+        key[1] = idx;
+        judy_cell_mt(h, (uchar *)key, 0, idx + 1);
+    }
+
+    CU_ASSERT_PTR_NULL(judy_copy(h));
+    judy_detach(h);
+    c = judy_copy(j);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(c);
+    judy_close(j);
+
+    for (idx = 0; idx < samples; ++idx) {
+        key[0] = (judyvalue)idx * 0x9E3779B97F4A7C15ULL;
+        key[1] = idx;
+        slot = judy_slot(c, (uchar *)key, 0);
+        CU_ASSERT_EQUAL_FATAL(slot ? *slot : 0, idx + 1);
+        *judy_cell(c, (uchar *)key, 0) = samples + idx;
+    }
+
+    judy_close(c);
+}
+
+static void setops_check(Judy *a, Judy *b, uint samples, uint mode) {
+    Judy *r[3];
+    JudySlot *slot, *sa, *sb;
+    judyvalue key[1];
+    uchar str[32];
+    uint op, idx, cnt, expect;
+
+    r[0] = judy_union(a, b);
+    r[1] = judy_intersect(a, b);
+    r[2] = judy_difference(a, b);
+
+    for (op = 0; op < 3; op++) {
+        CU_ASSERT_PTR_NOT_NULL_FATAL(r[op]);
+        for (idx = cnt = 0; idx < samples; idx++) {
+            if (mode) {
+                snprintf((char *)str, sizeof(str), "%x", idx * 2654435761U);
+                sa = judy_slot(a, str, strlen((char *)str));
+                sb = judy_slot(b, str, strlen((char *)str));
+                slot = judy_slot(r[op], str, strlen((char *)str));
+            } else {
+                key[0] = idx % 7 ? idx : (judyvalue)idx << 36;
+                sa = judy_slot(a, (uchar *)key, 0);
+                sb = judy_slot(b, (uchar *)key, 0);
+                slot = judy_slot(r[op], (uchar *)key, 0);
+            }
+            sa = sa && *sa ? sa : NULL;
+            sb = sb && *sb ? sb : NULL;
+            if (op == 0)
+                expect = sa ? *sa : sb ? *sb : 0;
+            else if (op == 1)
+                expect = sa && sb ? *sa : 0;
+            else
+                expect = sa && !sb ? *sa : 0;
+            CU_ASSERT_EQUAL_FATAL(slot ? *slot : 0, expect);
+            cnt += expect != 0;
+        }
+        for (slot = judy_strt(r[op], NULL, 0); slot; slot = judy_nxt(r[op]))
+            --cnt;
+        CU_ASSERT_EQUAL(cnt, 0);
+        judy_close(r[op]);
+    }
+}
+
+void test_setops(void) {
+    const uint samples = 50000;
+    judyvalue key[1];
+    uchar str[32];
+    uint mode, idx;
+    Judy *a, *b;
+
+    for (mode = 0; mode < 2; mode++) {
+        a = mode ? judy_open(32, 0) : judy_open(0, 1);
+        b = mode ? judy_open(32, 0) : judy_open(0, 1);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(a);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(b);
+
+        for (idx = 0; idx < samples; idx++) {
+            key[0] = idx % 7 ? idx : (judyvalue)idx << 36;
+            snprintf((char *)str, sizeof(str), "%x", idx * 2654435761U);
+            if (idx % 2 == 0 || (idx > samples / 2 && idx % 5 == 0))
+                *judy_cell(a, mode ? str : (uchar *)key, strlen((char *)str)) = idx + 1;
+            if (idx % 3 == 0 || idx < samples / 10)
+                *judy_cell(b, mode ? str : (uchar *)key, strlen((char *)str)) = samples + idx;
+        }
+
+        setops_check(a, b, samples, mode);
+        setops_check(b, a, samples, mode);
+        judy_close(a);
+        judy_close(b);
+    }
+}
+
+void test_merge(void) {
+    const uint inputs = 9, samples = 20000;
+    Judy *judy[9];
+    JudyMerge *merge;
+    JudySlot *slot;
+    judyvalue key[1], prev;
+    uchar str[32], last[32];
+    uint mode, idx, cnt;
+
+    for (mode = 0; mode < 2; mode++) {
+        for (idx = 0; idx < inputs; idx++) {
+            judy[idx] = mode ? judy_open(32, 0) : judy_open(0, 1);
+            CU_ASSERT_PTR_NOT_NULL_FATAL(judy[idx]);
+        }
+
+        //  input 0 stays empty, and every tenth key is in two inputs
+
+        for (idx = 0; idx < samples; idx++) {
+            key[0] = (judyvalue)idx * 2654435761U;
+            snprintf((char *)str, sizeof(str), "%x", idx * 2654435761U);
+            *judy_cell(judy[1 + idx % (inputs - 1)], mode ? str : (uchar *)key, strlen((char *)str)) = idx + 1;
+            if (idx % 10 == 0)
+                *judy_cell(judy[1 + (idx + 1) % (inputs - 1)], mode ? str : (uchar *)key, strlen((char *)str)) = idx + 1;
+        }
+
+        merge = judy_merge_open(judy, inputs, sizeof(str));
+        CU_ASSERT_PTR_NOT_NULL_FATAL(merge);
+
+        prev = 0, last[0] = 0, cnt = 0;
+        for (slot = judy_merge_strt(merge, NULL, 0); slot; slot = judy_merge_nxt(merge)) {
+            if (mode) {
+                CU_ASSERT(judy_merge_key(merge, str, sizeof(str)) == strlen((char *)str));
+                CU_ASSERT(strcmp((char *)last, (char *)str) <= 0);
+                strcpy((char *)last, (char *)str);
+            } else {
+                CU_ASSERT(judy_merge_key(merge, (uchar *)key, sizeof(key)) == sizeof(key));
+                CU_ASSERT(prev <= key[0]);
+                prev = key[0];
+            }
+            CU_ASSERT(judy_merge_src(merge) > 0);
+            ++cnt;
+        }
+        CU_ASSERT_EQUAL(cnt, samples + samples / 10);
+
+        //  seek to the middle of the key space
+
+        if (mode) {
+            slot = judy_merge_strt(merge, (uchar *)"8", 1);
+            judy_merge_key(merge, str, sizeof(str));
+            CU_ASSERT(slot && strcmp((char *)str, "8") >= 0);
+        } else {
+            key[0] = (judyvalue)1 << 31;
+            slot = judy_merge_strt(merge, (uchar *)key, sizeof(key));
+            judy_merge_key(merge, (uchar *)key, sizeof(key));
+            CU_ASSERT(slot && key[0] >= (judyvalue)1 << 31);
+        }
+
+        judy_merge_close(merge);
+        for (idx = 0; idx < inputs; idx++)
+            judy_close(judy[idx]);
+    }
+}
+
+typedef struct {
+    JudySharded *sharded;
+    uint first, last;
+} sharded_arg;
+
+static void *sharded_fill(void *arg) {
+    sharded_arg *a = arg;
+    judyvalue key[1];
+    uint idx;
+
+    for (idx = a->first; idx < a->last; idx++) {
+        key[0] = (judyvalue)idx * 2654435761U << 16;
+        CU_ASSERT_EQUAL(judy_sharded_put(a->sharded, (uchar *)key, sizeof(key), idx + 1), 0);
+    }
+
+    return NULL;
+}
+
+static int sharded_visit(void *ctx, uchar *key, uint len, JudySlot value) {
+    judyvalue *prev = ctx;
+
+    CU_ASSERT_EQUAL(len, sizeof(judyvalue));
+    CU_ASSERT(prev[0] < *(judyvalue *)key || !prev[1]);
+    CU_ASSERT_EQUAL(*(judyvalue *)key, (judyvalue)(value - 1) * 2654435761U << 16);
+    prev[0] = *(judyvalue *)key;
+    prev[1]++;
     return 0;
 }
 
-int main(int argc, char **argv) {
-   CU_pSuite suite = NULL;
-   (void)argc, (void)argv;
+void test_sharded(void) {
+    const uint threads = 4, samples = 40000;
+    pthread_t tid[4];
+    sharded_arg arg[4];
+    JudySharded *sharded;
+    judyvalue key[1], prev[2];
+    uint idx;
 
-   if (CUE_SUCCESS != CU_initialize_registry())
-      return CU_get_error();
+    sharded = judy_sharded_open(7, 0, 1);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(sharded);
 
-   if (!(suite = CU_add_suite("basic", init_suite, clean_suite)))
-       goto out;
+    for (idx = 0; idx < threads; idx++) {
+        arg[idx].sharded = sharded;
+        arg[idx].first = idx * samples / threads;
+        arg[idx].last = (idx + 1) * samples / threads;
+        CU_ASSERT_FATAL(!pthread_create(&tid[idx], NULL, sharded_fill, &arg[idx]));
+    }
+    for (idx = 0; idx < threads; idx++)
+        pthread_join(tid[idx], NULL);
 
-   if (!(CU_add_test(suite, "construction", test_construction)))
-       goto out;
-   if (!(CU_add_test(suite, "fill_binkeys", test_fill_binkeys)))
+    for (idx = 0; idx < samples; idx++) {
+        key[0] = (judyvalue)idx * 2654435761U << 16;
+        CU_ASSERT_EQUAL(judy_sharded_get(sharded, (uchar *)key, sizeof(key)), idx + 1);
+    }
+
+    prev[0] = prev[1] = 0;
+    judy_sharded_scan(sharded, NULL, 0, sharded_visit, prev);
+    CU_ASSERT_EQUAL(prev[1], samples);
+
+    //  scan from the middle of the key space
+
+    key[0] = (judyvalue)1 << 62;
+    prev[0] = key[0], prev[1] = 0;
+    judy_sharded_scan(sharded, (uchar *)key, sizeof(key), sharded_visit, prev);
+    CU_ASSERT(prev[1] > 0 && prev[1] < samples);
+
+    for (idx = 0; idx < samples; idx += 2) {
+        key[0] = (judyvalue)idx * 2654435761U << 16;
+        CU_ASSERT_EQUAL(judy_sharded_del(sharded, (uchar *)key, sizeof(key)), idx + 1);
+        CU_ASSERT_EQUAL(judy_sharded_get(sharded, (uchar *)key, sizeof(key)), 0);
+    }
+
+    prev[0] = prev[1] = 0;
+    judy_sharded_scan(sharded, NULL, 0, sharded_visit, prev);
+    CU_ASSERT_EQUAL(prev[1], samples / 2);
+
+    judy_sharded_close(sharded);
+}
+
+//  concurrent stress: writers own disjoint keys and store
+//  increasing sequence numbers, deleting some keys each round.
+//  Readers check each value belongs to its key and that no key
+//  is seen going back to an older sequence number.
+
+#define MT_KEYS 2048
+#define MT_ROUNDS 24
+#define MT_WRITERS 4
+#define MT_READERS 4
+
+typedef struct {
+    Judy *judy;
+    uint mode, id;
+    uint *done;
+    uint errors;
+    JudySlot *expect;
+} mt_arg;
+
+static uint mt_key(uint mode, uint idx, uchar *buff) {
+    if (mode)
+        return snprintf((char *)buff, 32, "%x", idx * 2654435761U);
+
+    *(judyvalue *)buff = (judyvalue)idx * 2654435761U << 8;
+    return sizeof(judyvalue);
+}
+
+static void *mt_writer(void *arg) {
+    mt_arg *a = arg;
+    Judy *handle = judy_attach(a->judy);
+    uchar key[32];
+    JudySlot value;
+    uint idx, round, len;
+
+    if (!handle) {
+        a->errors++;
+        return NULL;
+    }
+
+    for (round = 1; round <= MT_ROUNDS; round++)
+        for (idx = a->id; idx < MT_KEYS; idx += MT_WRITERS) {
+            len = mt_key(a->mode, idx, key);
+
+            if ((idx + round) % 3)
+                value = (JudySlot)idx << 32 | round;
+            else
+                value = 0;
+
+            if (value)
+                judy_cell_mt(handle, key, len, value);
+            else
+                judy_del_mt(handle, key, len);
+
+            a->expect[idx] = value;
+        }
+
+    judy_detach(handle);
+    return NULL;
+}
+
+static void *mt_reader(void *arg) {
+    mt_arg *a = arg;
+    Judy *handle = judy_attach(a->judy);
+    uint seen[MT_KEYS] = {0};
+    uchar key[32];
+    JudySlot value;
+    uint idx, len;
+
+    if (!handle) {
+        a->errors++;
+        return NULL;
+    }
+
+    for (idx = a->id; !__atomic_load_n(a->done, __ATOMIC_ACQUIRE); idx = (idx + 7) % MT_KEYS) {
+        len = mt_key(a->mode, idx, key);
+
+        if ((value = judy_slot_mt(handle, key, len))) {
+            if (value >> 32 != idx || (uint)value < seen[idx])
+                a->errors++;
+            seen[idx] = (uint)value;
+        }
+
+        //  keys between the inserted ones are never present
+
+        if (!a->mode) {
+            *(judyvalue *)key += 1;
+            if (judy_slot_mt(handle, key, len))
+                a->errors++;
+        }
+    }
+
+    judy_detach(handle);
+    return NULL;
+}
+
+void test_concurrent(void) {
+    pthread_t tid[MT_WRITERS + MT_READERS];
+    mt_arg arg[MT_WRITERS + MT_READERS];
+    JudySlot expect[MT_KEYS];
+    JudySlot *slot;
+    uint mode, idx, done, cnt;
+    uchar key[32];
+    Judy *judy, *handle;
+
+    for (mode = 0; mode < 2; mode++) {
+        judy = mode ? judy_open_mt(32, 0) : judy_open_mt(0, 1);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+        done = 0;
+
+        for (idx = 0; idx < MT_WRITERS + MT_READERS; idx++) {
+            arg[idx].judy = judy;
+            arg[idx].mode = mode;
+            arg[idx].id = idx < MT_WRITERS ? idx : idx * 131;
+            arg[idx].done = &done;
+            arg[idx].errors = 0;
+            arg[idx].expect = expect;
+            CU_ASSERT_FATAL(!pthread_create(&tid[idx], NULL, idx < MT_WRITERS ? mt_writer : mt_reader, &arg[idx]));
+        }
+
+        for (idx = 0; idx < MT_WRITERS; idx++)
+            pthread_join(tid[idx], NULL);
+
+        __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+
+        for (; idx < MT_WRITERS + MT_READERS; idx++)
+            pthread_join(tid[idx], NULL);
+
+        for (idx = 0; idx < MT_WRITERS + MT_READERS; idx++)
+            CU_ASSERT_EQUAL(arg[idx].errors, 0);
+
+        //  the array now holds exactly the last value written
+
+        handle = judy_attach(judy);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+
+        for (idx = cnt = 0; idx < MT_KEYS; idx++) {
+            CU_ASSERT_EQUAL(judy_slot_mt(handle, key, mt_key(mode, idx, key)), expect[idx]);
+            cnt += expect[idx] != 0;
+        }
+
+        judy_detach(handle);
+
+        for (slot = judy_strt(judy, NULL, 0); slot; slot = judy_nxt(judy))
+            cnt -= *slot != 0;
+        CU_ASSERT_EQUAL(cnt, 0);
+
+        judy_close(judy);
+    }
+}
+
+static int cell_after_cmp(const void *x, const void *y) {
+    return strcmp(*(char * const *)x, *(char * const *)y);
+}
+
+static int build_cmp(const void *x, const void *y) {
+    const judyvalue *p = x, *q = y;
+
+    if (p[0] != q[0])
+        return p[0] < q[0] ? -1 : 1;
+
+    return p[1] < q[1] ? -1 : p[1] > q[1];
+}
+
+void test_cell_after(void) {
+    const uint samples = 30000;
+    char **strs, *str;
+    judyvalue key[1], prev;
+    JudySlot *slot;
+    uint mode, idx, common, cnt;
+    Judy *judy;
+
+    strs = malloc(samples * sizeof(char *));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(strs);
+
+    for (idx = 0; idx < samples; idx++) {
+        strs[idx] = malloc(16);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(strs[idx]);
+        snprintf(strs[idx], 16, "%x", idx * 2654435761U >> (idx % 5 * 4));
+    }
+
+    qsort(strs, samples, sizeof(char *), cell_after_cmp);
+
+    for (mode = 0; mode < 2; mode++) {
+        judy = mode ? judy_open(16, 0) : judy_open(0, 1);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+        prev = 0;
+
+        //  ascending keys, each sharing a prefix with the last
+
+        for (idx = 0; idx < samples; idx++) {
+            if (mode) {
+                str = strs[idx];
+                for (common = 0; idx && str[common] && str[common] == strs[idx - 1][common]; common++)
+                    ;
+                slot = judy_cell_after(judy, (uchar *)str, strlen(str), common);
+            } else {
+                key[0] = (judyvalue)idx * idx * 40503U;
+                for (common = 0; common < 8 && !((key[0] ^ prev) >> (56 - 8 * common)); common++)
+                    ;
+                slot = judy_cell_after(judy, (uchar *)key, 0, common);
+                prev = key[0];
+            }
+            CU_ASSERT_PTR_NOT_NULL_FATAL(slot);
+            *slot = idx + 1;
+        }
+
+        for (idx = cnt = 0; idx < samples; idx++) {
+            if (mode) {
+                slot = judy_slot(judy, (uchar *)strs[idx], strlen(strs[idx]));
+                cnt += idx && !strcmp(strs[idx], strs[idx - 1]);
+            } else {
+                key[0] = (judyvalue)idx * idx * 40503U;
+                slot = judy_slot(judy, (uchar *)key, 0);
+            }
+            CU_ASSERT_PTR_NOT_NULL(slot);
+        }
+
+        for (slot = judy_strt(judy, NULL, 0); slot; slot = judy_nxt(judy))
+            cnt++;
+        CU_ASSERT_EQUAL(cnt, samples);
+
+        judy_close(judy);
+    }
+
+    for (idx = 0; idx < samples; idx++)
+        free(strs[idx]);
+    free(strs);
+}
+
+//  walk two arrays side by side, expecting the same keys and values
+
+static void build_same(Judy *judy, Judy *ref) {
+    JudySlot *slot, *want;
+    uchar key[32], wkey[32];
+    uint len, wlen;
+
+    want = judy_strt(ref, NULL, 0);
+
+    for (slot = judy_strt(judy, NULL, 0); slot && want; slot = judy_nxt(judy), want = judy_nxt(ref)) {
+        len = judy_key(judy, key, sizeof(key));
+        wlen = judy_key(ref, wkey, sizeof(wkey));
+        CU_ASSERT(len == wlen && !memcmp(key, wkey, len));
+        CU_ASSERT_EQUAL(*slot, *want);
+    }
+
+    CU_ASSERT(!slot && !want);
+}
+
+void test_build(void) {
+    const uint samples = 20000, runs[] = { 1, 3, 7, 300 };
+    judyvalue *ints;
+    uchar **keys;
+    JudySlot *values;
+    uint idx, run;
+    char **strs;
+    Judy *judy, *ref;
+
+    strs = malloc(samples * sizeof(char *));
+    keys = malloc(samples * sizeof(uchar *));
+    values = malloc(samples * sizeof(JudySlot));
+    ints = malloc(samples * 2 * sizeof(judyvalue));
+    CU_ASSERT_FATAL(strs && keys && values && ints);
+
+    //  string keys, with repeats and the empty string
+
+    for (idx = 0; idx < samples; idx++) {
+        strs[idx] = malloc(16);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(strs[idx]);
+        if (idx)
+            snprintf(strs[idx], 16, "%x", idx * 2654435761U >> (idx % 7 * 4));
+        else
+            strs[idx][0] = 0;
+    }
+
+    qsort(strs, samples, sizeof(char *), cell_after_cmp);
+    ref = judy_open(16, 0);
+
+    for (idx = 0; idx < samples; idx++) {
+        keys[idx] = (uchar *)strs[idx];
+        values[idx] = idx + 1;
+        *judy_cell(ref, keys[idx], strlen(strs[idx])) = idx + 1;
+    }
+
+    for (run = 0; run < sizeof(runs) / sizeof(runs[0]); run++) {
+        judy = judy_build(16, 0, keys, NULL, values, samples, runs[run]);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+        build_same(judy, ref);
+        judy_close(judy);
+    }
+
+    judy_close(ref);
+
+    //  two word integer keys spread over every first byte
+
+    ref = judy_open(0, 2);
+
+    for (idx = 0; idx < samples; idx++) {
+        ints[2 * idx] = (judyvalue)idx * 0x9e3779b97f4a7c15ULL >> 8 << 8 | (idx & 0xff);
+        ints[2 * idx + 1] = idx % 3;
+    }
+
+    qsort(ints, samples, 2 * sizeof(judyvalue), build_cmp);
+
+    for (idx = 0; idx < samples; idx++) {
+        keys[idx] = (uchar *)(ints + 2 * idx);
+        *judy_cell(ref, keys[idx], 0) = idx + 1;
+    }
+
+    for (run = 0; run < sizeof(runs) / sizeof(runs[0]); run++) {
+        judy = judy_build(0, 2, keys, NULL, values, samples, runs[run]);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+        build_same(judy, ref);
+
+        //  the result is an ordinary array
+
+        for (idx = 0; idx < samples; idx += 2) {
+            CU_ASSERT_PTR_NOT_NULL(judy_slot(judy, keys[idx], 0));
+            judy_del(judy);
+        }
+        *judy_cell(judy, keys[0], 0) = 1;
+        CU_ASSERT_EQUAL(*judy_slot(judy, keys[1], 0), 2);
+
+        //  refilling it draws on the free blocks the workers left
+
+        for (idx = 0; idx < samples; idx += 2)
+            *judy_cell(judy, keys[idx], 0) = idx + 1;
+        build_same(judy, ref);
+        judy_close(judy);
+    }
+
+    judy_close(ref);
+
+    for (idx = 0; idx < samples; idx++)
+        free(strs[idx]);
+    free(strs);
+    free(keys);
+    free(values);
+    free(ints);
+}
+
+//  fill an array by batches of unsorted keys, the first part of
+//  them stored beforehand with other values, against judy_cell
+
+static void batch_check(uint max, uint depth, uchar **keys, uint *lens, JudySlot *values, uint cnt) {
+    const uint threads[] = { 1, 2, 5, 64 }, before[] = { 0, 3, 4000 };
+    uint run, pre, idx;
+    JudySlot *slot;
+    Judy *judy, *ref;
+
+    ref = judy_open(max, depth);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(ref);
+
+    for (idx = 0; idx < cnt; idx++)
+        *judy_cell(ref, keys[idx], lens[idx]) = values[idx];
+
+    for (run = 0; run < sizeof(threads) / sizeof(threads[0]); run++)
+        for (pre = 0; pre < sizeof(before) / sizeof(before[0]); pre++) {
+            judy = judy_open(max, depth);
+            CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+
+            for (idx = 0; idx < before[pre]; idx++)
+                *judy_cell(judy, keys[idx], lens[idx]) = ~values[idx];
+
+            CU_ASSERT(judy_cell_batch(judy, keys, lens, values, cnt, threads[run]));
+            build_same(judy, ref);
+
+            //  the result is an ordinary array
+
+            for (idx = 0; idx < cnt; idx += 2)
+                if ((slot = judy_slot(judy, keys[idx], lens[idx])) && *slot)
+                    judy_del(judy);
+
+            for (idx = 0; idx < cnt; idx += 2)
+                *judy_cell(judy, keys[idx], lens[idx]) = *judy_slot(ref, keys[idx], lens[idx]);
+
+            build_same(judy, ref);
+            judy_close(judy);
+        }
+
+    judy_close(ref);
+}
+
+void test_cell_batch(void) {
+    const uint samples = 20000;
+    judyvalue *ints;
+    uchar **keys;
+    JudySlot *values;
+    uint *lens, idx;
+    char **strs;
+
+    strs = malloc(samples * sizeof(char *));
+    keys = malloc(samples * sizeof(uchar *));
+    lens = malloc(samples * sizeof(uint));
+    values = malloc(samples * sizeof(JudySlot));
+    ints = malloc(samples * 2 * sizeof(judyvalue));
+    CU_ASSERT_FATAL(strs && keys && lens && values && ints);
+
+    //  string keys in hash order, with repeats and the empty
+    //  string, where the last value stored must win
+
+    for (idx = 0; idx < samples; idx++) {
+        strs[idx] = malloc(16);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(strs[idx]);
+        if (idx % 4999)
+            snprintf(strs[idx], 16, "%x", idx * 2654435761U >> (idx % 7 * 4));
+        else
+            strs[idx][0] = 0;
+        keys[idx] = (uchar *)strs[idx];
+        lens[idx] = strlen(strs[idx]);
+        values[idx] = idx + 1;
+    }
+
+    batch_check(16, 0, keys, lens, values, samples);
+
+    //  one and two word integer keys
+
+    for (idx = 0; idx < samples; idx++) {
+        ints[2 * idx] = (judyvalue)(idx % 15000) * 0x9e3779b97f4a7c15ULL;
+        ints[2 * idx + 1] = idx % 3;
+        keys[idx] = (uchar *)(ints + 2 * idx);
+        lens[idx] = 0;
+    }
+
+    batch_check(0, 1, keys, lens, values, samples);
+    batch_check(0, 2, keys, lens, values, samples);
+
+    for (idx = 0; idx < samples; idx++)
+        free(strs[idx]);
+    free(strs);
+    free(keys);
+    free(lens);
+    free(values);
+    free(ints);
+}
+
+//  destructor for close_ex: free the payload and count it
+
+static void close_free(JudySlot value, void *ctx) {
+    free((void *)value);
+    __atomic_add_fetch((uint *)ctx, 1, __ATOMIC_RELAXED);
+}
+
+void test_close_ex(void) {
+    const uint samples = 50000, runs[] = { 1, 4, 64 };
+    judyvalue key[2];
+    JudySlot *slot;
+    uint idx, run, mode, freed;
+    char str[24];
+    Judy *judy;
+
+    for (mode = 0; mode < 3; mode++)
+        for (run = 0; run < sizeof(runs) / sizeof(runs[0]); run++) {
+            judy = mode == 2 ? judy_open(24, 0) : judy_open(0, 2);
+            CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+
+            //  small integers share their top bytes, so the
+            //  teardown has to open up several radix levels
+
+            for (idx = 0; idx < samples; idx++) {
+                if (mode == 2) {
+                    snprintf(str, sizeof(str), "%x", idx * 2654435761U >> (idx % 7));
+                    slot = judy_cell(judy, (uchar *)str, strlen(str));
+                } else {
+                    key[0] = mode ? (judyvalue)idx * 0x9e3779b97f4a7c15ULL : idx / 3;
+                    key[1] = idx;
+                    slot = judy_cell(judy, (uchar *)key, 0);
+                }
+                CU_ASSERT_PTR_NOT_NULL_FATAL(slot);
+                if (!*slot)
+                    *slot = (JudySlot)malloc(8);
+            }
+
+            for (idx = 0, slot = judy_strt(judy, NULL, 0); slot; slot = judy_nxt(judy))
+                idx += !!*slot;
+            if (mode < 2)
+                CU_ASSERT_EQUAL(idx, samples);
+
+            freed = 0;
+            judy_close_ex(judy, close_free, &freed, runs[run]);
+            CU_ASSERT_EQUAL(freed, idx);
+        }
+}
+
+#define FC_THREADS 6
+#define FC_KEYS 6000
+
+typedef struct {
+    JudyFc *fc;
+    uint id;
+    uint errors;
+    uint *arrived;
+} fc_arg;
+
+static void *fc_worker(void *arg) {
+    fc_arg *a = arg;
+    JudyFcSlot *req = judy_fc_attach(a->fc);
+    judyvalue key[1];
+    uint idx;
+
+    if (!req) {
+        a->errors++;
+        return NULL;
+    }
+
+    //  every thread inserts every key; only one insert wins
+
+    for (idx = 0; idx < FC_KEYS; idx++) {
+        key[0] = (judyvalue)idx * 2654435761U;
+        judy_fc_insert(req, (uchar *)key, sizeof(key), (JudySlot)idx << 8 | a->id);
+    }
+
+    //  once all inserts are in, each thread
+    //  updates and deletes its own share
+
+    __atomic_add_fetch(a->arrived, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(a->arrived, __ATOMIC_ACQUIRE) < FC_THREADS)
+        ;
+
+    for (idx = a->id; idx < FC_KEYS; idx += FC_THREADS) {
+        key[0] = (judyvalue)idx * 2654435761U;
+        if ((judy_fc_update(req, (uchar *)key, sizeof(key), (JudySlot)idx << 8 | 0xff) >> 8) != idx)
+            a->errors++;
+        if (idx % 3 == 0 && judy_fc_del(req, (uchar *)key, sizeof(key)) != ((JudySlot)idx << 8 | 0xff))
+            a->errors++;
+    }
+
+    judy_fc_detach(req);
+    return NULL;
+}
+
+void test_combining(void) {
+    pthread_t tid[FC_THREADS];
+    fc_arg arg[FC_THREADS];
+    judyvalue key[1];
+    JudySlot *slot;
+    uint idx, cnt, arrived = 0;
+    Judy *judy;
+    JudyFc *fc;
+
+    judy = judy_open(0, 1);
+    fc = judy_fc_open(judy);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(fc);
+
+    for (idx = 0; idx < FC_THREADS; idx++) {
+        arg[idx].fc = fc;
+        arg[idx].id = idx;
+        arg[idx].errors = 0;
+        arg[idx].arrived = &arrived;
+        CU_ASSERT_FATAL(!pthread_create(&tid[idx], NULL, fc_worker, &arg[idx]));
+    }
+
+    for (idx = 0; idx < FC_THREADS; idx++) {
+        pthread_join(tid[idx], NULL);
+        CU_ASSERT_EQUAL(arg[idx].errors, 0);
+    }
+
+    for (idx = cnt = 0; idx < FC_KEYS; idx++) {
+        key[0] = (judyvalue)idx * 2654435761U;
+        slot = judy_slot(judy, (uchar *)key, sizeof(key));
+        if (idx % 3)
+            CU_ASSERT(slot && *slot == ((JudySlot)idx << 8 | 0xff));
+        else
+            CU_ASSERT(!slot || !*slot);
+        cnt += idx % 3 != 0;
+    }
+
+    for (slot = judy_strt(judy, NULL, 0); slot; slot = judy_nxt(judy))
+        cnt--;
+    CU_ASSERT_EQUAL(cnt, 0);
+
+    judy_fc_close(fc);
+    judy_close(judy);
+}
+
+#define CNT_THREADS 4
+#define CNT_KEYS 4096
+#define CNT_ROUNDS 16
+
+typedef struct {
+    Judy *judy;
+    uint id;
+    uint errors;
+} cnt_arg;
+
+//  the counters sit among keys another thread keeps
+//  inserting and deleting, so their nodes keep moving
+
+static void *cnt_worker(void *arg) {
+    cnt_arg *a = arg;
+    Judy *h = judy_attach(a->judy);
+    JudySlot old;
+    judyvalue key[1];
+    uint idx, round;
+
+    if (!h) {
+        a->errors++;
+        return NULL;
+    }
+
+    for (round = 0; round < CNT_ROUNDS; round++)
+        for (idx = 0; idx < CNT_KEYS; idx++) {
+            key[0] = (judyvalue)(idx * 7 % CNT_KEYS) << 1;
+
+            if (!a->id) {
+                key[0] |= 1;
+                if (round & 1)
+                    judy_del_mt(h, (uchar *)key, sizeof(key));
+                else
+                    judy_cell_mt(h, (uchar *)key, sizeof(key), idx + 1);
+            } else if (a->id & 1)
+                judy_fetch_add(h, (uchar *)key, sizeof(key), 1);
+            else
+                for (old = judy_slot_mt(h, (uchar *)key, sizeof(key)); !judy_cas_cell(h, (uchar *)key, sizeof(key), &old, old + 1); )
+                    ;
+        }
+
+    judy_detach(h);
+    return NULL;
+}
+
+void test_counting(void) {
+    pthread_t tid[CNT_THREADS];
+    cnt_arg arg[CNT_THREADS];
+    JudySlot expected;
+    judyvalue key[1];
+    Judy *judy, *h;
+    uint idx;
+
+    //  plain arrays
+
+    judy = judy_open(0, 1);
+    key[0] = 42;
+    CU_ASSERT_EQUAL(judy_fetch_add(judy, (uchar *)key, sizeof(key), 5), 0);
+    CU_ASSERT_EQUAL(judy_fetch_add(judy, (uchar *)key, sizeof(key), 2), 5);
+    expected = 6;
+    CU_ASSERT(!judy_cas_cell(judy, (uchar *)key, sizeof(key), &expected, 9));
+    CU_ASSERT_EQUAL(expected, 7);
+    CU_ASSERT(judy_cas_cell(judy, (uchar *)key, sizeof(key), &expected, 9));
+    CU_ASSERT_EQUAL(judy_exchange_cell(judy, (uchar *)key, sizeof(key), 3), 9);
+    key[0] = 43;
+    expected = 0;
+    CU_ASSERT(judy_cas_cell(judy, (uchar *)key, sizeof(key), &expected, 1));
+    CU_ASSERT_EQUAL(*judy_slot(judy, (uchar *)key, sizeof(key)), 1);
+    judy_close(judy);
+
+    //  concurrent array: counters bumped by fetch_add
+    //  and by cas loops must not lose an increment
+
+    judy = judy_open_mt(0, 1);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+
+    for (idx = 0; idx < CNT_THREADS; idx++) {
+        arg[idx].judy = judy;
+        arg[idx].id = idx;
+        arg[idx].errors = 0;
+        CU_ASSERT_FATAL(!pthread_create(&tid[idx], NULL, cnt_worker, &arg[idx]));
+    }
+
+    for (idx = 0; idx < CNT_THREADS; idx++) {
+        pthread_join(tid[idx], NULL);
+        CU_ASSERT_EQUAL(arg[idx].errors, 0);
+    }
+
+    h = judy_attach(judy);
+
+    for (idx = 0; idx < CNT_KEYS; idx++) {
+        key[0] = (judyvalue)idx << 1;
+        CU_ASSERT_EQUAL(judy_slot_mt(h, (uchar *)key, sizeof(key)), (CNT_THREADS - 1) * CNT_ROUNDS);
+    }
+
+    key[0] = 2;
+    CU_ASSERT_EQUAL(judy_exchange_cell(h, (uchar *)key, sizeof(key), 7), (CNT_THREADS - 1) * CNT_ROUNDS);
+    expected = 0;
+    CU_ASSERT(!judy_cas_cell(h, (uchar *)key, sizeof(key), &expected, 1));
+    CU_ASSERT_EQUAL(expected, 7);
+    key[0] = (judyvalue)CNT_KEYS << 1;
+    CU_ASSERT(judy_cas_cell(h, (uchar *)key, sizeof(key), &expected, 1) == 0 && expected == 0);
+    CU_ASSERT(judy_cas_cell(h, (uchar *)key, sizeof(key), &expected, 1));
+    CU_ASSERT_EQUAL(judy_slot_mt(h, (uchar *)key, sizeof(key)), 1);
+
+    judy_detach(h);
+    judy_close(judy);
+}
+
+#define PUB_READERS 4
+#define PUB_KEYS 512
+#define PUB_ROUNDS 40
+
+typedef struct {
+    JudyHandle *handle;
+    uint errors;
+    uint *done;
+} pub_arg;
+
+//  every array published holds the same keys, all valued with
+//  its generation: a reader must see one generation throughout
+//  a section, and never an older one than before
+
+static void *pub_reader(void *arg) {
+    pub_arg *a = arg;
+    JudyReader *reader = judy_handle_attach(a->handle);
+    JudySlot *slot, gen, last = 0;
+    judyvalue key[1];
+    uint idx;
+    Judy *judy;
+
+    if (!reader) {
+        a->errors++;
+        return NULL;
+    }
+
+    while (!__atomic_load_n(a->done, __ATOMIC_ACQUIRE)) {
+        judy = judy_handle_enter(reader);
+        gen = 0;
+
+        for (idx = 0; idx < PUB_KEYS; idx += 7) {
+            key[0] = (judyvalue)idx * 2654435761U;
+            slot = judy_slot(judy, (uchar *)key, sizeof(key));
+            if (!slot || (gen && *slot != gen))
+                a->errors++;
+            else
+                gen = *slot;
+        }
+
+        judy_handle_leave(reader);
+
+        if (gen < last)
+            a->errors++;
+        last = gen;
+    }
+
+    judy_handle_detach(reader);
+    return NULL;
+}
+
+static Judy *pub_build(JudySlot gen) {
+    Judy *judy = judy_open(0, 1);
+    judyvalue key[1];
+    uint idx;
+
+    for (idx = 0; idx < PUB_KEYS; idx++) {
+        key[0] = (judyvalue)idx * 2654435761U;
+        *judy_cell(judy, (uchar *)key, sizeof(key)) = gen;
+    }
+
+    return judy;
+}
+
+void test_publish(void) {
+    pthread_t tid[PUB_READERS];
+    pub_arg arg[PUB_READERS];
+    JudyHandle *handle;
+    JudySlot gen;
+    uint idx, done = 0;
+    Judy *judy;
+
+    handle = judy_handle_open(pub_build(1));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+
+    for (idx = 0; idx < PUB_READERS; idx++) {
+        arg[idx].handle = handle;
+        arg[idx].errors = 0;
+        arg[idx].done = &done;
+        CU_ASSERT_FATAL(!pthread_create(&tid[idx], NULL, pub_reader, &arg[idx]));
+    }
+
+    for (gen = 2; gen <= PUB_ROUNDS; gen++)
+        CU_ASSERT(judy_handle_publish(handle, pub_build(gen)));
+
+    //  arrays of another kind are refused
+
+    judy = judy_open(0, 2);
+    CU_ASSERT(!judy_handle_publish(handle, judy));
+    judy_close(judy);
+
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+
+    for (idx = 0; idx < PUB_READERS; idx++) {
+        pthread_join(tid[idx], NULL);
+        CU_ASSERT_EQUAL(arg[idx].errors, 0);
+    }
+
+    judy_handle_close(handle);
+}
+
+//  restore every checkpoint written to f, expecting judy's contents
+
+static void ckpt_same(FILE *f, Judy *judy) {
+    Judy *restored;
+
+    rewind(f);
+    restored = judy_restore(f);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(restored);
+    build_same(restored, judy);
+    judy_close(restored);
+    fseek(f, 0, SEEK_END);
+}
+
+void test_checkpoint(void) {
+    const uint samples = 300000;
+    uchar keys[3][8], *ptrs[3];
+    JudySlot values[3] = { 1, 2, 3 };
+    judyvalue key[1];
+    long full, delta;
+    Judy *judy, *kept, *restored;
+    uchar *buff;
+    uint idx, round;
+    FILE *f, *g;
+
+    f = tmpfile();
+    CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+    judy = judy_open(0, 1);
+
+    for (idx = 0; idx < samples; idx++) {
+        key[0] = (judyvalue)idx * 0x9e3779b97f4a7c15ULL;
+        *judy_cell(judy, (uchar *)key, 0) = idx + 1;
+    }
+
+    CU_ASSERT(judy_checkpoint(judy, f, 0));
+    full = ftell(f);
+    ckpt_same(f, judy);
+
+    //  small changes of every kind write small deltas;
+    //  the last round changes keys all over the array
+
+    for (round = 1; round <= 3; round++) {
+        for (idx = round; idx < samples; idx += round < 3 ? samples / 3 : 101) {
+            key[0] = (judyvalue)idx * 0x9e3779b97f4a7c15ULL;
+            *judy_slot(judy, (uchar *)key, 0) = round << 20 | idx;
+            key[0] = (judyvalue)idx * 0x9e3779b97f4a7c15ULL + round;
+            *judy_cell(judy, (uchar *)key, 0) = idx;
+            key[0] = (judyvalue)(idx + 7) * 0x9e3779b97f4a7c15ULL;
+            if (judy_slot(judy, (uchar *)key, 0))
+                judy_del(judy);
+        }
+
+        delta = ftell(f);
+        CU_ASSERT(judy_checkpoint(judy, f, 0));
+        CU_ASSERT(round == 3 || ftell(f) - delta < full / 4);
+        ckpt_same(f, judy);
+    }
+
+    //  a torn delta restores the checkpoint before it
+
+    kept = judy_copy(judy);
+
+    for (idx = 0; idx < samples; idx += 3) {
+        key[0] = (judyvalue)idx * 0x9e3779b97f4a7c15ULL;
+        if (judy_slot(judy, (uchar *)key, 0))
+            judy_del(judy);
+    }
+
+    delta = ftell(f);
+    CU_ASSERT(judy_checkpoint(judy, f, 0));
+    ckpt_same(f, judy);
+
+    g = tmpfile();
+    buff = malloc(delta + 100);
+    CU_ASSERT_FATAL(g && buff);
+    rewind(f);
+    CU_ASSERT_EQUAL(fread(buff, 1, delta + 100, f), (size_t)delta + 100);
+    fwrite(buff, 1, delta + 100, g);
+    ckpt_same(g, kept);
+
+    //  a restored array is an ordinary one, and checkpoints in full
+
+    rewind(g);
+    restored = judy_restore(g);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(restored);
+    key[0] = 12345;
+    *judy_cell(restored, (uchar *)key, 0) = 1;
+    *judy_cell(kept, (uchar *)key, 0) = 1;
+    fclose(g);
+    g = tmpfile();
+    CU_ASSERT(judy_checkpoint(restored, g, 0));
+    CU_ASSERT(ftell(g) >= full / 2);
+    ckpt_same(g, kept);
+
+    fclose(g);
+    free(buff);
+    judy_close(restored);
+    judy_close(kept);
+    judy_close(judy);
+    fclose(f);
+
+    //  string keys, with a parallel batch between checkpoints
+
+    f = tmpfile();
+    CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+    judy = judy_open(16, 0);
+
+    for (idx = 0; idx < 20000; idx++) {
+        snprintf((char *)keys[0], 8, "%x", idx * 2654435761U >> 8);
+        *judy_cell(judy, keys[0], strlen((char *)keys[0])) = idx + 1;
+    }
+
+    CU_ASSERT(judy_checkpoint(judy, f, 0));
+    strcpy((char *)keys[0], "");
+    strcpy((char *)keys[1], "zz");
+    strcpy((char *)keys[2], "1234");
+
+    for (idx = 0; idx < 3; idx++)
+        ptrs[idx] = keys[idx];
+
+    CU_ASSERT(judy_cell_batch(judy, ptrs, NULL, values, 3, 3));
+    CU_ASSERT(judy_checkpoint(judy, f, 0));
+    ckpt_same(f, judy);
+
+    CU_ASSERT(judy_checkpoint(judy, f, 1));
+    ckpt_same(f, judy);
+
+    //  a snapshot leaves the writer an empty segment
+
+    kept = judy_snapshot(judy);
+    CU_ASSERT(judy_checkpoint(judy, f, 1));
+    ckpt_same(f, judy);
+    judy_close(kept);
+
+    judy_close(judy);
+    fclose(f);
+}
+
+//  string keys for the persistent heap test
+
+static void heap_fill(Judy *judy, Judy *ref, uint batch, uint cnt) {
+    uchar key[32];
+    uint idx;
+
+    for (idx = 0; idx < cnt; idx++) {
+        snprintf((char *)key, sizeof(key), "b%03u-%05u", batch, idx * 7919 % cnt);
+        *judy_cell(judy, key, strlen((char *)key)) = batch << 16 | idx;
+        if (ref)
+            *judy_cell(ref, key, strlen((char *)key)) = batch << 16 | idx;
+    }
+}
+
+static void heap_drop(Judy *judy, uint batch, uint cnt) {
+    uchar key[32];
+    uint idx;
+
+    for (idx = 0; idx < cnt; idx += 3) {
+        snprintf((char *)key, sizeof(key), "b%03u-%05u", batch, idx);
+        if (judy_slot(judy, key, strlen((char *)key)))
+            judy_del(judy);
+    }
+}
+
+void test_heap(void) {
+    const size_t size = 64 << 20;
+    Judy *judy, *ref;
+    uint batch, last;
+    uchar key[32];
+    char path[64];
+    int pipes[2], status;
+    void *addr, *block;
+    pid_t pid;
+    int fd;
+
+    snprintf(path, sizeof(path), "/tmp/judy_heap_test.%d", (int)getpid());
+    unlink(path);
+
+    judy = judy_open_heap(path, 31, 0, size);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+    ref = judy_open(31, 0);
+    heap_fill(judy, ref, 0, 20000);
+    heap_fill(judy, ref, 1, 20000);
+    judy_close(judy);
+
+    //  reopening finds the array as closed, and changes to it
+    //  are kept by the next close
+
+    judy = judy_open_heap(path, 0, 0, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+    build_same(judy, ref);
+    heap_drop(judy, 0, 20000);
+    heap_drop(ref, 0, 20000);
+    heap_fill(judy, ref, 2, 5000);
+    judy_close(judy);
+
+    judy = judy_open_heap(path, 0, 0, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+    build_same(judy, ref);
+    judy_close(judy);
+
+    //  a process dying after changes since its last commit
+    //  leaves the commit
+
+    fflush(stdout);
+
+    if (!(pid = fork())) {
+        judy = judy_open_heap(path, 0, 0, 0);
+        heap_fill(judy, NULL, 3, 5000);
+        judy_heap_sync(judy);
+        heap_drop(judy, 1, 20000);
+        heap_fill(judy, NULL, 4, 20000);
+        for (batch = 0; batch < 5000; batch++) {
+            snprintf((char *)key, sizeof(key), "b003-%05u", batch);
+            *judy_cell(judy, key, strlen((char *)key)) = 0;
+        }
+        _exit(0);
+    }
+
+    CU_ASSERT_FATAL(pid > 0);
+    waitpid(pid, &status, 0);
+    heap_fill(ref, NULL, 3, 5000);
+
+    judy = judy_open_heap(path, 0, 0, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+    build_same(judy, ref);
+    judy_close(judy);
+
+    //  or killed at any point while committing batches, the
+    //  last commit it reported or the one after
+
+    CU_ASSERT_FATAL(!pipe(pipes));
+
+    if (!(pid = fork())) {
+        judy = judy_open_heap(path, 0, 0, 0);
+        for (batch = 10; ; batch++) {
+            heap_fill(judy, NULL, batch, 2000);
+            heap_drop(judy, batch - 1, 2000);
+            judy_heap_sync(judy);
+            if (write(pipes[1], &batch, sizeof(batch)) != sizeof(batch))
+                _exit(1);
+        }
+    }
+
+    CU_ASSERT_FATAL(pid > 0);
+    close(pipes[1]);
+
+    for (last = 0; last < 14; )
+        CU_ASSERT_FATAL(read(pipes[0], &last, sizeof(last)) == sizeof(last));
+
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+
+    while (read(pipes[0], &batch, sizeof(batch)) == sizeof(batch))
+        last = batch;
+
+    close(pipes[0]);
+
+    judy = judy_open_heap(path, 0, 0, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+
+    for (batch = 10; batch <= last; batch++) {
+        heap_fill(ref, NULL, batch, 2000);
+        heap_drop(ref, batch - 1, 2000);
+    }
+
+    //  the commit after the last reported one may have landed
+
+    snprintf((char *)key, sizeof(key), "b%03u-%05u", last + 1, 1);
+
+    if (judy_slot(judy, key, strlen((char *)key))) {
+        heap_fill(ref, NULL, last + 1, 2000);
+        heap_drop(ref, last, 2000);
+    }
+
+    build_same(judy, ref);
+
+    //  with its old address taken, the array moves
+
+    addr = (void *)((JudySlot)judy & ~(JudySlot)0xffff);
+    judy_close(judy);
+
+    fd = open("/dev/zero", O_RDONLY);
+    block = mmap(addr, 1 << 16, PROT_NONE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    CU_ASSERT_EQUAL_FATAL(block, addr);
+
+    judy = judy_open_heap(path, 0, 0, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+    CU_ASSERT((JudySlot)judy >> 16 != (JudySlot)addr >> 16);
+    build_same(judy, ref);
+    heap_fill(judy, ref, 5, 1000);
+    judy_close(judy);
+    munmap(block, 1 << 16);
+
+    judy = judy_open_heap(path, 0, 0, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+    build_same(judy, ref);
+    judy_close(judy);
+    judy_close(ref);
+    unlink(path);
+
+    //  commits changing nothing, and sessions changing little,
+    //  keep reusing the segments of a small file
+
+    judy = judy_open_heap(path, 31, 0, 4 << 20);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+
+    for (batch = 0; batch < 500; batch++)
+        CU_ASSERT_FATAL(judy_heap_sync(judy));
+
+    judy_close(judy);
+
+    for (batch = 0; batch < 500; batch++) {
+        judy = judy_open_heap(path, 0, 0, 0);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+        *judy_cell(judy, (uchar *)"key", 3) = batch;
+        judy_close(judy);
+    }
+
+    ref = judy_open(31, 0);
+    *judy_cell(ref, (uchar *)"key", 3) = batch - 1;
+
+    for (batch = 0; batch < 300; batch++) {
+        judy = judy_open_heap(path, 0, 0, 0);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+        heap_drop(judy, (batch + 1) % 3, 300);
+        heap_drop(ref, (batch + 1) % 3, 300);
+        heap_fill(judy, ref, batch % 3, 300);
+        judy_close(judy);
+    }
+
+    judy = judy_open_heap(path, 0, 0, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+    build_same(judy, ref);
+    judy_close(judy);
+
+    judy_close(ref);
+    unlink(path);
+}
+
+//  check a reader's view of the shared test array: the newest
+//  round's keys hold their first value, the round before's its
+//  second, and no other round is present.  Returns the newest
+//  round, or -1 if the view is torn.
+
+static int shared_check(Judy *view, uint cnt) {
+    uint seen[2] = { 0, 0 }, round, idx, newest = 0;
+    JudySlot *cell;
+    uchar key[32];
+    int first = 1;
+
+    for (cell = judy_strt(view, (uchar *)"", 0); cell; cell = judy_nxt(view)) {
+        judy_key(view, key, sizeof(key));
+
+        if (sscanf((char *)key, "r%u-%u", &round, &idx) != 2)
+            return -1;
+
+        if (first)
+            newest = round + (*cell & 0xff) - 1, first = 0;
+
+        if (round + 1 < newest || round > newest || *cell != (round << 8 | (newest - round + 1)))
+            return -1;
+
+        seen[newest - round]++;
+    }
+
+    if (seen[0] != cnt || (newest && seen[1] != cnt))
+        return -1;
+
+    return newest;
+}
+
+void test_shared(void) {
+    const uint cnt = 1000, rounds = 100;
+    uint round, idx;
+    int ready[2], status, newest;
+    JudyShared *shared;
+    uchar key[32];
+    char path[64];
+    Judy *judy, *view;
+    char go = 0;
+    pid_t pid;
+
+    snprintf(path, sizeof(path), "/dev/shm/judy_shared_test.%d", (int)getpid());
+    unlink(path);
+    CU_ASSERT_FATAL(!pipe(ready));
+    fflush(stdout);
+
+    //  the reader forks before the writer maps the file, so the
+    //  writer's address is free in it
+
+    if (!(pid = fork())) {
+        close(ready[1]);
+
+        if (read(ready[0], &go, 1) != 1 || !(shared = judy_shared_open(path)))
+            _exit(2);
+
+        do {
+            if (!(view = judy_shared_enter(shared)))
+                _exit(3);
+
+            newest = shared_check(view, cnt);
+            judy_shared_leave(shared);
+
+            if (newest < 0)
+                _exit(1);
+        } while ((uint)newest < rounds);
+
+        judy_shared_close(shared);
+        _exit(0);
+    }
+
+    CU_ASSERT_FATAL(pid > 0);
+    close(ready[0]);
+
+    //  each round adds its keys, gives the last round's keys
+    //  their second value and deletes the round before
+
+    judy = judy_open_heap(path, 31, 0, 64 << 20);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+
+    for (round = 0; round <= rounds; round++) {
+        for (idx = 0; idx < cnt; idx++) {
+            snprintf((char *)key, sizeof(key), "r%03u-%04u", round, idx);
+            *judy_cell(judy, key, strlen((char *)key)) = round << 8 | 1;
+
+            if (round) {
+                snprintf((char *)key, sizeof(key), "r%03u-%04u", round - 1, idx);
+                *judy_cell(judy, key, strlen((char *)key)) = (round - 1) << 8 | 2;
+            }
+
+            if (round > 1) {
+                snprintf((char *)key, sizeof(key), "r%03u-%04u", round - 2, idx);
+                if (judy_slot(judy, key, strlen((char *)key)))
+                    judy_del(judy);
+            }
+        }
+
+        CU_ASSERT(judy_heap_sync(judy));
+
+        if (!round)
+            CU_ASSERT(write(ready[1], &go, 1) == 1);
+    }
+
+    close(ready[1]);
+    waitpid(pid, &status, 0);
+    CU_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    //  the writer's own process has the file mapped where
+    //  readers need it
+
+    CU_ASSERT_PTR_NULL(judy_shared_open(path));
+    judy_close(judy);
+
+    shared = judy_shared_open(path);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(shared);
+    view = judy_shared_enter(shared);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(view);
+    CU_ASSERT_EQUAL(shared_check(view, cnt), (int)rounds);
+    judy_shared_leave(shared);
+    judy_shared_close(shared);
+    unlink(path);
+}
+
+//  is the page holding addr resident?
+
+static int warm_resident(void *addr) {
+    uintptr_t pg = (uintptr_t)sysconf(_SC_PAGESIZE);
+    unsigned char vec;
+
+    return !mincore((void *)((uintptr_t)addr & ~(pg - 1)), pg, &vec) && (vec & 1);
+}
+
+static void warm_evict(const char *path) {
+    int fd = open(path, O_RDONLY);
+
+    CU_ASSERT_FATAL(fd >= 0);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+void test_warm(void) {
+    const uint cnt = 20000;
+    JudySlot **cells, *cell;
+    judyvalue key[1];
+    char path[64];
+    Judy *judy;
+    void *addr;
+    uint idx;
+
+    //  arrays in memory: warming reads only, at any depth
+
+    judy = judy_open(0, 1);
+    CU_ASSERT(judy_warm(judy, 4, 0));
+
+    for (idx = 0; idx < 100000; idx++) {
+        key[0] = idx * 0x9e3779b97f4a7c15ULL;
+        *judy_cell(judy, (uchar *)key, 0) = idx + 1;
+    }
+
+    CU_ASSERT(judy_warm(judy, 3, 0));
+    CU_ASSERT(judy_warm(judy, 64, 0));
+    CU_ASSERT(judy_warm(judy, 0, 0));
+
+    for (idx = 0; idx < 100000; idx++) {
+        key[0] = idx * 0x9e3779b97f4a7c15ULL;
+        cell = judy_slot(judy, (uchar *)key, 0);
+        CU_ASSERT(cell && *cell == idx + 1);
+    }
+
+    judy_close(judy);
+
+    //  a file-backed array reopened with its pages dropped: with
+    //  every level locked, every cell's page stays resident
+
+    snprintf(path, sizeof(path), "/tmp/judy_warm_test.%d", (int)getpid());
+    unlink(path);
+
+    judy = judy_open_heap(path, 31, 0, 64 << 20);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+    heap_fill(judy, NULL, 1, cnt);
+    cells = malloc(cnt * sizeof(JudySlot *));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(cells);
+
+    for (idx = 0, cell = judy_strt(judy, NULL, 0); cell && idx < cnt; cell = judy_nxt(judy))
+        cells[idx++] = cell;
+
+    CU_ASSERT_EQUAL(idx, cnt);
+    addr = judy;
+    judy_close(judy);
+    warm_evict(path);
+
+    judy = judy_open_heap(path, 0, 0, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+
+    if (judy == addr && judy_warm(judy, ~0U, 1)) {
+        warm_evict(path);
+
+        for (idx = 0; idx < cnt; idx++)
+            if (!warm_resident(cells[idx]))
+                break;
+
+        CU_ASSERT_EQUAL(idx, cnt);
+    }
+
+    for (idx = 0, cell = judy_strt(judy, NULL, 0); cell && idx < cnt; cell = judy_nxt(judy), idx++)
+        CU_ASSERT(cell == cells[idx]);
+
+    judy_close(judy);
+    free(cells);
+    unlink(path);
+}
+
+//  a tiered scan checked against a model array in lockstep
+
+typedef struct {
+    Judy        *ref;
+    JudySlot    *want;          // model's next cell
+    uint        seen, wrong;
+} tier_walk;
+
+static int tier_visit(void *ctx, uchar *key, uint len, JudySlot value) {
+    tier_walk *walk = ctx;
+    uchar want[32];
+    uint wlen;
+
+    while (walk->want && !*walk->want)
+        walk->want = judy_nxt(walk->ref);
+
+    if (!walk->want) {
+        walk->wrong++;
+        return 1;
+    }
+
+    wlen = judy_key(walk->ref, want, sizeof(want));
+
+    if (wlen != len || memcmp(want, key, len) || *walk->want != value)
+        walk->wrong++;
+
+    walk->seen++;
+    walk->want = judy_nxt(walk->ref);
+    return 0;
+}
+
+static void tier_same(JudyTier *tier, Judy *ref, uchar *from, uint len) {
+    tier_walk walk[1];
+
+    walk->ref = ref;
+    walk->want = judy_strt(ref, from, len);
+    walk->seen = walk->wrong = 0;
+    CU_ASSERT_EQUAL(judy_tier_scan(tier, from, len, tier_visit, walk), 0);
+
+    while (walk->want && !*walk->want)
+        walk->want = judy_nxt(ref);
+
+    CU_ASSERT_PTR_NULL(walk->want);
+    CU_ASSERT_EQUAL(walk->wrong, 0);
+}
+
+void test_tier(void) {
+    uint idx, op, cnt = 0, present;
+    JudySlot *cell, value, got;
+    JudyTier *tier;
+    uchar key[32];
+    char path[64];
+    Judy *ref;
+
+    snprintf(path, sizeof(path), "/tmp/judy_tier_test.%d", (int)getpid());
+    unlink(path);
+
+    tier = judy_tier_open(path, 31, 0, 64 << 20, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(tier);
+    ref = judy_open(31, 0);
+
+    //  random puts and deletes, folded now and then, some folds
+    //  running while the ops go on
+
+    srand(7);
+
+    for (idx = 0; idx < 60000; idx++) {
+        snprintf((char *)key, sizeof(key), "t%05u", rand() % 8000);
+        op = rand() % 4;
+        cell = judy_slot(ref, key, strlen((char *)key));
+        present = cell && *cell;
+
+        if (op) {
+            value = rand() + 1;
+            got = judy_tier_put(tier, key, strlen((char *)key), value);
+            CU_ASSERT_EQUAL(got, present ? *cell : 0);
+            *judy_cell(ref, key, strlen((char *)key)) = value;
+        } else {
+            got = judy_tier_del(tier, key, strlen((char *)key));
+            CU_ASSERT_EQUAL(got, present ? *cell : 0);
+            if (present)
+                judy_del(ref);
+        }
+
+        snprintf((char *)key, sizeof(key), "t%05u", rand() % 8000);
+        cell = judy_slot(ref, key, strlen((char *)key));
+        CU_ASSERT_EQUAL(judy_tier_get(tier, key, strlen((char *)key)), cell ? *cell : 0);
+
+        if (idx % 7000 == 6999)
+            CU_ASSERT(judy_tier_merge(tier, 1));
+        else if (idx % 7000 == 3000)
+            judy_tier_merge(tier, 0);
+
+        if (idx % 10000 == 0)
+            tier_same(tier, ref, NULL, 0);
+    }
+
+    tier_same(tier, ref, NULL, 0);
+    tier_same(tier, ref, (uchar *)"t04", 3);
+    CU_ASSERT(judy_tier_close(tier));
+
+    //  the cold file holds every key after a close
+
+    tier = judy_tier_open(path, 31, 0, 64 << 20, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(tier);
+    tier_same(tier, ref, NULL, 0);
+
+    //  deleting cold keys leaves tombstones that hide them
+
+    for (idx = 0; idx < 8000; idx += 5) {
+        snprintf((char *)key, sizeof(key), "t%05u", idx);
+        if ((cell = judy_slot(ref, key, strlen((char *)key))) && *cell) {
+            CU_ASSERT_EQUAL(judy_tier_del(tier, key, strlen((char *)key)), *cell);
+            judy_del(ref);
+        }
+    }
+
+    tier_same(tier, ref, NULL, 0);
+    CU_ASSERT(judy_tier_close(tier));
+
+    //  a hot tier of limit keys is folded on its own
+
+    tier = judy_tier_open(path, 31, 0, 64 << 20, 100);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(tier);
+    tier_same(tier, ref, NULL, 0);
+
+    for (idx = 0; idx < 5000; idx++) {
+        snprintf((char *)key, sizeof(key), "u%05u", idx * 7919 % 5000);
+        judy_tier_put(tier, key, strlen((char *)key), idx + 1);
+        *judy_cell(ref, key, strlen((char *)key)) = idx + 1;
+    }
+
+    tier_same(tier, ref, NULL, 0);
+    CU_ASSERT(judy_tier_close(tier));
+
+    tier = judy_tier_open(path, 31, 0, 64 << 20, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(tier);
+    tier_same(tier, ref, NULL, 0);
+
+    for (cell = judy_strt(ref, NULL, 0); cell; cell = judy_nxt(ref))
+        if (*cell)
+            cnt++;
+
+    CU_ASSERT(cnt > 5000);
+    CU_ASSERT(judy_tier_close(tier));
+
+    //  a file of another kind of array is refused
+
+    CU_ASSERT_PTR_NULL(judy_tier_open(path, 0, 1, 64 << 20, 0));
+    CU_ASSERT_EQUAL(errno, EINVAL);
+
+    judy_close(ref);
+    unlink(path);
+}
+
+//  the reference for judy_lpm: prefixes kept exactly, under
+//  their length and masked address, probed longest first
+
+static void lpm_refkey(judyvalue *key, uchar *addr, uint len) {
+    uchar *bytes = (uchar *)(key + 1);
+    uint idx;
+
+    memset(key, 0, 8 * sizeof(judyvalue));
+    key[0] = len;
+
+    for (idx = 0; idx < (len + 7) / 8; idx++)
+        bytes[idx] = addr[idx];
+
+    if (len % 8)
+        bytes[len / 8] &= 0xff << (8 - len % 8);
+}
+
+static JudySlot lpm_probe(Judy *ref, uchar *addr, uint bits, uint *len) {
+    judyvalue key[8];
+    JudySlot *cell;
+    int bit;
+
+    for (bit = bits; bit >= 0; bit--) {
+        lpm_refkey(key, addr, bit);
+        if ((cell = judy_slot_bin(ref, key)) && *cell) {
+            *len = bit;
+            return *cell;
+        }
+    }
+
+    return 0;
+}
+
+//  random prefixes of a few random bases, so they nest deeply,
+//  checked against the reference at addresses near them
+
+static void lpm_check(uint bits, uint count, uint bases) {
+    uint bytes = (bits + 7) / 8, idx, bit, len, want = 0;
+    uchar base[16][56], addr[56];
+    JudySlot *cell, value;
+    judyvalue key[8];
+    Judy *judy, *ref;
+
+    judy = judy_open_lpm(bits);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(judy);
+    ref = judy_open_bin(8 * sizeof(judyvalue));
+
+    for (idx = 0; idx < bases; idx++)
+        for (bit = 0; bit < bytes; bit++)
+            base[idx][bit] = rand();
+
+    memset(addr, 0, sizeof(addr));
+    CU_ASSERT_PTR_NULL(judy_lpm(judy, addr, bits, &len));
+
+    for (idx = 0; idx < count; idx++) {
+        memcpy(addr, base[rand() % bases], bytes);
+        len = rand() % (bits + 1);
+
+        for (bit = len / 2 + rand() % (len / 2 + 1); bit < bits; bit++)
+            if (rand() & 1)
+                addr[bit / 8] ^= 0x80 >> bit % 8;
+
+        value = idx + 1;
+        *judy_lpm_cell(judy, addr, len) = value;
+        lpm_refkey(key, addr, len);
+        *judy_cell_bin(ref, key) = value;
+    }
+
+    for (bit = 0; bit < 2; bit++) {
+        for (idx = 0; idx < 4 * count; idx++) {
+            memcpy(addr, base[rand() % bases], bytes);
+
+            for (len = rand() % (bits + 1); len < bits; len++)
+                if (rand() % 8 == 0)
+                    addr[len / 8] ^= 0x80 >> len % 8;
+
+            value = lpm_probe(ref, addr, bits, &want);
+            cell = judy_lpm(judy, addr, bits, &len);
+            CU_ASSERT_EQUAL(cell ? *cell : 0, value);
+            if (cell && value)
+                CU_ASSERT_EQUAL(len, want);
+        }
+
+        //  then again with a third of the prefixes deleted
+
+        for (idx = 0; idx < count / 3; idx++) {
+            memcpy(addr, base[rand() % bases], bytes);
+            len = rand() % (bits + 1);
+            lpm_refkey(key, addr, len);
+            value = (cell = judy_slot_bin(ref, key)) ? *cell : 0;
+            CU_ASSERT_EQUAL(judy_lpm_del(judy, addr, len), value);
+            if (cell)
+                judy_del(ref);
+        }
+    }
+
+    judy_close(judy);
+    judy_close(ref);
+}
+
+void test_lpm(void) {
+    uchar addr[4] = {10, 1, 2, 3};
+    uint len;
+    Judy *judy;
+
+    srand(11);
+
+    //  a small routing table by hand
+
+    judy = judy_open_lpm(32);
+    *judy_lpm_cell(judy, addr, 0) = 1;
+    *judy_lpm_cell(judy, addr, 8) = 2;
+    *judy_lpm_cell(judy, addr, 24) = 3;
+    *judy_lpm_cell(judy, addr, 32) = 4;
+
+    CU_ASSERT_EQUAL(*judy_lpm(judy, addr, 32, &len), 4);
+    CU_ASSERT_EQUAL(len, 32);
+    addr[3] = 4;
+    CU_ASSERT_EQUAL(*judy_lpm(judy, addr, 32, &len), 3);
+    CU_ASSERT_EQUAL(len, 24);
+    addr[2] = 9;
+    CU_ASSERT_EQUAL(*judy_lpm(judy, addr, 32, &len), 2);
+    CU_ASSERT_EQUAL(len, 8);
+    addr[0] = 11;
+    CU_ASSERT_EQUAL(*judy_lpm(judy, addr, 32, &len), 1);
+    CU_ASSERT_EQUAL(len, 0);
+    CU_ASSERT_EQUAL(judy_lpm_del(judy, addr, 0), 1);
+    CU_ASSERT_PTR_NULL(judy_lpm(judy, addr, 32, &len));
+    CU_ASSERT_PTR_NULL(judy_lpm_cell(judy, addr, 40));
+    judy_close(judy);
+
+    //  IPv4 and IPv6 tables, and addresses long enough for span nodes
+
+    lpm_check(32, 20000, 4);
+    lpm_check(32, 20000, 16);
+    lpm_check(128, 10000, 8);
+    lpm_check(440, 2000, 3);
+}
+
+//  interval map keys for model point idx: one word, or two with
+//  the point split across them
+
+static void interval_key(judyvalue *key, uint depth, uint idx) {
+    if (depth == 1)
+        key[0] = idx;
+    else
+        key[0] = idx >> 4, key[1] = (judyvalue)(idx & 15) << 60;
+}
+
+static uint interval_idx(judyvalue *key, uint depth) {
+    if (depth == 1)
+        return key[0];
+
+    return key[0] << 4 | key[1] >> 60;
+}
+
+typedef struct {
+    JudySlot    *model;
+    uint        depth, next, lo, hi, seen;
+} interval_walk;
+
+static int interval_visit(void *ctx, judyvalue *lo, judyvalue *hi, JudySlot value) {
+    interval_walk *walk = ctx;
+    uint start = interval_idx(lo, walk->depth), end = interval_idx(hi, walk->depth), idx;
+
+    //  ranges come in order, meet [lo, hi) and match the model
+
+    CU_ASSERT(start >= walk->next && start < walk->hi && end > walk->lo);
+    for (idx = start; idx < end; idx++)
+        CU_ASSERT_EQUAL(walk->model[idx], value);
+
+    walk->next = end;
+    walk->seen++;
+    return walk->seen == 1000;
+}
+
+static void interval_check(uint depth) {
+    const uint points = 3000;
+    judyvalue lo[2], hi[2], key[2];
+    JudySlot model[points], value;
+    uint idx, op, start, end, run;
+    interval_walk walk[1];
+    JudyInterval *map;
+
+    map = judy_interval_open(depth);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(map);
+    memset(model, 0, sizeof(model));
+
+    interval_key(lo, depth, 5);
+    CU_ASSERT(!judy_interval_insert(map, lo, lo, 1));
+
+    for (op = 0; op < 4000; op++) {
+        start = rand() % (points - 1);
+        end = start + 1 + rand() % (op % 3 ? 20 : 400);
+        if (end > points - 1)
+            end = points - 1;
+        value = rand() % 4;
+
+        interval_key(lo, depth, start);
+        interval_key(hi, depth, end);
+        CU_ASSERT(judy_interval_insert(map, lo, hi, value));
+
+        for (idx = start; idx < end; idx++)
+            model[idx] = value;
+
+        if (op % 500)
+            continue;
+
+        //  every point finds its value, in a range spanning
+        //  the whole run of it, neighbours being joined
+
+        for (idx = 0; idx < points; idx++) {
+            interval_key(key, depth, idx);
+            CU_ASSERT_EQUAL(judy_interval_lookup(map, key, lo, hi), model[idx]);
+
+            if (!model[idx])
+                continue;
+
+            for (run = idx; run && model[run - 1] == model[idx]; run--)
+                ;
+            CU_ASSERT_EQUAL(interval_idx(lo, depth), run);
+            for (run = idx; run < points && model[run] == model[idx]; run++)
+                ;
+            CU_ASSERT_EQUAL(interval_idx(hi, depth), run);
+        }
+
+        //  and a scan meets every run in its span
+
+        for (idx = 0; idx < 20; idx++) {
+            walk->model = model;
+            walk->depth = depth;
+            walk->lo = rand() % points;
+            walk->hi = walk->lo + 1 + rand() % (points - walk->lo);
+            walk->next = walk->seen = 0;
+
+            interval_key(lo, depth, walk->lo);
+            interval_key(hi, depth, walk->hi);
+            judy_interval_scan(map, lo, hi, interval_visit, walk);
+
+            for (run = 0, start = walk->lo; start < walk->hi; start++)
+                if (model[start] && (start == walk->lo || model[start - 1] != model[start]))
+                    run++;
+
+            CU_ASSERT_EQUAL(walk->seen, run < 1000 ? run : 1000);
+        }
+    }
+
+    judy_interval_close(map);
+}
+
+void test_interval(void) {
+    uchar buff[64], found[64];
+    JudySlot *cell, *want;
+    judyvalue key[1];
+    uint idx, len;
+    Judy *judy;
+
+    srand(13);
+
+    //  judy_floor against judy_strt and judy_prv, over
+    //  integer keys dense enough for radix leaves
+
+    judy = judy_open(0, 1);
+
+    for (idx = 0; idx < 20000; idx++) {
+        key[0] = (judyvalue)(rand() % 40000) << (idx % 2 ? 0 : 20);
+        *judy_cell(judy, (uchar *)key, 0) = key[0] + 1;
+    }
+
+    for (idx = 0; idx < 20000; idx++) {
+        key[0] = (judyvalue)(rand() % 40000) << (idx % 2 ? 0 : 20);
+
+        if (!(want = judy_strt(judy, (uchar *)key, sizeof(key))))
+            want = judy_end(judy);
+        else if (*want != key[0] + 1)
+            want = judy_prv(judy);
+
+        cell = judy_floor(judy, (uchar *)key, sizeof(key));
+        CU_ASSERT_EQUAL(cell ? *cell : 0, want ? *want : 0);
+        if (cell) {
+            judy_key(judy, (uchar *)key, 0);
+            CU_ASSERT_EQUAL(*cell, key[0] + 1);
+        }
+    }
+
+    //  stepping back returns the cell of the key stepped to
+
+    for (cell = judy_end(judy); cell; cell = judy_prv(judy)) {
+        judy_key(judy, (uchar *)key, 0);
+        CU_ASSERT_EQUAL(*cell, key[0] + 1);
+    }
+
+    judy_close(judy);
+
+    //  and over strings, some long enough for span nodes
+
+    judy = judy_open(63, 0);
+
+    for (idx = 0; idx < 20000; idx++) {
+        len = snprintf((char *)buff, sizeof(buff), "%0*d", idx % 3 ? 6 : 60, rand() % 40000);
+        *judy_cell(judy, buff, len) = idx + 1;
+    }
+
+    for (idx = 0; idx < 20000; idx++) {
+        len = snprintf((char *)buff, sizeof(buff), "%0*d", rand() % 2 ? 6 : 60, rand() % 40000);
+        if (idx % 5 == 0)
+            len = 3;
+
+        if (!(want = judy_strt(judy, buff, len)))
+            want = judy_end(judy);
+        else if (judy_key(judy, found, sizeof(found)) != len || memcmp(buff, found, len))
+            want = judy_prv(judy);
+
+        cell = judy_floor(judy, buff, len);
+        CU_ASSERT_EQUAL(cell ? *cell : 0, want ? *want : 0);
+    }
+
+    judy_close(judy);
+
+    interval_check(1);
+    interval_check(2);
+}
+
+//  what judy_topk_prefix handed out
+
+typedef struct {
+    JudyTopk    *topk;
+    uchar       *prefix;
+    uint        len, cnt;
+    JudySlot    value[100];
+} topk_seen;
+
+static int topk_visit(void *ctx, uchar *key, uint len, JudySlot value) {
+    topk_seen *seen = ctx;
+
+    CU_ASSERT(len >= seen->len && !memcmp(key, seen->prefix, seen->len));
+    CU_ASSERT_EQUAL(judy_topk_get(seen->topk, key, len), value);
+    seen->value[seen->cnt++] = value;
+    return 0;
+}
+
+static int topk_desc(const void *x, const void *y) {
+    JudySlot a = *(const JudySlot *)x, b = *(const JudySlot *)y;
+
+    return a < b ? 1 : a > b ? -1 : 0;
+}
+
+//  random keys over a small alphabet, so that prefixes are shared
+
+static uint topk_key(uchar *key) {
+    uint len = 1 + rand() % 12, idx;
+
+    for (idx = 0; idx < len; idx++)
+        key[idx] = "abcd"[rand() % 4];
+
+    return len;
+}
+
+void test_topk(void) {
+    static JudySlot want[20000];
+    uchar key[16], prefix[16];
+    uint idx, len, cnt, k, round;
+    JudySlot *cell, value;
+    topk_seen seen[1];
+    JudyTopk *topk;
+    Judy *ref;
+
+    //  a prefix scan starting inside a span node finds the span's key
+
+    ref = judy_open(63, 0);
+    *judy_cell(ref, (uchar *)"b", 1) = 1;
+    *judy_cell(ref, (uchar *)"a123456789012345678901234567890123456789012345678901234567890", 61) = 2;
+    cell = judy_strt(ref, (uchar *)"a12345678901234567890123456789012345678901234567890123456789", 60);
+    CU_ASSERT(cell && *cell == 2);
+    judy_close(ref);
+
+    srand(17);
+    topk = judy_topk_open(15, 4);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(topk);
+    ref = judy_open(15, 0);
+
+    CU_ASSERT_PTR_NULL(judy_topk_open(3, 4));
+
+    for (round = 0; round < 4; round++) {
+        //  stores, score changes up and down, and deletes
+
+        for (idx = 0; idx < 10000; idx++) {
+            len = topk_key(key);
+            cell = judy_slot(ref, key, len);
+            value = cell ? *cell : 0;
+
+            if (round && rand() % 3 == 0) {
+                CU_ASSERT_EQUAL(judy_topk_del(topk, key, len), value);
+                if (cell)
+                    judy_del(ref);
+                continue;
+            }
+
+            CU_ASSERT_EQUAL(judy_topk_put(topk, key, len, idx % 7 ? rand() % 1000000 + 1 : 1), value);
+            *judy_cell(ref, key, len) = judy_topk_get(topk, key, len);
+        }
+
+        //  the best scores under a prefix are the ones a full
+        //  scan of it finds
+
+        for (idx = 0; idx < 300; idx++) {
+            len = rand() % 7;
+            memcpy(prefix, "abcdabc", len);
+            if (idx % 2)
+                topk_key(prefix);
+            k = (uint[]){1, 3, 10, 100}[idx % 4];
+
+            cnt = 0;
+            for (cell = judy_strt(ref, prefix, len); cell; cell = judy_nxt(ref)) {
+                if (judy_key(ref, key, sizeof(key)) < len || memcmp(key, prefix, len))
+                    break;
+                if (*cell)
+                    want[cnt++] = *cell;
+            }
+
+            qsort(want, cnt, sizeof(JudySlot), topk_desc);
+            if (cnt > k)
+                cnt = k;
+
+            seen->topk = topk;
+            seen->prefix = prefix;
+            seen->len = len;
+            seen->cnt = 0;
+
+            CU_ASSERT_EQUAL(judy_topk_prefix(topk, prefix, len, k, topk_visit, seen), (int)cnt);
+            CU_ASSERT_EQUAL(seen->cnt, cnt);
+            CU_ASSERT(!memcmp(seen->value, want, cnt * sizeof(JudySlot)));
+        }
+    }
+
+    judy_topk_close(topk);
+    judy_close(ref);
+}
+
+//  random keys from a few byte values, so that prefixes are
+//  shared and the scans take both sides of a node
+
+static void sum_key(judyvalue *key, uint depth) {
+    uint idx, off;
+
+    for (idx = 0; idx < depth; idx++)
+        for (key[idx] = 0, off = 0; off < JUDY_key_size; off++)
+            key[idx] = key[idx] << 8 | (uchar[]){0x00, 0x01, 0x7f, 0x80, 0xfe, 0xff}[rand() % (off < 4 ? 2 : 6)];
+}
+
+static int sum_cmp(judyvalue *x, judyvalue *y, uint depth) {
+    uint idx;
+
+    for (idx = 0; idx < depth; idx++)
+        if (x[idx] != y[idx])
+            return x[idx] < y[idx] ? -1 : 1;
+
+    return 0;
+}
+
+static void sum_check(uint depth) {
+    judyvalue lo[2], hi[2], key[2];
+    JudySlot *cell, value, want;
+    uint idx, round, size;
+    JudySum *map;
+    Judy *ref;
+
+    map = judy_sum_open(depth);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(map);
+    ref = judy_open(0, depth);
+    size = depth * JUDY_key_size;
+
+    for (round = 0; round < 3; round++) {
+        //  additions either way, stores, and deletes
+
+        for (idx = 0; idx < 20000; idx++) {
+            sum_key(key, depth);
+            cell = judy_slot(ref, (uchar *)key, size);
+            value = cell ? *cell : 0;
+            CU_ASSERT_EQUAL(judy_sum_get(map, key), value);
+
+            if (round == 2 && idx % 2)
+                CU_ASSERT(judy_sum_set(map, key, 0));
+            else if (idx % 3)
+                CU_ASSERT(judy_sum_add(map, key, rand() % 2000 - 1000));
+            else
+                CU_ASSERT(judy_sum_set(map, key, rand() % 1000));
+
+            if ((value = judy_sum_get(map, key)))
+                *judy_cell(ref, (uchar *)key, size) = value;
+            else if (judy_slot(ref, (uchar *)key, size))
+                judy_del(ref);
+        }
+
+        //  range sums against a walk of the range
+
+        for (idx = 0; idx < 2000; idx++) {
+            sum_key(lo, depth);
+            sum_key(hi, depth);
+
+            want = 0;
+            for (cell = judy_strt(ref, (uchar *)lo, size); cell; cell = judy_nxt(ref)) {
+                judy_key(ref, (uchar *)key, size);
+                if (sum_cmp(key, hi, depth) >= 0)
+                    break;
+                want += *cell;
+            }
+
+            CU_ASSERT_EQUAL(judy_sum(map, lo, hi), want);
+        }
+    }
+
+    //  emptied, every sum is zero
+
+    for (cell = judy_strt(ref, (uchar *)lo, 0); cell; cell = judy_nxt(ref)) {
+        judy_key(ref, (uchar *)key, size);
+        CU_ASSERT(judy_sum_set(map, key, 0));
+    }
+
+    memset(lo, 0, sizeof(lo));
+    memset(hi, 0xff, sizeof(hi));
+    CU_ASSERT_EQUAL(judy_sum(map, lo, hi), 0);
+    CU_ASSERT_EQUAL(judy_sum(map, hi, lo), 0);
+
+    judy_sum_close(map);
+    judy_close(ref);
+}
+
+void test_sum(void) {
+    srand(23);
+    sum_check(1);
+    sum_check(2);
+}
+
+//  how often judy_sample drew each key
+
+typedef struct {
+    Judy        *ref;
+    uint        size, draws;
+    uint        hits[500];
+} sample_seen;
+
+static int sample_visit(void *ctx, uchar *key, uint len, JudySlot value) {
+    sample_seen *seen = ctx;
+    JudySlot *cell = judy_slot(seen->ref, key, seen->size ? seen->size : len);
+
+    CU_ASSERT_FATAL(cell && *cell == value);
+    seen->hits[value - 1]++;
+    return ++seen->draws == 1000000;
+}
+
+//  judy_sum_sample draws: the reference holds each key's index
+
+static int sample_weigh(void *ctx, uchar *key, uint len, JudySlot value) {
+    sample_seen *seen = ctx;
+    JudySlot *cell = judy_slot(seen->ref, key, len);
+
+    CU_ASSERT_FATAL(cell && value == 1 + *cell % 2);
+    seen->hits[*cell - 1]++;
+    seen->draws++;
+    return 0;
+}
+
+//  draw 100 times per key, allowing six standard deviations
+
+static void sample_check(Judy *judy, sample_seen *seen, uint keys, uint64_t *seed) {
+    uint idx, most = 0, least = ~0U;
+
+    memset(seen->hits, 0, sizeof(seen->hits));
+    seen->draws = 0;
+
+    CU_ASSERT_EQUAL(judy_sample(judy, seed, keys * 100, sample_visit, seen), (int)keys * 100);
+
+    for (idx = 0; idx < keys; idx++) {
+        if (most < seen->hits[idx])
+            most = seen->hits[idx];
+        if (least > seen->hits[idx])
+            least = seen->hits[idx];
+    }
+
+    CU_ASSERT(most < 100 + 60 && least > 100 - 60);
+}
+
+void test_sample(void) {
+    uint64_t seed = 29;
+    judyvalue key[2];
+    sample_seen seen[1];
+    uchar buff[80];
+    uint idx, len;
+    JudySum *map;
+    Judy *judy;
+
+    //  strings: short ones ending inside radix and linear nodes,
+    //  long ones through span nodes, and a dense cluster of
+    //  numbers, so that descents to different keys weigh apart
+
+    judy = judy_open(79, 0);
+    seen->ref = judy;
+    seen->size = 0;
+
+    CU_ASSERT_EQUAL(judy_sample(judy, &seed, 10, sample_visit, seen), 0);
+
+    for (idx = 0; idx < 500; idx++) {
+        if (idx < 20)
+            len = snprintf((char *)buff, sizeof(buff), "%.*s", idx % 5 + 1, "abcdefgh" + idx / 5);
+        else if (idx < 60)
+            len = snprintf((char *)buff, sizeof(buff), "%070u", idx * 7919);
+        else if (idx < 400)
+            len = snprintf((char *)buff, sizeof(buff), "n%u", idx);
+        else
+            len = snprintf((char *)buff, sizeof(buff), "%u.%u", idx * 2654435761U, idx);
+
+        CU_ASSERT_EQUAL(*judy_cell(judy, buff, len), 0);
+        *judy_cell(judy, buff, len) = idx + 1;
+    }
+
+    sample_check(judy, seen, 500, &seed);
+
+    //  stopping early
+
+    seen->draws = 1000000 - 5;
+    CU_ASSERT_EQUAL(judy_sample(judy, &seed, 100, sample_visit, seen), 5);
+    judy_close(judy);
+
+    //  integers, a dense run beside scattered ones
+
+    judy = judy_open(0, 2);
+    seen->ref = judy;
+    seen->size = 2 * JUDY_key_size;
+
+    for (idx = 0; idx < 120; idx++) {
+        key[0] = idx < 80 ? 7 : (judyvalue)idx * 0x9E3779B97F4A7C15ULL;
+        key[1] = idx < 80 ? idx : idx * 0x2545F4914F6CDD1DULL;
+        *judy_cell(judy, (uchar *)key, seen->size) = idx + 1;
+    }
+
+    sample_check(judy, seen, 120, &seed);
+    judy_close(judy);
+
+    //  a large dense run beside as many scattered keys, whose
+    //  paths weigh apart more than the first descents show
+
+    judy = judy_open(0, 1);
+    seen->ref = judy;
+    seen->size = JUDY_key_size;
+    seen->draws = 0;
+
+    for (idx = 0; idx < 20000; idx++) {
+        key[0] = idx < 10000 ? idx : (judyvalue)idx * 0x9E3779B97F4A7C15ULL | 1ULL << 63;
+        *judy_cell(judy, (uchar *)key, seen->size) = 1 + (idx >= 10000);
+    }
+
+    for (len = 0; len < 4; len++) {
+        seen->hits[0] = 0;
+        CU_ASSERT_EQUAL(judy_sample(judy, &seed, 1000, sample_visit, seen), 1000);
+        CU_ASSERT(abs((int)seen->hits[0] - 500) < 95);
+    }
+
+    judy_close(judy);
+
+    //  drawn in proportion to weights, from a dense run beside
+    //  scattered keys
+
+    map = judy_sum_open(1);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(map);
+    judy = judy_open(0, 1);
+    seen->ref = judy;
+    seen->size = JUDY_key_size;
+    memset(seen->hits, 0, sizeof(seen->hits));
+
+    for (idx = 0; idx < 300; idx++) {
+        key[0] = idx < 200 ? 7ULL << 32 | idx : (judyvalue)idx * 0x9E3779B97F4A7C15ULL;
+        *judy_cell(judy, (uchar *)key, seen->size) = idx + 1;
+        CU_ASSERT(judy_sum_set(map, key, 1 + (idx + 1) % 2));
+    }
+
+    CU_ASSERT_EQUAL(judy_sum_sample(map, &seed, 450 * 600, sample_weigh, seen), 450 * 600);
+
+    for (idx = 0; idx < 300; idx++)
+        CU_ASSERT(abs((int)seen->hits[idx] - 600 * (int)(1 + (idx + 1) % 2)) < 200);
+
+    judy_sum_close(map);
+    judy_close(judy);
+}
+
+//  what the background checkpoint callbacks saw
+
+typedef struct {
+    uint64_t    done, total;
+    uint        calls, finished;
+    int         err;
+} async_seen;
+
+static void async_progress(void *ctx, uint64_t done, uint64_t total) {
+    async_seen *seen = ctx;
+
+    CU_ASSERT(done > seen->done && done <= total);
+    seen->done = done;
+    seen->total = total;
+    seen->calls++;
+}
+
+static void async_finish(void *ctx, int err) {
+    async_seen *seen = ctx;
+
+    seen->err = err;
+    seen->finished++;
+}
+
+void test_snapshot_async(void) {
+    const uint samples = 200000;
+    Judy *judy, *ref, *restored;
+    async_seen seen[1];
+    JudyAsync *async;
+    judyvalue key[1];
+    uint idx, pass;
+    long size;
+    char path[64];
+    int fd, pipes[2];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/tmp/judy_async_test.%d", (int)getpid());
+
+    //  once through io_uring, where there is one, once from threads
+
+    for (pass = 0; pass < 2; pass++) {
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        CU_ASSERT_FATAL(fd >= 0);
+        CU_ASSERT_EQUAL(write(fd, "prefix..", 8), 8);
+        judy = judy_open(0, 1);
+
+        for (idx = 0; idx < samples; idx++) {
+            key[0] = (judyvalue)idx * 0x9e3779b97f4a7c15ULL;
+            *judy_cell(judy, (uchar *)key, 0) = idx + 1;
+        }
+
+        ref = judy_copy(judy);
+        memset(seen, 0, sizeof(seen));
+        async = judy_snapshot_async(judy, fd, pass ? 1 << 20 : 256 << 10, pass ? JUDY_async_threads : 0, async_progress, async_finish, seen);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(async);
+
+        //  the array changes while it is written
+
+        for (idx = 0; idx < samples; idx += 1000) {
+            key[0] = (judyvalue)idx * 0x9e3779b97f4a7c15ULL;
+            if (judy_slot(judy, (uchar *)key, 0))
+                judy_del(judy);
+            key[0] = (judyvalue)idx * 0x9e3779b97f4a7c15ULL + 1;
+            *judy_cell(judy, (uchar *)key, 0) = idx;
+        }
+
+        CU_ASSERT_EQUAL(judy_async_wait(async), 0);
+        CU_ASSERT_EQUAL(seen->finished, 1);
+        CU_ASSERT_EQUAL(seen->err, 0);
+        CU_ASSERT(seen->calls > 1);
+        CU_ASSERT_EQUAL(seen->done, seen->total);
+        size = lseek(fd, 0, SEEK_CUR);
+        CU_ASSERT_EQUAL((uint64_t)size, seen->total + 8);
+
+        lseek(fd, 8, SEEK_SET);
+        restored = judy_restore_fd(fd);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(restored);
+        build_same(restored, ref);
+        judy_close(restored);
+
+        //  a delta follows on from the background checkpoint
+
+        f = fopen(path, "r+b");
+        CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+        fseek(f, 0, SEEK_END);
+        CU_ASSERT(judy_checkpoint(judy, f, 0));
+        CU_ASSERT(ftell(f) - size < size / 4);
+        fseek(f, 8, SEEK_SET);
+        restored = judy_restore(f);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(restored);
+        build_same(restored, judy);
+        judy_close(restored);
+
+        fclose(f);
+        close(fd);
+        judy_close(ref);
+        judy_close(judy);
+    }
+
+    //  a pipe cannot take writes at fixed offsets
+
+    judy = judy_open(0, 1);
+    key[0] = 1;
+    *judy_cell(judy, (uchar *)key, 0) = 1;
+    CU_ASSERT_FATAL(!pipe(pipes));
+    CU_ASSERT_PTR_NULL(judy_snapshot_async(judy, pipes[1], 1 << 20, 0, NULL, NULL, NULL));
+    close(pipes[0]);
+    close(pipes[1]);
+    judy_close(judy);
+    unlink(path);
+}
+
+//  writers for the log test: each puts its own keys and
+//  deletes every third of them again
+
+#define WAL_WRITERS 4
+#define WAL_KEYS    3000
+
+typedef struct {
+    JudyWal     *wal;
+    uint        id;
+} wal_arg;
+
+static void *wal_writer(void *arg) {
+    wal_arg *a = arg;
+    char key[16];
+    uint idx;
+
+    for (idx = 0; idx < WAL_KEYS; idx++) {
+        snprintf(key, sizeof(key), "%u.%x", a->id, idx * 2654435761U);
+        judy_wal_put(a->wal, (uchar *)key, strlen(key), idx + 1);
+
+        if (idx % 3 == 2) {
+            snprintf(key, sizeof(key), "%u.%x", a->id, (idx - 2) * 2654435761U);
+            judy_wal_del(a->wal, (uchar *)key, strlen(key));
+        }
+    }
+
+    return NULL;
+}
+
+static long wal_size(char *path) {
+    struct stat st;
+
+    return stat(path, &st) ? -1 : st.st_size;
+}
+
+//  reopen a log into a fresh array and compare it with judy
+
+static void wal_replayed(char *path, Judy *judy, uint max, uint depth) {
+    Judy *copy = judy_open(max, depth);
+    JudyWal *wal;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(copy);
+    wal = judy_wal_open(copy, path, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(wal);
+    build_same(copy, judy);
+    judy_wal_close(wal);
+    judy_close(copy);
+}
+
+void test_wal(void) {
+    pthread_t tid[WAL_WRITERS];
+    wal_arg arg[WAL_WRITERS];
+    struct stat st, want;
+    judyvalue key[2];
+    char path[64];
+    JudyWal *wal;
+    Judy *judy, *copy;
+    int fd, full;
+    long size;
+    uint idx;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/tmp/judy_wal_test.%d", (int)getpid());
+    unlink(path);
+
+    //  concurrent writers sharing group commits
+
+    judy = judy_open(16, 0);
+    wal = judy_wal_open(judy, path, 200);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(wal);
+
+    for (idx = 0; idx < WAL_WRITERS; idx++) {
+        arg[idx].wal = wal;
+        arg[idx].id = idx;
+        CU_ASSERT_FATAL(!pthread_create(&tid[idx], NULL, wal_writer, &arg[idx]));
+    }
+
+    for (idx = 0; idx < WAL_WRITERS; idx++)
+        pthread_join(tid[idx], NULL);
+
+    CU_ASSERT_EQUAL(judy_wal_get(wal, (uchar *)"0.0", 3), 0);
+    CU_ASSERT_EQUAL(judy_wal_get(wal, (uchar *)"1.9e3779b1", 10), 2);
+    CU_ASSERT_EQUAL(judy_wal_error(wal), 0);
+    judy_wal_close(wal);
+    wal_replayed(path, judy, 16, 0);
+
+    //  a torn last record is dropped and cut from the log
+
+    size = wal_size(path);
+    f = fopen(path, "ab");
+    CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+    fwrite("\x12\x34\x56\x78\x01\x09zz", 1, 8, f);
+    fclose(f);
+    wal_replayed(path, judy, 16, 0);
+    CU_ASSERT_EQUAL(wal_size(path), size);
+
+    //  a checkpoint keeps only live keys
+
+    judy_close(judy);
+    judy = judy_open(16, 0);
+    wal = judy_wal_open(judy, path, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(wal);
+    CU_ASSERT(judy_wal_checkpoint(wal));
+    CU_ASSERT(wal_size(path) < size);
+    judy_wal_put(wal, (uchar *)"after", 5, 7);
+    judy_wal_close(wal);
+    wal_replayed(path, judy, 16, 0);
+
+    //  logs only open for arrays of their own kind
+
+    judy_close(judy);
+    judy = judy_open(0, 2);
+    errno = 0;
+    CU_ASSERT_PTR_NULL(judy_wal_open(judy, path, 0));
+    CU_ASSERT_EQUAL(errno, EINVAL);
+    unlink(path);
+
+    //  two word integer keys
+
+    wal = judy_wal_open(judy, path, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(wal);
+
+    for (idx = 0; idx < 2000; idx++) {
+        key[0] = (judyvalue)idx * 0x9e3779b97f4a7c15ULL;
+        key[1] = idx % 5;
+        CU_ASSERT_EQUAL(judy_wal_put(wal, (uchar *)key, 0, idx + 1), 0);
+        if (idx % 4 == 0)
+            CU_ASSERT_EQUAL(judy_wal_del(wal, (uchar *)key, 0), idx + 1);
+    }
+
+    judy_wal_close(wal);
+    wal_replayed(path, judy, 0, 2);
+
+    copy = judy_open(0, 2);
+    wal = judy_wal_open(copy, path, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(wal);
+    CU_ASSERT(judy_wal_checkpoint(wal));
+    judy_wal_close(wal);
+    judy_close(copy);
+    wal_replayed(path, judy, 0, 2);
+
+    //  once a write fails, every change not yet on disk reports
+    //  failure.  The log takes the lowest free descriptor, so it
+    //  is found by probing for that first.
+
+    unlink(path);
+    judy_close(judy);
+    judy = judy_open(16, 0);
+    fd = open("/dev/null", O_RDONLY);
+    CU_ASSERT_FATAL(fd >= 0);
+    close(fd);
+    wal = judy_wal_open(judy, path, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(wal);
+    CU_ASSERT_FATAL(!fstat(fd, &st) && !stat(path, &want) && st.st_ino == want.st_ino);
+    CU_ASSERT_EQUAL(judy_wal_put(wal, (uchar *)"kept", 4, 1), 0);
+    CU_ASSERT_EQUAL(judy_wal_put(wal, (uchar *)"kept", 4, 2), 1);
+
+    full = open("/dev/full", O_WRONLY);
+    CU_ASSERT_FATAL(full >= 0 && dup2(full, fd) == fd);
+    close(full);
+
+    errno = 0;
+    CU_ASSERT_EQUAL(judy_wal_put(wal, (uchar *)"kept", 4, 3), 0);
+    CU_ASSERT_EQUAL(errno, ENOSPC);
+    errno = 0;
+    CU_ASSERT_EQUAL(judy_wal_del(wal, (uchar *)"kept", 4), 0);
+    CU_ASSERT_EQUAL(errno, ENOSPC);
+    CU_ASSERT_EQUAL(judy_wal_error(wal), ENOSPC);
+    judy_wal_close(wal);
+
+    unlink(path);
+    judy_close(judy);
+}
+
+int init_suite(void) {
+    srand((unsigned)time(NULL));
+
+    return 0;
+}
+
+int clean_suite(void) {
+    return 0;
+}
+
+int main(int argc, char **argv) {
+   CU_pSuite suite = NULL;
+   (void)argc, (void)argv;
+
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   if (!(suite = CU_add_suite("basic", init_suite, clean_suite)))
+       goto out;
+
+   if (!(CU_add_test(suite, "construction", test_construction)))
+       goto out;
+   if (!(CU_add_test(suite, "fill_binkeys", test_fill_binkeys)))
+       goto out;
+   if (!(CU_add_test(suite, "split", test_split)))
+       goto out;
+   if (!(CU_add_test(suite, "reverse", test_reverse)))
+       goto out;
+   if (!(CU_add_test(suite, "strt_span", test_strt_span)))
+       goto out;
+   if (!(CU_add_test(suite, "snapshot", test_snapshot)))
+       goto out;
+   if (!(CU_add_test(suite, "copy", test_copy)))
+       goto out;
+   if (!(CU_add_test(suite, "setops", test_setops)))
+       goto out;
+   if (!(CU_add_test(suite, "merge", test_merge)))
+       goto out;
+   if (!(CU_add_test(suite, "sharded", test_sharded)))
+       goto out;
+   if (!(CU_add_test(suite, "concurrent", test_concurrent)))
+       goto out;
+   if (!(CU_add_test(suite, "cell_after", test_cell_after)))
+       goto out;
+   if (!(CU_add_test(suite, "build", test_build)))
+       goto out;
+   if (!(CU_add_test(suite, "cell_batch", test_cell_batch)))
+       goto out;
+   if (!(CU_add_test(suite, "close_ex", test_close_ex)))
+       goto out;
+   if (!(CU_add_test(suite, "combining", test_combining)))
+       goto out;
+   if (!(CU_add_test(suite, "counting", test_counting)))
+       goto out;
+   if (!(CU_add_test(suite, "publish", test_publish)))
+       goto out;
+   if (!(CU_add_test(suite, "checkpoint", test_checkpoint)))
+       goto out;
+   if (!(CU_add_test(suite, "heap", test_heap)))
+       goto out;
+   if (!(CU_add_test(suite, "shared", test_shared)))
+       goto out;
+   if (!(CU_add_test(suite, "warm", test_warm)))
+       goto out;
+   if (!(CU_add_test(suite, "tier", test_tier)))
+       goto out;
+   if (!(CU_add_test(suite, "lpm", test_lpm)))
+       goto out;
+   if (!(CU_add_test(suite, "interval", test_interval)))
+       goto out;
+   if (!(CU_add_test(suite, "topk", test_topk)))
+       goto out;
+   if (!(CU_add_test(suite, "sum", test_sum)))
+       goto out;
+   if (!(CU_add_test(suite, "sample", test_sample)))
+       goto out;
+   if (!(CU_add_test(suite, "snapshot_async", test_snapshot_async)))
+       goto out;
+   if (!(CU_add_test(suite, "wal", test_wal)))
        goto out;
 
    CU_basic_run_tests();